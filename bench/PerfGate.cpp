@@ -0,0 +1,365 @@
+#include "PerfGate.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+
+void PerfGateReporter::ReportRuns(const std::vector<Run>& reports)
+{
+	benchmark::ConsoleReporter::ReportRuns(reports);
+	for (const auto& run : reports)
+	{
+		if (run.run_type != Run::RT_Iteration || run.iterations == 0) // aggregates and runs skipped with error
+		{
+			continue;
+		}
+		const std::string name = run.benchmark_name();
+		if (!m_samples.contains(name))
+		{
+			m_order.push_back(name);
+		}
+		m_samples[name].push_back(run.real_accumulated_time * 1e9 / static_cast<double>(run.iterations));
+	}
+}
+std::vector<PerfSummary> PerfGateReporter::summarize() const
+{
+	std::vector<PerfSummary> summaries {};
+	for (const auto& name : m_order)
+	{
+		summaries.push_back(PerfGate::summarize(name, m_samples.at(name)));
+	}
+	return summaries;
+}
+
+std::pair<size_t, double> PerfGate::interval(size_t repetitions)
+{
+	// samples[k] and samples[n - 1 - k] bound the median with probability 1 - 2 P(Binomial(n, 1/2) <= k),
+	// k grows while that stays at least Confidence; with 5 or fewer samples even the whole range covers less
+	const size_t n = repetitions;
+	if (n == 0)
+	{
+		return {0, 0};
+	}
+	double probability = std::pow(0.5, static_cast<double>(n));
+	double cumulative = probability; // P(X <= k)
+	size_t k = 0;
+	while (k + 1 < n / 2)
+	{
+		probability = probability * static_cast<double>(n - k) / static_cast<double>(k + 1);
+		if (cumulative + probability > (1 - Confidence) / 2)
+		{
+			break;
+		}
+		cumulative += probability;
+		k++;
+	}
+	return {k, std::max(0.0, 1 - 2 * cumulative)};
+}
+PerfSummary PerfGate::summarize(const std::string& name, std::vector<double> samples)
+{
+	std::sort(samples.begin(), samples.end());
+	const size_t n = samples.size();
+	PerfSummary summary {.name = name, .repetitions = n};
+	if (n == 0)
+	{
+		return summary;
+	}
+	summary.medianNs = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+	const size_t k = interval(n).first;
+	summary.ciLowNs = samples[k];
+	summary.ciHighNs = samples[n - 1 - k];
+	return summary;
+}
+
+// reader for baseline files written by writeBaseline, values of unknown keys are skipped
+class PerfBaselineReader
+{
+private:
+	std::string m_text;
+	size_t m_position {};
+
+	void skipWhitespace()
+	{
+		while (m_position < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_position])))
+		{
+			m_position++;
+		}
+	}
+	bool consume(char c)
+	{
+		skipWhitespace();
+		if (m_position < m_text.size() && m_text[m_position] == c)
+		{
+			m_position++;
+			return true;
+		}
+		return false;
+	}
+	std::optional<std::string> readString()
+	{
+		if (!consume('"'))
+		{
+			return std::nullopt;
+		}
+		std::string value {};
+		while (m_position < m_text.size() && m_text[m_position] != '"')
+		{
+			if (m_text[m_position] == '\\' && m_position + 1 < m_text.size())
+			{
+				m_position++;
+			}
+			value += m_text[m_position++];
+		}
+		if (m_position == m_text.size())
+		{
+			return std::nullopt;
+		}
+		m_position++;
+		return value;
+	}
+	std::optional<double> readNumber()
+	{
+		skipWhitespace();
+		const char* begin = m_text.c_str() + m_position;
+		char* end = nullptr;
+		const double value = std::strtod(begin, &end);
+		if (end == begin)
+		{
+			return std::nullopt;
+		}
+		m_position += end - begin;
+		return value;
+	}
+	bool skipValue()
+	{
+		skipWhitespace();
+		if (m_position == m_text.size())
+		{
+			return false;
+		}
+		if (m_text[m_position] == '"')
+		{
+			return readString().has_value();
+		}
+		if (m_text[m_position] == '{' || m_text[m_position] == '[')
+		{
+			const char close = m_text[m_position] == '{' ? '}' : ']';
+			m_position++;
+			if (consume(close))
+			{
+				return true;
+			}
+			do
+			{
+				if (close == '}' && (!readString().has_value() || !consume(':')))
+				{
+					return false;
+				}
+				if (!skipValue())
+				{
+					return false;
+				}
+			} while (consume(','));
+			return consume(close);
+		}
+		while (m_position < m_text.size() && (std::isalnum(static_cast<unsigned char>(m_text[m_position])) || m_text[m_position] == '-' || m_text[m_position] == '+' || m_text[m_position] == '.'))
+		{
+			m_position++;
+		}
+		return true;
+	}
+	std::optional<PerfSummary> readSummary()
+	{
+		PerfSummary summary {};
+		if (!consume('{'))
+		{
+			return std::nullopt;
+		}
+		do
+		{
+			const auto key = readString();
+			if (!key.has_value() || !consume(':'))
+			{
+				return std::nullopt;
+			}
+			if (key == "name")
+			{
+				const auto name = readString();
+				if (!name.has_value())
+				{
+					return std::nullopt;
+				}
+				summary.name = name.value();
+				continue;
+			}
+			if (key != "median_ns" && key != "ci_low_ns" && key != "ci_high_ns" && key != "repetitions")
+			{
+				if (!skipValue())
+				{
+					return std::nullopt;
+				}
+				continue;
+			}
+			const auto number = readNumber();
+			if (!number.has_value())
+			{
+				return std::nullopt;
+			}
+			if (key == "median_ns")
+			{
+				summary.medianNs = number.value();
+			}
+			else if (key == "ci_low_ns")
+			{
+				summary.ciLowNs = number.value();
+			}
+			else if (key == "ci_high_ns")
+			{
+				summary.ciHighNs = number.value();
+			}
+			else
+			{
+				summary.repetitions = static_cast<size_t>(number.value());
+			}
+		} while (consume(','));
+		if (!consume('}') || summary.name.empty())
+		{
+			return std::nullopt;
+		}
+		return summary;
+	}
+
+public:
+	PerfBaselineReader(std::istream& input): m_text(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()) {}
+	std::optional<std::vector<PerfSummary>> read()
+	{
+		std::vector<PerfSummary> summaries {};
+		if (!consume('{'))
+		{
+			return std::nullopt;
+		}
+		do
+		{
+			const auto key = readString();
+			if (!key.has_value() || !consume(':'))
+			{
+				return std::nullopt;
+			}
+			if (key != "benchmarks")
+			{
+				if (!skipValue())
+				{
+					return std::nullopt;
+				}
+				continue;
+			}
+			if (!consume('['))
+			{
+				return std::nullopt;
+			}
+			if (consume(']'))
+			{
+				continue;
+			}
+			do
+			{
+				const auto summary = readSummary();
+				if (!summary.has_value())
+				{
+					return std::nullopt;
+				}
+				summaries.push_back(summary.value());
+			} while (consume(','));
+			if (!consume(']'))
+			{
+				return std::nullopt;
+			}
+		} while (consume(','));
+		if (!consume('}'))
+		{
+			return std::nullopt;
+		}
+		return summaries;
+	}
+};
+
+std::optional<std::vector<PerfSummary>> PerfGate::readBaseline(std::istream& input)
+{
+	return PerfBaselineReader {input}.read();
+}
+void PerfGate::writeBaseline(const std::vector<PerfSummary>& summaries, std::ostream& output)
+{
+	output << "{\n  \"unit\": \"ns\",\n  \"benchmarks\": [";
+	for (size_t i = 0; i < summaries.size(); i++)
+	{
+		const PerfSummary& summary = summaries[i];
+		output << (i ? ",\n" : "\n") << std::fixed << std::setprecision(1);
+		output << "    {\"name\": \"" << summary.name << "\", \"median_ns\": " << summary.medianNs << ", \"ci_low_ns\": " << summary.ciLowNs << ", \"ci_high_ns\": " << summary.ciHighNs << ", \"repetitions\": " << summary.repetitions << "}";
+	}
+	output << "\n  ]\n}\n";
+}
+bool PerfGate::compare(const std::vector<PerfSummary>& baseline, const std::vector<PerfSummary>& current, double threshold, size_t top, std::ostream& report)
+{
+	struct Comparison
+	{
+		const PerfSummary* baseline;
+		const PerfSummary* current;
+		double change;
+		bool regressed;
+	};
+	std::map<std::string, const PerfSummary*> baselineByName {};
+	for (const auto& summary : baseline)
+	{
+		baselineByName[summary.name] = &summary;
+	}
+	std::vector<Comparison> comparisons {};
+	std::vector<std::string> missing {};
+	for (const auto& summary : current)
+	{
+		const auto found = baselineByName.find(summary.name);
+		if (found == baselineByName.end() || found->second->medianNs <= 0)
+		{
+			missing.push_back(summary.name);
+			continue;
+		}
+		const PerfSummary& base = *found->second;
+		const double change = summary.medianNs / base.medianNs - 1;
+		comparisons.push_back({&base, &summary, change, change > threshold && summary.ciLowNs > base.ciHighNs});
+	}
+	std::sort(comparisons.begin(), comparisons.end(), [](const Comparison& a, const Comparison& b) { return a.change > b.change; });
+	const size_t regressions = std::count_if(comparisons.begin(), comparisons.end(), [](const Comparison& c) { return c.regressed; });
+	// intervals of runs with few repetitions cover the median less often than Confidence, report what was achieved
+	double coverage = Confidence;
+	for (const auto& c : comparisons)
+	{
+		coverage = std::min({coverage, PerfGate::coverage(c.baseline->repetitions), PerfGate::coverage(c.current->repetitions)});
+	}
+
+	report << "\nPerf gate: " << regressions << " of " << comparisons.size() << " benchmarks regressed by more than " << std::fixed << std::setprecision(0) << threshold * 100 << "%";
+	report << " (medians with " << std::setprecision(coverage < Confidence ? 2 : 0) << coverage * 100 << "% confidence intervals)\n";
+	report << std::left << std::setw(50) << "benchmark" << std::right << std::setw(14) << "baseline ns" << std::setw(14) << "current ns" << std::setw(26) << "current interval" << std::setw(10) << "change" << "\n";
+	for (size_t i = 0; i < comparisons.size(); i++)
+	{
+		const Comparison& c = comparisons[i];
+		if (i >= top && !c.regressed) // sorted by change, so every regression is shown
+		{
+			break;
+		}
+		std::ostringstream interval {};
+		interval << std::fixed << std::setprecision(1) << "[" << c.current->ciLowNs << ", " << c.current->ciHighNs << "]";
+		report << std::left << std::setw(50) << c.current->name << std::right << std::fixed << std::setprecision(1) << std::setw(14) << c.baseline->medianNs << std::setw(14) << c.current->medianNs << std::setw(26) << interval.str();
+		report << std::setw(9) << std::showpos << c.change * 100 << std::noshowpos << "%" << (c.regressed ? "  REGRESSION" : "") << "\n";
+	}
+	if (!missing.empty())
+	{
+		report << missing.size() << " benchmarks have no baseline:";
+		for (const auto& name : missing)
+		{
+			report << " " << name;
+		}
+		report << "\n";
+	}
+	return regressions == 0;
+}
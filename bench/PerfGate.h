@@ -0,0 +1,54 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+#include <inttypes.h>
+#include <istream>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// median and distribution free confidence interval of one benchmark over repetitions, real time per iteration
+struct PerfSummary
+{
+	std::string name {};
+	double medianNs {};
+	double ciLowNs {};
+	double ciHighNs {};
+	size_t repetitions {};
+};
+
+// console reporter that also keeps real time of every repetition
+class PerfGateReporter : public benchmark::ConsoleReporter
+{
+private:
+	std::map<std::string, std::vector<double>> m_samples {}; // nanoseconds per iteration
+	std::vector<std::string> m_order {};
+
+public:
+	PerfGateReporter(): benchmark::ConsoleReporter(benchmark::ConsoleReporter::OO_Tabular) {}
+	void ReportRuns(const std::vector<Run>& reports) override;
+	std::vector<PerfSummary> summarize() const;
+};
+
+// compares summaries against a baseline, a benchmark regresses when its median is slower by more than
+// threshold and the confidence intervals of baseline and current run do not overlap
+class PerfGate
+{
+private:
+	static std::pair<size_t, double> interval(size_t repetitions); // rank of the bounds in sorted samples and probability they cover the median
+
+public:
+	static const size_t Default_Repetitions = 6; // fewest for which the whole range of samples covers the median with Confidence
+	static constexpr double Default_Threshold = 0.1;
+	static const size_t Default_Top = 10;
+	static constexpr double Confidence = 0.95;
+
+	static PerfSummary summarize(const std::string& name, std::vector<double> samples);
+	static double coverage(size_t repetitions) { return interval(repetitions).second; }
+	static std::optional<std::vector<PerfSummary>> readBaseline(std::istream& input);
+	static void writeBaseline(const std::vector<PerfSummary>& summaries, std::ostream& output);
+	static bool compare(const std::vector<PerfSummary>& baseline, const std::vector<PerfSummary>& current, double threshold, size_t top, std::ostream& report); // false on regression
+};
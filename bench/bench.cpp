@@ -0,0 +1,575 @@
+#include "../src/BitStreamReader.h"
+#include "../src/ESETVM.h"
+#include "../src/EVMControlFlowGraph.h"
+#include "../src/EVMDisasm.h"
+#include "../src/EVMExecutionUnit.h"
+#include "../src/utils.h"
+#include "PerfGate.h"
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <string_view>
+#include <vector>
+
+static std::vector<std::byte> makeData(size_t size)
+{
+	std::vector<std::byte> data (size);
+	for (size_t i = 0; i < size; i++)
+	{
+		data[i] = static_cast<std::byte>((i * 2654435761u) >> 13);
+	}
+	return data;
+}
+
+// hex dump as it was written before the vectorized encoder, kept as the baseline
+static std::string byteArrayToHexStringStream(std::span<const std::byte> byteArray, uint32_t width)
+{
+	std::stringstream ss;
+	ss << std::hex << std::setfill('0');
+	for (size_t i = 0; i < byteArray.size(); ++i)
+	{
+		ss << std::setw(2) << static_cast<unsigned>(static_cast<unsigned char>(byteArray[i])) << " ";
+		if ((i + 1) % width == 0)
+		{
+			ss << std::endl;
+		}
+	}
+	return ss.str();
+}
+
+static const uint32_t Data_HexDump_Width = 40;
+
+static void BM_HexDumpStringStream(benchmark::State& state)
+{
+	const auto data = makeData(state.range(0));
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(byteArrayToHexStringStream(data, Data_HexDump_Width));
+	}
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_HexDumpStringStream)->Arg(64 * 1024)->Arg(16 * 1024 * 1024);
+
+static void BM_HexDump(benchmark::State& state)
+{
+	const auto data = makeData(state.range(0));
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(utils::byteArrayToHexString(data, Data_HexDump_Width, 1));
+	}
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_HexDump)->Arg(64 * 1024)->Arg(16 * 1024 * 1024);
+
+static void BM_HexEncode(benchmark::State& state)
+{
+	const auto encoder = static_cast<utils::HexEncoder>(state.range(0));
+	if (!utils::isHexEncoderSupported(encoder))
+	{
+		state.SkipWithError("encoder not supported by this CPU");
+		return;
+	}
+	const auto data = makeData(state.range(1));
+	std::string output (data.size() * 3, '\0');
+	for (auto _ : state)
+	{
+		utils::encodeHex(data, output.data(), encoder);
+		benchmark::DoNotOptimize(output.data());
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_HexEncode)
+	->ArgNames({"encoder", "bytes"})
+	->Args({static_cast<int64_t>(utils::HexEncoder::SCALAR), 1024 * 1024})
+	->Args({static_cast<int64_t>(utils::HexEncoder::SSSE3), 1024 * 1024})
+	->Args({static_cast<int64_t>(utils::HexEncoder::AVX2), 1024 * 1024});
+
+// code stream writer following the encoding of test/compiler.py: opcodes most significant bit first, operands least significant bit first
+class BenchBitWriter
+{
+private:
+	std::vector<std::byte> m_bytes {};
+	uint64_t m_bitCount {};
+public:
+	void appendBit(bool bit)
+	{
+		if (m_bitCount % BITS_IN_BYTE == 0)
+		{
+			m_bytes.push_back(std::byte {0});
+		}
+		if (bit)
+		{
+			m_bytes.back() |= std::byte {static_cast<uint8_t>(0x80 >> (m_bitCount % BITS_IN_BYTE))};
+		}
+		m_bitCount++;
+	}
+	void appendOpcode(uint64_t bits, size_t count)
+	{
+		for (size_t i = count; i > 0; i--)
+		{
+			appendBit((bits >> (i - 1)) & 1);
+		}
+	}
+	void appendOperand(uint64_t value, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			appendBit((value >> i) & 1);
+		}
+	}
+	void appendRegister(uint8_t registerIndex) { appendBit(false); appendOperand(registerIndex, 4); }
+	void appendDereference(uint8_t sizeBits, uint8_t registerIndex) { appendBit(true); appendOperand(sizeBits, 2); appendOperand(registerIndex, 4); }
+	const std::vector<std::byte>& getBytes() const { return m_bytes; }
+};
+
+// random mix of common instructions, code addresses point to the first instruction
+static std::vector<std::byte> makeCodeStream(size_t instructionCount)
+{
+	std::mt19937 random {42};
+	BenchBitWriter writer {};
+	for (size_t i = 0; i < instructionCount; i++)
+	{
+		const uint8_t r1 = random() % 16, r2 = random() % 16, r3 = random() % 16;
+		switch (random() % 8)
+		{
+			case 0: writer.appendOpcode(0b000, 3); writer.appendRegister(r1); writer.appendRegister(r2); break; // mov
+			case 1: writer.appendOpcode(0b001, 3); writer.appendOperand(random(), 64); writer.appendRegister(r1); break; // loadConst
+			case 2: writer.appendOpcode(0b010001, 6); writer.appendRegister(r1); writer.appendRegister(r2); writer.appendRegister(r3); break; // add
+			case 3: writer.appendOpcode(0b010101, 6); writer.appendRegister(r1); writer.appendDereference(random() % 4, r2); writer.appendRegister(r3); break; // mul
+			case 4: writer.appendOpcode(0b01100, 5); writer.appendRegister(r1); writer.appendRegister(r2); writer.appendRegister(r3); break; // compare
+			case 5: writer.appendOpcode(0b01110, 5); writer.appendOperand(0, 32); writer.appendRegister(r1); writer.appendRegister(r2); break; // jumpEqual
+			case 6: writer.appendOpcode(0b1100, 4); writer.appendOperand(0, 32); break; // call
+			default: writer.appendOpcode(0b000, 3); writer.appendDereference(random() % 4, r1); writer.appendRegister(r2); break; // mov from memory
+		}
+	}
+	writer.appendOpcode(0b10110, 5); // hlt
+	return writer.getBytes();
+}
+
+static void BM_BitStreamReadVar(benchmark::State& state)
+{
+	const auto data = makeData(state.range(0));
+	const size_t bitCount = state.range(1);
+	uint64_t bitsRead = 0;
+	for (auto _ : state)
+	{
+		BitStreamReader reader {data};
+		while (const auto value = reader.readVar<uint64_t>(bitCount))
+		{
+			benchmark::DoNotOptimize(value);
+		}
+		bitsRead += reader.getStreamPosition();
+	}
+	state.SetBytesProcessed(bitsRead / BITS_IN_BYTE);
+}
+BENCHMARK(BM_BitStreamReadVar)->ArgNames({"bytes", "bits"})->Args({64 * 1024, 4})->Args({64 * 1024, 32})->Args({64 * 1024, 64});
+
+static void BM_ParseInstructions(benchmark::State& state)
+{
+	const auto code = makeCodeStream(state.range(0));
+	for (auto _ : state)
+	{
+		EVMDisasm disasm {code};
+		if (!disasm.parseInstructions())
+		{
+			state.SkipWithError("synthetic code does not decode");
+			return;
+		}
+		benchmark::DoNotOptimize(disasm.getInstructions().data());
+	}
+	state.SetItemsProcessed(state.iterations() * (state.range(0) + 1));
+	state.SetBytesProcessed(state.iterations() * code.size());
+}
+BENCHMARK(BM_ParseInstructions)->Arg(1024)->Arg(64 * 1024)->Arg(1024 * 1024)->Unit(benchmark::kMillisecond);
+
+static void BM_ConvertInstructionsToSourceCode(benchmark::State& state)
+{
+	const auto code = makeCodeStream(state.range(0));
+	EVMDisasm disasm {code};
+	if (!disasm.parseInstructions())
+	{
+		state.SkipWithError("synthetic code does not decode");
+		return;
+	}
+	for (auto _ : state)
+	{
+		disasm.convertInstructionsToSourceCode();
+		benchmark::DoNotOptimize(disasm.getSourceCodeLines().data());
+	}
+	state.SetItemsProcessed(state.iterations() * (state.range(0) + 1));
+}
+BENCHMARK(BM_ConvertInstructionsToSourceCode)->Arg(1024)->Arg(64 * 1024)->Arg(1024 * 1024)->Unit(benchmark::kMillisecond);
+
+static EVMArgument registerArgument(uint8_t registerIndex)
+{
+	EVMArgument argument {ArgumentType::DATA_ACCESS};
+	argument.data.dataAccess = {DataAccessType::REGISTER, MemoryAccessSize::NONE, registerIndex};
+	return argument;
+}
+static EVMArgument constantArgument(int64_t constant)
+{
+	EVMArgument argument {ArgumentType::CONSTANT};
+	argument.data.constant = constant;
+	return argument;
+}
+static EVMArgument addressArgument(uint32_t codeAddress)
+{
+	EVMArgument argument {ArgumentType::ADDRESS};
+	argument.data.codeAddress = codeAddress;
+	return argument;
+}
+static EVMArgument dereferenceArgument(MemoryAccessSize accessSize, uint8_t registerIndex)
+{
+	EVMArgument argument {ArgumentType::DATA_ACCESS};
+	argument.data.dataAccess = {DataAccessType::DEREFERENCE, accessSize, registerIndex};
+	return argument;
+}
+static EVMInstruction makeInstruction(EVMOpcode opcode, uint32_t offset, std::initializer_list<EVMArgument> arguments, uint32_t target = EVMInstruction::Unresolved_Target)
+{
+	EVMInstruction instruction {opcode, offset, {}, target};
+	for (const auto& argument : arguments)
+	{
+		instruction.arguments.push_back(argument);
+	}
+	return instruction;
+}
+
+// linked code with short loops and branches, calls to anywhere and returns, for graph analyses
+static std::vector<EVMInstruction> makeBranchyProgram(size_t instructionCount)
+{
+	std::mt19937 random {42};
+	std::vector<EVMInstruction> instructions {};
+	instructions.reserve(instructionCount);
+	for (uint32_t i = 0; i < instructionCount; i++)
+	{
+		const uint32_t near = static_cast<uint32_t>(std::clamp<int64_t>(static_cast<int64_t>(i) + random() % 64 - 32, 0, instructionCount - 1));
+		const uint32_t far = random() % instructionCount;
+		switch (random() % 16)
+		{
+			case 0: case 1: instructions.push_back(makeInstruction(EVMOpcode::JUMPEQUAL, i, {addressArgument(near), registerArgument(0), registerArgument(1)}, near)); break;
+			case 2: instructions.push_back(makeInstruction(EVMOpcode::JUMP, i, {addressArgument(near)}, near)); break;
+			case 3: instructions.push_back(makeInstruction(EVMOpcode::CALL, i, {addressArgument(far)}, far)); break;
+			case 4: instructions.push_back(makeInstruction(EVMOpcode::RET, i, {})); break;
+			default: instructions.push_back(makeInstruction(EVMOpcode::ADD, i, {registerArgument(0), registerArgument(1), registerArgument(2)})); break;
+		}
+	}
+	return instructions;
+}
+
+// blocks, edges, functions, dominators and loops
+static void BM_ControlFlowGraph(benchmark::State& state)
+{
+	const auto instructions = makeBranchyProgram(state.range(0));
+	for (auto _ : state)
+	{
+		EVMControlFlowGraph graph {};
+		graph.build(instructions);
+		graph.computeDominators();
+		benchmark::DoNotOptimize(graph.getLoops().data());
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ControlFlowGraph)->Arg(64 * 1024)->Arg(1024 * 1024)->Arg(4 * 1024 * 1024)->Unit(benchmark::kMillisecond);
+
+// runs linked instructions on one execution unit, offsets are instruction numbers as targets are linked up front
+static bool runInstructions(const std::vector<EVMInstruction>& instructions, size_t memorySize, std::optional<size_t> maxEmulatedInstructionCount = std::nullopt)
+{
+	static const EVMDisasm disasm {};
+	std::vector<uint8_t> memory (memorySize);
+	std::unordered_map<registerIntegerType, std::shared_ptr<std::mutex>> mutices {};
+	std::fstream file {};
+	EVMFileCache fileCache {file};
+	std::atomic<size_t> instructionCounter {};
+	EVMSharedState sharedState {instructions, memory, disasm, nullptr, mutices, fileCache, false, maxEmulatedInstructionCount, instructionCounter, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+	EVMExecutionUnit executionUnit {sharedState, EVMContext {16, 10000}};
+	return executionUnit.run() == ESETVMStatus::SUCCESS;
+}
+
+// countdown loop, four instructions per iteration
+static void BM_RunLoop(benchmark::State& state)
+{
+	const int64_t iterations = 1000000;
+	const std::vector<EVMInstruction> instructions
+	{
+		makeInstruction(EVMOpcode::LOADCONST, 0, {constantArgument(iterations), registerArgument(1)}),
+		makeInstruction(EVMOpcode::LOADCONST, 1, {constantArgument(1), registerArgument(2)}),
+		makeInstruction(EVMOpcode::JUMPEQUAL, 2, {addressArgument(6), registerArgument(1), registerArgument(3)}, 6),
+		makeInstruction(EVMOpcode::ADD, 3, {registerArgument(4), registerArgument(2), registerArgument(4)}),
+		makeInstruction(EVMOpcode::SUB, 4, {registerArgument(1), registerArgument(2), registerArgument(1)}),
+		makeInstruction(EVMOpcode::JUMP, 5, {addressArgument(2)}, 2),
+		makeInstruction(EVMOpcode::HLT, 6, {})
+	};
+	const std::optional<size_t> maxEmulatedInstructionCount = state.range(0) ? std::optional<size_t> {SIZE_MAX} : std::nullopt;
+	for (auto _ : state)
+	{
+		if (!runInstructions(instructions, 0, maxEmulatedInstructionCount))
+		{
+			state.SkipWithError("loop did not halt");
+			return;
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * iterations * 4);
+}
+BENCHMARK(BM_RunLoop)->ArgName("budgeted")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+enum class BenchOpcode
+{
+	LOOP, // loop overhead only, to be subtracted from the others
+	MOV,
+	LOADCONST,
+	ADD,
+	MUL,
+	DIV,
+	COMPARE,
+	JUMPEQUAL, // not taken
+	CALL_RET,
+	MOV_BYTE,
+	MOV_WORD,
+	MOV_DWORD,
+	MOV_QWORD
+};
+
+// countdown loop with Opcode_Bench_Repeat copies of measured instruction in its body; r3 stays 0, r2 stays 1
+static const int64_t Opcode_Bench_Iterations = 100000;
+static const size_t Opcode_Bench_Repeat = 16;
+static std::vector<EVMInstruction> makeOpcodeLoop(BenchOpcode opcode)
+{
+	const size_t bodySize = opcode == BenchOpcode::LOOP ? 0 : Opcode_Bench_Repeat;
+	const uint32_t loopStart = 3;
+	const uint32_t end = loopStart + 1 + bodySize + 2;
+	const uint32_t function = end + 1;
+	std::vector<EVMInstruction> instructions
+	{
+		makeInstruction(EVMOpcode::LOADCONST, 0, {constantArgument(Opcode_Bench_Iterations), registerArgument(1)}),
+		makeInstruction(EVMOpcode::LOADCONST, 1, {constantArgument(1), registerArgument(2)}),
+		makeInstruction(EVMOpcode::LOADCONST, 2, {constantArgument(7), registerArgument(4)}),
+		makeInstruction(EVMOpcode::JUMPEQUAL, loopStart, {addressArgument(end), registerArgument(1), registerArgument(3)}, end)
+	};
+	for (size_t i = 0; i < bodySize; i++)
+	{
+		const uint32_t offset = static_cast<uint32_t>(instructions.size());
+		switch (opcode)
+		{
+			case BenchOpcode::MOV: instructions.push_back(makeInstruction(EVMOpcode::MOV, offset, {registerArgument(4), registerArgument(5)})); break;
+			case BenchOpcode::LOADCONST: instructions.push_back(makeInstruction(EVMOpcode::LOADCONST, offset, {constantArgument(0x1234), registerArgument(5)})); break;
+			case BenchOpcode::ADD: instructions.push_back(makeInstruction(EVMOpcode::ADD, offset, {registerArgument(4), registerArgument(2), registerArgument(5)})); break;
+			case BenchOpcode::MUL: instructions.push_back(makeInstruction(EVMOpcode::MUL, offset, {registerArgument(4), registerArgument(4), registerArgument(5)})); break;
+			case BenchOpcode::DIV: instructions.push_back(makeInstruction(EVMOpcode::DIV, offset, {registerArgument(4), registerArgument(2), registerArgument(5)})); break;
+			case BenchOpcode::COMPARE: instructions.push_back(makeInstruction(EVMOpcode::COMPARE, offset, {registerArgument(4), registerArgument(2), registerArgument(5)})); break;
+			case BenchOpcode::JUMPEQUAL: instructions.push_back(makeInstruction(EVMOpcode::JUMPEQUAL, offset, {addressArgument(end), registerArgument(2), registerArgument(3)}, end)); break;
+			case BenchOpcode::CALL_RET: instructions.push_back(makeInstruction(EVMOpcode::CALL, offset, {addressArgument(function)}, function)); break;
+			case BenchOpcode::MOV_BYTE: instructions.push_back(makeInstruction(EVMOpcode::MOV, offset, {dereferenceArgument(MemoryAccessSize::BYTE, 3), registerArgument(5)})); break;
+			case BenchOpcode::MOV_WORD: instructions.push_back(makeInstruction(EVMOpcode::MOV, offset, {dereferenceArgument(MemoryAccessSize::WORD, 3), registerArgument(5)})); break;
+			case BenchOpcode::MOV_DWORD: instructions.push_back(makeInstruction(EVMOpcode::MOV, offset, {dereferenceArgument(MemoryAccessSize::DWORD, 3), registerArgument(5)})); break;
+			case BenchOpcode::MOV_QWORD: instructions.push_back(makeInstruction(EVMOpcode::MOV, offset, {dereferenceArgument(MemoryAccessSize::QWORD, 3), registerArgument(5)})); break;
+			default: break;
+		}
+	}
+	instructions.push_back(makeInstruction(EVMOpcode::SUB, static_cast<uint32_t>(instructions.size()), {registerArgument(1), registerArgument(2), registerArgument(1)}));
+	instructions.push_back(makeInstruction(EVMOpcode::JUMP, static_cast<uint32_t>(instructions.size()), {addressArgument(loopStart)}, loopStart));
+	instructions.push_back(makeInstruction(EVMOpcode::HLT, end, {}));
+	instructions.push_back(makeInstruction(EVMOpcode::RET, function, {}));
+	return instructions;
+}
+// items are measured instructions, call/ret counts a pair as one
+static void BM_Opcode(benchmark::State& state, BenchOpcode opcode)
+{
+	const auto instructions = makeOpcodeLoop(opcode);
+	for (auto _ : state)
+	{
+		if (!runInstructions(instructions, 8))
+		{
+			state.SkipWithError("loop did not halt");
+			return;
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * Opcode_Bench_Iterations * (opcode == BenchOpcode::LOOP ? 1 : Opcode_Bench_Repeat));
+}
+BENCHMARK_CAPTURE(BM_Opcode, loop, BenchOpcode::LOOP)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, mov, BenchOpcode::MOV)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, loadConst, BenchOpcode::LOADCONST)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, add, BenchOpcode::ADD)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, mul, BenchOpcode::MUL)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, div, BenchOpcode::DIV)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, compare, BenchOpcode::COMPARE)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, jumpEqual, BenchOpcode::JUMPEQUAL)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, callRet, BenchOpcode::CALL_RET)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, movByte, BenchOpcode::MOV_BYTE)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, movWord, BenchOpcode::MOV_WORD)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, movDword, BenchOpcode::MOV_DWORD)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Opcode, movQword, BenchOpcode::MOV_QWORD)->Unit(benchmark::kMillisecond);
+
+// console input, binary file and instruction budget of precompiled samples, samples not listed run without them
+struct BenchSample
+{
+	std::string input {};
+	std::string binaryFile {}; // copied aside, samples may write to it
+	std::optional<size_t> maxEmulatedInstructionCount {};
+};
+static const std::map<std::string, BenchSample> Bench_Samples
+{
+	{"crc.evm", {.binaryFile = "crc.bin"}},
+	{"fibonacci_loop.evm", {.input = "5a\n"}},
+	{"multithreaded_file_write.evm", {.binaryFile = "multithreaded_file_write.bin"}},
+	{"philosophers.evm", {.input = "5\n", .maxEmulatedInstructionCount = 1000}}, // never halts, threads sleep in between meals
+	{"pseudorandom.evm", {.input = "123\n"}},
+	{"xor.evm", {.input = "123456\n98765\n"}},
+	{"xor-with-stack-frame.evm", {.input = "123456\n98765\n"}}
+};
+
+// end to end: load, decode, optimize with -O and run
+static void BM_Sample(benchmark::State& state, const std::string& samplePath, const BenchSample& sample, const std::string& binaryPath, bool optimize)
+{
+	for (auto _ : state)
+	{
+		std::istringstream input {sample.input};
+		std::ostringstream output {};
+		std::streambuf* cinbuf = std::cin.rdbuf(input.rdbuf());
+		std::streambuf* coutbuf = std::cout.rdbuf(output.rdbuf());
+		ESETVM evm {samplePath, "", ESETVMOptions {.optimize = optimize}};
+		ESETVMStatus status = evm.init();
+		if (status == ESETVMStatus::SUCCESS)
+		{
+			status = evm.run(binaryPath, sample.maxEmulatedInstructionCount);
+		}
+		std::cin.rdbuf(cinbuf);
+		std::cout.rdbuf(coutbuf);
+		const ESETVMStatus expectedStatus = sample.maxEmulatedInstructionCount.has_value() ? ESETVMStatus::EMULATION_INS_NUM_EXCEEDED : ESETVMStatus::SUCCESS;
+		if (status != expectedStatus)
+		{
+			state.SkipWithError("sample failed");
+			return;
+		}
+	}
+}
+static void registerSampleBenchmarks()
+{
+	const std::filesystem::path samplesDirectory {ESETVM_SAMPLES_DIR};
+	std::vector<std::filesystem::path> samplePaths {};
+	for (const auto& entry : std::filesystem::directory_iterator(samplesDirectory / "precompiled"))
+	{
+		if (entry.path().extension() == ".evm")
+		{
+			samplePaths.push_back(entry.path());
+		}
+	}
+	std::sort(samplePaths.begin(), samplePaths.end());
+	for (const auto& samplePath : samplePaths)
+	{
+		const std::string name = samplePath.filename().string();
+		const auto known = Bench_Samples.find(name);
+		const BenchSample sample = known != Bench_Samples.end() ? known->second : BenchSample {};
+		std::string binaryPath {};
+		if (!sample.binaryFile.empty())
+		{
+			const auto copyPath = std::filesystem::temp_directory_path() / ("esetvm_bench_" + sample.binaryFile);
+			std::error_code error {};
+			std::filesystem::copy_file(samplesDirectory / sample.binaryFile, copyPath, std::filesystem::copy_options::overwrite_existing, error);
+			binaryPath = copyPath.string();
+		}
+		for (const bool optimize : {false, true})
+		{
+			const std::string benchmarkName = (optimize ? "BM_SampleOptimized/" : "BM_Sample/") + name;
+			auto* registered = benchmark::RegisterBenchmark(benchmarkName.c_str(), BM_Sample, samplePath.string(), sample, binaryPath, optimize)->Unit(benchmark::kMicrosecond);
+			if (sample.maxEmulatedInstructionCount.has_value())
+			{
+				registered->Iterations(1); // wall time is spent sleeping in guest threads
+			}
+		}
+	}
+}
+
+// results as JSON for diffing: esetvm_bench --benchmark_out=results.json
+// regression gate: esetvm_bench --gate_baseline=baseline.json [--gate_threshold=0.1] [--gate_top=10], --gate_update=baseline.json records one
+int main(int argc, char** argv)
+{
+	std::string baselinePath {};
+	std::string updatePath {};
+	double threshold = PerfGate::Default_Threshold;
+	size_t top = PerfGate::Default_Top;
+	bool repetitionsGiven = false;
+	std::vector<char*> args {};
+	for (int i = 0; i < argc; i++)
+	{
+		const std::string_view arg {argv[i]};
+		if (arg.starts_with("--gate_baseline="))
+		{
+			baselinePath = arg.substr(arg.find('=') + 1);
+		}
+		else if (arg.starts_with("--gate_update="))
+		{
+			updatePath = arg.substr(arg.find('=') + 1);
+		}
+		else if (arg.starts_with("--gate_threshold="))
+		{
+			threshold = std::stod(std::string {arg.substr(arg.find('=') + 1)});
+		}
+		else if (arg.starts_with("--gate_top="))
+		{
+			top = std::stoul(std::string {arg.substr(arg.find('=') + 1)});
+		}
+		else
+		{
+			repetitionsGiven = repetitionsGiven || arg.starts_with("--benchmark_repetitions=");
+			args.push_back(argv[i]);
+		}
+	}
+	const bool gate = !baselinePath.empty() || !updatePath.empty();
+	if (gate) // gate needs every repetition, not aggregates only
+	{
+		std::erase_if(args, [](const char* arg)
+		{
+			const std::string_view view {arg};
+			return view.starts_with("--benchmark_display_aggregates_only") || view.starts_with("--benchmark_report_aggregates_only");
+		});
+	}
+	std::string defaultRepetitions = "--benchmark_repetitions=" + std::to_string(PerfGate::Default_Repetitions);
+	if (gate && !repetitionsGiven)
+	{
+		args.push_back(defaultRepetitions.data());
+	}
+	int gateArgc = static_cast<int>(args.size());
+	args.push_back(nullptr);
+
+	registerSampleBenchmarks();
+	benchmark::Initialize(&gateArgc, args.data());
+	if (benchmark::ReportUnrecognizedArguments(gateArgc, args.data()))
+	{
+		return 1;
+	}
+	if (!gate)
+	{
+		benchmark::RunSpecifiedBenchmarks();
+		benchmark::Shutdown();
+		return 0;
+	}
+	PerfGateReporter reporter {};
+	benchmark::RunSpecifiedBenchmarks(&reporter);
+	benchmark::Shutdown();
+	const auto current = reporter.summarize();
+	if (!updatePath.empty())
+	{
+		std::ofstream baselineFile {updatePath, std::ios::trunc};
+		PerfGate::writeBaseline(current, baselineFile);
+		if (!baselineFile.is_open() || baselineFile.fail())
+		{
+			std::cerr << "Could not write baseline " << updatePath << std::endl;
+			return 1;
+		}
+		std::cout << "Baseline of " << current.size() << " benchmarks saved to " << updatePath << std::endl;
+	}
+	if (baselinePath.empty())
+	{
+		return 0;
+	}
+	std::ifstream baselineFile {baselinePath};
+	const auto baseline = baselineFile.is_open() ? PerfGate::readBaseline(baselineFile) : std::nullopt;
+	if (!baseline.has_value())
+	{
+		std::cerr << "Could not read baseline " << baselinePath << std::endl;
+		return 1;
+	}
+	return PerfGate::compare(baseline.value(), current, threshold, top, std::cout) ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+# Measures how guest throughput scales with the number of guest threads in bench/scaling/scaling.evm
+# and compares parallel efficiency against bench/scaling/baseline.json.
+#
+# speedup(N) = throughput(N) / throughput(1)
+# efficiency(N) = speedup(N) / min(N, host CPUs)
+#
+# Efficiency depends on the host, so baselines are stored per host CPU count. The script exits with 1
+# when efficiency of any mode and thread count drops below baseline * (1 - tolerance).
+# Hosts without a baseline of their own are held to the "floor" entry, limits that hold on any host:
+# minimum efficiency for modes whose workers share nothing, minimum speedup for modes serialized by a
+# lock or the binary file. Floors catch collapse, not drift. With --require-baseline a mode checked
+# against neither is an error (exit 2), so a CI gate cannot pass by having nothing to compare with.
+#
+# usage: run_scaling.py <path to EsetVM> [--threads 1,2,4] [--modes compute,lock] [--repeat N]
+#                       [--tolerance 0.2] [--json results.json] [--update-baseline] [--require-baseline]
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+SCALING_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "scaling")
+BASELINE_PATH = os.path.join(SCALING_DIR, "baseline.json")
+
+# mode name: (mode number read by guest, total iterations split between workers)
+MODES = {
+	"compute": (0, 0x800000),
+	"lock": (1, 0x100000),
+	"write": (2, 0x100000),
+}
+DEFAULT_THREADS = [1, 2, 4, 8, 16, 32, 64, 128]
+MAX_THREADS = 128 # worker slots in guest memory
+
+def run_once(esetvm, mode, threads, iterations, binary_path):
+	open(binary_path, "wb").close()
+	command = [esetvm, "-r", os.path.join(SCALING_DIR, "scaling.evm"), "-b", binary_path]
+	guest_input = "%x\n%x\n%x\n" % (mode, threads, iterations)
+	start = time.perf_counter()
+	result = subprocess.run(command, input=guest_input, capture_output=True, text=True)
+	wall = time.perf_counter() - start
+	if result.returncode != 0:
+		raise RuntimeError("mode %d with %d threads exited with %d: %s" % (mode, threads, result.returncode, result.stderr.strip()))
+	done = int(result.stdout.split()[0], 16)
+	return wall, done
+
+def load_baseline():
+	if not os.path.exists(BASELINE_PATH):
+		return {}
+	with open(BASELINE_PATH) as f:
+		return json.load(f)
+
+def main():
+	parser = argparse.ArgumentParser(description="Guest thread scaling benchmark")
+	parser.add_argument("esetvm", help="path to EsetVM executable")
+	parser.add_argument("--threads", default=",".join(map(str, DEFAULT_THREADS)), help="comma separated guest thread counts, must include 1")
+	parser.add_argument("--modes", default=",".join(MODES), help="comma separated modes: " + ", ".join(MODES))
+	parser.add_argument("--repeat", type=int, default=3, help="runs per point, median is reported")
+	parser.add_argument("--tolerance", type=float, default=0.2, help="allowed relative drop of efficiency against baseline")
+	parser.add_argument("--json", help="save results to JSON file")
+	parser.add_argument("--update-baseline", action="store_true", help="store results as baseline for this CPU count")
+	parser.add_argument("--require-baseline", action="store_true", help="fail when a mode has neither a baseline for this CPU count nor a floor")
+	args = parser.parse_args()
+
+	thread_counts = sorted(set(int(t) for t in args.threads.split(",")))
+	modes = args.modes.split(",")
+	if thread_counts[0] != 1 or thread_counts[-1] > MAX_THREADS:
+		parser.error("thread counts must include 1 and be at most %d" % MAX_THREADS)
+	unknown = [mode for mode in modes if mode not in MODES]
+	if unknown:
+		parser.error("unknown modes: " + ", ".join(unknown))
+
+	cpus = os.cpu_count() or 1
+	results = {}
+	with tempfile.TemporaryDirectory() as temp:
+		binary_path = os.path.join(temp, "scaling.bin")
+		for mode in modes:
+			number, iterations = MODES[mode]
+			print("%s (%d host CPUs)" % (mode, cpus))
+			print("%8s %10s %16s %8s %10s" % ("threads", "wall s", "iterations/s", "speedup", "efficiency"))
+			points = {}
+			for threads in thread_counts:
+				runs = [run_once(args.esetvm, number, threads, iterations, binary_path) for _ in range(args.repeat)]
+				wall = statistics.median(run[0] for run in runs)
+				throughput = runs[0][1] / wall
+				speedup = throughput / points[1]["throughput"] if threads > 1 else 1.0
+				efficiency = speedup / min(threads, cpus)
+				points[threads] = {"wallSeconds": wall, "throughput": throughput, "speedup": speedup, "efficiency": efficiency}
+				print("%8d %10.3f %16.0f %8.2f %10.2f" % (threads, wall, throughput, speedup, efficiency))
+			results[mode] = points
+
+	if args.json:
+		with open(args.json, "w") as f:
+			json.dump({"cpus": cpus, "modes": results}, f, indent=2)
+
+	baseline = load_baseline()
+	key = "cpus=%d" % cpus
+	if args.update_baseline:
+		stored = baseline.get(key, {})
+		for mode, points in results.items():
+			stored[mode] = {str(threads): round(point["efficiency"], 3) for threads, point in points.items()}
+		baseline[key] = stored
+		with open(BASELINE_PATH, "w") as f:
+			json.dump(baseline, f, indent=2, sort_keys=True)
+			f.write("\n")
+		print("Baseline for %s saved to %s" % (key, BASELINE_PATH))
+		return 0
+	regressions = []
+	unchecked = []
+	for mode, points in results.items():
+		if mode in baseline.get(key, {}):
+			for threads, point in points.items():
+				expected = baseline[key][mode].get(str(threads))
+				if expected is not None and point["efficiency"] < expected * (1 - args.tolerance):
+					regressions.append("%s with %d threads: efficiency %.2f, baseline %.2f" % (mode, threads, point["efficiency"], expected))
+		elif mode in baseline.get("floor", {}):
+			floor = baseline["floor"][mode]
+			for threads, point in points.items():
+				for metric in ("efficiency", "speedup"):
+					if metric in floor and point[metric] < floor[metric]:
+						regressions.append("%s with %d threads: %s %.2f, floor %.2f" % (mode, threads, metric, point[metric], floor[metric]))
+		else:
+			unchecked.append(mode)
+	for regression in regressions:
+		print("Regression: " + regression)
+	if unchecked:
+		print("No baseline for %s and no floor for %s, run with --update-baseline to create one" % (key, ", ".join(unchecked)))
+		if args.require_baseline:
+			return 2
+	return 1 if regressions else 0
+
+if __name__ == "__main__":
+	sys.exit(main())
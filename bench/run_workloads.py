@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+# Runs the workload corpus in bench/workloads, checks console output against .expected files
+# and reports median wall time and instructions per second of each workload.
+# Wall time includes process start, loading and decoding, which are small next to execution.
+#
+# With --optimize every workload is also run with -O and the speedup of the optimized program is reported.
+# With --rewrite every workload is rewritten with --optimize into a new .evm file, which is run without -O.
+# With --aot every workload is also run compiled to native code with --aot. Compiled code is kept in a cache directory
+# by a first untimed run, so timed runs do not include the C compiler.
+#
+# usage: run_workloads.py <path to EsetVM> [--repeat N] [--optimize] [--rewrite] [--aot] [--json results.json] [workload ...]
+
+import argparse
+import hashlib
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+WORKLOADS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "workloads")
+
+def crc32_input(path):
+	# 2 MiB of SHA-256 blocks of a counter, crc32.expected is zlib.crc32 of it
+	with open(path, "wb") as f:
+		for i in range(65536):
+			f.write(hashlib.sha256(i.to_bytes(4, "little")).digest())
+
+# name: function creating the binary file passed with -b, or None
+WORKLOADS = {
+	"crc32": crc32_input,
+	"sort": None,
+	"matmul": None,
+	"hashtable": None,
+	"recursion": None,
+	"prodcons": None,
+}
+
+def run_once(esetvm, name, binary_path, stats, optimize=False, program=None, aot_cache=None):
+	command = [esetvm, "-r", program or os.path.join(WORKLOADS_DIR, name + ".evm")]
+	if aot_cache is not None:
+		command[1:1] = ["--aot", "-c", aot_cache]
+	if stats:
+		command.insert(1, "--stats=json")
+	if optimize:
+		command.insert(1, "-O")
+	if binary_path is not None:
+		command += ["-b", binary_path]
+	start = time.perf_counter()
+	result = subprocess.run(command, stdin=subprocess.DEVNULL, capture_output=True, text=True)
+	wall = time.perf_counter() - start
+	if result.returncode != 0:
+		raise RuntimeError("%s exited with %d: %s" % (name, result.returncode, result.stderr.strip()))
+	return wall, result.stdout, json.loads(result.stderr.strip().splitlines()[-1]) if stats else None
+
+def main():
+	parser = argparse.ArgumentParser(description="Run EVM workload corpus")
+	parser.add_argument("esetvm", help="path to EsetVM executable")
+	parser.add_argument("--repeat", type=int, default=3, help="runs per workload, median is reported")
+	parser.add_argument("--optimize", action="store_true", help="also run with -O and report speedup")
+	parser.add_argument("--rewrite", action="store_true", help="also run programs rewritten with --optimize and report speedup")
+	parser.add_argument("--aot", action="store_true", help="also run compiled to native code with --aot and report speedup")
+	parser.add_argument("--json", help="save results to JSON file")
+	parser.add_argument("workloads", nargs="*", help="workloads to run, all by default")
+	args = parser.parse_intermixed_args() # workloads may follow options
+
+	names = args.workloads or list(WORKLOADS)
+	unknown = [name for name in names if name not in WORKLOADS]
+	if unknown:
+		parser.error("unknown workloads: " + ", ".join(unknown))
+
+	results = []
+	failed = False
+	with tempfile.TemporaryDirectory() as temp:
+		print("%-12s %10s %14s %10s  %s" % ("workload", "wall s", "instructions", "MIPS", "output") + ("  %10s %14s %8s" % ("-O wall s", "-O instr.", "speedup") if args.optimize else "") +
+			("  %10s %14s %8s" % ("rw wall s", "rw instr.", "speedup") if args.rewrite else "") + ("  %10s %8s" % ("aot wall s", "speedup") if args.aot else ""))
+		for name in names:
+			binary_path = None
+			if WORKLOADS[name] is not None:
+				binary_path = os.path.join(temp, name + ".bin")
+				WORKLOADS[name](binary_path)
+			with open(os.path.join(WORKLOADS_DIR, name + ".expected")) as f:
+				expected = f.read()
+			# --stats runs the slower instrumented interpreter loop, so instructions are counted in a separate run
+			_, output, stats = run_once(args.esetvm, name, binary_path, True)
+			output_ok = output == expected
+			instructions = stats["instructions"]["total"] # varies with lock contention in threaded workloads
+			walls = []
+			for _ in range(args.repeat):
+				wall, output, _ = run_once(args.esetvm, name, binary_path, False)
+				output_ok = output_ok and output == expected
+				walls.append(wall)
+			wall = statistics.median(walls)
+			mips = instructions / wall / 1e6
+			result = {"name": name, "wallSeconds": wall, "instructions": instructions, "mips": mips, "outputOk": output_ok, "runs": walls}
+			line = "%-12s %10.3f %14d %10.1f  %s" % (name, wall, instructions, mips, "ok" if output_ok else "MISMATCH")
+			if args.optimize:
+				_, output, stats = run_once(args.esetvm, name, binary_path, True, True)
+				optimized_ok = output == expected
+				optimized_walls = []
+				for _ in range(args.repeat):
+					optimized_wall, output, _ = run_once(args.esetvm, name, binary_path, False, True)
+					optimized_ok = optimized_ok and output == expected
+					optimized_walls.append(optimized_wall)
+				optimized_wall = statistics.median(optimized_walls)
+				output_ok = output_ok and optimized_ok
+				result["optimized"] = {"wallSeconds": optimized_wall, "instructions": stats["instructions"]["total"], "outputOk": optimized_ok, "runs": optimized_walls}
+				line += "  %10.3f %14d %7.2fx" % (optimized_wall, stats["instructions"]["total"], wall / optimized_wall)
+			if args.rewrite:
+				program = os.path.join(temp, name + ".evm")
+				rewrite = subprocess.run([args.esetvm, "--optimize", os.path.join(WORKLOADS_DIR, name + ".evm"), program], capture_output=True, text=True)
+				if rewrite.returncode != 0:
+					raise RuntimeError("%s rewrite exited with %d: %s" % (name, rewrite.returncode, rewrite.stderr.strip()))
+				_, output, stats = run_once(args.esetvm, name, binary_path, True, program=program)
+				rewritten_ok = output == expected
+				rewritten_walls = []
+				for _ in range(args.repeat):
+					rewritten_wall, output, _ = run_once(args.esetvm, name, binary_path, False, program=program)
+					rewritten_ok = rewritten_ok and output == expected
+					rewritten_walls.append(rewritten_wall)
+				rewritten_wall = statistics.median(rewritten_walls)
+				output_ok = output_ok and rewritten_ok
+				result["rewritten"] = {"wallSeconds": rewritten_wall, "instructions": stats["instructions"]["total"], "outputOk": rewritten_ok, "runs": rewritten_walls}
+				line += "  %10.3f %14d %7.2fx" % (rewritten_wall, stats["instructions"]["total"], wall / rewritten_wall)
+			if args.aot:
+				# native code counts no instructions, so only wall time is reported
+				aot_cache = os.path.join(temp, "aot")
+				_, output, _ = run_once(args.esetvm, name, binary_path, False, aot_cache=aot_cache)
+				aot_ok = output == expected
+				aot_walls = []
+				for _ in range(args.repeat):
+					aot_wall, output, _ = run_once(args.esetvm, name, binary_path, False, aot_cache=aot_cache)
+					aot_ok = aot_ok and output == expected
+					aot_walls.append(aot_wall)
+				aot_wall = statistics.median(aot_walls)
+				output_ok = output_ok and aot_ok
+				result["aot"] = {"wallSeconds": aot_wall, "outputOk": aot_ok, "runs": aot_walls}
+				line += "  %10.3f %7.2fx" % (aot_wall, wall / aot_wall)
+			failed = failed or not output_ok
+			print(line)
+			results.append(result)
+
+	if args.json:
+		with open(args.json, "w") as f:
+			json.dump({"workloads": results}, f, indent=2)
+	return 1 if failed else 0
+
+if __name__ == "__main__":
+	sys.exit(main())
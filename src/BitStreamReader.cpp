@@ -1,35 +1,26 @@
 #include "BitStreamReader.h"
 
-BitStreamReader::BitStreamReader(const std::vector<std::byte>& inputData)
+BitStreamReader::BitStreamReader(std::span<const std::byte> inputData)
 {
 	init(inputData);
 }
-void BitStreamReader::init(const std::vector<std::byte>& inputData)
+void BitStreamReader::init(std::span<const std::byte> inputData)
 {
-	m_bitStream.resize(inputData.size() * BITS_IN_BYTE);
-	size_t byteIter = 0;
-	for (const auto& byte : inputData)
-	{
-		for (size_t i = 0; i < BITS_IN_BYTE; i++)
-		{
-			size_t bitMask = BITS_IN_BYTE - i - 1;
-			bool bit = static_cast<uint8_t>(byte) & (1 << bitMask);
-			m_bitStream[byteIter * BITS_IN_BYTE + i] = bit;
-		}
-		byteIter++;
-	}
+	m_bytes = inputData;
+	m_bitStreamSize = inputData.size() * BITS_IN_BYTE;
+	m_bitStreamPosition = 0;
 }
 bool BitStreamReader::seek(size_t offset, BitStreamReaderSeekStrategy strategy)
 {
 	if (strategy == BitStreamReaderSeekStrategy::CUR)
 	{
-		if (m_bitStreamPosition + offset > m_bitStream.size())
+		if (m_bitStreamPosition + offset > m_bitStreamSize)
 		{
 			return false;
 		}
 		m_bitStreamPosition += offset;
 	}
-	if (offset >= m_bitStream.size())
+	if (offset >= m_bitStreamSize)
 	{
 		return false;
 	}
@@ -39,22 +30,26 @@ bool BitStreamReader::seek(size_t offset, BitStreamReaderSeekStrategy strategy)
 	}
 	else if (strategy == BitStreamReaderSeekStrategy::END)
 	{
-		m_bitStreamPosition = m_bitStream.size() - offset - 1;
+		m_bitStreamPosition = m_bitStreamSize - offset - 1;
 	}
 	return true;
 }
-std::optional<std::vector<bool>::const_iterator> BitStreamReader::readBits(size_t count, bool movePointer)
+std::optional<std::vector<bool>> BitStreamReader::readBits(size_t count, bool movePointer)
 {
-	if (m_bitStreamPosition + count > m_bitStream.size())
+	if (m_bitStreamPosition + count > m_bitStreamSize)
 	{
 		return std::nullopt;
 	}
-	const auto begin = m_bitStream.cbegin() + m_bitStreamPosition;
-	const auto end = begin + count;
+	std::vector<bool> bits(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const uint64_t position = m_bitStreamPosition + i;
+		const uint8_t byte = static_cast<uint8_t>(m_bytes[position / BITS_IN_BYTE]);
+		bits[i] = byte & (1 << (BITS_IN_BYTE - position % BITS_IN_BYTE - 1));
+	}
 	if (movePointer)
 	{
 		m_bitStreamPosition += count;
 	}
-	return end;
+	return bits;
 }
-
@@ -1,9 +1,10 @@
 #pragma once
 #include "utils.h"
 #include <algorithm>
-#include <bitset>
+#include <cstring>
 #include <inttypes.h>
 #include <optional>
+#include <span>
 #include <string>
 #include <vector>
 
@@ -14,63 +15,73 @@ enum class BitStreamReaderSeekStrategy
 	END
 };
 
+// Reads bits (most significant bit of every byte first) directly from a byte view,
+// the underlying bytes must outlive the reader.
 class BitStreamReader
 {
 private:
-	std::vector<bool> m_bitStream {};
+	std::span<const std::byte> m_bytes {};
+	uint64_t m_bitStreamSize {};
 	uint64_t m_bitStreamPosition {};
-	
-	template <typename T>
-	std::optional<T> bitStreamToVar(std::vector<bool>::const_iterator begin, std::vector<bool>::const_iterator end, bool bigEndian = false)
+
+	// returns count (<= 64) bits starting at position, first bit in stream is the most significant one
+	uint64_t peekBitsBigEndian(uint64_t position, size_t count) const
 	{
-		if (std::distance(begin, end) > sizeof(T) * BITS_IN_BYTE)
+		if (count == 0)
 		{
-			return std::nullopt;
+			return 0;
 		}
-		T var {};
-		size_t bitIndex = 0;
-		for (auto& it = begin; it != end; it++, bitIndex++)
+		const size_t byteIndex = position / BITS_IN_BYTE;
+		const size_t bitInByte = position % BITS_IN_BYTE;
+		uint8_t window[9] {};
+		std::memcpy(window, m_bytes.data() + byteIndex, std::min<size_t>(sizeof(window), m_bytes.size() - byteIndex));
+		uint64_t word {};
+		for (size_t i = 0; i < sizeof(word); i++)
 		{
-			if (*it == true)
-			{
-				if (bigEndian)
-				{
-					var |= static_cast<T>(1) << (end - it - 1);
-				}
-				else
-				{
-					var |= static_cast<T>(1) << bitIndex;
-				}
-			}
+			word = (word << BITS_IN_BYTE) | window[i];
 		}
-		return var;
+		word <<= bitInByte;
+		if (bitInByte > 0)
+		{
+			word |= window[8] >> (BITS_IN_BYTE - bitInByte);
+		}
+		return word >> (64 - count);
 	}
 public:
+	// reverses order of the lowest count bits
+	static uint64_t reverseBits(uint64_t value, size_t count)
+	{
+		value = ((value >> 1) & 0x5555555555555555ULL) | ((value & 0x5555555555555555ULL) << 1);
+		value = ((value >> 2) & 0x3333333333333333ULL) | ((value & 0x3333333333333333ULL) << 2);
+		value = ((value >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((value & 0x0F0F0F0F0F0F0F0FULL) << 4);
+		value = __builtin_bswap64(value);
+		return count == 0 ? 0 : value >> (64 - count);
+	}
 	BitStreamReader() = default;
-	BitStreamReader(const std::vector<std::byte>& inputData);
-	void init(const std::vector<std::byte>& inputData);
+	BitStreamReader(std::span<const std::byte> inputData);
+	void init(std::span<const std::byte> inputData);
 	bool seek(size_t offset, BitStreamReaderSeekStrategy strategy = BitStreamReaderSeekStrategy::CUR);
-	std::optional<std::vector<bool>::const_iterator> readBits(size_t count, bool movePointer = true);
-	uint64_t getStreamSize() const { return m_bitStream.size(); }
+	std::optional<std::vector<bool>> readBits(size_t count, bool movePointer = true);
+	uint64_t getStreamSize() const { return m_bitStreamSize; }
 	uint64_t getStreamPosition() const { return m_bitStreamPosition; }
-	
+
 	template <typename T>
 	std::optional<T> readVar(size_t overrideCountBytes = 0, bool movePointer = true, bool bigEndian = false)
 	{
-		std::vector<bool> bits;
 		size_t bitsToRead = overrideCountBytes == 0 ? sizeof(T) * BITS_IN_BYTE : overrideCountBytes;
-
-		const auto readBitsResult = readBits(bitsToRead, movePointer);
-		if (!readBitsResult.has_value())
+		if (bitsToRead > sizeof(T) * BITS_IN_BYTE || m_bitStreamPosition + bitsToRead > m_bitStreamSize)
 		{
 			return std::nullopt;
 		}
-		const auto& endIt = readBitsResult.value();
-		const auto varResult = bitStreamToVar<T>(endIt - bitsToRead, endIt, bigEndian);
-		if (!varResult.has_value())
+		uint64_t var = peekBitsBigEndian(m_bitStreamPosition, bitsToRead);
+		if (!bigEndian)
 		{
-			return std::nullopt;
+			var = reverseBits(var, bitsToRead);
+		}
+		if (movePointer)
+		{
+			m_bitStreamPosition += bitsToRead;
 		}
-		return varResult.value();
+		return static_cast<T>(var);
 	}
 };
@@ -0,0 +1,17 @@
+#include "BitStreamWriter.h"
+
+void BitStreamWriter::pokeBitsBigEndian(uint64_t position, uint64_t bits, size_t count)
+{
+	while (count > 0)
+	{
+		const size_t bitInByte = position % BITS_IN_BYTE;
+		const size_t taken = std::min(BITS_IN_BYTE - bitInByte, count);
+		const uint8_t chunk = static_cast<uint8_t>((bits >> (count - taken)) & ((1U << taken) - 1));
+		const size_t shift = BITS_IN_BYTE - bitInByte - taken;
+		const uint8_t mask = static_cast<uint8_t>(((1U << taken) - 1) << shift);
+		std::byte& byte = m_bytes[position / BITS_IN_BYTE];
+		byte = (byte & std::byte {static_cast<uint8_t>(~mask)}) | std::byte {static_cast<uint8_t>(chunk << shift)};
+		position += taken;
+		count -= taken;
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "BitStreamReader.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <span>
+#include <vector>
+
+// Appends bits (most significant bit of every byte first) to a growing byte buffer, counterpart of BitStreamReader.
+class BitStreamWriter
+{
+private:
+	std::vector<std::byte> m_bytes {};
+	uint64_t m_bitStreamSize {};
+
+	// stores the lowest count (<= 64) bits of bits at position, the most significant of them first
+	void pokeBitsBigEndian(uint64_t position, uint64_t bits, size_t count);
+	void pokeVar(uint64_t position, uint64_t value, size_t count, bool bigEndian)
+	{
+		if (count < 64)
+		{
+			value &= (1ULL << count) - 1;
+		}
+		pokeBitsBigEndian(position, bigEndian ? value : BitStreamReader::reverseBits(value, count), count);
+	}
+public:
+	BitStreamWriter() = default;
+	void reserve(size_t byteCount) { m_bytes.reserve(byteCount); }
+	void alignToByte() { m_bitStreamSize = m_bytes.size() * BITS_IN_BYTE; } // rest of the last byte stays zero
+	uint64_t getStreamSize() const { return m_bitStreamSize; }
+	std::span<const std::byte> getBytes() const { return m_bytes; }
+
+	// same bit order as BitStreamReader::readVar, count defaults to the size of T
+	template <typename T>
+	void writeVar(T value, size_t overrideCountBits = 0, bool bigEndian = false)
+	{
+		const size_t count = overrideCountBits == 0 ? sizeof(T) * BITS_IN_BYTE : overrideCountBits;
+		m_bytes.resize((m_bitStreamSize + count + BITS_IN_BYTE - 1) / BITS_IN_BYTE);
+		pokeVar(m_bitStreamSize, static_cast<uint64_t>(value), count, bigEndian);
+		m_bitStreamSize += count;
+	}
+	// overwrites bits already written, used to patch forward references
+	template <typename T>
+	bool writeVarAt(uint64_t position, T value, size_t count, bool bigEndian = false)
+	{
+		if (count > sizeof(T) * BITS_IN_BYTE || position + count > m_bitStreamSize)
+		{
+			return false;
+		}
+		pokeVar(position, static_cast<uint64_t>(value), count, bigEndian);
+		return true;
+	}
+};
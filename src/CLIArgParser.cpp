@@ -6,12 +6,28 @@ CLIArgParser::CLIArgParser(int argc, const char** argv)
 }
 void CLIArgParser::showHelp()
 {
-	std::cout << "Usage: esetvm [-h] [-v] [-d] [-r] <input.evm> <output.easm> [-b] <file.bin>" << std::endl;
+	std::cout << "Usage: esetvm [-h] [-v] [-l] [-c <cache dir>] [-t <file.trace> [--trace-registers]] [-p [--profile-json <file.json>]] [-s <file.folded>] [--lock-profile [--lock-profile-json <file.json>]] [--stats[=json]] [-O] [--aot] [-d] [-r] <input.evm> <output.easm> [-b] <file.bin> [-a <input.easm> <output.evm>] [--cfg-dot <input.evm> <output.dot>] [--optimize <input.evm> <output.evm>]" << std::endl;
 	std::cout << "-h shows this help" << std::endl;
 	std::cout << "-v enables verbose mode" << std::endl;
 	std::cout << "-d <input.evm> <output.easm> deassembles input file and saves it to output" << std::endl;
+	std::cout << "-a <input.easm> <output.evm> assembles input file and saves it to output" << std::endl;
+	std::cout << "--optimize <input.evm> <output.evm> saves input file optimized as with -O, output runs on any ESET-VM2 interpreter" << std::endl;
+	std::cout << "--cfg-dot <input.evm> <output.dot> saves control flow graph of input file as Graphviz file: basic blocks, functions and loops" << std::endl;
 	std::cout << "-r <input.evm> runs .evm file" << std::endl;
 	std::cout << "-b <file.bin> passes file to program" << std::endl;
+	std::cout << "-l decodes code lazily when it is first executed (with -r)" << std::endl;
+	std::cout << "-c <cache dir> keeps decoded programs in cache dir and reuses them on later runs (with -r)" << std::endl;
+	std::cout << "-t <file.trace> records executed instructions to binary trace file (with -r)" << std::endl;
+	std::cout << "--trace-registers records register changes in trace as well (with -t)" << std::endl;
+	std::cout << "--decode-trace <file.trace> <input.evm> prints trace recorded while running input.evm" << std::endl;
+	std::cout << "-p prints execution profile per opcode and per instruction to stderr after run (with -r, without -l)" << std::endl;
+	std::cout << "--profile-json <file.json> saves execution profile as JSON as well (with -p)" << std::endl;
+	std::cout << "-s <file.folded> samples guest call stacks and saves them in collapsed format for flame graphs (with -r, without -l)" << std::endl;
+	std::cout << "--lock-profile prints guest lock contention per lock id to stderr after run (with -r)" << std::endl;
+	std::cout << "--lock-profile-json <file.json> saves lock contention as JSON as well (with --lock-profile)" << std::endl;
+	std::cout << "-O optimizes decoded program before it runs: constant propagation and folding, loop constant hoisting, dead and unreachable code removal (with -r, without -l and -t)" << std::endl;
+	std::cout << "--aot translates decoded program to C, compiles it with $CC or cc and runs it natively, interpreted when no compiler is available, compiled code is kept in cache dir with -c (with -r, without -l, -t, -p, -s and --stats)" << std::endl;
+	std::cout << "--stats[=json] prints phase timings and run metrics to stderr as key=value lines or JSON (with -r, -d, --cfg-dot or --optimize)" << std::endl;
 }
 bool CLIArgParser::parseArguments ()
 {
@@ -30,7 +46,7 @@ bool CLIArgParser::parseArguments ()
 			{
 				m_inputPath = *(checkedArg + 1);
 			}
-			else if (*checkedArg == "-d" && checkedArg + 1 != m_args.cend() && checkedArg + 2 != m_args.cend())
+			else if ((*checkedArg == "-d" || *checkedArg == "-a" || *checkedArg == "--cfg-dot" || *checkedArg == "--optimize") && checkedArg + 1 != m_args.cend() && checkedArg + 2 != m_args.cend())
 			{
 				m_inputPath = *(checkedArg + 1);
 				m_outputPath = *(checkedArg + 2);
@@ -39,6 +55,31 @@ bool CLIArgParser::parseArguments ()
 			{
 				m_binaryFilePath = *(checkedArg + 1);
 			}
+			else if (*checkedArg == "-c" && checkedArg + 1 != m_args.cend())
+			{
+				m_imageCacheDirectory = *(checkedArg + 1);
+			}
+			else if (*checkedArg == "-t" && checkedArg + 1 != m_args.cend())
+			{
+				m_tracePath = *(checkedArg + 1);
+			}
+			else if (*checkedArg == "--decode-trace" && checkedArg + 1 != m_args.cend() && checkedArg + 2 != m_args.cend())
+			{
+				m_tracePath = *(checkedArg + 1);
+				m_inputPath = *(checkedArg + 2);
+			}
+			else if (*checkedArg == "--profile-json" && checkedArg + 1 != m_args.cend())
+			{
+				m_profileJsonPath = *(checkedArg + 1);
+			}
+			else if (*checkedArg == "-s" && checkedArg + 1 != m_args.cend())
+			{
+				m_samplePath = *(checkedArg + 1);
+			}
+			else if (*checkedArg == "--lock-profile-json" && checkedArg + 1 != m_args.cend())
+			{
+				m_lockProfileJsonPath = *(checkedArg + 1);
+			}
 		}
 	}
 		
@@ -52,16 +93,54 @@ bool CLIArgParser::parseArguments ()
 		std::cerr << "If you want to dissasemble .evm file please provide <file.evm> <output.easm>" << std::endl;
 		return false;
 	}
+	else if (m_cliFlags.assemble && (m_inputPath.empty() || m_outputPath.empty()))
+	{
+		std::cerr << "If you want to assemble .easm file please provide <file.easm> <output.evm>" << std::endl;
+		return false;
+	}
+	else if (m_cliFlags.cfgDot && (m_inputPath.empty() || m_outputPath.empty()))
+	{
+		std::cerr << "If you want to save control flow graph please provide <file.evm> <output.dot>" << std::endl;
+		return false;
+	}
+	else if (m_cliFlags.rewrite && (m_inputPath.empty() || m_outputPath.empty()))
+	{
+		std::cerr << "If you want to optimize .evm file please provide <file.evm> <output.evm>" << std::endl;
+		return false;
+	}
 	else if (m_cliFlags.run && m_inputPath.empty())
 	{
 		std::cerr << "If you want to run evm program please provide -i <file.evm>" << std::endl;
 		return false;
 	}
-	else if ( (m_cliFlags.disassemble && (m_cliFlags.run || m_cliFlags.binaryFile)) || (m_cliFlags.binaryFile && !(m_cliFlags.disassemble) && !(m_cliFlags.run)))
+	else if ( (m_cliFlags.disassemble && (m_cliFlags.run || m_cliFlags.binaryFile)) || (m_cliFlags.binaryFile && !(m_cliFlags.disassemble) && !(m_cliFlags.run)) || (m_cliFlags.lazyDecoding && !m_cliFlags.run) || (m_cliFlags.imageCache && (!m_cliFlags.run || m_cliFlags.lazyDecoding || m_imageCacheDirectory.empty())))
+	{
+		std::cout << "Invalid arguments" << std::endl;
+		return false;
+	}
+	else if ((m_cliFlags.trace && (!m_cliFlags.run || m_tracePath.empty())) || (m_cliFlags.traceRegisters && !m_cliFlags.trace) ||
+		(m_cliFlags.decodeTrace && (m_cliFlags.run || m_cliFlags.disassemble || m_cliFlags.binaryFile || m_cliFlags.trace || m_inputPath.empty())) ||
+		(m_cliFlags.assemble && (m_cliFlags.run || m_cliFlags.disassemble || m_cliFlags.decodeTrace || m_cliFlags.binaryFile)) ||
+		(m_cliFlags.optimize && (!m_cliFlags.run || m_cliFlags.lazyDecoding || m_cliFlags.trace)) ||
+		(m_cliFlags.aot && (!m_cliFlags.run || m_cliFlags.lazyDecoding || m_cliFlags.trace || m_cliFlags.profile || m_cliFlags.sample || m_cliFlags.stats || m_cliFlags.statsJson)) ||
+		(m_cliFlags.cfgDot && (m_cliFlags.run || m_cliFlags.disassemble || m_cliFlags.assemble || m_cliFlags.decodeTrace || m_cliFlags.binaryFile)) ||
+		(m_cliFlags.rewrite && (m_cliFlags.run || m_cliFlags.disassemble || m_cliFlags.assemble || m_cliFlags.decodeTrace || m_cliFlags.binaryFile || m_cliFlags.cfgDot)))
+	{
+		std::cout << "Invalid arguments" << std::endl;
+		return false;
+	}
+	else if ((m_cliFlags.profile && (!m_cliFlags.run || m_cliFlags.lazyDecoding)) || (m_cliFlags.profileJson && (!m_cliFlags.profile || m_profileJsonPath.empty())) ||
+		(m_cliFlags.sample && (!m_cliFlags.run || m_cliFlags.lazyDecoding || m_samplePath.empty())) ||
+		(m_cliFlags.lockProfile && !m_cliFlags.run) || ((m_cliFlags.stats || m_cliFlags.statsJson) && !m_cliFlags.run && !m_cliFlags.disassemble && !m_cliFlags.cfgDot && !m_cliFlags.rewrite) || (m_cliFlags.lockProfileJson && (!m_cliFlags.lockProfile || m_lockProfileJsonPath.empty())))
 	{
 		std::cout << "Invalid arguments" << std::endl;
 		return false;
 	}
+	else if (m_cliFlags.decodeTrace && !std::filesystem::exists(m_tracePath))
+	{
+		std::cerr << "Invalid trace file" << std::endl;
+		return false;
+	}
 	else if (!m_binaryFilePath.empty() && !std::filesystem::exists(m_binaryFilePath))
 	{
 		std::cerr << "Invalid binary file" << std::endl;
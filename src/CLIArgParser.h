@@ -12,8 +12,25 @@ struct cmdLineFlags
 	bool help;
 	bool verbose;
 	bool disassemble;
+	bool assemble;
 	bool run;
 	bool binaryFile;
+	bool lazyDecoding;
+	bool imageCache;
+	bool trace;
+	bool traceRegisters;
+	bool decodeTrace;
+	bool profile;
+	bool profileJson;
+	bool sample;
+	bool lockProfile;
+	bool lockProfileJson;
+	bool stats;
+	bool statsJson;
+	bool optimize;
+	bool cfgDot;
+	bool rewrite;
+	bool aot;
 };
 
 class CLIArgParser
@@ -25,13 +42,35 @@ private:
 		{"-h", &m_cliFlags.help},
 		{"-v", &m_cliFlags.verbose},
 		{"-d", &m_cliFlags.disassemble},
+		{"-a", &m_cliFlags.assemble},
 		{"-r", &m_cliFlags.run},
-		{"-b", &m_cliFlags.binaryFile}
+		{"-b", &m_cliFlags.binaryFile},
+		{"-l", &m_cliFlags.lazyDecoding},
+		{"-c", &m_cliFlags.imageCache},
+		{"-t", &m_cliFlags.trace},
+		{"--trace-registers", &m_cliFlags.traceRegisters},
+		{"--decode-trace", &m_cliFlags.decodeTrace},
+		{"-p", &m_cliFlags.profile},
+		{"--profile-json", &m_cliFlags.profileJson},
+		{"-s", &m_cliFlags.sample},
+		{"--lock-profile", &m_cliFlags.lockProfile},
+		{"--lock-profile-json", &m_cliFlags.lockProfileJson},
+		{"--stats", &m_cliFlags.stats},
+		{"--stats=json", &m_cliFlags.statsJson},
+		{"-O", &m_cliFlags.optimize},
+		{"--cfg-dot", &m_cliFlags.cfgDot},
+		{"--optimize", &m_cliFlags.rewrite},
+		{"--aot", &m_cliFlags.aot}
 	};
 	std::vector<std::string> m_args {};
 	std::string m_inputPath {};
 	std::string m_outputPath {};
 	std::string m_binaryFilePath {};
+	std::string m_imageCacheDirectory {};
+	std::string m_tracePath {};
+	std::string m_profileJsonPath {};
+	std::string m_samplePath {};
+	std::string m_lockProfileJsonPath {};
 public:
 
 	CLIArgParser(int argc, const char** argv);
@@ -41,4 +80,9 @@ public:
 	std::string getInputPath() const { return m_inputPath; }
 	std::string getOutputPath() const { return m_outputPath; }
 	std::string getBinaryFilePath() const { return m_binaryFilePath; }
+	std::string getImageCacheDirectory() const { return m_imageCacheDirectory; }
+	std::string getTracePath() const { return m_tracePath; }
+	std::string getProfileJsonPath() const { return m_profileJsonPath; }
+	std::string getSamplePath() const { return m_samplePath; }
+	std::string getLockProfileJsonPath() const { return m_lockProfileJsonPath; }
 };
@@ -1,11 +1,16 @@
 #include "ESETVM.h"
 
 ESETVM::ESETVM(std::string inputPath, std::string outputPath, bool verbose):
+ESETVM(inputPath, outputPath, ESETVMOptions {.verbose = verbose})
+{}
+ESETVM::ESETVM(std::string inputPath, std::string outputPath, ESETVMOptions options):
 m_inputPath(inputPath),
 m_outputPath(outputPath),
-m_file(m_inputPath),
-m_verbose(verbose)
-{}
+m_file(m_inputPath, EVMFileLoadMode::MAPPED),
+m_options(options)
+{
+	m_stats.addPhase("load", std::chrono::steady_clock::now() - m_created);
+}
 
 ESETVMStatus ESETVM::init()
 {
@@ -14,72 +19,346 @@ ESETVMStatus ESETVM::init()
 		std::cerr << "Input file error" << std::endl;
 		return m_file.getError();
 	}
-	std::vector<std::byte> codeBytes = m_file.getCodeBytes();
-	m_disasm.init(codeBytes);
+	m_disasm.init(m_file.getCodeBytes()); // decoder reads directly from the file view
+	if (m_options.lazyDecoding)
+	{
+		return ESETVMStatus::SUCCESS;
+	}
+	const ESETVMStatus status = m_options.imageCacheDirectory.empty() ? parseInstructions() : loadOrBuildImage();
+	if (status == ESETVMStatus::SUCCESS && m_options.optimize)
+	{
+		optimizeInstructions();
+	}
+	if (status == ESETVMStatus::SUCCESS && m_options.aot)
+	{
+		buildNativeProgram();
+	}
+	return status;
+}
+ESETVMStatus ESETVM::loadOrBuildImage()
+{
+	const auto fileBytes = m_file.getFileBytes();
+	const uint64_t fileHash = utils::hashBytes(fileBytes);
+	const std::string imagePath = EVMImage::getImagePath(m_options.imageCacheDirectory, fileHash);
+	const auto start = std::chrono::steady_clock::now();
+	if (m_image.load(imagePath, fileHash, fileBytes.size(), m_disasm.getCodeBitSize()))
+	{
+		m_disasm.loadImage(m_image.getInstructions(), m_image.getInstructionOffsets());
+		m_instructionsParsed = true;
+		m_stats.addPhase("decode", std::chrono::steady_clock::now() - start);
+		return ESETVMStatus::SUCCESS;
+	}
+	// missing or stale image, decode and store it for the next run
+	ESETVMStatus parseStatus = parseInstructions();
+	if (parseStatus != ESETVMStatus::SUCCESS)
+	{
+		return parseStatus;
+	}
+	if (!EVMImage::write(imagePath, fileHash, fileBytes.size(), m_disasm.getCodeBitSize(), m_disasm.getInstructions(), m_file.getDataBytes()))
+	{
+		std::cerr << "Could not write decoded image to " << imagePath << std::endl; // not fatal, program still runs
+	}
+	return ESETVMStatus::SUCCESS;
+}
+void ESETVM::optimizeInstructions()
+{
+	const auto start = std::chrono::steady_clock::now();
+	if (!m_optimizer.optimize(m_disasm.getInstructions()))
+	{
+		std::cerr << "Program jumps outside of its code, it runs unoptimized" << std::endl;
+		return;
+	}
+	m_disasm.loadImage(m_optimizer.getInstructions(), m_optimizer.getInstructionOffsets()); // original offsets keep listings and profiles readable
+	m_stats.addPhase("optimize", std::chrono::steady_clock::now() - start);
+	if (m_options.verbose)
+	{
+		printOptimizerStats();
+	}
+}
+void ESETVM::buildNativeProgram()
+{
+	const auto start = std::chrono::steady_clock::now();
+	if (!m_nativeProgram.build(m_disasm.getInstructions(), m_options.imageCacheDirectory, m_options.verbose))
+	{
+		std::cerr << "Native code could not be built, program is interpreted" << std::endl;
+		return;
+	}
+	const auto duration = std::chrono::steady_clock::now() - start;
+	m_stats.addPhase("compile", duration);
+	if (m_options.verbose || m_options.stats)
+	{
+		// native code does not count instructions, so runs collecting stats are interpreted like verbose runs
+		std::cerr << "Native code built in " << std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() << " ms, " << (m_options.verbose ? "verbose runs" : "runs collecting stats") << " are interpreted" << std::endl;
+	}
+}
+void ESETVM::printOptimizerStats() const
+{
+	const auto& stats = m_optimizer.getStats();
+	std::cerr << "Optimizer folded " << stats.foldedInstructions << ", simplified " << stats.simplifiedBranches << " branches and " << stats.simplifiedJumps << " jumps, hoisted " << stats.hoistedConstants << " loop constants, removed " << stats.removedRedundantWrites << " redundant and " << stats.removedDeadWrites << " dead writes and " << stats.removedUnreachable << " unreachable instructions" << std::endl;
+}
+ESETVMStatus ESETVM::parseInstructions()
+{
+	if (m_instructionsParsed)
+	{
+		return ESETVMStatus::SUCCESS;
+	}
+	const auto start = std::chrono::steady_clock::now();
 	if (!m_disasm.parseInstructions())
 	{
 		std::cerr << "Instruction parsing error" << std::endl;
 		return m_disasm.getError();
 	}
+	m_stats.addPhase("decode", std::chrono::steady_clock::now() - start - m_disasm.getLinkDuration());
+	m_stats.addPhase("link", m_disasm.getLinkDuration());
+	m_instructionsParsed = true;
 	return ESETVMStatus::SUCCESS;
 }
 bool ESETVM::writeSourceCode()
 {
 	std::ofstream outputFile(m_outputPath);
-	outputFile << ".dataSize " << m_file.getDataSize() << std::endl;
+	outputFile << ".dataSize " << m_file.getDataSize() << '\n';
 	if (m_file.getInitialDataSize() > 0)
 	{
-		outputFile << ".data" << std::endl << std::endl;
-		std::vector<std::byte> dataBytes = m_file.getDataBytes();
-		outputFile << utils::byteArrayToHexString(dataBytes, Data_HexDump_Width);
-		outputFile << std::endl << std::endl;
-	}
-	outputFile << ".code" << std::endl << std::endl;
-	for (const auto& line : m_disasm.getSourceCodeLines())
-	{
-		outputFile << line << std::endl;
+		outputFile << ".data" << "\n\n";
+		outputFile << utils::byteArrayToHexString(m_file.getDataBytes(), Data_HexDump_Width);
+		outputFile << "\n\n";
 	}
-	if (outputFile.fail()) 
+	outputFile << ".code" << "\n\n";
+	if (!m_disasm.writeSourceCode(outputFile))
 	{
 		return false;
 	}
 	outputFile.close();
-	return true;
+	return !outputFile.fail();
 }
 ESETVMStatus ESETVM::saveSourceCode()
 {
-	std::vector<std::string> sourceCodeLines{};
-	if (!m_disasm.convertInstructionsToSourceCode())
+	ESETVMStatus parseStatus = parseInstructions(); // disassembly always needs linear decoding
+	if (parseStatus != ESETVMStatus::SUCCESS)
 	{
-		std::cerr << "Source code produce error" << std::endl;
-		return ESETVMStatus::PRODUCE_SOURCE_CODE_ERROR;
-	}	
-	if (!writeSourceCode())
+		return parseStatus;
+	}
+	const auto start = std::chrono::steady_clock::now();
+	if (!writeSourceCode()) // listing is formatted while it is written
 	{
 		std::cerr << "Source code writing error" << std::endl;
 		return ESETVMStatus::SOURCE_CODE_WRITE_ERROR;
 	}
+	m_stats.addPhase("render", std::chrono::steady_clock::now() - start);
 	return ESETVMStatus::SUCCESS;
 }
-ESETVMStatus ESETVM::run(const std::string& binaryFile, std::optional<size_t> maxEmulatedInstructionCount)
+ESETVMStatus ESETVM::saveOptimizedProgram()
+{
+	ESETVMStatus parseStatus = parseInstructions();
+	if (parseStatus != ESETVMStatus::SUCCESS)
+	{
+		return parseStatus;
+	}
+	auto start = std::chrono::steady_clock::now();
+	if (!m_optimizer.optimize(m_disasm.getInstructions()))
+	{
+		std::cerr << "Program jumps outside of its code, it cannot be rewritten" << std::endl;
+		return ESETVMStatus::ASSEMBLE_ERROR;
+	}
+	m_stats.addPhase("optimize", std::chrono::steady_clock::now() - start);
+	start = std::chrono::steady_clock::now();
+	EVMAssembler assembler {};
+	if (!assembler.encode(m_optimizer.getInstructions(), m_file.getDataBytes(), m_file.getDataSize()))
+	{
+		return assembler.getError();
+	}
+	std::ofstream outputFile(m_outputPath, std::ios::binary | std::ios::trunc);
+	if (!outputFile.is_open() || !assembler.writeFile(outputFile))
+	{
+		std::cerr << "Output file write error" << std::endl;
+		return ESETVMStatus::FILE_WRITE_ERROR;
+	}
+	m_stats.addPhase("render", std::chrono::steady_clock::now() - start);
+	if (m_options.verbose)
+	{
+		printOptimizerStats();
+		std::cerr << "Rewritten code has " << m_optimizer.getInstructions().size() << " instructions in " << assembler.getCodeBytes().size() << " bytes, was " << m_disasm.getInstructions().size() << " in " << m_file.getcodeSize() << std::endl;
+	}
+	return ESETVMStatus::SUCCESS;
+}
+ESETVMStatus ESETVM::saveControlFlowGraph()
 {
-	const std::vector<std::byte>& initialDataBytes = m_file.getDataBytes();
-	std::vector<uint8_t> memory {};
-	memory.resize(m_file.getDataSize());
-	if (initialDataBytes.size() > 0)
+	ESETVMStatus parseStatus = parseInstructions();
+	if (parseStatus != ESETVMStatus::SUCCESS)
 	{
-		std::copy(initialDataBytes.begin(), initialDataBytes.end(),
-				  reinterpret_cast<std::byte*>(memory.data()));
+		return parseStatus;
 	}
+	auto start = std::chrono::steady_clock::now();
+	EVMControlFlowGraph graph {};
+	graph.build(m_disasm.getInstructions());
+	graph.computeDominators();
+	m_stats.addPhase("cfg", std::chrono::steady_clock::now() - start);
+	start = std::chrono::steady_clock::now();
+	std::ofstream outputFile(m_outputPath);
+	if (!graph.writeDot(outputFile, m_disasm))
+	{
+		std::cerr << "Control flow graph writing error" << std::endl;
+		return ESETVMStatus::FILE_WRITE_ERROR;
+	}
+	m_stats.addPhase("render", std::chrono::steady_clock::now() - start);
+	if (m_options.verbose)
+	{
+		std::cerr << "Control flow graph has " << graph.getBlocks().size() << " blocks, " << graph.getFunctions().size() << " functions and " << graph.getLoops().size() << " loops" << std::endl;
+	}
+	return ESETVMStatus::SUCCESS;
+}
+ESETVMStatus ESETVM::run(const std::string& binaryFile, std::optional<size_t> maxEmulatedInstructionCount)
+{
+	const auto initialDataBytes = m_image.isLoaded() ? m_image.getInitialData() : m_file.getDataBytes();
+	const uint8_t* initialData = reinterpret_cast<const uint8_t*>(initialDataBytes.data());
+	std::vector<uint8_t> memory (initialData, initialData + initialDataBytes.size()); // single copy of initial data
+	memory.resize(m_file.getDataSize()); // only the rest of memory is zeroed
 	EVMContext mainThreadContext {Register_Count, Stack_Size};
 	std::unordered_map<registerIntegerType, std::shared_ptr<std::mutex>> mutices {};
-	m_disasm.convertInstructionsToSourceCode(false);
+	std::optional<EVMBlockCache> blockCache {};
+	if (m_options.lazyDecoding)
+	{
+		blockCache.emplace(m_disasm); // execution starts at code offset 0, which is also instruction index 0
+	}
 	
+	std::optional<EVMTraceWriter> traceWriter {};
+	if (!m_options.traceFilePath.empty())
+	{
+		const uint32_t traceFlags = (m_options.lazyDecoding ? TRACE_CODE_OFFSETS : 0) | (m_options.traceRegisters ? TRACE_REGISTERS : 0);
+		traceWriter.emplace(m_options.traceFilePath, traceFlags, utils::hashBytes(m_file.getFileBytes()));
+		if (!traceWriter->isOpen())
+		{
+			std::cerr << "Could not open trace file" << std::endl;
+			return ESETVMStatus::FILE_OPEN_ERROR;
+		}
+	}
+	std::optional<EVMProfiler> profiler {};
+	if (m_options.profile)
+	{
+		if (m_options.lazyDecoding)
+		{
+			std::cerr << "Profiling needs whole code decoded up front" << std::endl;
+			return ESETVMStatus::EMULATION_ERROR;
+		}
+		profiler.emplace(m_disasm.getInstructions().size());
+	}
+	std::optional<EVMSampler> sampler {};
+	if (!m_options.sampleFilePath.empty())
+	{
+		if (m_options.lazyDecoding)
+		{
+			std::cerr << "Sampling needs whole code decoded up front" << std::endl;
+			return ESETVMStatus::EMULATION_ERROR;
+		}
+		sampler.emplace();
+	}
+	std::optional<EVMLockProfiler> lockProfiler {};
+	if (m_options.lockProfile)
+	{
+		lockProfiler.emplace();
+	}
 	std::atomic<size_t> instructionCounter {};
 	std::fstream fileHandle {binaryFile, std::ios::binary | std::ios::out | std::ios::in};
-	EVMExecutionUnit mainThread {m_disasm.getInstructions(), memory, m_disasm, mainThreadContext, mutices, fileHandle, m_verbose, maxEmulatedInstructionCount, instructionCounter};
-	ESETVMStatus status = mainThread.run();
-	
-	fileHandle.close();
+	EVMFileCache fileCache {fileHandle, File_Cache_Max_Dirty_Bytes};
+	EVMSharedState sharedState {m_disasm.getInstructions(), memory, m_disasm, blockCache.has_value() ? &blockCache.value() : nullptr, mutices, fileCache, m_options.verbose, maxEmulatedInstructionCount, instructionCounter, traceWriter.has_value() ? &traceWriter.value() : nullptr, profiler.has_value() ? &profiler.value() : nullptr, sampler.has_value() ? &sampler.value() : nullptr,
+		lockProfiler.has_value() ? &lockProfiler.value() : nullptr, m_options.stats ? &m_stats : nullptr, m_nativeProgram.isLoaded() ? &m_nativeProgram : nullptr};
+	if (sampler.has_value() && !sampler->start())
+	{
+		std::cerr << "Another sampler is running" << std::endl;
+		return ESETVMStatus::EMULATION_ERROR;
+	}
+	ESETVMStatus status {};
+	const auto start = std::chrono::steady_clock::now();
+	{
+		EVMExecutionUnit mainThread {sharedState, mainThreadContext};
+		status = mainThread.run();
+		
+		fileCache.flush(); // main thread reached hlt, threads still running are flushed when cache goes out of scope
+	} // guest threads have exited and merged their profiles here
+	m_stats.addPhase("execute", std::chrono::steady_clock::now() - start);
+	m_stats.setGuestMemoryBytes(memory.size());
+	m_stats.setFileStats(fileCache.getStats());
+	if (profiler.has_value() && !writeProfile(profiler.value()))
+	{
+		std::cerr << "Could not write profile" << std::endl;
+		return status == ESETVMStatus::SUCCESS ? ESETVMStatus::FILE_OPEN_ERROR : status;
+	}
+	if (lockProfiler.has_value() && !writeLockProfile(lockProfiler.value()))
+	{
+		std::cerr << "Could not write lock profile" << std::endl;
+		return status == ESETVMStatus::SUCCESS ? ESETVMStatus::FILE_OPEN_ERROR : status;
+	}
+	if (sampler.has_value())
+	{
+		sampler->stop();
+		std::ofstream sampleFile {m_options.sampleFilePath, std::ios::trunc};
+		sampler->writeCollapsedStacks(sampleFile);
+		if (!sampleFile.is_open() || sampleFile.fail())
+		{
+			std::cerr << "Could not write samples" << std::endl;
+			return status == ESETVMStatus::SUCCESS ? ESETVMStatus::FILE_OPEN_ERROR : status;
+		}
+	}
 	return status;
 }
+void ESETVM::writeStats(std::ostream& output, bool json) const
+{
+	if (json)
+	{
+		m_stats.writeJson(output);
+	}
+	else
+	{
+		m_stats.writeText(output);
+	}
+}
+bool ESETVM::writeProfile(const EVMProfiler& profiler) const
+{
+	profiler.writeReport(m_disasm, std::cerr);
+	if (m_options.profileJsonPath.empty())
+	{
+		return true;
+	}
+	std::ofstream jsonFile {m_options.profileJsonPath, std::ios::trunc};
+	if (!jsonFile.is_open())
+	{
+		return false;
+	}
+	profiler.writeJson(m_disasm, jsonFile);
+	return !jsonFile.fail();
+}
+bool ESETVM::writeLockProfile(const EVMLockProfiler& lockProfiler) const
+{
+	lockProfiler.writeReport(m_disasm, std::cerr);
+	if (m_options.lockProfileJsonPath.empty())
+	{
+		return true;
+	}
+	std::ofstream jsonFile {m_options.lockProfileJsonPath, std::ios::trunc};
+	if (!jsonFile.is_open())
+	{
+		return false;
+	}
+	lockProfiler.writeJson(m_disasm, jsonFile);
+	return !jsonFile.fail();
+}
+ESETVMStatus ESETVM::decodeTrace(const std::string& tracePath, std::ostream& output)
+{
+	ESETVMStatus parseStatus = parseInstructions(); // trace refers to instructions of the input program
+	if (parseStatus != ESETVMStatus::SUCCESS)
+	{
+		return parseStatus;
+	}
+	EVMTraceDecoder decoder {tracePath};
+	if (decoder.getError() != ESETVMStatus::SUCCESS)
+	{
+		std::cerr << "Trace file error" << std::endl;
+		return decoder.getError();
+	}
+	if (!decoder.render(m_disasm, utils::hashBytes(m_file.getFileBytes()), output))
+	{
+		std::cerr << "Trace does not belong to input program" << std::endl;
+		return ESETVMStatus::FILE_CORRUPTED;
+	}
+	return ESETVMStatus::SUCCESS;
+}
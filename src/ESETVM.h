@@ -1,8 +1,19 @@
 #pragma once
 #include "CLIArgParser.h"
+#include "EVMAssembler.h"
+#include "EVMControlFlowGraph.h"
 #include "EVMDisasm.h"
 #include "EVMExecutionUnit.h"
 #include "EVMFile.h"
+#include "EVMFileCache.h"
+#include "EVMImage.h"
+#include "EVMOptimizer.h"
+#include "EVMLockProfiler.h"
+#include "EVMNativeProgram.h"
+#include "EVMProfiler.h"
+#include "EVMSampler.h"
+#include "EVMStats.h"
+#include "EVMTrace.h"
 #include "EVMTypes.h"
 #include <iostream>
 #include <map>
@@ -10,23 +21,59 @@
 #include <utility>
 #include <vector>
 
+struct ESETVMOptions
+{
+	bool verbose {};
+	bool lazyDecoding {}; // decode basic blocks when control first reaches them instead of whole code up front
+	std::string imageCacheDirectory {}; // when set, decoded programs are stored there and mapped on later runs of the same file (run only)
+	std::string traceFilePath {}; // when set, executed instructions are recorded there in binary form
+	bool traceRegisters {}; // trace also records register changes
+	bool profile {}; // per opcode and per instruction profile is reported to stderr after run, needs eager decoding
+	std::string profileJsonPath {}; // when set, profile is also written there as JSON
+	std::string sampleFilePath {}; // when set, guest call stacks are sampled during run and saved there as collapsed stacks, needs eager decoding
+	bool lockProfile {}; // guest lock contention is reported to stderr after run
+	std::string lockProfileJsonPath {}; // when set, lock contention is also written there as JSON
+	bool stats {}; // run metrics are collected for writeStats
+	bool optimize {}; // decoded program is optimized before it runs, needs eager decoding
+	bool aot {}; // decoded program is compiled to native code through C and runs instead of the interpreter, needs eager decoding
+};
+
 class ESETVM
 {
 private:
 	static const size_t Register_Count = 16;
 	static const size_t Stack_Size = 10000;
 	static const unsigned int Data_HexDump_Width = 40;
+	static const size_t File_Cache_Max_Dirty_Bytes = EVMFileCache::Default_Max_Dirty_Bytes;
+	std::chrono::steady_clock::time_point m_created {std::chrono::steady_clock::now()}; // before m_file, times loading of input
 	std::string m_inputPath;
 	std::string m_outputPath;
 	EVMFile m_file {};
+	EVMImage m_image {}; // must outlive m_disasm, which views its instructions
+	EVMOptimizer m_optimizer {}; // must outlive m_disasm as well
 	EVMDisasm m_disasm {};
-	bool m_verbose {};
+	EVMNativeProgram m_nativeProgram {};
+	ESETVMOptions m_options {};
+	bool m_instructionsParsed {};
+	EVMStats m_stats {};
 	
+	ESETVMStatus parseInstructions();
+	ESETVMStatus loadOrBuildImage();
+	void optimizeInstructions();
+	void printOptimizerStats() const;
+	void buildNativeProgram();
 	bool writeSourceCode();
+	bool writeProfile(const EVMProfiler& profiler) const;
+	bool writeLockProfile(const EVMLockProfiler& lockProfiler) const;
 
 public:
 	ESETVM(std::string inputPath, std::string outputPath, bool verbose);
+	ESETVM(std::string inputPath, std::string outputPath, ESETVMOptions options);
 	[[nodiscard]] ESETVMStatus init();
 	[[nodiscard]] ESETVMStatus saveSourceCode ();
+	[[nodiscard]] ESETVMStatus saveOptimizedProgram (); // optimized and re-encoded input program, runs on any interpreter
+	[[nodiscard]] ESETVMStatus saveControlFlowGraph (); // Graphviz file with blocks, functions and loops of input program
 	[[nodiscard]] ESETVMStatus run (const std::string& binaryFile, std::optional<size_t> maxEmulatedInstructionCount = std::nullopt);
+	[[nodiscard]] ESETVMStatus decodeTrace (const std::string& tracePath, std::ostream& output);
+	void writeStats (std::ostream& output, bool json) const; // phases that ran so far and metrics of last run
 };
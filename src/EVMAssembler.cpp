@@ -0,0 +1,488 @@
+#include "EVMAssembler.h"
+#include "EVMDisasm.h"
+#include "utils.h"
+#include <charconv>
+#include <fstream>
+#include <iostream>
+
+namespace
+{
+	bool isWhitespace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+	}
+	std::string_view trim(std::string_view text)
+	{
+		while (!text.empty() && isWhitespace(text.front()))
+		{
+			text.remove_prefix(1);
+		}
+		while (!text.empty() && isWhitespace(text.back()))
+		{
+			text.remove_suffix(1);
+		}
+		return text;
+	}
+	// whole text has to be digits of base, fails on overflow of uint64_t
+	std::optional<uint64_t> parseDigits(std::string_view text, int base)
+	{
+		uint64_t value {};
+		const auto result = std::from_chars(text.data(), text.data() + text.size(), value, base);
+		if (text.empty() || result.ec != std::errc {} || result.ptr != text.data() + text.size())
+		{
+			return std::nullopt;
+		}
+		return value;
+	}
+	bool startsWithPrefix(std::string_view text, char lower)
+	{
+		return text.size() > 2 && text[0] == '0' && (text[1] == lower || text[1] == lower - 'a' + 'A');
+	}
+}
+
+const std::unordered_map<std::string_view, EVMAssembler::OpcodeEncoding>& EVMAssembler::getOpcodeEncodings()
+{
+	static const std::unordered_map<std::string_view, OpcodeEncoding> encodings = []()
+	{
+		std::unordered_map<std::string_view, OpcodeEncoding> result {};
+		size_t length = 3; // first table holds 3 bit opcodes, see EVMDisasm::getOpcode
+		for (const auto& bitSequences : EVMDisasm::m_opcodeBitsequences)
+		{
+			for (const auto& [bits, opcode] : bitSequences)
+			{
+				result[EVMDisasm::m_opcodeToName.at(opcode)] = {opcode, bits, length, &EVMDisasm::m_opcodeArguments.at(opcode)};
+			}
+			length++;
+		}
+		return result;
+	}();
+	return encodings;
+}
+const std::unordered_map<std::string_view, bitSequenceInteger>& EVMAssembler::getMemoryAccessSizeEncodings()
+{
+	static const std::unordered_map<std::string_view, bitSequenceInteger> encodings = []()
+	{
+		std::unordered_map<std::string_view, bitSequenceInteger> result {};
+		for (const auto& [bits, accessSize] : EVMDisasm::m_bitStreamToMemoryAccessSize)
+		{
+			result[EVMDisasm::m_memoryAccessSizeToName.at(accessSize)] = bits;
+		}
+		return result;
+	}();
+	return encodings;
+}
+bool EVMAssembler::fail(const std::string& message)
+{
+	std::cerr << "Parser error on line " << m_lineNumber << ": " << message << std::endl;
+	m_error = ESETVMStatus::ASSEMBLE_ERROR;
+	return false;
+}
+std::optional<int64_t> EVMAssembler::parseConstant(std::string_view text)
+{
+	bool negative = false;
+	if (!text.empty() && (text.front() == '-' || text.front() == '+'))
+	{
+		negative = text.front() == '-';
+		text.remove_prefix(1);
+	}
+	int base = 10;
+	if (startsWithPrefix(text, 'x') || startsWithPrefix(text, 'o') || startsWithPrefix(text, 'b'))
+	{
+		base = text[1] == 'x' || text[1] == 'X' ? 16 : text[1] == 'o' || text[1] == 'O' ? 8 : 2;
+		text.remove_prefix(2);
+	}
+	else if (text.size() > 1 && text.front() == '0')
+	{
+		base = 8; // python 2 octal literal
+		text.remove_prefix(1);
+	}
+	const auto magnitude = parseDigits(text, base);
+	if (!magnitude.has_value() || (negative && magnitude.value() > (1ULL << 63)))
+	{
+		return std::nullopt;
+	}
+	return static_cast<int64_t>(negative ? 0 - magnitude.value() : magnitude.value());
+}
+bool EVMAssembler::assembleRegister(std::string_view argument)
+{
+	std::string_view registerText = argument;
+	std::optional<bitSequenceInteger> accessSize {};
+	const size_t bracket = argument.find('[');
+	if (bracket != std::string_view::npos)
+	{
+		const auto accessSizeIt = getMemoryAccessSizeEncodings().find(trim(argument.substr(0, bracket)));
+		if (accessSizeIt == getMemoryAccessSizeEncodings().cend() || argument.back() != ']')
+		{
+			return fail("Bad register argument type [" + std::string(argument) + "] (syntax error)");
+		}
+		accessSize = accessSizeIt->second;
+		registerText = trim(argument.substr(bracket + 1, argument.size() - bracket - 2));
+	}
+	if (registerText.size() < 2 || registerText.front() != 'r' || registerText.find_first_not_of("0123456789", 1) != std::string_view::npos)
+	{
+		return fail("Bad register argument type [" + std::string(argument) + "] (syntax error)");
+	}
+	const auto registerIndex = parseDigits(registerText.substr(1), 10);
+	if (!registerIndex.has_value() || registerIndex.value() > Max_Register_Index)
+	{
+		return fail("Bad register argument type (too big)");
+	}
+	// 0 XXXX register, 1 SS XXXX dereference, fields least significant bit first
+	m_code.writeVar<uint8_t>(accessSize.has_value(), 1);
+	if (accessSize.has_value())
+	{
+		m_code.writeVar<uint8_t>(accessSize.value(), 2);
+	}
+	m_code.writeVar<uint8_t>(static_cast<uint8_t>(registerIndex.value()), 4);
+	return true;
+}
+bool EVMAssembler::assembleConstant(std::string_view argument)
+{
+	const auto constant = parseConstant(argument);
+	if (!constant.has_value())
+	{
+		return fail("Bad constant [" + std::string(argument) + "]");
+	}
+	m_code.writeVar<int64_t>(constant.value());
+	return true;
+}
+void EVMAssembler::assembleLabel(std::string_view argument)
+{
+	const auto labelIt = m_codeLabels.find(argument);
+	if (labelIt == m_codeLabels.cend())
+	{
+		m_labelPatches.push_back({m_code.getStreamSize(), argument, m_lineNumber}); // forward reference
+	}
+	m_code.writeVar<uint32_t>(labelIt == m_codeLabels.cend() ? 0 : static_cast<uint32_t>(labelIt->second));
+}
+bool EVMAssembler::parseDirective()
+{
+	if (m_tokens[0] == ".dataSize")
+	{
+		if (m_dataSize.has_value())
+		{
+			return fail("Double data size spotted");
+		}
+		const auto dataSize = m_tokens.size() > 1 ? parseDigits(m_tokens[1], 10) : std::nullopt;
+		if (!dataSize.has_value() || dataSize.value() > UINT32_MAX)
+		{
+			return fail("Bad data size");
+		}
+		m_dataSize = static_cast<uint32_t>(dataSize.value());
+	}
+	else if (m_tokens[0] == ".code")
+	{
+		m_mode = SectionMode::CODE;
+	}
+	else if (m_tokens[0] == ".data")
+	{
+		m_mode = SectionMode::DATA;
+	}
+	else
+	{
+		return fail("Bad token");
+	}
+	return true;
+}
+bool EVMAssembler::parseLabel()
+{
+	const std::string_view label = m_tokens[0].substr(0, m_tokens[0].size() - 1);
+	if (m_mode == SectionMode::CODE)
+	{
+		if (!m_codeLabels.emplace(label, m_code.getStreamSize()).second)
+		{
+			return fail("Duplicated label");
+		}
+	}
+	else if (m_mode == SectionMode::DATA)
+	{
+		if (!m_dataLabels.insert(label).second)
+		{
+			return fail("Duplicated label");
+		}
+	}
+	else
+	{
+		return fail("Bad label");
+	}
+	return true;
+}
+bool EVMAssembler::parseInstruction(std::string_view argumentText)
+{
+	const auto encodingIt = getOpcodeEncodings().find(m_tokens[0]);
+	if (encodingIt == getOpcodeEncodings().cend())
+	{
+		return fail("Bad opcode [" + std::string(m_tokens[0]) + "]");
+	}
+	const OpcodeEncoding& encoding = encodingIt->second;
+	m_arguments.clear();
+	while (!argumentText.empty())
+	{
+		const size_t comma = argumentText.find(',');
+		m_arguments.push_back(trim(argumentText.substr(0, comma)));
+		if (comma == std::string_view::npos)
+		{
+			break;
+		}
+		argumentText.remove_prefix(comma + 1);
+		if (argumentText.empty())
+		{
+			m_arguments.push_back(argumentText); // trailing comma
+		}
+	}
+	if (m_arguments.size() != encoding.arguments->size())
+	{
+		return fail("Bad opcode argument count");
+	}
+	m_code.writeVar<bitSequenceInteger>(encoding.bits, encoding.length, true);
+	for (size_t i = 0; i < m_arguments.size(); i++)
+	{
+		const ArgumentType argumentType = (*encoding.arguments)[i];
+		if (argumentType == ArgumentType::DATA_ACCESS)
+		{
+			if (!assembleRegister(m_arguments[i]))
+			{
+				return false;
+			}
+		}
+		else if (argumentType == ArgumentType::CONSTANT)
+		{
+			if (!assembleConstant(m_arguments[i]))
+			{
+				return false;
+			}
+		}
+		else if (argumentType == ArgumentType::ADDRESS)
+		{
+			assembleLabel(m_arguments[i]);
+		}
+	}
+	return true;
+}
+bool EVMAssembler::parseData()
+{
+	for (std::string_view token : m_tokens)
+	{
+		if (startsWithPrefix(token, 'x'))
+		{
+			token.remove_prefix(2);
+		}
+		const auto value = parseDigits(token, 16);
+		if (!value.has_value() || value.value() > 0xff)
+		{
+			return fail("Bad value in line");
+		}
+		m_data.push_back(static_cast<std::byte>(value.value()));
+	}
+	return true;
+}
+bool EVMAssembler::parseLine(std::string_view line)
+{
+	line = line.substr(0, line.find('#'));
+	m_tokens.clear();
+	size_t position = 0;
+	while (true)
+	{
+		while (position < line.size() && isWhitespace(line[position]))
+		{
+			position++;
+		}
+		if (position == line.size())
+		{
+			break;
+		}
+		const size_t start = position;
+		while (position < line.size() && !isWhitespace(line[position]))
+		{
+			position++;
+		}
+		m_tokens.push_back(line.substr(start, position - start));
+	}
+	if (m_tokens.empty())
+	{
+		return true;
+	}
+	if (m_tokens[0].front() == '.')
+	{
+		return parseDirective();
+	}
+	if (m_tokens.size() == 1 && m_tokens[0].back() == ':')
+	{
+		return parseLabel();
+	}
+	if (m_mode == SectionMode::CODE)
+	{
+		const char* argumentsBegin = m_tokens.size() > 1 ? m_tokens[1].data() : m_tokens[0].data() + m_tokens[0].size();
+		return parseInstruction(std::string_view(argumentsBegin, m_tokens.back().data() + m_tokens.back().size() - argumentsBegin));
+	}
+	if (m_mode == SectionMode::DATA)
+	{
+		return parseData();
+	}
+	return fail("Bad token");
+}
+bool EVMAssembler::applyPatches()
+{
+	for (const auto& patch : m_labelPatches)
+	{
+		const auto labelIt = m_codeLabels.find(patch.label);
+		if (labelIt == m_codeLabels.cend())
+		{
+			std::cerr << "Assembler error on line " << patch.lineNumber << ": Undefined code label " << patch.label << std::endl;
+			m_error = ESETVMStatus::ASSEMBLE_ERROR;
+			return false;
+		}
+		m_code.writeVarAt<uint32_t>(patch.position, static_cast<uint32_t>(labelIt->second), 32);
+	}
+	return true;
+}
+bool EVMAssembler::assemble(std::string_view source)
+{
+	*this = EVMAssembler {};
+	m_code.reserve(source.size() / 2); // instructions take a few bytes per source line of a dozen or more characters
+	while (!source.empty())
+	{
+		m_lineNumber++;
+		const size_t lineEnd = source.find('\n');
+		if (!parseLine(source.substr(0, lineEnd)))
+		{
+			return false;
+		}
+		source.remove_prefix(lineEnd == std::string_view::npos ? source.size() : lineEnd + 1);
+	}
+	if (m_code.getStreamSize() > UINT32_MAX)
+	{
+		std::cerr << "Assembler error: code does not fit 32 bit code addresses" << std::endl;
+		m_error = ESETVMStatus::ASSEMBLE_ERROR;
+		return false;
+	}
+	if (!applyPatches())
+	{
+		return false;
+	}
+	m_code.alignToByte();
+	if (m_dataSize.has_value() && m_dataSize.value() < m_data.size())
+	{
+		std::cerr << "Warning: bad .dataSize, was " << m_dataSize.value() << " but used " << m_data.size() << ", expanding" << std::endl;
+	}
+	if (m_data.size() > UINT32_MAX)
+	{
+		std::cerr << "Assembler error: data section too big" << std::endl;
+		m_error = ESETVMStatus::ASSEMBLE_ERROR;
+		return false;
+	}
+	m_dataSize = std::max<uint32_t>(m_dataSize.value_or(0), static_cast<uint32_t>(m_data.size()));
+	return true;
+}
+uint64_t EVMAssembler::getEncodedSize(const EVMInstruction& instruction)
+{
+	uint64_t size = getOpcodeEncodings().at(EVMDisasm::getOpcodeName(instruction.opcode)).length;
+	for (const auto& argument : instruction.arguments)
+	{
+		if (argument.type == ArgumentType::CONSTANT)
+		{
+			size += 64;
+		}
+		else if (argument.type == ArgumentType::ADDRESS)
+		{
+			size += 32;
+		}
+		else
+		{
+			size += argument.data.dataAccess.type == DataAccessType::REGISTER ? 5 : 7;
+		}
+	}
+	return size;
+}
+bool EVMAssembler::encode(std::span<const EVMInstruction> instructions, std::span<const std::byte> initialData, uint32_t dataSize)
+{
+	*this = EVMAssembler {};
+	m_data.assign(initialData.begin(), initialData.end());
+	m_dataSize = std::max<uint32_t>(dataSize, static_cast<uint32_t>(m_data.size()));
+	// encoded size does not depend on code addresses, so all new offsets are known before writing
+	std::vector<uint32_t> offsets(instructions.size() + 1);
+	uint64_t position = 0;
+	for (size_t i = 0; i < instructions.size(); i++)
+	{
+		offsets[i] = static_cast<uint32_t>(position);
+		position += getEncodedSize(instructions[i]);
+		if (position > UINT32_MAX)
+		{
+			std::cerr << "Assembler error: code does not fit 32 bit code addresses" << std::endl;
+			m_error = ESETVMStatus::ASSEMBLE_ERROR;
+			return false;
+		}
+	}
+	offsets.back() = static_cast<uint32_t>(position); // target past the last instruction stays past it
+	m_code.reserve(position / BITS_IN_BYTE + 1);
+	for (const auto& instruction : instructions)
+	{
+		const OpcodeEncoding& encoding = getOpcodeEncodings().at(EVMDisasm::getOpcodeName(instruction.opcode));
+		m_code.writeVar<bitSequenceInteger>(encoding.bits, encoding.length, true);
+		for (const auto& argument : instruction.arguments)
+		{
+			if (argument.type == ArgumentType::CONSTANT)
+			{
+				m_code.writeVar<int64_t>(argument.data.constant);
+			}
+			else if (argument.type == ArgumentType::ADDRESS)
+			{
+				if (instruction.target > instructions.size())
+				{
+					std::cerr << "Assembler error: code address " << argument.data.codeAddress << " is not an instruction" << std::endl;
+					m_error = ESETVMStatus::ASSEMBLE_ERROR;
+					return false;
+				}
+				m_code.writeVar<uint32_t>(offsets[instruction.target]);
+			}
+			else
+			{
+				const DataAccess& dataAccess = argument.data.dataAccess;
+				m_code.writeVar<uint8_t>(dataAccess.type == DataAccessType::DEREFERENCE, 1);
+				if (dataAccess.type == DataAccessType::DEREFERENCE)
+				{
+					m_code.writeVar<uint8_t>(static_cast<uint8_t>(getMemoryAccessSizeEncodings().at(EVMDisasm::m_memoryAccessSizeToName.at(dataAccess.accessSize))), 2);
+				}
+				m_code.writeVar<uint8_t>(dataAccess.registerIndex, 4);
+			}
+		}
+	}
+	m_code.alignToByte();
+	return true;
+}
+bool EVMAssembler::writeFile(std::ostream& output) const
+{
+	const uint32_t sizes[] = {static_cast<uint32_t>(m_code.getBytes().size()), getDataSize(), static_cast<uint32_t>(m_data.size())}; // header fields after magic, host order as read by EVMFile
+	output.write(EVM_Magic, sizeof(EVM_Magic) - 1);
+	output.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+	output.write(reinterpret_cast<const char*>(m_code.getBytes().data()), m_code.getBytes().size());
+	output.write(reinterpret_cast<const char*>(m_data.data()), m_data.size());
+	return output.good();
+}
+ESETVMStatus EVMAssembler::assembleFile(const std::string& inputPath, const std::string& outputPath)
+{
+	std::ifstream input(inputPath, std::ios::binary);
+	if (!input.is_open())
+	{
+		std::cerr << "Invalid input file" << std::endl;
+		return ESETVMStatus::FILE_OPEN_ERROR;
+	}
+	std::string source(static_cast<size_t>(utils::getFileSize(input)), '\0');
+	if (!input.read(source.data(), source.size()))
+	{
+		std::cerr << "Input file read error" << std::endl;
+		return ESETVMStatus::FILE_READ_ERROR;
+	}
+	EVMAssembler assembler {};
+	if (!assembler.assemble(source))
+	{
+		return assembler.getError();
+	}
+	std::ofstream output(outputPath, std::ios::binary | std::ios::trunc);
+	if (!output.is_open() || !assembler.writeFile(output))
+	{
+		std::cerr << "Output file write error" << std::endl;
+		return ESETVMStatus::FILE_WRITE_ERROR;
+	}
+	return ESETVMStatus::SUCCESS;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "BitStreamWriter.h"
+#include "EVMTypes.h"
+#include <inttypes.h>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Assembles .easm source into .evm files, accepts the syntax of test/compiler.py and produces the same bytes.
+// Also encodes decoded instructions back, so rewritten programs get fresh code offsets.
+class EVMAssembler
+{
+private:
+	static constexpr char EVM_Magic[] = "ESET-VM2";
+	static const size_t Max_Register_Index = 15;
+
+	enum class SectionMode
+	{
+		NONE,
+		CODE,
+		DATA
+	};
+	struct OpcodeEncoding
+	{
+		EVMOpcode opcode;
+		bitSequenceInteger bits;
+		size_t length;
+		const std::vector<ArgumentType>* arguments;
+	};
+	// forward reference to a code label, patched when the whole source is read
+	struct LabelPatch
+	{
+		uint64_t position;
+		std::string_view label;
+		size_t lineNumber;
+	};
+
+	BitStreamWriter m_code {};
+	std::vector<std::byte> m_data {};
+	std::optional<uint32_t> m_dataSize {};
+	SectionMode m_mode {SectionMode::NONE};
+	std::unordered_map<std::string_view, uint64_t> m_codeLabels {}; // bit offsets, names point into source
+	std::unordered_set<std::string_view> m_dataLabels {};
+	std::vector<LabelPatch> m_labelPatches {};
+	std::vector<std::string_view> m_tokens {};
+	std::vector<std::string_view> m_arguments {};
+	size_t m_lineNumber {};
+	ESETVMStatus m_error {ESETVMStatus::SUCCESS};
+
+	// reverse lookups of EVMDisasm tables, names point into them
+	static const std::unordered_map<std::string_view, OpcodeEncoding>& getOpcodeEncodings();
+	static const std::unordered_map<std::string_view, bitSequenceInteger>& getMemoryAccessSizeEncodings();
+
+	bool fail(const std::string& message);
+	bool parseLine(std::string_view line);
+	bool parseDirective();
+	bool parseLabel();
+	bool parseInstruction(std::string_view argumentText);
+	bool parseData();
+	bool assembleRegister(std::string_view argument);
+	bool assembleConstant(std::string_view argument);
+	void assembleLabel(std::string_view argument);
+	bool applyPatches();
+	static uint64_t getEncodedSize(const EVMInstruction& instruction); // bits
+public:
+	EVMAssembler() = default;
+	bool assemble(std::string_view source); // source must outlive the assembler
+	bool encode(std::span<const EVMInstruction> instructions, std::span<const std::byte> initialData, uint32_t dataSize); // linked instructions, code addresses are recomputed from targets
+	ESETVMStatus getError() const { return m_error; }
+	std::span<const std::byte> getCodeBytes() const { return m_code.getBytes(); }
+	std::span<const std::byte> getDataBytes() const { return m_data; }
+	uint32_t getDataSize() const { return m_dataSize.value_or(0); }
+	bool writeFile(std::ostream& output) const;
+	static ESETVMStatus assembleFile(const std::string& inputPath, const std::string& outputPath);
+	static std::optional<int64_t> parseConstant(std::string_view text); // python int(text, 0) syntax, two's complement
+};
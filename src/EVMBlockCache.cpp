@@ -0,0 +1,29 @@
+#include "EVMBlockCache.h"
+
+EVMBlockCache::EVMBlockCache(const EVMDisasm& disasm):
+m_disasm(disasm)
+{}
+const EVMBasicBlock* EVMBlockCache::getBlock(uint32_t codeOffset)
+{
+	{
+		std::shared_lock l {m_mutex};
+		if (const auto it = m_blocks.find(codeOffset); it != m_blocks.end())
+		{
+			return it->second.get();
+		}
+	}
+	// decode without holding the lock, if another thread was faster its block is kept
+	auto block = m_disasm.decodeBasicBlock(codeOffset);
+	if (!block.has_value())
+	{
+		return nullptr;
+	}
+	std::unique_lock l {m_mutex};
+	const auto [it, inserted] = m_blocks.try_emplace(codeOffset, std::make_unique<const EVMBasicBlock>(std::move(block.value())));
+	return it->second.get();
+}
+size_t EVMBlockCache::getBlockCount() const
+{
+	std::shared_lock l {m_mutex};
+	return m_blocks.size();
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "EVMDisasm.h"
+#include "EVMTypes.h"
+#include <inttypes.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+// Basic blocks decoded the first time control reaches them, shared by all guest threads.
+// Blocks are never evicted so returned pointers stay valid for the cache lifetime.
+class EVMBlockCache
+{
+private:
+	const EVMDisasm& m_disasm;
+	mutable std::shared_mutex m_mutex {};
+	std::unordered_map<uint32_t, std::unique_ptr<const EVMBasicBlock>> m_blocks {};
+
+public:
+	EVMBlockCache(const EVMDisasm& disasm);
+	const EVMBasicBlock* getBlock(uint32_t codeOffset); // nullptr if there is no decodable instruction at codeOffset
+	size_t getBlockCount() const;
+};
@@ -0,0 +1,537 @@
+#include "EVMControlFlowGraph.h"
+#include "EVMDisasm.h"
+#include <charconv>
+
+void EVMControlFlowGraph::buildBlocks(std::span<const EVMInstruction> instructions)
+{
+	const size_t count = instructions.size();
+	std::vector<bool> leaders(count + 1);
+	leaders[0] = true;
+	for (size_t i = 0; i < count; i++)
+	{
+		const EVMInstruction& instruction = instructions[i];
+		if (instruction.target < count)
+		{
+			leaders[instruction.target] = true; // also call and createThread targets, they start functions
+		}
+		if (EVMDisasm::isBlockTerminator(instruction.opcode))
+		{
+			leaders[i + 1] = true;
+		}
+	}
+	m_blocks.clear();
+	m_blockOf.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (leaders[i])
+		{
+			m_blocks.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(i), No_Block, No_Block, No_Block});
+		}
+		m_blocks.back().end = static_cast<uint32_t>(i + 1);
+		m_blockOf[i] = static_cast<uint32_t>(m_blocks.size() - 1);
+	}
+}
+void EVMControlFlowGraph::buildEdges(std::span<const EVMInstruction> instructions)
+{
+	const size_t count = instructions.size();
+	m_successorStarts.assign(1, 0);
+	m_successors.clear();
+	for (const auto& block : m_blocks)
+	{
+		const EVMInstruction& last = instructions[block.end - 1];
+		if ((last.opcode == EVMOpcode::JUMP || last.opcode == EVMOpcode::JUMPEQUAL) && last.target < count)
+		{
+			m_successors.push_back(m_blockOf[last.target]);
+		}
+		const bool fallsThrough = last.opcode != EVMOpcode::JUMP && last.opcode != EVMOpcode::RET && last.opcode != EVMOpcode::HLT;
+		if (fallsThrough && block.end < count && (m_successors.size() == m_successorStarts.back() || m_successors.back() != m_blockOf[block.end]))
+		{
+			m_successors.push_back(m_blockOf[block.end]); // call returns here
+		}
+		m_successorStarts.push_back(static_cast<uint32_t>(m_successors.size()));
+	}
+	// predecessors are the transposed successor lists, filled by counting sort
+	m_predecessorStarts.assign(m_blocks.size() + 1, 0);
+	for (const uint32_t successor : m_successors)
+	{
+		m_predecessorStarts[successor + 1]++;
+	}
+	for (size_t block = 0; block < m_blocks.size(); block++)
+	{
+		m_predecessorStarts[block + 1] += m_predecessorStarts[block];
+	}
+	m_predecessors.resize(m_successors.size());
+	std::vector<uint32_t> cursors(m_predecessorStarts.begin(), m_predecessorStarts.end() - 1);
+	for (uint32_t block = 0; block < m_blocks.size(); block++)
+	{
+		for (const uint32_t successor : getSuccessors(block))
+		{
+			m_predecessors[cursors[successor]++] = block;
+		}
+	}
+}
+void EVMControlFlowGraph::findFunctions(std::span<const EVMInstruction> instructions)
+{
+	const auto isFunctionReference = [&](const EVMInstruction& instruction)
+	{
+		return (instruction.opcode == EVMOpcode::CALL || instruction.opcode == EVMOpcode::CREATETHREAD) && instruction.target < instructions.size();
+	};
+	std::vector<Function> entries(m_blocks.size());
+	std::vector<uint32_t> functionAt(m_blocks.size(), No_Block);
+	for (const auto& instruction : instructions)
+	{
+		if (isFunctionReference(instruction))
+		{
+			Function& entry = entries[m_blockOf[instruction.target]];
+			entry.called = entry.called || instruction.opcode == EVMOpcode::CALL;
+			entry.threadEntry = entry.threadEntry || instruction.opcode == EVMOpcode::CREATETHREAD;
+		}
+	}
+	m_functions.clear();
+	for (uint32_t block = 0; block < m_blocks.size(); block++)
+	{
+		if (block == 0 || entries[block].called || entries[block].threadEntry)
+		{
+			functionAt[block] = static_cast<uint32_t>(m_functions.size());
+			m_functions.push_back({block, entries[block].called, entries[block].threadEntry});
+		}
+	}
+	m_callSites.clear();
+	for (size_t i = 0; i < instructions.size(); i++)
+	{
+		if (isFunctionReference(instructions[i]))
+		{
+			m_callSites.push_back({static_cast<uint32_t>(i), functionAt[m_blockOf[instructions[i].target]]});
+		}
+	}
+	std::vector<uint32_t> worklist {};
+	for (uint32_t function = 0; function < m_functions.size(); function++)
+	{
+		const uint32_t entry = m_functions[function].entry;
+		if (m_blocks[entry].function != No_Block)
+		{
+			continue; // code of an earlier function runs into this entry
+		}
+		m_blocks[entry].function = function;
+		worklist.push_back(entry);
+		while (!worklist.empty())
+		{
+			const uint32_t block = worklist.back();
+			worklist.pop_back();
+			for (const uint32_t successor : getSuccessors(block))
+			{
+				if (m_blocks[successor].function == No_Block)
+				{
+					m_blocks[successor].function = function;
+					worklist.push_back(successor);
+				}
+			}
+		}
+	}
+}
+void EVMControlFlowGraph::build(std::span<const EVMInstruction> instructions)
+{
+	m_blocks.clear();
+	m_blockOf.clear();
+	m_successorStarts.assign(1, 0);
+	m_successors.clear();
+	m_predecessorStarts.assign(1, 0);
+	m_predecessors.clear();
+	m_functions.clear();
+	m_callSites.clear();
+	m_loops.clear();
+	m_dominatorsComputed = false;
+	if (instructions.empty())
+	{
+		return;
+	}
+	buildBlocks(instructions);
+	buildEdges(instructions);
+	findFunctions(instructions);
+}
+void EVMControlFlowGraph::computeImmediateDominators()
+{
+	// Lengauer-Tarjan with path compression, O(E log V), over blocks and a virtual root whose successors are all
+	// function entries. Vertices are numbered in depth first order from the root, which gets number 0.
+	const uint32_t root = static_cast<uint32_t>(m_blocks.size());
+	std::vector<bool> isEntry(m_blocks.size());
+	for (const auto& function : m_functions)
+	{
+		isEntry[function.entry] = true;
+	}
+	std::vector<uint32_t> number(m_blocks.size() + 1, No_Block);
+	std::vector<uint32_t> vertex {root};
+	std::vector<uint32_t> parent {No_Block};
+	struct Frame
+	{
+		uint32_t vertex;
+		uint32_t nextChild;
+	};
+	std::vector<Frame> stack {{root, 0}};
+	number[root] = 0;
+	while (!stack.empty())
+	{
+		Frame& frame = stack.back();
+		uint32_t child = No_Block;
+		if (frame.vertex == root)
+		{
+			while (child == No_Block && frame.nextChild < m_functions.size())
+			{
+				const uint32_t entry = m_functions[frame.nextChild++].entry;
+				child = number[entry] == No_Block ? entry : No_Block;
+			}
+		}
+		else
+		{
+			const auto successors = getSuccessors(frame.vertex);
+			while (child == No_Block && frame.nextChild < successors.size())
+			{
+				const uint32_t successor = successors[frame.nextChild++];
+				child = number[successor] == No_Block ? successor : No_Block;
+			}
+		}
+		if (child == No_Block)
+		{
+			stack.pop_back();
+			continue;
+		}
+		const uint32_t parentNumber = number[frame.vertex];
+		number[child] = static_cast<uint32_t>(vertex.size());
+		vertex.push_back(child);
+		parent.push_back(parentNumber);
+		stack.push_back({child, 0});
+	}
+
+	const uint32_t count = static_cast<uint32_t>(vertex.size());
+	std::vector<uint32_t> semi(count);
+	std::vector<uint32_t> label(count);
+	std::vector<uint32_t> ancestor(count, No_Block);
+	std::vector<uint32_t> idom(count);
+	std::vector<uint32_t> bucketHead(count, No_Block);
+	std::vector<uint32_t> bucketNext(count, No_Block);
+	for (uint32_t v = 0; v < count; v++)
+	{
+		semi[v] = v;
+		label[v] = v;
+	}
+	std::vector<uint32_t> path {};
+	// vertex with minimal semidominator on the forest path from v, compressing the path on the way
+	const auto eval = [&](uint32_t v)
+	{
+		if (ancestor[v] == No_Block)
+		{
+			return v;
+		}
+		path.clear();
+		for (uint32_t x = v; ancestor[ancestor[x]] != No_Block; x = ancestor[x])
+		{
+			path.push_back(x);
+		}
+		while (!path.empty())
+		{
+			const uint32_t x = path.back();
+			path.pop_back();
+			const uint32_t a = ancestor[x];
+			if (semi[label[a]] < semi[label[x]])
+			{
+				label[x] = label[a];
+			}
+			ancestor[x] = ancestor[a];
+		}
+		return label[v];
+	};
+	for (uint32_t w = count - 1; w >= 1; w--)
+	{
+		const uint32_t block = vertex[w];
+		const auto updateSemi = [&](uint32_t predecessorNumber)
+		{
+			const uint32_t u = eval(predecessorNumber);
+			semi[w] = std::min(semi[w], semi[u]);
+		};
+		for (const uint32_t predecessor : getPredecessors(block))
+		{
+			if (number[predecessor] != No_Block)
+			{
+				updateSemi(number[predecessor]);
+			}
+		}
+		if (isEntry[block])
+		{
+			updateSemi(0);
+		}
+		bucketNext[w] = bucketHead[semi[w]];
+		bucketHead[semi[w]] = w;
+		const uint32_t p = parent[w];
+		ancestor[w] = p;
+		for (uint32_t v = bucketHead[p]; v != No_Block; v = bucketNext[v])
+		{
+			const uint32_t u = eval(v);
+			idom[v] = semi[u] < semi[v] ? u : p;
+		}
+		bucketHead[p] = No_Block;
+	}
+	for (auto& block : m_blocks)
+	{
+		block.idom = No_Block;
+	}
+	for (uint32_t w = 1; w < count; w++)
+	{
+		if (idom[w] != semi[w])
+		{
+			idom[w] = idom[idom[w]];
+		}
+		m_blocks[vertex[w]].idom = idom[w] == 0 ? No_Block : vertex[idom[w]];
+	}
+}
+void EVMControlFlowGraph::numberDominatorTree(std::vector<uint32_t>& postorder)
+{
+	// children lists of the dominator tree, function entries hang below the virtual root at index size
+	const uint32_t root = static_cast<uint32_t>(m_blocks.size());
+	std::vector<uint32_t> childStarts(m_blocks.size() + 2, 0);
+	for (uint32_t block = 0; block < m_blocks.size(); block++)
+	{
+		if (isReachable(block))
+		{
+			childStarts[(m_blocks[block].idom == No_Block ? root : m_blocks[block].idom) + 1]++;
+		}
+	}
+	for (size_t i = 0; i + 1 < childStarts.size(); i++)
+	{
+		childStarts[i + 1] += childStarts[i];
+	}
+	std::vector<uint32_t> children(childStarts.back());
+	std::vector<uint32_t> cursors(childStarts.begin(), childStarts.end() - 1);
+	for (uint32_t block = 0; block < m_blocks.size(); block++)
+	{
+		if (isReachable(block))
+		{
+			children[cursors[m_blocks[block].idom == No_Block ? root : m_blocks[block].idom]++] = block;
+		}
+	}
+	m_dominatorPre.assign(m_blocks.size() + 1, No_Block);
+	m_dominatorPost.assign(m_blocks.size() + 1, No_Block);
+	postorder.clear();
+	uint32_t preCounter = 0;
+	uint32_t postCounter = 0;
+	std::vector<std::pair<uint32_t, uint32_t>> stack {{root, childStarts[root]}};
+	m_dominatorPre[root] = preCounter++;
+	while (!stack.empty())
+	{
+		auto& [node, next] = stack.back();
+		if (next == childStarts[node + 1])
+		{
+			m_dominatorPost[node] = postCounter++;
+			if (node != root)
+			{
+				postorder.push_back(node);
+			}
+			stack.pop_back();
+			continue;
+		}
+		const uint32_t child = children[next++];
+		m_dominatorPre[child] = preCounter++;
+		stack.push_back({child, childStarts[child]});
+	}
+}
+void EVMControlFlowGraph::findLoops(const std::vector<uint32_t>& postorder)
+{
+	// Headers are visited inner first, in postorder of the dominator tree. A loop collects blocks backwards from the
+	// sources of its back edges up to its header; blocks of an inner loop found on the way are skipped over by
+	// continuing from the inner loop header, which makes the whole pass near linear.
+	m_loops.clear();
+	for (auto& block : m_blocks)
+	{
+		block.loop = No_Block;
+	}
+	std::vector<uint32_t> outermost {}; // union find over loops, towards the outermost loop found so far
+	const auto findOutermost = [&](uint32_t loop)
+	{
+		uint32_t top = loop;
+		while (outermost[top] != top)
+		{
+			top = outermost[top];
+		}
+		while (outermost[loop] != top)
+		{
+			const uint32_t next = outermost[loop];
+			outermost[loop] = top;
+			loop = next;
+		}
+		return top;
+	};
+	std::vector<uint32_t> worklist {};
+	for (const uint32_t header : postorder)
+	{
+		worklist.clear();
+		for (const uint32_t predecessor : getPredecessors(header))
+		{
+			if (dominates(header, predecessor))
+			{
+				worklist.push_back(predecessor); // back edge
+			}
+		}
+		if (worklist.empty())
+		{
+			continue;
+		}
+		const uint32_t loop = static_cast<uint32_t>(m_loops.size());
+		m_loops.push_back({header, No_Block, 0});
+		outermost.push_back(loop);
+		m_blocks[header].loop = loop;
+		while (!worklist.empty())
+		{
+			const uint32_t block = worklist.back();
+			worklist.pop_back();
+			uint32_t nextBlock = block;
+			if (m_blocks[block].loop == No_Block)
+			{
+				m_blocks[block].loop = loop;
+			}
+			else
+			{
+				const uint32_t inner = findOutermost(m_blocks[block].loop);
+				if (inner == loop)
+				{
+					continue;
+				}
+				m_loops[inner].parent = loop;
+				outermost[inner] = loop;
+				nextBlock = m_loops[inner].header;
+			}
+			for (const uint32_t predecessor : getPredecessors(nextBlock))
+			{
+				if (isReachable(predecessor))
+				{
+					worklist.push_back(predecessor);
+				}
+			}
+		}
+	}
+	for (size_t loop = m_loops.size(); loop-- > 0;) // parents come after their inner loops
+	{
+		const uint32_t parent = m_loops[loop].parent;
+		m_loops[loop].depth = parent == No_Block ? 1 : m_loops[parent].depth + 1;
+	}
+}
+void EVMControlFlowGraph::computeDominators()
+{
+	if (m_blocks.empty())
+	{
+		return;
+	}
+	std::vector<uint32_t> postorder {};
+	computeImmediateDominators();
+	numberDominatorTree(postorder);
+	findLoops(postorder);
+	m_dominatorsComputed = true;
+}
+bool EVMControlFlowGraph::dominates(uint32_t dominator, uint32_t block) const
+{
+	if (m_dominatorPre[dominator] == No_Block || m_dominatorPre[block] == No_Block)
+	{
+		return false;
+	}
+	return m_dominatorPre[dominator] <= m_dominatorPre[block] && m_dominatorPost[block] <= m_dominatorPost[dominator];
+}
+bool EVMControlFlowGraph::isInLoop(uint32_t block, uint32_t loop) const
+{
+	for (uint32_t l = m_blocks[block].loop; l != No_Block; l = m_loops[l].parent)
+	{
+		if (l == loop)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+static void appendBlockName(std::string& buffer, uint32_t block)
+{
+	char digits[10];
+	const auto result = std::to_chars(std::begin(digits), std::end(digits), block);
+	buffer += 'b';
+	buffer.append(digits, result.ptr);
+}
+bool EVMControlFlowGraph::writeDot(std::ostream& output, const EVMDisasm& disasm) const
+{
+	const auto instructions = disasm.getInstructions();
+	std::string buffer {"digraph evm\n{\n\tnode [shape=box, fontname=\"monospace\"];\n"};
+	const auto flush = [&]()
+	{
+		if (buffer.size() >= Dot_Flush_Bytes)
+		{
+			output << buffer;
+			buffer.clear();
+		}
+	};
+	const auto appendBlock = [&](uint32_t block, const char* indent)
+	{
+		buffer += indent;
+		appendBlockName(buffer, block);
+		buffer += " [label=\"";
+		for (uint32_t i = m_blocks[block].begin; i < m_blocks[block].end; i++)
+		{
+			disasm.appendInstructionSource(buffer, instructions[i]);
+			buffer += "\\l";
+		}
+		buffer += '"';
+		if (m_dominatorsComputed && m_blocks[block].loop != No_Block && m_loops[m_blocks[block].loop].header == block)
+		{
+			buffer += ", peripheries=2"; // loop header
+		}
+		if (!isReachable(block))
+		{
+			buffer += ", style=dashed";
+		}
+		buffer += "];\n";
+		flush();
+	};
+	std::vector<std::vector<uint32_t>> blocksOfFunction(m_functions.size());
+	for (uint32_t block = 0; block < m_blocks.size(); block++)
+	{
+		if (isReachable(block))
+		{
+			blocksOfFunction[m_blocks[block].function].push_back(block);
+		}
+		else
+		{
+			appendBlock(block, "\t");
+		}
+	}
+	char offset[8];
+	for (size_t function = 0; function < m_functions.size(); function++)
+	{
+		const auto result = std::to_chars(std::begin(offset), std::end(offset), instructions[m_blocks[m_functions[function].entry].begin].offset, 16);
+		buffer += "\tsubgraph cluster_" + std::to_string(function) + "\n\t{\n\t\tlabel=\"sub_";
+		buffer.append(offset, result.ptr);
+		buffer += m_functions[function].threadEntry ? " (thread)\";\n" : "\";\n";
+		for (const uint32_t block : blocksOfFunction[function])
+		{
+			appendBlock(block, "\t\t");
+		}
+		buffer += "\t}\n";
+	}
+	for (uint32_t block = 0; block < m_blocks.size(); block++)
+	{
+		for (const uint32_t successor : getSuccessors(block))
+		{
+			buffer += '\t';
+			appendBlockName(buffer, block);
+			buffer += " -> ";
+			appendBlockName(buffer, successor);
+			buffer += ";\n";
+			flush();
+		}
+	}
+	for (const auto& callSite : m_callSites)
+	{
+		buffer += '\t';
+		appendBlockName(buffer, m_blockOf[callSite.instruction]);
+		buffer += " -> ";
+		appendBlockName(buffer, m_functions[callSite.function].entry);
+		buffer += instructions[callSite.instruction].opcode == EVMOpcode::CALL ? " [style=dashed];\n" : " [style=dotted];\n";
+		flush();
+	}
+	buffer += "}\n";
+	output << buffer;
+	return !output.fail();
+}
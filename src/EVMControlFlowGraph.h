@@ -0,0 +1,83 @@
+#pragma once
+
+#include "EVMTypes.h"
+#include <inttypes.h>
+#include <ostream>
+#include <span>
+#include <vector>
+
+class EVMDisasm;
+
+// Basic blocks, edges and functions of a decoded program. Edges stay within a guest function: call falls through to
+// its return point, ret and hlt have no successors, called code and new threads are separate functions.
+// Dominators and natural loops are computed on demand. Everything is linear or near linear in program size.
+class EVMControlFlowGraph
+{
+public:
+	static constexpr uint32_t No_Block = UINT32_MAX;
+
+	struct Block
+	{
+		uint32_t begin; // index of first instruction
+		uint32_t end; // one past last instruction
+		uint32_t function; // first function reaching the block, in order of getFunctions, No_Block when unreachable
+		uint32_t idom; // immediate dominator, No_Block for function entries and unreachable blocks
+		uint32_t loop; // innermost natural loop, No_Block outside of loops
+	};
+	struct Function
+	{
+		uint32_t entry; // block
+		bool called;
+		bool threadEntry;
+	};
+	struct Loop
+	{
+		uint32_t header; // block
+		uint32_t parent; // enclosing loop, No_Block for outermost loops
+		uint32_t depth; // 1 for outermost loops
+	};
+	struct CallSite
+	{
+		uint32_t instruction; // call or createThread
+		uint32_t function;
+	};
+
+private:
+	static const size_t Dot_Flush_Bytes = 1 << 16;
+
+	std::vector<Block> m_blocks {};
+	std::vector<uint32_t> m_blockOf {}; // per instruction
+	std::vector<uint32_t> m_successorStarts {}; // edges of block b are [starts[b], starts[b + 1])
+	std::vector<uint32_t> m_successors {};
+	std::vector<uint32_t> m_predecessorStarts {};
+	std::vector<uint32_t> m_predecessors {};
+	std::vector<Function> m_functions {}; // program entry first, then called and thread entry blocks in code order
+	std::vector<CallSite> m_callSites {};
+	std::vector<Loop> m_loops {}; // inner loops before the loops containing them
+	std::vector<uint32_t> m_dominatorPre {}; // dominator tree numbering, a dominates b when pre[a] <= pre[b] and post[b] <= post[a]
+	std::vector<uint32_t> m_dominatorPost {};
+	bool m_dominatorsComputed {};
+
+	void buildBlocks(std::span<const EVMInstruction> instructions);
+	void buildEdges(std::span<const EVMInstruction> instructions);
+	void findFunctions(std::span<const EVMInstruction> instructions);
+	void computeImmediateDominators();
+	void numberDominatorTree(std::vector<uint32_t>& postorder);
+	void findLoops(const std::vector<uint32_t>& postorder);
+
+public:
+	void build(std::span<const EVMInstruction> instructions); // code addresses that are not linked make no edges
+	void computeDominators(); // fills idom and loop of blocks and the loop list
+	const std::vector<Block>& getBlocks() const { return m_blocks; }
+	uint32_t getBlockOf(size_t instruction) const { return m_blockOf[instruction]; }
+	std::span<const uint32_t> getSuccessors(uint32_t block) const { return {m_successors.data() + m_successorStarts[block], m_successors.data() + m_successorStarts[block + 1]}; }
+	std::span<const uint32_t> getPredecessors(uint32_t block) const { return {m_predecessors.data() + m_predecessorStarts[block], m_predecessors.data() + m_predecessorStarts[block + 1]}; }
+	const std::vector<Function>& getFunctions() const { return m_functions; }
+	const std::vector<CallSite>& getCallSites() const { return m_callSites; }
+	const std::vector<Loop>& getLoops() const { return m_loops; }
+	bool isReachable(uint32_t block) const { return m_blocks[block].function != No_Block; }
+	bool dominates(uint32_t dominator, uint32_t block) const; // needs computeDominators, false for unreachable blocks
+	bool isInLoop(uint32_t block, uint32_t loop) const; // also true for loops enclosing the innermost one
+	// Graphviz digraph with one cluster per function, graph must be built from instructions of disasm
+	bool writeDot(std::ostream& output, const EVMDisasm& disasm) const;
+};
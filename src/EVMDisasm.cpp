@@ -1,4 +1,5 @@
 #include "EVMDisasm.h"
+#include <charconv>
 
 // total 21 opcodes
 const std::vector<std::unordered_map<bitSequenceInteger, EVMOpcode>> EVMDisasm::m_opcodeBitsequences =
@@ -104,21 +105,21 @@ const std::unordered_map<MemoryAccessSize, std::string> EVMDisasm::m_memoryAcces
 	{MemoryAccessSize::QWORD, "qword"}
 };
 
-EVMDisasm::EVMDisasm(const std::vector<std::byte>& input)
+EVMDisasm::EVMDisasm(std::span<const std::byte> input)
 {
 	init(input);
 }
-void EVMDisasm::init(const std::vector<std::byte>& input)
+void EVMDisasm::init(std::span<const std::byte> input)
 {
 	m_bitStreamReader.init(input);
 }
-EVMOpcode EVMDisasm::getOpcode()
+EVMOpcode EVMDisasm::getOpcode(BitStreamReader& reader) const
 {
 	// opcodes are 3-6 bits long, iterate through these sizes
 	size_t opcodeSize = 3;
 	for (const auto& currentSizeIt : m_opcodeBitsequences)
 	{
-		const auto readVarResult = m_bitStreamReader.readVar<bitSequenceInteger>(opcodeSize, false, true);
+		const auto readVarResult = reader.readVar<bitSequenceInteger>(opcodeSize, false, true);
 		if (!readVarResult.has_value())
 		{
 			return EVMOpcode::UNKNOWN;
@@ -128,7 +129,7 @@ EVMOpcode EVMDisasm::getOpcode()
 		{
 			if (opcodeBitSequence.first == opcodeVal)
 			{
-				if (!m_bitStreamReader.seek(opcodeSize))
+				if (!reader.seek(opcodeSize))
 				{
 					return EVMOpcode::UNKNOWN;
 				}
@@ -139,9 +140,9 @@ EVMOpcode EVMDisasm::getOpcode()
 	}
 	return EVMOpcode::UNKNOWN;
 }
-std::optional<std::vector<EVMArgument>> EVMDisasm::readArguments(const std::vector<ArgumentType>& argumentLayout)
+std::optional<EVMArgumentList> EVMDisasm::readArguments(BitStreamReader& reader, const std::vector<ArgumentType>& argumentLayout) const
 {
-    std::vector<EVMArgument> arguments;
+	EVMArgumentList arguments {};
 	for (const auto& arg : argumentLayout)
 	{
 		EVMArgument argument{};
@@ -150,7 +151,7 @@ std::optional<std::vector<EVMArgument>> EVMDisasm::readArguments(const std::vect
 		{
 			//accessType == 0 XXXX, read XXXX as little endian register index
 			//accessType == 1 SS XXXX, decode SS as memory access size, read XXXX as little endian register index, 
-			const auto accessTypeResult = m_bitStreamReader.readVar<bitSequenceInteger>(1);
+			const auto accessTypeResult = reader.readVar<bitSequenceInteger>(1);
 			if (!accessTypeResult.has_value())
 			{
 				return std::nullopt;
@@ -159,7 +160,7 @@ std::optional<std::vector<EVMArgument>> EVMDisasm::readArguments(const std::vect
 			argument.data.dataAccess.type = DataAccessType::REGISTER;
 			if (accessType == 1)
 			{
-				const auto memoryAccessSizeResult = m_bitStreamReader.readVar<bitSequenceInteger>(2);
+				const auto memoryAccessSizeResult = reader.readVar<bitSequenceInteger>(2);
 				if (!memoryAccessSizeResult.has_value())
 				{
 					return std::nullopt;
@@ -168,7 +169,7 @@ std::optional<std::vector<EVMArgument>> EVMDisasm::readArguments(const std::vect
 				argument.data.dataAccess.accessSize = m_bitStreamToMemoryAccessSize.at(memoryAccessSize);
 				argument.data.dataAccess.type = DataAccessType::DEREFERENCE;
 			}
-			const auto registerIndexResult = m_bitStreamReader.readVar<bitSequenceInteger>(4);
+			const auto registerIndexResult = reader.readVar<bitSequenceInteger>(4);
 			if (!registerIndexResult.has_value())
 			{
 				return std::nullopt;
@@ -178,7 +179,7 @@ std::optional<std::vector<EVMArgument>> EVMDisasm::readArguments(const std::vect
 		}
 		else if (arg == ArgumentType::CONSTANT)
 		{
-			const auto constantResult = m_bitStreamReader.readVar<int64_t>();
+			const auto constantResult = reader.readVar<int64_t>();
 			if (!constantResult.has_value())
 			{
 				return std::nullopt;
@@ -188,131 +189,465 @@ std::optional<std::vector<EVMArgument>> EVMDisasm::readArguments(const std::vect
 		}
 		else if (arg == ArgumentType::ADDRESS)
 		{
-			const auto codeAddressResult = m_bitStreamReader.readVar<uint32_t>();
+			const auto codeAddressResult = reader.readVar<uint32_t>();
 			if (!codeAddressResult.has_value())
 			{
 				return std::nullopt;
 			}
 			uint32_t codeAddress = codeAddressResult.value();
 			argument.data.codeAddress = codeAddress;
-			m_labelOffsets.insert(codeAddress);
 		}
 		arguments.push_back(argument);
 	}
 	return arguments;
 }
+bool EVMDisasm::isEndOfCode(BitStreamReader& reader) const
+{
+	size_t streamSize = reader.getStreamSize();
+	if (reader.getStreamPosition() >= streamSize)
+	{
+		return true;
+	}
+	size_t bitsLeft = streamSize - reader.getStreamPosition();
+	if (bitsLeft < 8)
+	{
+		// removal of ambiguous mov instruction at the end of bit stream
+		const auto lastBitsResult = reader.readVar<bitSequenceInteger>(bitsLeft, false);
+		if (!lastBitsResult.has_value() || lastBitsResult.value() == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+ESETVMStatus EVMDisasm::decodeInstruction(BitStreamReader& reader, EVMInstruction& instruction) const
+{
+	instruction.offset = static_cast<uint32_t>(reader.getStreamPosition());
+	EVMOpcode opcode = getOpcode(reader);
+	if (opcode == EVMOpcode::UNKNOWN)
+	{
+		return ESETVMStatus::OPCODE_PARSING_ERROR;
+	}
+	instruction.opcode = opcode;
+	const std::vector<ArgumentType>& argumentLayout = m_opcodeArguments.at(opcode);
+	if (argumentLayout.size() > 0)
+	{
+		const auto argumentResult = readArguments(reader, argumentLayout);
+		if (!argumentResult.has_value())
+		{
+			return ESETVMStatus::OPCODE_ARGUMENT_PARSING_ERROR;
+		}
+		instruction.arguments = argumentResult.value();
+	}
+	return ESETVMStatus::SUCCESS;
+}
 bool EVMDisasm::parseInstructions()
 {
-	size_t streamSize = m_bitStreamReader.getStreamSize();
-	while (m_bitStreamReader.getStreamPosition() < streamSize)
+	size_t threadCount = utils::getWorkerThreadCount();
+	if (threadCount > 1 && getCodeBitSize() >= Parallel_Decoding_Min_Bits)
+	{
+		return parseInstructionsParallel(threadCount);
+	}
+	return parseInstructionsSequential();
+}
+void EVMDisasm::indexAndLinkInstructions()
+{
+	const auto start = std::chrono::steady_clock::now();
+	indexInstructions();
+	linkInstructions();
+	m_linkDuration = std::chrono::steady_clock::now() - start;
+}
+bool EVMDisasm::parseInstructionsSequential()
+{
+	while (!isEndOfCode(m_bitStreamReader))
+	{
+		EVMInstruction currentInstruction{};
+		ESETVMStatus status = decodeInstruction(m_bitStreamReader, currentInstruction);
+		if (status != ESETVMStatus::SUCCESS)
+		{
+			m_error = status;
+			return false;
+		}
+		m_instructions.push_back(currentInstruction);
+	}
+	indexAndLinkInstructions();
+	return true;
+}
+std::vector<EVMDisasm::ChunkDecodePath> EVMDisasm::decodeChunk(uint64_t chunkStart, uint64_t chunkEnd) const
+{
+	// instruction boundaries are unknown inside a chunk, but the first one lies within Max_Instruction_Bits of its start,
+	// so decode from every candidate position; paths quickly synchronize, later ones stop where they meet an earlier path
+	std::vector<ChunkDecodePath> paths {};
+	std::vector<bool> visited(chunkEnd - chunkStart);
+	uint64_t lastCandidate = chunkStart == 0 ? 0 : std::min(chunkStart + Max_Instruction_Bits, chunkEnd) - 1;
+	for (uint64_t candidate = chunkStart; candidate <= lastCandidate; candidate++)
 	{
-		size_t bitsLeft = streamSize - m_bitStreamReader.getStreamPosition();
-		if (bitsLeft < 8)
+		ChunkDecodePath path {};
+		path.startPosition = candidate;
+		BitStreamReader reader {m_bitStreamReader};
+		if (!reader.seek(candidate, BitStreamReaderSeekStrategy::BEG))
+		{
+			break;
+		}
+		while (true)
 		{
-			// removal of ambiguous mov instruction at the end of bit stream
-			const auto lastBitsResult = m_bitStreamReader.readVar<bitSequenceInteger>(bitsLeft, false);
-			if (!lastBitsResult.has_value())
+			uint64_t position = reader.getStreamPosition();
+			path.exitPosition = position;
+			if (position >= chunkEnd)
 			{
-				return false;
+				break;
+			}
+			if (isEndOfCode(reader))
+			{
+				path.reachedEndOfCode = true;
+				break;
+			}
+			if (visited[position - chunkStart])
+			{
+				for (size_t i = 0; i < paths.size() && !path.join.has_value(); i++)
+				{
+					const auto& instructions = paths[i].instructions;
+					auto it = std::lower_bound(instructions.begin(), instructions.end(), position, [](const EVMInstruction& instruction, uint64_t offset) { return instruction.offset < offset; });
+					if (it != instructions.end() && it->offset == position)
+					{
+						path.join = {i, static_cast<size_t>(it - instructions.begin())};
+					}
+				}
+				break;
 			}
-			bitSequenceInteger lastBitsInLastByte = lastBitsResult.value();
-			if (lastBitsInLastByte == 0)
+			EVMInstruction instruction {};
+			path.status = decodeInstruction(reader, instruction);
+			if (path.status != ESETVMStatus::SUCCESS)
 			{
 				break;
 			}
+			visited[position - chunkStart] = true;
+			path.instructions.push_back(std::move(instruction));
 		}
-		EVMInstruction currentInstruction{};
-		currentInstruction.offset = static_cast<uint32_t>(m_bitStreamReader.getStreamPosition());
-		m_codeOffsetToInstructionNum.insert({currentInstruction.offset, m_currentInstructionNum});
-		EVMOpcode opcode = getOpcode();
-		if (opcode == EVMOpcode::UNKNOWN)
+		paths.push_back(std::move(path));
+	}
+	return paths;
+}
+bool EVMDisasm::parseInstructionsParallel(size_t threadCount, size_t chunkBits)
+{
+	uint64_t codeBits = getCodeBitSize();
+	size_t chunkCount = std::max<size_t>(1, (codeBits + chunkBits - 1) / chunkBits);
+	std::vector<std::vector<ChunkDecodePath>> chunkPaths (chunkCount);
+	utils::parallelFor(chunkCount, [&](size_t chunk)
+	{
+		chunkPaths[chunk] = decodeChunk(chunk * chunkBits, std::min<uint64_t>((chunk + 1) * chunkBits, codeBits));
+	}, threadCount);
+
+	// stitch chunks together following the path that starts where the previous chunk left off
+	struct Segment
+	{
+		ChunkDecodePath* path;
+		size_t begin;
+		size_t end;
+	};
+	std::vector<Segment> segments {};
+	uint64_t position = 0;
+	bool valid = true;
+	for (size_t chunk = 0; chunk < chunkCount && valid; chunk++)
+	{
+		if (position >= std::min<uint64_t>((chunk + 1) * chunkBits, codeBits))
+		{
+			continue;
+		}
+		auto& paths = chunkPaths[chunk];
+		auto pathIt = std::find_if(paths.begin(), paths.end(), [position](const ChunkDecodePath& path) { return path.startPosition == position; });
+		if (pathIt == paths.end())
 		{
-			m_error = ESETVMStatus::OPCODE_PARSING_ERROR;
-            return false;
+			valid = false;
+			break;
 		}
-		currentInstruction.opcode = opcode;
-		const std::vector<ArgumentType>& argumentLayout = m_opcodeArguments.at(opcode);
-		if (argumentLayout.size() > 0)
+		ChunkDecodePath* path = &*pathIt;
+		size_t begin = 0;
+		while (true)
 		{
-            std::vector<EVMArgument> arguments;
-			const auto argumentResult = readArguments(argumentLayout);
-			if (!argumentResult.has_value())
+			segments.push_back({path, begin, path->instructions.size()});
+			if (!path->join.has_value())
 			{
-				m_error = ESETVMStatus::OPCODE_ARGUMENT_PARSING_ERROR;
-				return false;
-                
-            }
-			arguments = argumentResult.value();
-			currentInstruction.arguments = arguments;
+				break;
+			}
+			begin = path->join->second;
+			path = &paths[path->join->first];
 		}
-		m_currentInstructionNum++;
-		m_instructions.push_back(currentInstruction);
+		if (path->status != ESETVMStatus::SUCCESS)
+		{
+			valid = false;
+			break;
+		}
+		position = path->exitPosition;
+		if (path->reachedEndOfCode)
+		{
+			break;
+		}
+	}
+	if (!valid)
+	{
+		// let the sequential decoder find and report the error exactly as it would without threads
+		return parseInstructionsSequential();
+	}
+
+	std::vector<size_t> segmentStarts (segments.size() + 1);
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		segmentStarts[i + 1] = segmentStarts[i] + (segments[i].end - segments[i].begin);
 	}
+	m_instructions.resize(segmentStarts.back());
+	utils::parallelFor(segments.size(), [&](size_t i)
+	{
+		auto& instructions = segments[i].path->instructions;
+		std::move(instructions.begin() + segments[i].begin, instructions.begin() + segments[i].end, m_instructions.begin() + segmentStarts[i]);
+	}, threadCount);
+	m_bitStreamReader.seek(position, BitStreamReaderSeekStrategy::BEG);
+	indexAndLinkInstructions();
 	return true;
 }
-bool EVMDisasm::convertInstructionsToSourceCode(bool labels)
+void EVMDisasm::linkInstructions()
 {
-	m_sourceCodeLines.reserve(m_instructions.size() + m_labelOffsets.size());
-	for (const auto& it : m_instructions)
+	// branch targets are resolved once so execution does not look up code offsets
+	for (auto& instruction : m_instructions)
 	{
-		std::stringstream ss;
-		if (labels)
+		for (const auto& argument : instruction.arguments)
 		{
-			if (const auto findIt = m_labelOffsets.find(it.offset); findIt != m_labelOffsets.cend())
+			if (argument.type == ArgumentType::ADDRESS)
 			{
-				ss << "sub_" << std::hex << it.offset << ":" << std::dec;
-				m_sourceCodeLines.push_back(ss.str());
-				std::stringstream().swap(ss); // empty ss
+				const auto target = insNumFromCodeOff(argument.data.codeAddress);
+				instruction.target = target.has_value() ? static_cast<uint32_t>(target.value()) : EVMInstruction::Unresolved_Target;
 			}
 		}
-		ss << m_opcodeToName.at(it.opcode);
-		if (it.arguments.size() > 0)
+	}
+}
+void EVMDisasm::loadImage(std::span<const EVMInstruction> instructions, std::span<const uint32_t> instructionOffsets)
+{
+	m_imageInstructions = instructions;
+	m_instructionOffsets.init(getCodeBitSize());
+	for (const uint32_t offset : instructionOffsets)
+	{
+		m_instructionOffsets.insert(offset);
+	}
+	m_instructionOffsets.buildRanks();
+}
+void EVMDisasm::indexInstructions()
+{
+	m_instructionOffsets.init(getCodeBitSize());
+	m_labelOffsets.init(getCodeBitSize());
+	for (const auto& instruction : m_instructions)
+	{
+		m_instructionOffsets.insert(instruction.offset);
+		for (const auto& argument : instruction.arguments)
 		{
-			ss << " ";
+			if (argument.type == ArgumentType::ADDRESS)
+			{
+				m_labelOffsets.insert(argument.data.codeAddress);
+			}
 		}
-		for (const auto& argument : it.arguments)
+	}
+	m_instructionOffsets.buildRanks();
+	m_labelOffsets.buildRanks();
+}
+std::optional<EVMBasicBlock> EVMDisasm::decodeBasicBlock(uint32_t codeOffset) const
+{
+	BitStreamReader reader {m_bitStreamReader}; // private cursor, safe to call from many threads
+	if (!reader.seek(codeOffset, BitStreamReaderSeekStrategy::BEG))
+	{
+		return std::nullopt;
+	}
+	EVMBasicBlock block {};
+	block.offset = codeOffset;
+	while (!isEndOfCode(reader))
+	{
+		EVMInstruction instruction {};
+		if (decodeInstruction(reader, instruction) != ESETVMStatus::SUCCESS)
+		{
+			// block ends before undecodable bits, error is reported only if execution reaches them
+			reader.seek(instruction.offset, BitStreamReaderSeekStrategy::BEG);
+			break;
+		}
+		block.instructions.push_back(instruction);
+		if (isBlockTerminator(instruction.opcode))
+		{
+			break;
+		}
+	}
+	if (block.instructions.empty())
+	{
+		return std::nullopt;
+	}
+	block.endOffset = static_cast<uint32_t>(reader.getStreamPosition());
+	return block;
+}
+bool EVMDisasm::isBlockTerminator(EVMOpcode opcode)
+{
+	switch (opcode)
+	{
+		case EVMOpcode::JUMP:
+		case EVMOpcode::JUMPEQUAL:
+		case EVMOpcode::CALL:
+		case EVMOpcode::RET:
+		case EVMOpcode::HLT:
+			return true;
+		default:
+			return false;
+	}
+}
+bool EVMDisasm::isValidInstruction(const EVMInstruction& instruction)
+{
+	const auto layoutIt = m_opcodeArguments.find(instruction.opcode);
+	if (layoutIt == m_opcodeArguments.cend() || layoutIt->second.size() != instruction.arguments.size())
+	{
+		return false;
+	}
+	for (size_t i = 0; i < instruction.arguments.size(); i++)
+	{
+		const EVMArgument& argument = instruction.arguments[i];
+		if (argument.type != layoutIt->second[i])
+		{
+			return false;
+		}
+		if (argument.type == ArgumentType::DATA_ACCESS)
 		{
-			if (argument.type == ArgumentType::CONSTANT)
+			const DataAccess& dataAccess = argument.data.dataAccess;
+			if (dataAccess.registerIndex > 0b1111)
 			{
-				ss << std::hex << "0x" << argument.data.constant << std::dec;
+				return false;
 			}
-			else if (argument.type == ArgumentType::ADDRESS)
+			if (dataAccess.type == DataAccessType::DEREFERENCE && !m_memoryAccessSizeToName.contains(dataAccess.accessSize))
 			{
-				ss << "sub_" << std::hex << argument.data.codeAddress << std::dec;
+				return false;
 			}
-			else if (argument.type == ArgumentType::DATA_ACCESS)
+			if (dataAccess.type != DataAccessType::REGISTER && dataAccess.type != DataAccessType::DEREFERENCE)
 			{
-				if (argument.data.dataAccess.type == DataAccessType::REGISTER)
-				{
-					ss << "r" << static_cast<int>(argument.data.dataAccess.registerIndex);
-				}
-				else if (argument.data.dataAccess.type == DataAccessType::DEREFERENCE)
-				{
-					ss << m_memoryAccessSizeToName.at(argument.data.dataAccess.accessSize) << "[" << "r" << static_cast<int>(argument.data.dataAccess.registerIndex) << "]";
-				}
+				return false;
 			}
-			if (&argument != &it.arguments.back())
+		}
+	}
+	return true;
+}
+static void appendNumber(std::string& buffer, uint64_t value, int base)
+{
+	char digits[20];
+	const auto result = std::to_chars(std::begin(digits), std::end(digits), value, base);
+	buffer.append(digits, result.ptr);
+}
+static void appendLabel(std::string& buffer, uint32_t codeOffset)
+{
+	buffer += "sub_";
+	appendNumber(buffer, codeOffset, 16);
+}
+std::string EVMDisasm::instructionToSourceCode(const EVMInstruction& instruction) const
+{
+	std::string line {};
+	appendInstructionSource(line, instruction);
+	return line;
+}
+void EVMDisasm::appendInstructionSource(std::string& buffer, const EVMInstruction& instruction) const
+{
+	buffer += m_opcodeToName.at(instruction.opcode);
+	for (size_t i = 0; i < instruction.arguments.size(); i++)
+	{
+		const EVMArgument& argument = instruction.arguments[i];
+		buffer += i == 0 ? " " : ", ";
+		if (argument.type == ArgumentType::CONSTANT)
+		{
+			buffer += "0x";
+			appendNumber(buffer, static_cast<uint64_t>(argument.data.constant), 16); // negative constants are printed as two's complement
+		}
+		else if (argument.type == ArgumentType::ADDRESS)
+		{
+			appendLabel(buffer, argument.data.codeAddress);
+		}
+		else if (argument.type == ArgumentType::DATA_ACCESS)
+		{
+			if (argument.data.dataAccess.type == DataAccessType::REGISTER)
+			{
+				buffer += "r";
+				appendNumber(buffer, argument.data.dataAccess.registerIndex, 10);
+			}
+			else if (argument.data.dataAccess.type == DataAccessType::DEREFERENCE)
 			{
-				ss << ", ";
+				buffer += m_memoryAccessSizeToName.at(argument.data.dataAccess.accessSize);
+				buffer += "[r";
+				appendNumber(buffer, argument.data.dataAccess.registerIndex, 10);
+				buffer += "]";
 			}
 		}
-		m_sourceCodeLines.push_back(ss.str());
 	}
-	return true;
 }
-std::optional<size_t> EVMDisasm::insNumFromCodeOff(uint32_t codeOffset) const
+void EVMDisasm::renderSourceCode(std::string& buffer, std::span<const EVMInstruction> instructions, bool labels) const
 {
-	if (!m_codeOffsetToInstructionNum.contains(codeOffset))
+	for (const auto& instruction : instructions)
 	{
-		return std::nullopt;
+		if (labels && m_labelOffsets.contains(instruction.offset))
+		{
+			appendLabel(buffer, instruction.offset);
+			buffer += ":\n";
+		}
+		appendInstructionSource(buffer, instruction);
+		buffer += '\n';
 	}
-	return m_codeOffsetToInstructionNum.at(codeOffset);
+}
+bool EVMDisasm::writeSourceCode(std::ostream& output, bool labels, size_t threadCount, size_t blockInstructions) const
+{
+	const auto instructions = getInstructions();
+	threadCount = threadCount == 0 ? utils::getWorkerThreadCount() : threadCount;
+	const size_t blockCount = (instructions.size() + blockInstructions - 1) / blockInstructions;
+	const size_t blocksPerRound = threadCount * 2;
+	std::vector<std::string> buffers (std::min(blocksPerRound, blockCount)); // reused by every round
+	for (size_t firstBlock = 0; firstBlock < blockCount; firstBlock += blocksPerRound)
+	{
+		const size_t roundBlocks = std::min(blocksPerRound, blockCount - firstBlock);
+		utils::parallelFor(roundBlocks, [&](size_t i)
+		{
+			const size_t first = (firstBlock + i) * blockInstructions;
+			buffers[i].clear();
+			renderSourceCode(buffers[i], instructions.subspan(first, std::min(blockInstructions, instructions.size() - first)), labels);
+		}, threadCount);
+		for (size_t i = 0; i < roundBlocks; i++)
+		{
+			output.write(buffers[i].data(), buffers[i].size());
+		}
+	}
+	return !output.fail();
+}
+bool EVMDisasm::convertInstructionsToSourceCode(bool labels)
+{
+	const auto instructions = getInstructions();
+	m_sourceCodeLines.reserve(instructions.size() + m_labelOffsets.size());
+	for (const auto& it : instructions)
+	{
+		if (labels)
+		{
+			if (m_labelOffsets.contains(it.offset))
+			{
+				std::string label {};
+				appendLabel(label, it.offset);
+				m_sourceCodeLines.push_back(label + ":");
+			}
+		}
+		m_sourceCodeLines.push_back(instructionToSourceCode(it));
+	}
+	return true;
+}
+std::optional<size_t> EVMDisasm::insNumFromCodeOff(uint32_t codeOffset) const
+{
+	return m_instructionOffsets.rank(codeOffset);
 }
 std::optional<std::string> EVMDisasm::getSourceCodeLineForIp (size_t ip) const
 {
-	if (ip >= m_sourceCodeLines.size())
+	const auto instructions = getInstructions();
+	if (ip >= instructions.size())
 	{
 		return std::nullopt;
 	}
-	return m_sourceCodeLines.at(ip);
+	std::unique_lock l {m_sourceLineCacheMutex};
+	auto& [cachedIp, cachedLine] = m_sourceLineCache[ip % Source_Line_Cache_Size];
+	if (cachedLine.empty() || cachedIp != ip)
+	{
+		cachedIp = ip;
+		cachedLine = instructionToSourceCode(instructions[ip]);
+	}
+	return cachedLine;
 }
@@ -1,11 +1,17 @@
 #pragma once
 #include "BitStreamReader.h"
+#include "EVMOffsetIndex.h"
 #include "EVMTypes.h"
 #include "utils.h"
+#include <array>
+#include <chrono>
 #include <inttypes.h>
 #include <map>
+#include <mutex>
 #include <optional>
+#include <ostream>
 #include <set>
+#include <span>
 #include <sstream>
 #include <unordered_map>
 #include <vector>
@@ -19,30 +25,71 @@ private:
 	static const std::unordered_map<EVMOpcode, std::string> m_opcodeToName;
 	static const std::unordered_map<MemoryAccessSize, std::string> m_memoryAccessSizeToName;
 
+	static const size_t Max_Instruction_Bits = 74; // loadConst with dereference operand
+	static const size_t Parallel_Decoding_Min_Bits = 8 * 1024 * 1024; // smaller code sections are decoded on one thread
+	static const size_t Parallel_Decoding_Chunk_Bits = 1024 * 1024;
+	static const size_t Source_Line_Cache_Size = 256; // recently rendered lines kept for verbose tracing of loops
+	static const size_t Source_Render_Block_Instructions = 16 * 1024; // listing is formatted in blocks of this many instructions, a few blocks per thread at a time
+
+	// instructions decoded speculatively from one start position inside a chunk
+	struct ChunkDecodePath
+	{
+		uint64_t startPosition {};
+		uint64_t exitPosition {}; // first position outside of the chunk, end of code or position of the error
+		ESETVMStatus status {ESETVMStatus::SUCCESS};
+		bool reachedEndOfCode {};
+		std::vector<EVMInstruction> instructions {};
+		std::optional<std::pair<size_t, size_t>> join {}; // path index and instruction index where this path merged into an earlier one
+	};
+
 	BitStreamReader m_bitStreamReader {};
 	ESETVMStatus m_error {ESETVMStatus::SUCCESS};
 
 	std::vector<EVMInstruction> m_instructions {};
+	std::span<const EVMInstruction> m_imageInstructions {}; // set when instructions come from a pre-decoded image
 	std::vector<std::string> m_sourceCodeLines {};
-	std::set<uint32_t> m_labelOffsets {};
-	std::unordered_map<uint32_t, size_t> m_codeOffsetToInstructionNum {};
-	size_t m_currentInstructionNum {};
+	mutable std::mutex m_sourceLineCacheMutex {};
+	mutable std::array<std::pair<size_t, std::string>, Source_Line_Cache_Size> m_sourceLineCache {}; // direct mapped by instruction number
+	EVMOffsetIndex m_labelOffsets {}; // code addresses used as operands, only those inside code can get a label
+	EVMOffsetIndex m_instructionOffsets {}; // rank of an instruction offset is its instruction number
+	std::chrono::steady_clock::duration m_linkDuration {};
+
+	EVMOpcode getOpcode(BitStreamReader& reader) const;
+	std::optional<EVMArgumentList> readArguments(BitStreamReader& reader, const std::vector<ArgumentType>& argumentLayout) const;
+	bool isEndOfCode(BitStreamReader& reader) const;
+	ESETVMStatus decodeInstruction(BitStreamReader& reader, EVMInstruction& instruction) const;
+	std::vector<ChunkDecodePath> decodeChunk(uint64_t chunkStart, uint64_t chunkEnd) const;
+	bool parseInstructionsSequential();
+	void indexInstructions();
+	void linkInstructions();
+	void indexAndLinkInstructions(); // last step of decoding
+	void renderSourceCode(std::string& buffer, std::span<const EVMInstruction> instructions, bool labels) const;
 
-	EVMOpcode getOpcode();
-	std::optional<std::vector<EVMArgument>> readArguments(const std::vector<ArgumentType>& argumentLayout);
-	
+	friend class EVMAssembler; // encodes with the same tables
 public:
 	EVMDisasm() = default;
-	EVMDisasm(const std::vector<std::byte>& input);
-	void init(const std::vector<std::byte>& input);
+	EVMDisasm(std::span<const std::byte> input); // input must outlive the disassembler
+	void init(std::span<const std::byte> input);
 	ESETVMStatus getError() const { return m_error; };
 
-	const std::vector<EVMInstruction>& getInstructions() const { return m_instructions; }
+	std::span<const EVMInstruction> getInstructions() const { return m_imageInstructions.empty() ? std::span<const EVMInstruction> {m_instructions} : m_imageInstructions; }
 	const std::vector<std::string>& getSourceCode() const { return m_sourceCodeLines; }
+	uint64_t getCodeBitSize() const { return m_bitStreamReader.getStreamSize(); }
+	std::chrono::steady_clock::duration getLinkDuration() const { return m_linkDuration; } // part of parseInstructions spent indexing and linking
 	bool parseInstructions();
+	bool parseInstructionsParallel(size_t threadCount, size_t chunkBits = Parallel_Decoding_Chunk_Bits);
+	void loadImage(std::span<const EVMInstruction> instructions, std::span<const uint32_t> instructionOffsets); // linked instructions, views must outlive the disassembler
+	std::optional<EVMBasicBlock> decodeBasicBlock(uint32_t codeOffset) const; // on-demand decoding, does not touch parsed instructions
+	static bool isBlockTerminator(EVMOpcode opcode);
+	static const std::string& getOpcodeName(EVMOpcode opcode) { return m_opcodeToName.at(opcode); }
+	static bool isValidInstruction(const EVMInstruction& instruction); // instruction could have been produced by the decoder
+	std::string instructionToSourceCode(const EVMInstruction& instruction) const;
+	void appendInstructionSource(std::string& buffer, const EVMInstruction& instruction) const;
+	// streams whole listing formatted on threadCount threads (0 = all cores), memory use does not depend on program size
+	bool writeSourceCode(std::ostream& output, bool labels = true, size_t threadCount = 0, size_t blockInstructions = Source_Render_Block_Instructions) const;
 	bool convertInstructionsToSourceCode(bool labels = true);
-	std::vector<std::string> getSourceCodeLines() { return m_sourceCodeLines; }
+	const std::vector<std::string>& getSourceCodeLines() const { return m_sourceCodeLines; }
 	std::optional<size_t> insNumFromCodeOff(uint32_t codeOffset) const;
-	std::optional<std::string> getSourceCodeLineForIp (size_t ip) const;
+	std::optional<std::string> getSourceCodeLineForIp (size_t ip) const; // rendered on demand, thread safe
 };
 
@@ -2,7 +2,6 @@
 
 std::mutex EVMExecutionUnit::printCrashMutex;
 std::mutex EVMExecutionUnit::writeMemoryMutex;
-std::mutex EVMExecutionUnit::writeFileMutex;
 std::mutex EVMExecutionUnit::consoleReadMutex;
 std::mutex EVMExecutionUnit::consoleWriteMutex;
 std::mutex EVMExecutionUnit::verboseMutex;
@@ -10,22 +9,66 @@ std::mutex EVMExecutionUnit::muticesMutex;
 std::mutex EVMExecutionUnit::interruptMutex;
 std::atomic<bool> EVMExecutionUnit::interrupt = false;
 
-EVMExecutionUnit::EVMExecutionUnit(const std::vector<EVMInstruction>& instructions, std::vector<uint8_t>& memory, const EVMDisasm& disasm, EVMContext context, std::unordered_map<registerIntegerType, std::shared_ptr<std::mutex>>& mutices, std::fstream& binaryFile, bool verbose, std::optional<size_t> maxEmulatedInstructionCount, std::atomic<size_t>& emulatedInstructionCount):
-m_maxEmulatedInstructionCount(maxEmulatedInstructionCount),
-m_emulatedInstructionCount(emulatedInstructionCount),
+EVMExecutionUnit::EVMExecutionUnit(EVMSharedState& shared, EVMContext context):
+m_maxEmulatedInstructionCount(shared.maxEmulatedInstructionCount),
+m_emulatedInstructionCount(shared.emulatedInstructionCount),
+m_shared(shared),
 m_threadContext(context),
 m_running(true),
-m_verbose(verbose),
-m_instructions(instructions),
-m_memory(memory),
-m_disasm(disasm),
-m_binaryFile(binaryFile),
-m_mutices(mutices)
+m_verbose(shared.verbose),
+m_instructions(shared.instructions),
+m_memory(shared.memory),
+m_disasm(shared.disasm),
+m_fileCache(shared.fileCache),
+m_blockCache(shared.blockCache),
+m_traceWriter(shared.traceWriter),
+m_profiler(shared.profiler),
+m_sampler(shared.sampler),
+m_lockProfiler(shared.lockProfiler),
+m_stats(shared.stats),
+m_mutices(shared.mutices)
 {
 	m_threadContext.registers.resize(16);
+	if (m_traceWriter != nullptr)
+	{
+		m_traceRing = &m_traceWriter->createRing();
+		m_tracedRegisters = m_threadContext.registers;
+	}
+	if (m_profiler != nullptr)
+	{
+		m_profile.emplace(m_profiler->createThreadProfile());
+	}
+	if (m_sampler != nullptr)
+	{
+		m_samples.emplace(m_sampler->createThreadSamples(m_instructions, m_threadContext.ip));
+	}
+	if (m_lockProfiler != nullptr)
+	{
+		m_lockStats.emplace();
+	}
+	if (m_stats != nullptr)
+	{
+		m_statsThreadNumber = m_stats->threadStarted();
+	}
 }
 EVMExecutionUnit::~EVMExecutionUnit()
 {
+	if (m_profile.has_value())
+	{
+		m_profiler->merge(m_profile.value());
+	}
+	if (m_samples.has_value())
+	{
+		m_sampler->merge(m_samples.value());
+	}
+	if (m_lockStats.has_value())
+	{
+		m_lockProfiler->merge(m_lockStats.value());
+	}
+	if (m_stats != nullptr)
+	{
+		m_stats->threadExited(m_statsThreadNumber, m_executedInstructions);
+	}
 	{
 		std::unique_lock l{ unlockMutex };
 		for (auto& m : m_currentOwnedMutices)
@@ -44,47 +87,236 @@ EVMExecutionUnit::~EVMExecutionUnit()
 		}
 	}
 }
+template <bool Verbose>
 std::optional<std::reference_wrapper<const EVMInstruction>> EVMExecutionUnit::fetchInstruction()
 {
-	if (m_threadContext.ip <= m_instructions.size())
+	const EVMInstruction* instruction = nullptr;
+	if (m_blockCache != nullptr)
+	{
+		instruction = fetchFromBlockCache();
+	}
+	else if (m_threadContext.ip < m_instructions.size())
+	{
+		instruction = &m_instructions[m_threadContext.ip];
+	}
+	if (instruction == nullptr)
+	{
+		return std::nullopt;
+	}
+	if constexpr (Verbose)
 	{
-		if (m_verbose)
+		std::unique_lock l {verboseMutex};
+		
+		const auto srcLine = getCurrentSourceCodeLine();
+		if (!srcLine.has_value())
 		{
-			std::unique_lock l {verboseMutex};
-			
-			const auto srcLine = m_disasm.getSourceCodeLineForIp(m_threadContext.ip);
-			if (!srcLine.has_value())
-			{
-				return std::nullopt;
-			}
-			for (size_t i = 0; i < m_threadContext.callStack.size(); i++)
-			{
-				std::cerr << "\t";
-			}
-			std::cerr << std::this_thread::get_id() << ": " << srcLine.value() << std::endl;
+			return std::nullopt;
+		}
+		for (size_t i = 0; i < m_threadContext.callStack.size(); i++)
+		{
+			std::cerr << "\t";
 		}
-		return std::cref(m_instructions.at(m_threadContext.ip));
+		std::cerr << std::this_thread::get_id() << ": " << srcLine.value() << std::endl;
 	}
-	return std::nullopt;
+	return std::cref(*instruction);
+}
+const EVMInstruction* EVMExecutionUnit::fetchFromBlockCache()
+{
+	const size_t ip = m_threadContext.ip;
+	// sequential execution stays inside the current block
+	if (m_currentBlock != nullptr && m_currentBlockIndex + 1 < m_currentBlock->instructions.size() && m_currentBlock->instructions[m_currentBlockIndex + 1].offset == ip)
+	{
+		m_currentBlockIndex++;
+		return &m_currentBlock->instructions[m_currentBlockIndex];
+	}
+	// small per thread lookup cache keeps hot loops away from the shared cache lock
+	const EVMBasicBlock*& cachedBlock = m_blockLookupCache[ip % Block_Lookup_Cache_Size];
+	if (cachedBlock == nullptr || cachedBlock->offset != ip)
+	{
+		const EVMBasicBlock* block = m_blockCache->getBlock(static_cast<uint32_t>(ip));
+		if (block == nullptr)
+		{
+			return nullptr;
+		}
+		cachedBlock = block;
+	}
+	m_currentBlock = cachedBlock;
+	m_currentBlockIndex = 0;
+	return &m_currentBlock->instructions[m_currentBlockIndex];
+}
+size_t EVMExecutionUnit::getNextIp() const
+{
+	if (m_blockCache == nullptr)
+	{
+		return m_threadContext.ip + 1;
+	}
+	if (m_currentBlockIndex + 1 < m_currentBlock->instructions.size())
+	{
+		return m_currentBlock->instructions[m_currentBlockIndex + 1].offset;
+	}
+	return m_currentBlock->endOffset;
+}
+bool EVMExecutionUnit::isValidIp(size_t ip) const
+{
+	if (m_blockCache == nullptr)
+	{
+		return ip < m_instructions.size();
+	}
+	return ip < m_disasm.getCodeBitSize();
+}
+std::optional<size_t> EVMExecutionUnit::resolveCodeAddress(const EVMInstruction& instruction) const
+{
+	uint32_t codeOffset = instruction.arguments.at(0).data.codeAddress;
+	if (m_blockCache == nullptr)
+	{
+		if (instruction.target != EVMInstruction::Unresolved_Target)
+		{
+			return instruction.target; // linked after decoding
+		}
+		return m_disasm.insNumFromCodeOff(codeOffset);
+	}
+	if (codeOffset >= m_disasm.getCodeBitSize())
+	{
+		return std::nullopt;
+	}
+	return codeOffset; // decoded when fetched
+}
+std::optional<std::string> EVMExecutionUnit::getCurrentSourceCodeLine() const
+{
+	if (m_blockCache == nullptr)
+	{
+		return m_disasm.getSourceCodeLineForIp(m_threadContext.ip);
+	}
+	if (m_currentBlock == nullptr)
+	{
+		return std::nullopt;
+	}
+	return m_disasm.instructionToSourceCode(m_currentBlock->instructions[m_currentBlockIndex]);
 }
 ESETVMStatus EVMExecutionUnit::run()
 {
+	// flags are fixed for the whole run, so every combination gets its own loop with disabled features compiled out
+	using RunLoop = ESETVMStatus (EVMExecutionUnit::*)();
+	static constexpr RunLoop Run_Loops[] =
+	{
+		&EVMExecutionUnit::runLoop<false, false, false>,
+		&EVMExecutionUnit::runLoop<false, false, true>,
+		&EVMExecutionUnit::runLoop<false, true, false>,
+		&EVMExecutionUnit::runLoop<false, true, true>,
+		&EVMExecutionUnit::runLoop<true, false, false>,
+		&EVMExecutionUnit::runLoop<true, false, true>,
+		&EVMExecutionUnit::runLoop<true, true, false>,
+		&EVMExecutionUnit::runLoop<true, true, true>
+	};
+	const bool budgeted = m_maxEmulatedInstructionCount.has_value();
+	const bool profiling = m_traceRing != nullptr || m_profile.has_value() || m_samples.has_value() || m_stats != nullptr;
+	// native code neither prints nor counts instructions, it runs only when execution is not observed that way
+	if (m_shared.nativeProgram != nullptr && !m_verbose && !budgeted && !profiling && m_shared.nativeProgram->canStartAt(m_threadContext.ip))
+	{
+		return runNative();
+	}
+	return (this->*Run_Loops[m_verbose * 4 + budgeted * 2 + profiling])();
+}
+ESETVMStatus EVMExecutionUnit::runNative()
+{
+	// threads inherit the call stack of their creator, native calls may only use the rest of the guest stack
+	const int64_t maxDepth = static_cast<int64_t>(m_threadContext.stackSize) - static_cast<int64_t>(m_threadContext.callStack.size());
+	std::vector<uint32_t> returnPoints(std::max<int64_t>(maxDepth + 1, 0));
+	EVMNativeRuntime runtime {m_threadContext.registers.data(), m_memory.data(), m_memory.size(), returnPoints.data(), maxDepth, 0, 0, &EVMExecutionUnit::executeFromNative, this};
+	switch (m_shared.nativeProgram->run(runtime, m_threadContext.ip))
+	{
+		case EVMNativeProgram::EVMNativeStatus::HALTED:
+			return ESETVMStatus::SUCCESS;
+		case EVMNativeProgram::EVMNativeStatus::FAILED:
+			printCrashInfo();
+			return ESETVMStatus::EXECUTION_ERROR;
+		case EVMNativeProgram::EVMNativeStatus::STACK_OVERFLOW:
+			m_threadContext.ip = runtime.ip;
+			std::cerr << "Stack overflow" << std::endl;
+			printCrashInfo();
+			return ESETVMStatus::EXECUTION_ERROR;
+		case EVMNativeProgram::EVMNativeStatus::FETCH_FAILED:
+			return ESETVMStatus::FETCH_ERROR;
+		default:
+			// ret with no native caller returns into the inherited call stack, which only the interpreter has
+			m_threadContext.ip = runtime.ip;
+			return runLoop<false, false, false>();
+	}
+}
+int EVMExecutionUnit::executeFromNative(EVMNativeRuntime* runtime, uint32_t instruction)
+{
+	EVMExecutionUnit& unit = *static_cast<EVMExecutionUnit*>(runtime->unit);
+	const EVMInstruction& executed = unit.m_instructions[instruction];
+	unit.m_threadContext.ip = instruction;
+	// return points of native calls are pushed only for instructions that read the call stack
+	const size_t callDepth = unit.m_threadContext.callStack.size();
+	const bool readsCallStack = executed.opcode == EVMOpcode::CREATETHREAD || executed.opcode == EVMOpcode::RET;
+	for (uint32_t depth = 0; readsCallStack && depth < runtime->depth; depth++)
+	{
+		unit.m_threadContext.callStack.push(runtime->returnPoints[depth]);
+	}
+	const bool success = unit.executeInstruction(executed);
+	while (unit.m_threadContext.callStack.size() > callDepth)
+	{
+		unit.m_threadContext.callStack.pop();
+	}
+	return success;
+}
+template <bool Verbose, bool Budgeted, bool Profiling>
+ESETVMStatus EVMExecutionUnit::runLoop()
+{
+	// instrumentation hooks (trace, profilers) run only in profiling loops
+	const bool recordRegisters = Profiling && m_traceRing != nullptr && (m_traceWriter->getFlags() & TRACE_REGISTERS);
+	const size_t maxEmulatedInstructionCount = Budgeted ? m_maxEmulatedInstructionCount.value() : 0;
 	while (m_running)
 	{
-		const auto instructionResult = fetchInstruction();
+		const auto instructionResult = fetchInstruction<Verbose>();
 		if (!instructionResult.has_value())
 		{
 			return ESETVMStatus::FETCH_ERROR;
 		}
+		uint64_t timestamp {};
+		[[maybe_unused]] const size_t ip = m_threadContext.ip; // instruction index for the profiler, execution moves it
+		if constexpr (Profiling)
+		{
+			m_executedInstructions++;
+			if (m_traceRing != nullptr)
+			{
+				timestamp = m_traceWriter->getTimestamp();
+				traceInstruction(timestamp);
+			}
+			if (m_profile.has_value())
+			{
+				m_profile->beginInstruction(ip);
+			}
+			if (m_samples.has_value())
+			{
+				const uint32_t tick = EVMSampler::getTick();
+				if (m_samples->isSampleDue(tick))
+				{
+					m_samples->sample(tick, m_threadContext.callStack);
+				}
+			}
+		}
 		if (!executeInstruction(instructionResult.value()))
 		{
 			printCrashInfo();
 			return ESETVMStatus::EXECUTION_ERROR;
 		}
-		if (m_maxEmulatedInstructionCount.has_value())
+		if constexpr (Profiling)
 		{
-			m_emulatedInstructionCount++;
-			if (m_emulatedInstructionCount > m_maxEmulatedInstructionCount.value())
+			if (m_profile.has_value())
+			{
+				m_profile->endInstruction(ip);
+			}
+			if (recordRegisters)
+			{
+				traceRegisters(timestamp);
+			}
+		}
+		if constexpr (Budgeted)
+		{
+			if (++m_emulatedInstructionCount > maxEmulatedInstructionCount)
 			{
 				return ESETVMStatus::EMULATION_INS_NUM_EXCEEDED;
 			}
@@ -92,9 +324,39 @@ ESETVMStatus EVMExecutionUnit::run()
 	}
 	return ESETVMStatus::SUCCESS;
 }
+void EVMExecutionUnit::traceInstruction(uint64_t timestamp)
+{
+	EVMTraceRecord record {};
+	record.timestamp = timestamp;
+	record.location = static_cast<uint32_t>(m_threadContext.ip);
+	record.threadId = m_traceRing->getThreadId();
+	record.type = EVMTraceRecordType::INSTRUCTION;
+	record.callDepth = static_cast<uint8_t>(std::min<size_t>(m_threadContext.callStack.size(), UINT8_MAX));
+	m_tracedCallDepth = record.callDepth; // register changes are shown at the level of the instruction that made them
+	m_traceRing->push(record);
+}
+void EVMExecutionUnit::traceRegisters(uint64_t timestamp)
+{
+	for (size_t i = 0; i < m_threadContext.registers.size(); i++)
+	{
+		if (m_threadContext.registers[i] == m_tracedRegisters[i])
+		{
+			continue;
+		}
+		m_tracedRegisters[i] = m_threadContext.registers[i];
+		EVMTraceRecord record {};
+		record.timestamp = timestamp;
+		record.value = static_cast<uint64_t>(m_threadContext.registers[i]);
+		record.location = static_cast<uint32_t>(i);
+		record.threadId = m_traceRing->getThreadId();
+		record.type = EVMTraceRecordType::REGISTER;
+		record.callDepth = m_tracedCallDepth;
+		m_traceRing->push(record);
+	}
+}
 std::optional<registerIntegerType> EVMExecutionUnit::readIntegerFromAddress(const size_t address, const MemoryAccessSize size)
 {
-	if (address >= m_memory.size())
+	if (address >= m_memory.size() || m_memory.size() - address < static_cast<size_t>(size))
 	{
 		std::cerr << "VM tries to read out of memory bounds" << std::endl;
 		return std::nullopt;
@@ -140,7 +402,7 @@ bool EVMExecutionUnit::saveDataAccess(registerIntegerType val, const DataAccess&
 		std::unique_lock l {writeMemoryMutex};
 			
 		size_t accessSize = static_cast<size_t>(da.accessSize);
-		if (static_cast<size_t>(regVal) > memory.size() - accessSize)
+		if (static_cast<size_t>(regVal) >= memory.size() || memory.size() - static_cast<size_t>(regVal) < accessSize)
 		{
 			std::cerr << "VM tries to write out of memory bounds" << std::endl;
 			return false;
@@ -157,12 +419,8 @@ void EVMExecutionUnit::printCrashInfo ()
 	
 	std::thread::id id = std::this_thread::get_id();
 	std::cerr << "Program crashed <thread: " << id << "> " << "at instruction: ";
-	const auto srcLine = m_disasm.getSourceCodeLineForIp(m_threadContext.ip);
-	if (!srcLine.has_value())
-	{
-		std::cerr << "unknown" << std::endl;
-	}
-	std::cerr << srcLine.value() << std::endl;
+	const auto srcLine = getCurrentSourceCodeLine();
+	std::cerr << srcLine.value_or("unknown") << std::endl;
 	for (size_t regIter = 0; regIter <m_threadContext.registers.size(); regIter++)
 	{
 		std::cerr << "R" << regIter << "= " << std::hex << std::setfill('0') << std::setw(sizeof(registerIntegerType) * 2) << m_threadContext.registers.at(regIter) << std::endl << std::dec;
@@ -170,7 +428,7 @@ void EVMExecutionUnit::printCrashInfo ()
 }
 bool EVMExecutionUnit::executeInstruction(const EVMInstruction& instruction)
 {
-	size_t nextIns = m_threadContext.ip + 1;
+	size_t nextIns = getNextIp();
 	switch (instruction.opcode)
 	{
 		case EVMOpcode::MOV:
@@ -435,14 +693,13 @@ bool EVMExecutionUnit::compare (const EVMInstruction& instruction)
 }
 std::optional<size_t> EVMExecutionUnit::jump(const EVMInstruction& instruction)
 {
-	uint32_t codeOffset = instruction.arguments.at(0).data.codeAddress;
-	const auto insNum = m_disasm.insNumFromCodeOff(codeOffset);
+	const auto insNum = resolveCodeAddress(instruction);
 	if (!insNum.has_value())
 	{
 		std::cerr << "Cannot find instruction to jump to" << std::endl;
 		return std::nullopt;
 	}
-	if (insNum.value() >= m_instructions.size())
+	if (!isValidIp(insNum.value()))
 	{
 		std::cerr << "VM tried to jump outside of code scope" << std::endl;
 		return std::nullopt;
@@ -468,7 +725,7 @@ std::optional<size_t> EVMExecutionUnit::jumpEqual(const EVMInstruction& instruct
 		}
 		return jumpResult.value();
 	}
-	return m_threadContext.ip + 1;
+	return getNextIp();
 }
 bool EVMExecutionUnit::read (const EVMInstruction& instruction)
 {	
@@ -480,42 +737,35 @@ bool EVMExecutionUnit::read (const EVMInstruction& instruction)
 	{
 		return false;
 	}
-	if (!m_binaryFile.is_open())
+	if (!m_fileCache.isOpen())
 	{
 		std::cerr << "Cannot open input binary file" << std::endl;
 		return false;
 	}
-	m_binaryFile.seekg(arg1.value());
-	if (m_binaryFile.bad())
+	if (arg1.value() < 0)
 	{
-		std::cerr << "VM tried to read from offset beyond file size" << std::endl;
-		m_binaryFile.close();
+		std::cerr << "VM tried to read from negative file offset" << std::endl;
 		return false;
 	}
 	if (static_cast<size_t>(arg2.value()) > m_memory.size() - static_cast<size_t>(arg3.value()))
 	{
 		std::cerr << "Out of bounds memory read <read opcode>" << std::endl;
-		m_binaryFile.close();
 		return false;
 	}
-	m_binaryFile.read(reinterpret_cast<char*>(m_memory.data() + arg3.value()), arg2.value());
-	if (m_binaryFile.bad())
+	const auto bytesRead = m_fileCache.read(arg1.value(), m_memory.data() + arg3.value(), arg2.value());
+	if (!bytesRead.has_value())
 	{
 		std::cerr << "Error while reading input binary file" << std::endl;
-		m_binaryFile.close();
 		return false;
 	}
-	if (!saveDataAccess(m_binaryFile.gcount(), instruction.arguments.at(3).data.dataAccess, m_threadContext.registers, m_memory))
+	if (!saveDataAccess(bytesRead.value(), instruction.arguments.at(3).data.dataAccess, m_threadContext.registers, m_memory))
 	{
-		m_binaryFile.close();
 		return false;
 	}
 	return true;
 }
 bool EVMExecutionUnit::write (const EVMInstruction& instruction)
 {
-	std::unique_lock l {writeFileMutex};
-
 	const auto arg1 = getDataAccess(instruction.arguments.at(0).data.dataAccess, m_threadContext.registers); // offset in output file
 	const auto arg2 = getDataAccess(instruction.arguments.at(1).data.dataAccess, m_threadContext.registers); // number of bytes to write
 	const auto arg3 = getDataAccess(instruction.arguments.at(2).data.dataAccess, m_threadContext.registers); // memory address from which bytes will be written
@@ -524,29 +774,24 @@ bool EVMExecutionUnit::write (const EVMInstruction& instruction)
 	{
 		return false;
 	}
-	if (!m_binaryFile.is_open())
+	if (!m_fileCache.isOpen())
 	{
 		std::cerr << "Cannot open output binary file" << std::endl;
 		return false;
 	}
-	m_binaryFile.seekp(arg1.value(), std::ios::beg); // should write zeros if beyond filesize
-	if (m_binaryFile.bad())
+	if (arg1.value() < 0)
 	{
-		std::cerr << "Error while writing data to binary file" << std::endl;
-		m_binaryFile.close();
+		std::cerr << "VM tried to write to negative file offset" << std::endl;
 		return false;
 	}
 	if (static_cast<size_t>(arg2.value()) > m_memory.size() - static_cast<size_t>(arg3.value()))
 	{
 		std::cerr << "Out of bounds memory read <write opcode>" << std::endl;
-		m_binaryFile.close();
 		return false;
 	}
-	m_binaryFile.write(reinterpret_cast<char*>(m_memory.data() + arg3.value()), arg2.value());
-	if (m_binaryFile.bad())
+	if (!m_fileCache.write(arg1.value(), m_memory.data() + arg3.value(), arg2.value()))
 	{
 		std::cerr << "Error while writing to output binary file" << std::endl;
-		m_binaryFile.close();
 		return false;
 	}
 	return true;
@@ -556,6 +801,10 @@ bool EVMExecutionUnit::consoleRead(const EVMInstruction& instruction)
 	std::unique_lock l {consoleReadMutex};
 	registerIntegerType val {};
 	std::cin >> std::hex >> val;
+	if (m_stats != nullptr)
+	{
+		m_stats->consoleRead();
+	}
 	if (!saveDataAccess(val, instruction.arguments.at(0).data.dataAccess, m_threadContext.registers, m_memory))
 	{
 		return false;
@@ -575,12 +824,15 @@ bool EVMExecutionUnit::consoleWrite(const EVMInstruction& instruction)
 	registerIntegerType val = daResult.value();
 	
 	std::cout << std::hex << std::setfill('0') << std::setw(sizeof(val) * 2) << daResult.value() << std::endl << std::dec;
+	if (m_stats != nullptr)
+	{
+		m_stats->consoleWritten(sizeof(val) * 2 + 1);
+	}
 	return true;
 }
 bool EVMExecutionUnit::createThread(const EVMInstruction& instruction)
 {
-	uint32_t codeOffset = instruction.arguments.at(0).data.codeAddress;
-	const auto insNum = m_disasm.insNumFromCodeOff(codeOffset);
+	const auto insNum = resolveCodeAddress(instruction);
 	if (!insNum.has_value())
 	{
 		return false;
@@ -594,7 +846,7 @@ bool EVMExecutionUnit::createThread(const EVMInstruction& instruction)
 	{
 		EVMContext newContext {m_threadContext};
 		newContext.ip = insNum.value();
-		EVMExecutionUnit executionUnit {m_instructions, m_memory, m_disasm, newContext, m_mutices, m_binaryFile, m_verbose, m_maxEmulatedInstructionCount, m_emulatedInstructionCount};
+		EVMExecutionUnit executionUnit {m_shared, newContext};
 		initPromise.set_value();
 		executionUnit.run();
 	});
@@ -643,7 +895,7 @@ bool EVMExecutionUnit::sleep(const EVMInstruction& instruction)
 }
 std::optional<size_t> EVMExecutionUnit::call(const EVMInstruction &instruction)
 {
-	if (m_threadContext.ip + 1 > m_instructions.size())
+	if (m_blockCache == nullptr && m_threadContext.ip + 1 > m_instructions.size())
 	{
 		std::cerr << "There is no next instruction to jump back" << std::endl;
 		return std::nullopt;
@@ -658,7 +910,7 @@ std::optional<size_t> EVMExecutionUnit::call(const EVMInstruction &instruction)
 		std::cerr << "Stack overflow" << std::endl;
 		return std::nullopt;
 	}
-	m_threadContext.callStack.push(m_threadContext.ip + 1);
+	m_threadContext.callStack.push(getNextIp());
 	return jumpResult.value();
 }
 std::optional<size_t> EVMExecutionUnit::ret()
@@ -670,7 +922,7 @@ std::optional<size_t> EVMExecutionUnit::ret()
 	}
 	size_t retInsOff = m_threadContext.callStack.top();
 	m_threadContext.callStack.pop();
-	if (retInsOff >= m_instructions.size())
+	if (!isValidIp(retInsOff))
 	{
 		std::cerr << "Ret tried to jump to non-existent instruction" << std::endl;
 		return std::nullopt;
@@ -694,19 +946,45 @@ bool EVMExecutionUnit::lock(const EVMInstruction &instruction)
 			std::cerr << "VM tried to lock the same mutex twice" << std::endl;
 			return false;
 		}
-		mutex->lock();
+		if (m_lockStats.has_value())
+		{
+			lockProfiled(*mutex, mutexObj.value(), instruction);
+		}
+		else
+		{
+			mutex->lock();
+		}
 		m_currentOwnedMutices.insert(mutex);
 	}
 	else
 	{
 		std::unique_lock l {muticesMutex};
 		auto mutex = std::make_shared<std::mutex>();
-		mutex->lock();
+		if (m_lockStats.has_value())
+		{
+			lockProfiled(*mutex, mutexObj.value(), instruction);
+		}
+		else
+		{
+			mutex->lock();
+		}
 		m_mutices.emplace(mutexObj.value(), mutex);
 		m_currentOwnedMutices.insert(mutex);
 	}
 	return true;
 }
+void EVMExecutionUnit::lockProfiled(std::mutex& mutex, registerIntegerType lockId, const EVMInstruction& instruction)
+{
+	// uncontended acquisitions are not timed
+	if (mutex.try_lock())
+	{
+		m_lockStats->acquired(lockId, instruction.offset, false, {});
+		return;
+	}
+	const auto waitStart = std::chrono::steady_clock::now();
+	mutex.lock();
+	m_lockStats->acquired(lockId, instruction.offset, true, std::chrono::steady_clock::now() - waitStart);
+}
 bool EVMExecutionUnit::unlock(const EVMInstruction &instruction)
 {
 	std::unique_lock l {unlockMutex};
@@ -721,6 +999,10 @@ bool EVMExecutionUnit::unlock(const EVMInstruction &instruction)
 		std::cerr << "Could not find mutex to unlock" << std::endl;
 		return false;
 	}
+	if (m_lockStats.has_value())
+	{
+		m_lockStats->released(mutexObj.value());
+	}
 	m_mutices.at(mutexObj.value())->unlock();
 	m_currentOwnedMutices.erase(m_mutices.at(mutexObj.value()));
 	return true;
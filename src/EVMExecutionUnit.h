@@ -1,31 +1,61 @@
 #pragma once
 
 #include "ESETVM.h"
+#include "EVMBlockCache.h"
 #include "EVMDisasm.h"
+#include "EVMFileCache.h"
+#include "EVMLockProfiler.h"
+#include "EVMNativeProgram.h"
+#include "EVMProfiler.h"
+#include "EVMSampler.h"
+#include "EVMStats.h"
+#include "EVMTrace.h"
 #include "EVMTypes.h"
+#include <array>
 #include <chrono>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <inttypes.h>
+#include <span>
 #include <stack>
 #include <thread>
 #include <vector>
 
 using registerIntegerType = int64_t;
 
+// state shared by all guest threads of one program run
+struct EVMSharedState
+{
+	std::span<const EVMInstruction> instructions;
+	std::vector<uint8_t>& memory;
+	const EVMDisasm& disasm;
+	EVMBlockCache* blockCache; // set when code is decoded on demand, instruction pointers are code offsets then
+	std::unordered_map<registerIntegerType, std::shared_ptr<std::mutex>>& mutices;
+	EVMFileCache& fileCache;
+	bool verbose;
+	std::optional<size_t> maxEmulatedInstructionCount;
+	std::atomic<size_t>& emulatedInstructionCount;
+	EVMTraceWriter* traceWriter; // set when execution is traced
+	EVMProfiler* profiler; // set when execution is profiled, requires instructions decoded up front
+	EVMSampler* sampler; // set when call stacks are sampled, requires instructions decoded up front
+	EVMLockProfiler* lockProfiler; // set when guest lock contention is profiled
+	EVMStats* stats; // set when run metrics are collected
+	const EVMNativeProgram* nativeProgram; // set when program was compiled ahead of time from instructions
+};
+
 class EVMExecutionUnit
 {
 private:
 	static std::mutex printCrashMutex;
 	static std::mutex writeMemoryMutex;
-	static std::mutex writeFileMutex;
 	static std::mutex consoleReadMutex;
 	static std::mutex consoleWriteMutex;
 	static std::mutex verboseMutex;
 	static std::mutex muticesMutex;
 	static std::mutex interruptMutex;
 	static std::atomic<bool> interrupt;
+	static const size_t Block_Lookup_Cache_Size = 64;
 	
 	std::mutex unlockMutex {};
 	std::mutex joinMutex {};
@@ -33,22 +63,55 @@ private:
 	std::optional<size_t> m_maxEmulatedInstructionCount{};
 	std::atomic<size_t>& m_emulatedInstructionCount;
 	
+	EVMSharedState& m_shared;
 	EVMContext m_threadContext;
 	
 	bool m_running {};
 	bool m_verbose {};
 	
-	const std::vector<EVMInstruction>& m_instructions;
+	std::span<const EVMInstruction> m_instructions;
 	std::vector<uint8_t>& m_memory;
 	const EVMDisasm& m_disasm;
-	std::fstream& m_binaryFile;
+	EVMFileCache& m_fileCache;
+	EVMBlockCache* m_blockCache;
+	
+	const EVMBasicBlock* m_currentBlock {};
+	size_t m_currentBlockIndex {};
+	std::array<const EVMBasicBlock*, Block_Lookup_Cache_Size> m_blockLookupCache {};
+	
+	EVMTraceWriter* m_traceWriter;
+	EVMTraceRing* m_traceRing {};
+	std::vector<registerIntegerType> m_tracedRegisters {}; // register values as last recorded in the trace
+	uint8_t m_tracedCallDepth {};
+	
+	EVMProfiler* m_profiler;
+	std::optional<EVMThreadProfile> m_profile {};
+	EVMSampler* m_sampler;
+	std::optional<EVMThreadSamples> m_samples {};
+	EVMLockProfiler* m_lockProfiler;
+	std::optional<EVMThreadLockStats> m_lockStats {};
+	EVMStats* m_stats;
+	uint32_t m_statsThreadNumber {};
+	uint64_t m_executedInstructions {}; // counted by profiling loops only
 	
 	std::unordered_map<registerIntegerType, std::thread> m_threads {};
 	std::unordered_map<registerIntegerType, std::shared_ptr<std::mutex>>& m_mutices;
 	std::set<std::shared_ptr<std::mutex>> m_currentOwnedMutices {};
 	
+	template <bool Verbose, bool Budgeted, bool Profiling>
+	ESETVMStatus runLoop();
+	ESETVMStatus runNative();
+	static int executeFromNative(EVMNativeRuntime* runtime, uint32_t instruction);
+	template <bool Verbose>
 	std::optional<std::reference_wrapper<const EVMInstruction>> fetchInstruction();
+	const EVMInstruction* fetchFromBlockCache();
+	size_t getNextIp() const;
+	bool isValidIp(size_t ip) const;
+	std::optional<size_t> resolveCodeAddress(const EVMInstruction& instruction) const; // target of the code address argument
+	std::optional<std::string> getCurrentSourceCodeLine() const;
 	bool executeInstruction(const EVMInstruction& instruction);
+	void traceInstruction(uint64_t timestamp);
+	void traceRegisters(uint64_t timestamp);
 	std::optional<registerIntegerType> readIntegerFromAddress(size_t address, MemoryAccessSize size);
 	std::optional<registerIntegerType> getDataAccess(const DataAccess& da, const std::vector<registerIntegerType>& registers);
 	bool saveDataAccess(registerIntegerType val, const DataAccess& da, std::vector<registerIntegerType>& registers, std::vector<uint8_t>& memory);
@@ -70,10 +133,11 @@ private:
 	std::optional<size_t> call (const EVMInstruction& instruction);
 	std::optional<size_t> ret ();
 	bool lock (const EVMInstruction& instruction);
+	void lockProfiled (std::mutex& mutex, registerIntegerType lockId, const EVMInstruction& instruction);
 	bool unlock (const EVMInstruction& instruction);
 	
 public:
-	EVMExecutionUnit(const std::vector<EVMInstruction>& instructions, std::vector<uint8_t>& memory, const EVMDisasm& disasm, EVMContext context, std::unordered_map<registerIntegerType, std::shared_ptr<std::mutex>>& mutices, std::fstream& binaryFile, bool verbose, std::optional<size_t> maxEmulatedInstructionCount, std::atomic<size_t>& emulatedInstructionCount);
+	EVMExecutionUnit(EVMSharedState& shared, EVMContext context);
 	~EVMExecutionUnit();
 	ESETVMStatus run();
 };
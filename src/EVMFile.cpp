@@ -1,64 +1,135 @@
 #include "EVMFile.h"
 
-EVMFile::EVMFile(std::string filePath)
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define EVM_FILE_MMAP_SUPPORTED
+#endif
+
+EVMFile::EVMFile(std::string filePath, EVMFileLoadMode loadMode)
+{
+	init(filePath, loadMode);
+}
+EVMFile::~EVMFile()
 {
-	init(filePath);
+	unmapFile();
 }
-void EVMFile::init(std::string filePath)
+void EVMFile::init(std::string filePath, EVMFileLoadMode loadMode)
 {
-	m_fileHandle.open(filePath, std::ios::binary);
-	if (!m_fileHandle.is_open())
+	unmapFile();
+	m_loadMode = loadMode;
+#ifndef EVM_FILE_MMAP_SUPPORTED
+	m_loadMode = EVMFileLoadMode::STREAM;
+#endif
+	const bool loaded = m_loadMode == EVMFileLoadMode::MAPPED ? mapFile(filePath) : readFile(filePath);
+	if (!loaded)
+	{
+		return;
+	}
+	if (!parseFile())
 	{
-		m_error = ESETVMStatus::FILE_OPEN_ERROR;
 		return;
 	}
-	m_fileSize = utils::getFileSize(m_fileHandle);
+}
+bool EVMFile::readFile(const std::string& filePath)
+{
+	std::ifstream fileHandle {filePath, std::ios::binary};
+	if (!fileHandle.is_open())
+	{
+		m_error = ESETVMStatus::FILE_OPEN_ERROR;
+		return false;
+	}
+	m_fileSize = utils::getFileSize(fileHandle);
 	if (m_fileSize > Max_Input_File_Size)
 	{
 		m_error = ESETVMStatus::FILE_TOO_BIG;
-		return;
+		return false;
 	}
-	if (!parseFile())
+	m_fileBuffer.resize(m_fileSize);
+	fileHandle.read(reinterpret_cast<char*>(m_fileBuffer.data()), m_fileSize);
+	if (fileHandle.fail())
 	{
-		return;
+		m_error = ESETVMStatus::FILE_READ_ERROR;
+		return false;
 	}
+	m_fileBytes = m_fileBuffer;
+	return true;
 }
-bool EVMFile::parseFile()
+bool EVMFile::mapFile(const std::string& filePath)
 {
-	m_fileHandle.read(reinterpret_cast<char*>(&m_header), sizeof(m_header));
-	if (m_fileHandle.fail()) 
+#ifdef EVM_FILE_MMAP_SUPPORTED
+	int fd = open(filePath.c_str(), O_RDONLY);
+	if (fd < 0)
 	{
+		m_error = ESETVMStatus::FILE_OPEN_ERROR;
+		return false;
+	}
+	struct stat fileStat {};
+	if (fstat(fd, &fileStat) != 0)
+	{
+		close(fd);
 		m_error = ESETVMStatus::FILE_READ_ERROR;
 		return false;
 	}
-	if (memcmp(m_header.magic, EVM_Magic, sizeof(m_header.magic)))
+	m_fileSize = static_cast<size_t>(fileStat.st_size);
+	if (m_fileSize > Max_Input_File_Size)
 	{
-		m_error = ESETVMStatus::NOT_EVM_FILE;
+		close(fd);
+		m_error = ESETVMStatus::FILE_TOO_BIG;
 		return false;
 	}
-	if (m_header.dataSize < m_header.initialDataSize || static_cast<size_t>(m_header.codeSize) + static_cast<size_t>(m_header.initialDataSize) + sizeof(m_header) != m_fileSize)
+	if (m_fileSize == 0)
 	{
-		m_error = ESETVMStatus::FILE_CORRUPTED;
+		close(fd);
+		m_error = ESETVMStatus::FILE_READ_ERROR;
 		return false;
 	}
-
-	m_codeBytes.resize(m_header.codeSize);
-	m_dataBytes.resize(m_header.initialDataSize);
-
-	m_fileHandle.read(reinterpret_cast<char*>(m_codeBytes.data()), m_header.codeSize);
-	if (m_fileHandle.fail())
+	void* mapping = mmap(nullptr, m_fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // mapping keeps its own reference to the file
+	if (mapping == MAP_FAILED)
 	{
 		m_error = ESETVMStatus::FILE_READ_ERROR;
 		return false;
 	}
-	if (m_header.initialDataSize > 0)
+	madvise(mapping, m_fileSize, MADV_SEQUENTIAL);
+	m_mapping = mapping;
+	m_fileBytes = {static_cast<const std::byte*>(mapping), m_fileSize};
+	return true;
+#else
+	return readFile(filePath);
+#endif
+}
+void EVMFile::unmapFile()
+{
+#ifdef EVM_FILE_MMAP_SUPPORTED
+	if (m_mapping != nullptr)
 	{
-		m_fileHandle.read(reinterpret_cast<char*>(m_dataBytes.data()), m_header.initialDataSize);
-		if (m_fileHandle.fail())
-		{
-			m_error = ESETVMStatus::FILE_READ_ERROR;
-			return false;
-		}
+		munmap(m_mapping, m_fileSize);
+		m_mapping = nullptr;
+	}
+#endif
+}
+bool EVMFile::parseFile()
+{
+	if (m_fileBytes.size() < sizeof(m_header))
+	{
+		m_error = ESETVMStatus::FILE_READ_ERROR;
+		return false;
+	}
+	memcpy(&m_header, m_fileBytes.data(), sizeof(m_header));
+	if (memcmp(m_header.magic, EVM_Magic, sizeof(m_header.magic)))
+	{
+		m_error = ESETVMStatus::NOT_EVM_FILE;
+		return false;
+	}
+	if (m_header.dataSize < m_header.initialDataSize || static_cast<size_t>(m_header.codeSize) + static_cast<size_t>(m_header.initialDataSize) + sizeof(m_header) != m_fileSize)
+	{
+		m_error = ESETVMStatus::FILE_CORRUPTED;
+		return false;
 	}
+	m_codeBytes = m_fileBytes.subspan(sizeof(m_header), m_header.codeSize);
+	m_dataBytes = m_fileBytes.subspan(sizeof(m_header) + m_header.codeSize, m_header.initialDataSize);
 	return true;
 }
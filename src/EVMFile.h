@@ -5,8 +5,16 @@
 #include <cstring>
 #include <fstream>
 #include <inttypes.h>
+#include <span>
+#include <string>
 #include <vector>
 
+enum class EVMFileLoadMode
+{
+	STREAM, // whole file is read into memory
+	MAPPED // file is mapped read only, views point directly into the mapping
+};
+
 class EVMFile
 {
 private:
@@ -23,24 +31,36 @@ private:
 	};
 #pragma pack()
 
-	std::ifstream m_fileHandle {};
+	EVMFileLoadMode m_loadMode {EVMFileLoadMode::MAPPED};
 	size_t m_fileSize {};
 	EVMHeader m_header{};
 	ESETVMStatus m_error {ESETVMStatus::SUCCESS};
-	std::vector<std::byte> m_codeBytes {};
-	std::vector<std::byte> m_dataBytes {};
+	std::vector<std::byte> m_fileBuffer {}; // STREAM mode storage
+	void* m_mapping {}; // MAPPED mode storage
+	std::span<const std::byte> m_fileBytes {};
+	std::span<const std::byte> m_codeBytes {};
+	std::span<const std::byte> m_dataBytes {};
 
+	bool readFile(const std::string& filePath);
+	bool mapFile(const std::string& filePath);
+	void unmapFile();
 	bool parseFile();
 public:
 	EVMFile() = default;
-	EVMFile(std::string filePath);
-	void init(std::string filePath);
+	EVMFile(std::string filePath, EVMFileLoadMode loadMode = EVMFileLoadMode::MAPPED);
+	EVMFile(const EVMFile&) = delete;
+	EVMFile& operator=(const EVMFile&) = delete;
+	~EVMFile();
+	void init(std::string filePath, EVMFileLoadMode loadMode = EVMFileLoadMode::MAPPED);
 
 	ESETVMStatus getError() const { return m_error; }
-	std::vector<std::byte> getCodeBytes() const { return m_codeBytes; }
-	std::vector<std::byte> getDataBytes() const { return m_dataBytes; }
+	EVMFileLoadMode getLoadMode() const { return m_loadMode; }
+	// views are valid as long as EVMFile object lives
+	std::span<const std::byte> getFileBytes() const { return m_fileBytes; }
+	std::span<const std::byte> getHeaderBytes() const { return m_fileBytes.first(std::min(m_fileBytes.size(), sizeof(EVMHeader))); }
+	std::span<const std::byte> getCodeBytes() const { return m_codeBytes; }
+	std::span<const std::byte> getDataBytes() const { return m_dataBytes; }
 	uint32_t getInitialDataSize() const { return m_header.initialDataSize; }
 	uint32_t getcodeSize() const{ return m_header.codeSize; }
 	uint32_t getDataSize() const{ return m_header.dataSize; }
 };
-
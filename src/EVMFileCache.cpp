@@ -0,0 +1,173 @@
+#include "EVMFileCache.h"
+
+EVMFileCache::EVMFileCache(std::fstream& file, size_t maxDirtyBytes):
+m_file(file),
+m_maxDirtyBytes(maxDirtyBytes)
+{
+	if (m_file.is_open())
+	{
+		m_file.seekg(0, std::ios::end);
+		const auto end = m_file.tellg();
+		m_fileSize = end < 0 ? 0 : static_cast<uint64_t>(end);
+		m_file.clear();
+	}
+}
+EVMFileCache::~EVMFileCache()
+{
+	flush();
+}
+std::optional<size_t> EVMFileCache::read(uint64_t offset, uint8_t* destination, size_t count)
+{
+	std::unique_lock l {m_mutex};
+	if (!isOpen())
+	{
+		return std::nullopt;
+	}
+	m_stats.guestReads++;
+	const uint64_t logicalSize = std::max(m_fileSize, m_dirtyEnd);
+	if (offset >= logicalSize || count == 0)
+	{
+		return 0;
+	}
+	const size_t bytesToRead = static_cast<size_t>(std::min<uint64_t>(count, logicalSize - offset));
+	const size_t bytesInFile = offset < m_fileSize ? static_cast<size_t>(std::min<uint64_t>(bytesToRead, m_fileSize - offset)) : 0;
+	if (bytesInFile > 0)
+	{
+		m_file.clear();
+		m_file.seekg(offset);
+		m_file.read(reinterpret_cast<char*>(destination), bytesInFile);
+		m_stats.fileReads++;
+		if (m_file.bad() || static_cast<size_t>(m_file.gcount()) != bytesInFile)
+		{
+			return std::nullopt;
+		}
+	}
+	std::fill(destination + bytesInFile, destination + bytesToRead, 0); // not yet flushed area behind end of file
+
+	// overlay dirty bytes which are not in the file yet
+	const uint64_t end = offset + bytesToRead;
+	for (auto it = m_pages.lower_bound(offset / Page_Size); it != m_pages.end() && it->first * Page_Size < end; it++)
+	{
+		const uint64_t pageBegin = it->first * Page_Size;
+		const size_t from = static_cast<size_t>(std::max(pageBegin, offset) - pageBegin);
+		const size_t to = static_cast<size_t>(std::min(pageBegin + Page_Size, end) - pageBegin);
+		for (size_t i = from; i < to; i++)
+		{
+			if (it->second->dirty[i])
+			{
+				destination[pageBegin + i - offset] = it->second->data[i];
+			}
+		}
+	}
+	m_stats.bytesRead += bytesToRead;
+	return bytesToRead;
+}
+bool EVMFileCache::write(uint64_t offset, const uint8_t* source, size_t count)
+{
+	std::unique_lock l {m_mutex};
+	if (!isOpen())
+	{
+		return false;
+	}
+	const uint64_t end = offset + count;
+	while (offset < end)
+	{
+		const uint64_t pageIndex = offset / Page_Size;
+		const size_t inPage = static_cast<size_t>(offset % Page_Size);
+		const size_t chunk = static_cast<size_t>(std::min<uint64_t>(end - offset, Page_Size - inPage));
+
+		auto& page = m_pages[pageIndex];
+		if (!page)
+		{
+			page = std::make_unique<Page>();
+		}
+		std::copy(source, source + chunk, page->data.begin() + inPage);
+		for (size_t i = inPage; i < inPage + chunk; i++)
+		{
+			if (!page->dirty[i])
+			{
+				page->dirty[i] = true;
+				m_dirtyBytes++;
+			}
+		}
+		source += chunk;
+		offset += chunk;
+	}
+	m_dirtyEnd = std::max(m_dirtyEnd, end);
+	m_stats.guestWrites++;
+	m_stats.bytesWritten += count;
+	if (m_dirtyBytes >= m_maxDirtyBytes)
+	{
+		return flushUnlocked();
+	}
+	return true;
+}
+bool EVMFileCache::flush()
+{
+	std::unique_lock l {m_mutex};
+	return flushUnlocked();
+}
+bool EVMFileCache::flushUnlocked()
+{
+	if (m_pages.empty() || !isOpen())
+	{
+		return true;
+	}
+	std::vector<uint8_t> run {};
+	uint64_t runOffset {};
+	for (const auto& [pageIndex, page] : m_pages)
+	{
+		size_t i = 0;
+		while (i < Page_Size)
+		{
+			if (!page->dirty[i])
+			{
+				i++;
+				continue;
+			}
+			const size_t runBegin = i;
+			while (i < Page_Size && page->dirty[i])
+			{
+				i++;
+			}
+			const uint64_t absoluteOffset = pageIndex * Page_Size + runBegin;
+			if (!run.empty() && runOffset + run.size() != absoluteOffset)
+			{
+				if (!writeRun(runOffset, run))
+				{
+					return false;
+				}
+				run.clear();
+			}
+			if (run.empty())
+			{
+				runOffset = absoluteOffset;
+			}
+			run.insert(run.end(), page->data.begin() + runBegin, page->data.begin() + i);
+		}
+	}
+	if (!run.empty() && !writeRun(runOffset, run))
+	{
+		return false;
+	}
+	m_pages.clear();
+	m_dirtyBytes = 0;
+	m_fileSize = std::max(m_fileSize, m_dirtyEnd);
+	m_dirtyEnd = 0;
+	m_file.flush();
+	m_stats.fileFlushes++;
+	return !m_file.bad();
+}
+EVMFileCache::EVMFileCacheStats EVMFileCache::getStats()
+{
+	std::unique_lock l {m_mutex};
+	return m_stats;
+}
+bool EVMFileCache::writeRun(uint64_t offset, const std::vector<uint8_t>& run)
+{
+	m_file.clear();
+	m_file.seekp(offset, std::ios::beg); // writes zeros if beyond file size
+	m_file.write(reinterpret_cast<const char*>(run.data()), run.size());
+	m_stats.fileWrites++;
+	return !m_file.fail();
+}
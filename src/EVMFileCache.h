@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <fstream>
+#include <inttypes.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Write-behind cache between guest read/write opcodes and the binary file.
+// Writes are kept in page sized buffers with per byte dirty bits, reads see dirty data,
+// and everything is written back in offset order with adjacent runs merged into single writes.
+class EVMFileCache
+{
+public:
+	static constexpr size_t Page_Size = 4096;
+	static constexpr size_t Default_Max_Dirty_Bytes = 16ULL * 1024ULL * 1024ULL; // 16 MB
+
+	struct EVMFileCacheStats
+	{
+		uint64_t guestReads {};
+		uint64_t guestWrites {};
+		uint64_t bytesRead {}; // returned to guest
+		uint64_t bytesWritten {}; // accepted from guest
+		uint64_t fileReads {}; // read, write and flush calls issued to the file
+		uint64_t fileWrites {};
+		uint64_t fileFlushes {};
+	};
+
+private:
+	struct Page
+	{
+		std::array<uint8_t, Page_Size> data {};
+		std::bitset<Page_Size> dirty {};
+	};
+
+	std::fstream& m_file;
+	std::mutex m_mutex {};
+	std::map<uint64_t, std::unique_ptr<Page>> m_pages {}; // ordered by page index so flush writes sequentially
+	size_t m_maxDirtyBytes {};
+	size_t m_dirtyBytes {};
+	uint64_t m_fileSize {};
+	uint64_t m_dirtyEnd {};
+	EVMFileCacheStats m_stats {};
+
+	bool flushUnlocked();
+	bool writeRun(uint64_t offset, const std::vector<uint8_t>& run);
+
+public:
+	EVMFileCache(std::fstream& file, size_t maxDirtyBytes = Default_Max_Dirty_Bytes);
+	~EVMFileCache();
+
+	bool isOpen() const { return m_file.is_open(); }
+	std::optional<size_t> read(uint64_t offset, uint8_t* destination, size_t count);
+	bool write(uint64_t offset, const uint8_t* source, size_t count);
+	bool flush();
+	EVMFileCacheStats getStats();
+};
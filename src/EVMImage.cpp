@@ -0,0 +1,210 @@
+#include "EVMImage.h"
+#include "EVMDisasm.h"
+#include "utils.h"
+#include <random>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define EVM_IMAGE_MMAP_SUPPORTED
+#endif
+
+static_assert(std::is_trivially_copyable_v<EVMInstruction>, "instructions are stored in images as raw bytes");
+
+EVMImage::~EVMImage()
+{
+	unmapImage();
+}
+std::string EVMImage::getImagePath(const std::string& cacheDirectory, uint64_t sourceHash)
+{
+	std::stringstream ss;
+	ss << std::hex << std::setw(16) << std::setfill('0') << sourceHash << ".evmimg";
+	return (std::filesystem::path {cacheDirectory} / ss.str()).string();
+}
+bool EVMImage::load(const std::string& imagePath, uint64_t sourceHash, uint64_t sourceSize, uint64_t codeBitSize)
+{
+	unmapImage();
+	m_imageBuffer.clear();
+	m_loaded = false;
+	if (!mapImage(imagePath))
+	{
+		return false;
+	}
+	std::span<const std::byte> image {m_mapping != nullptr ? static_cast<const std::byte*>(m_mapping) : m_imageBuffer.data(), m_imageSize};
+	if (!validate(image, sourceHash, sourceSize, codeBitSize))
+	{
+		unmapImage();
+		m_imageBuffer.clear();
+		return false;
+	}
+	m_loaded = true;
+	return true;
+}
+bool EVMImage::mapImage(const std::string& imagePath)
+{
+#ifdef EVM_IMAGE_MMAP_SUPPORTED
+	int fd = open(imagePath.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat fileStat {};
+	if (fstat(fd, &fileStat) != 0 || fileStat.st_size < static_cast<off_t>(sizeof(EVMImageHeader)) || fileStat.st_size > Max_Image_File_Size)
+	{
+		close(fd);
+		return false;
+	}
+	m_imageSize = static_cast<size_t>(fileStat.st_size);
+	void* mapping = mmap(nullptr, m_imageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		return false;
+	}
+	m_mapping = mapping;
+	return true;
+#else
+	std::ifstream imageFile {imagePath, std::ios::binary};
+	if (!imageFile.is_open())
+	{
+		return false;
+	}
+	std::streamsize imageSize = utils::getFileSize(imageFile);
+	if (imageSize < static_cast<std::streamsize>(sizeof(EVMImageHeader)) || imageSize > Max_Image_File_Size)
+	{
+		return false;
+	}
+	m_imageSize = static_cast<size_t>(imageSize);
+	m_imageBuffer.resize(m_imageSize);
+	imageFile.read(reinterpret_cast<char*>(m_imageBuffer.data()), m_imageSize);
+	return !imageFile.fail();
+#endif
+}
+void EVMImage::unmapImage()
+{
+#ifdef EVM_IMAGE_MMAP_SUPPORTED
+	if (m_mapping != nullptr)
+	{
+		munmap(m_mapping, m_imageSize);
+		m_mapping = nullptr;
+	}
+#endif
+	m_instructions = {};
+	m_instructionOffsets = {};
+	m_initialData = {};
+}
+bool EVMImage::validate(std::span<const std::byte> image, uint64_t sourceHash, uint64_t sourceSize, uint64_t codeBitSize)
+{
+	EVMImageHeader header {};
+	memcpy(&header, image.data(), sizeof(header));
+	if (memcmp(header.magic, Image_Magic, sizeof(header.magic)) || header.version != Image_Version || header.instructionSize != sizeof(EVMInstruction))
+	{
+		return false;
+	}
+	if (header.sourceHash != sourceHash || header.sourceSize != sourceSize || header.codeBitSize != codeBitSize || header.imageSize != image.size())
+	{
+		return false; // stale
+	}
+	if (utils::hashBytes(image.subspan(sizeof(header))) != header.contentHash)
+	{
+		return false; // damaged
+	}
+	const uint64_t instructionsSize = header.instructionCount * sizeof(EVMInstruction);
+	const uint64_t instructionOffsetsSize = header.instructionCount * sizeof(uint32_t);
+	if (header.instructionCount > codeBitSize ||
+		header.instructionsOffset != alignSection(sizeof(header)) ||
+		header.instructionOffsetsOffset != alignSection(header.instructionsOffset + instructionsSize) ||
+		header.initialDataOffset != alignSection(header.instructionOffsetsOffset + instructionOffsetsSize) ||
+		header.initialDataOffset + header.initialDataSize != image.size())
+	{
+		return false;
+	}
+	m_instructions = {reinterpret_cast<const EVMInstruction*>(image.data() + header.instructionsOffset), header.instructionCount};
+	m_instructionOffsets = {reinterpret_cast<const uint32_t*>(image.data() + header.instructionOffsetsOffset), header.instructionCount};
+	m_initialData = image.subspan(header.initialDataOffset, header.initialDataSize);
+	// image is trusted only as far as the decoder would be, so every instruction is checked before it gets executed
+	for (size_t i = 0; i < m_instructions.size(); i++)
+	{
+		const EVMInstruction& instruction = m_instructions[i];
+		if (instruction.offset != m_instructionOffsets[i] || (i > 0 && m_instructionOffsets[i - 1] >= instruction.offset) || instruction.offset >= codeBitSize)
+		{
+			return false;
+		}
+		if (!EVMDisasm::isValidInstruction(instruction))
+		{
+			return false;
+		}
+		if (instruction.target != EVMInstruction::Unresolved_Target && instruction.target >= m_instructions.size())
+		{
+			return false;
+		}
+	}
+	return true;
+}
+bool EVMImage::write(const std::string& imagePath, uint64_t sourceHash, uint64_t sourceSize, uint64_t codeBitSize, std::span<const EVMInstruction> instructions, std::span<const std::byte> initialData)
+{
+	EVMImageHeader header {};
+	memcpy(header.magic, Image_Magic, sizeof(header.magic));
+	header.version = Image_Version;
+	header.instructionSize = sizeof(EVMInstruction);
+	header.sourceHash = sourceHash;
+	header.sourceSize = sourceSize;
+	header.codeBitSize = codeBitSize;
+	header.instructionCount = instructions.size();
+	header.instructionsOffset = alignSection(sizeof(header));
+	header.instructionOffsetsOffset = alignSection(header.instructionsOffset + instructions.size_bytes());
+	header.initialDataOffset = alignSection(header.instructionOffsetsOffset + instructions.size() * sizeof(uint32_t));
+	header.initialDataSize = initialData.size();
+	header.imageSize = header.initialDataOffset + header.initialDataSize;
+
+	// image body is assembled in memory first, the header carries its hash
+	std::vector<std::byte> body (header.imageSize - sizeof(header));
+	auto placeSection = [&body](uint64_t offset, const void* data, size_t size)
+	{
+		if (size > 0)
+		{
+			memcpy(body.data() + offset - sizeof(EVMImageHeader), data, size);
+		}
+	};
+	placeSection(header.instructionsOffset, instructions.data(), instructions.size_bytes());
+	for (size_t i = 0; i < instructions.size(); i++)
+	{
+		placeSection(header.instructionOffsetsOffset + i * sizeof(uint32_t), &instructions[i].offset, sizeof(uint32_t));
+	}
+	placeSection(header.initialDataOffset, initialData.data(), initialData.size());
+	header.contentHash = utils::hashBytes(body);
+
+	std::error_code error {};
+	std::filesystem::path path {imagePath};
+	if (std::filesystem::create_directories(path.parent_path(), error))
+	{
+		std::filesystem::permissions(path.parent_path(), std::filesystem::perms::owner_all, error); // native code is cached here as well, see EVMNativeProgram::isCached
+	}
+	// written aside and renamed, so concurrent runs never map a partially written image
+	std::filesystem::path temporaryPath {path};
+	temporaryPath += ".tmp" + std::to_string(std::random_device {}());
+	{
+		std::ofstream imageFile {temporaryPath, std::ios::binary | std::ios::trunc};
+		if (!imageFile.is_open())
+		{
+			return false;
+		}
+		imageFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		imageFile.write(reinterpret_cast<const char*>(body.data()), body.size());
+		if (imageFile.fail())
+		{
+			imageFile.close();
+			std::filesystem::remove(temporaryPath, error);
+			return false;
+		}
+	}
+	std::filesystem::rename(temporaryPath, path, error);
+	if (error)
+	{
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "EVMTypes.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <inttypes.h>
+#include <span>
+#include <string>
+#include <vector>
+
+// pre-decoded program stored on disk, mapped and used in place of bit level decoding on later runs
+// layout: header, linked instructions, instruction code offsets (sorted), initial data; sections are aligned to Section_Alignment
+class EVMImage
+{
+private:
+	static constexpr char Image_Magic[] = "EVM-IMG1";
+	static const uint32_t Image_Version = 2; // bump whenever EVMInstruction layout or section layout changes
+	static const size_t Section_Alignment = 64;
+	static constexpr long long Max_Image_File_Size = 4096LL * 1024LL * 1024LL;
+
+	struct EVMImageHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t instructionSize;
+		uint64_t sourceHash;
+		uint64_t sourceSize;
+		uint64_t codeBitSize;
+		uint64_t instructionCount;
+		uint64_t instructionsOffset;
+		uint64_t instructionOffsetsOffset;
+		uint64_t initialDataOffset;
+		uint64_t initialDataSize;
+		uint64_t imageSize;
+		uint64_t contentHash; // of everything following the header
+	};
+
+	size_t m_imageSize {};
+	std::vector<std::byte> m_imageBuffer {}; // used when mapping is not supported
+	void* m_mapping {};
+	std::span<const EVMInstruction> m_instructions {};
+	std::span<const uint32_t> m_instructionOffsets {};
+	std::span<const std::byte> m_initialData {};
+	bool m_loaded {};
+
+	bool mapImage(const std::string& imagePath);
+	void unmapImage();
+	bool validate(std::span<const std::byte> image, uint64_t sourceHash, uint64_t sourceSize, uint64_t codeBitSize);
+	static uint64_t alignSection(uint64_t offset) { return (offset + Section_Alignment - 1) / Section_Alignment * Section_Alignment; }
+public:
+	EVMImage() = default;
+	EVMImage(const EVMImage&) = delete;
+	EVMImage& operator=(const EVMImage&) = delete;
+	~EVMImage();
+
+	static std::string getImagePath(const std::string& cacheDirectory, uint64_t sourceHash);
+	// false when image is missing, was built from different input or fails validation, image must be rebuilt then
+	bool load(const std::string& imagePath, uint64_t sourceHash, uint64_t sourceSize, uint64_t codeBitSize);
+	static bool write(const std::string& imagePath, uint64_t sourceHash, uint64_t sourceSize, uint64_t codeBitSize, std::span<const EVMInstruction> instructions, std::span<const std::byte> initialData);
+
+	bool isLoaded() const { return m_loaded; }
+	// views are valid as long as EVMImage object lives
+	std::span<const EVMInstruction> getInstructions() const { return m_instructions; }
+	std::span<const uint32_t> getInstructionOffsets() const { return m_instructionOffsets; }
+	std::span<const std::byte> getInitialData() const { return m_initialData; }
+};
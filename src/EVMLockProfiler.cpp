@@ -0,0 +1,142 @@
+#include "EVMLockProfiler.h"
+
+void EVMLockStats::merge(const EVMLockStats& other)
+{
+	acquisitions += other.acquisitions;
+	contended += other.contended;
+	totalWaitNs += other.totalWaitNs;
+	maxWaitNs = std::max(maxWaitNs, other.maxWaitNs);
+	totalHoldNs += other.totalHoldNs;
+	for (const auto& [offset, site] : other.sites)
+	{
+		EVMAcquireSite& mergedSite = sites[offset];
+		mergedSite.acquisitions += site.acquisitions;
+		mergedSite.contended += site.contended;
+		mergedSite.waitNs += site.waitNs;
+	}
+}
+
+void EVMThreadLockStats::acquired(int64_t lockId, uint32_t siteOffset, bool contended, std::chrono::steady_clock::duration wait)
+{
+	const uint64_t waitNs = getNanoseconds(wait);
+	EVMLockStats& stats = m_locks[lockId];
+	stats.acquisitions++;
+	stats.contended += contended;
+	stats.totalWaitNs += waitNs;
+	stats.maxWaitNs = std::max(stats.maxWaitNs, waitNs);
+	EVMLockStats::EVMAcquireSite& site = stats.sites[siteOffset];
+	site.acquisitions++;
+	site.contended += contended;
+	site.waitNs += waitNs;
+	m_acquired[lockId] = std::chrono::steady_clock::now();
+}
+void EVMThreadLockStats::released(int64_t lockId)
+{
+	const auto acquired = m_acquired.find(lockId);
+	if (acquired == m_acquired.end())
+	{
+		return; // not locked by this thread
+	}
+	m_locks[lockId].totalHoldNs += getNanoseconds(std::chrono::steady_clock::now() - acquired->second);
+	m_acquired.erase(acquired);
+}
+
+void EVMLockProfiler::merge(const EVMThreadLockStats& stats)
+{
+	std::unique_lock l {m_mergeMutex};
+	for (const auto& [lockId, lockStats] : stats.m_locks)
+	{
+		m_locks[lockId].merge(lockStats);
+	}
+}
+std::vector<std::pair<int64_t, const EVMLockStats*>> EVMLockProfiler::getSortedLocks() const
+{
+	std::vector<std::pair<int64_t, const EVMLockStats*>> locks {};
+	for (const auto& [lockId, stats] : m_locks)
+	{
+		locks.emplace_back(lockId, &stats);
+	}
+	std::sort(locks.begin(), locks.end(), [](const auto& a, const auto& b)
+	{
+		if (a.second->totalWaitNs != b.second->totalWaitNs)
+		{
+			return a.second->totalWaitNs > b.second->totalWaitNs;
+		}
+		return a.second->acquisitions != b.second->acquisitions ? a.second->acquisitions > b.second->acquisitions : a.first < b.first;
+	});
+	return locks;
+}
+std::vector<std::pair<uint32_t, EVMLockStats::EVMAcquireSite>> EVMLockProfiler::getSortedSites(const EVMLockStats& stats)
+{
+	std::vector<std::pair<uint32_t, EVMLockStats::EVMAcquireSite>> sites {stats.sites.begin(), stats.sites.end()};
+	std::sort(sites.begin(), sites.end(), [](const auto& a, const auto& b)
+	{
+		if (a.second.waitNs != b.second.waitNs)
+		{
+			return a.second.waitNs > b.second.waitNs;
+		}
+		return a.second.acquisitions != b.second.acquisitions ? a.second.acquisitions > b.second.acquisitions : a.first < b.first;
+	});
+	return sites;
+}
+void EVMLockProfiler::writeReport(const EVMDisasm& disasm, std::ostream& output) const
+{
+	uint64_t acquisitions = 0;
+	uint64_t contended = 0;
+	for (const auto& [lockId, stats] : m_locks)
+	{
+		acquisitions += stats.acquisitions;
+		contended += stats.contended;
+	}
+	std::stringstream ss;
+	ss << "Lock profile: " << m_locks.size() << " locks, " << acquisitions << " acquisitions, " << contended << " contended" << std::endl;
+	ss << std::endl << std::setw(18) << "lock" << std::setw(14) << "acquisitions" << std::setw(11) << "contended"
+		<< std::setw(16) << "wait total ns" << std::setw(14) << "wait max ns" << std::setw(16) << "hold total ns" << std::endl;
+	for (const auto& [lockId, stats] : getSortedLocks())
+	{
+		std::stringstream lockName;
+		lockName << "0x" << std::hex << static_cast<uint64_t>(lockId);
+		ss << std::setw(18) << lockName.str() << std::setw(14) << stats->acquisitions << std::setw(11) << stats->contended
+			<< std::setw(16) << stats->totalWaitNs << std::setw(14) << stats->maxWaitNs << std::setw(16) << stats->totalHoldNs << std::endl;
+		const auto sites = getSortedSites(*stats);
+		for (size_t i = 0; i < sites.size() && i < Report_Site_Count; i++)
+		{
+			const auto& [offset, site] = sites[i];
+			const auto index = disasm.insNumFromCodeOff(offset);
+			ss << std::setw(18) << ("@" + (index.has_value() ? std::to_string(index.value()) : std::string {"?"})) << std::setw(14) << site.acquisitions
+				<< std::setw(11) << site.contended << std::setw(16) << site.waitNs << "  offset " << offset;
+			if (index.has_value())
+			{
+				ss << "  " << disasm.getSourceCodeLineForIp(index.value()).value_or("");
+			}
+			ss << std::endl;
+		}
+	}
+	output << ss.str();
+}
+void EVMLockProfiler::writeJson(const EVMDisasm& disasm, std::ostream& output) const
+{
+	std::string json {"{\"locks\": ["};
+	bool firstLock = true;
+	for (const auto& [lockId, stats] : getSortedLocks())
+	{
+		json += firstLock ? "\n" : ",\n";
+		json += "{\"id\": " + std::to_string(lockId) + ", \"acquisitions\": " + std::to_string(stats->acquisitions) +
+			", \"contended\": " + std::to_string(stats->contended) + ", \"totalWaitNs\": " + std::to_string(stats->totalWaitNs) +
+			", \"maxWaitNs\": " + std::to_string(stats->maxWaitNs) + ", \"totalHoldNs\": " + std::to_string(stats->totalHoldNs) + ", \"sites\": [";
+		bool firstSite = true;
+		for (const auto& [offset, site] : getSortedSites(*stats))
+		{
+			const auto index = disasm.insNumFromCodeOff(offset);
+			json += firstSite ? "" : ", ";
+			json += "{\"offset\": " + std::to_string(offset) + ", \"index\": " + (index.has_value() ? std::to_string(index.value()) : std::string {"null"}) +
+				", \"acquisitions\": " + std::to_string(site.acquisitions) + ", \"contended\": " + std::to_string(site.contended) +
+				", \"waitNs\": " + std::to_string(site.waitNs) + "}";
+			firstSite = false;
+		}
+		json += "]}";
+		firstLock = false;
+	}
+	json += "]}\n";
+	output << json;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "EVMDisasm.h"
+#include "EVMTypes.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <inttypes.h>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// statistics of one guest lock id
+struct EVMLockStats
+{
+	struct EVMAcquireSite
+	{
+		uint64_t acquisitions {};
+		uint64_t contended {};
+		uint64_t waitNs {};
+	};
+
+	uint64_t acquisitions {};
+	uint64_t contended {}; // acquisitions that had to wait for another thread
+	uint64_t totalWaitNs {};
+	uint64_t maxWaitNs {};
+	uint64_t totalHoldNs {};
+	std::unordered_map<uint32_t, EVMAcquireSite> sites {}; // by code offset of the lock instruction
+
+	void merge(const EVMLockStats& other);
+};
+
+// lock statistics of one guest thread, owned by its execution unit and merged into the profiler when the thread exits
+class EVMThreadLockStats
+{
+private:
+	std::unordered_map<int64_t, EVMLockStats> m_locks {};
+	std::unordered_map<int64_t, std::chrono::steady_clock::time_point> m_acquired {}; // locks held by this thread
+
+	friend class EVMLockProfiler;
+public:
+	static uint64_t getNanoseconds(std::chrono::steady_clock::duration duration) { return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(); }
+	void acquired(int64_t lockId, uint32_t siteOffset, bool contended, std::chrono::steady_clock::duration wait);
+	void released(int64_t lockId);
+};
+
+// guest lock contention: acquisitions, waits and hold times per lock id and acquire site of all guest threads of a run
+class EVMLockProfiler
+{
+private:
+	static const size_t Report_Site_Count = 3; // hottest acquire sites listed per lock
+
+	std::mutex m_mergeMutex {};
+	std::unordered_map<int64_t, EVMLockStats> m_locks {};
+
+	std::vector<std::pair<int64_t, const EVMLockStats*>> getSortedLocks() const; // most waited for first
+	static std::vector<std::pair<uint32_t, EVMLockStats::EVMAcquireSite>> getSortedSites(const EVMLockStats& stats);
+public:
+	void merge(const EVMThreadLockStats& stats);
+	const std::unordered_map<int64_t, EVMLockStats>& getLocks() const { return m_locks; }
+	// threads must have exited, disasm provides instruction numbers and source lines when code was decoded up front
+	void writeReport(const EVMDisasm& disasm, std::ostream& output) const;
+	void writeJson(const EVMDisasm& disasm, std::ostream& output) const;
+};
@@ -0,0 +1,467 @@
+#include "EVMNativeProgram.h"
+#include "utils.h"
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define EVM_NATIVE_SUPPORTED
+#endif
+
+// Runtime part of every translated program. Memory accesses that the interpreter would reject are left to it, so
+// loads and stores only report whether they are in bounds.
+static const char* const Runtime_Source = R"(#include <stdint.h>
+#include <string.h>
+
+typedef struct evm_native_runtime
+{
+	int64_t* registers;
+	uint8_t* memory;
+	uint64_t memorySize;
+	uint32_t* returnPoints;
+	int64_t maxDepth;
+	uint32_t depth;
+	uint32_t ip;
+	int (*execute)(struct evm_native_runtime* runtime, uint32_t instruction);
+	void* unit;
+} evm_native_runtime;
+
+enum { EVM_RETURNED, EVM_HALTED, EVM_FAILED, EVM_FETCH_FAILED, EVM_STACK_OVERFLOW, EVM_LEFT };
+
+#define EVM_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define EVM_CONSTANT(x) ((int64_t)UINT64_C(x))
+#define EVM_SPILL() (R[0] = r0, R[1] = r1, R[2] = r2, R[3] = r3, R[4] = r4, R[5] = r5, R[6] = r6, R[7] = r7, R[8] = r8, R[9] = r9, R[10] = r10, R[11] = r11, R[12] = r12, R[13] = r13, R[14] = r14, R[15] = r15)
+#define EVM_RELOAD() (r0 = R[0], r1 = R[1], r2 = R[2], r3 = R[3], r4 = R[4], r5 = R[5], r6 = R[6], r7 = R[7], r8 = R[8], r9 = R[9], r10 = R[10], r11 = R[11], r12 = R[12], r13 = R[13], r14 = R[14], r15 = R[15])
+#define EVM_LOCALS int64_t* const R = rt->registers; int64_t r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15; int64_t a, b; EVM_RELOAD()
+/* interpreter executes the instruction, native code continues at next */
+#define EVM_EXECUTE(instruction, next) do { EVM_SPILL(); rt->depth = depth; if (!rt->execute(rt, instruction)) return EVM_FAILED; EVM_RELOAD(); goto next; } while (0)
+/* interpreter executes an instruction that cannot succeed and reports why */
+#define EVM_FAIL(instruction) do { EVM_SPILL(); rt->depth = depth; rt->execute(rt, instruction); return EVM_FAILED; } while (0)
+#define EVM_STOP(instruction, status) do { EVM_SPILL(); rt->ip = instruction; return status; } while (0)
+
+static inline int evm_load(const evm_native_runtime* rt, int64_t address, unsigned size, int64_t* value)
+{
+	if (EVM_UNLIKELY((uint64_t)address >= rt->memorySize || rt->memorySize - (uint64_t)address < size))
+	{
+		return 0;
+	}
+	const uint8_t* p = rt->memory + address;
+	switch (size)
+	{
+		case 1: { *value = p[0]; break; }
+		case 2: { uint16_t v; memcpy(&v, p, 2); *value = v; break; }
+		case 4: { uint32_t v; memcpy(&v, p, 4); *value = v; break; }
+		default: { uint64_t v; memcpy(&v, p, 8); *value = (int64_t)v; break; }
+	}
+	return 1;
+}
+static inline int evm_store(const evm_native_runtime* rt, int64_t address, unsigned size, int64_t value)
+{
+	if (EVM_UNLIKELY((uint64_t)address >= rt->memorySize || rt->memorySize - (uint64_t)address < size))
+	{
+		return 0;
+	}
+	memcpy(rt->memory + address, &value, size);
+	return 1;
+}
+)";
+
+static std::string getLabel(size_t instruction, size_t count)
+{
+	return instruction < count ? "i" + std::to_string(instruction) : "fetch_failed";
+}
+static std::string getRegister(const DataAccess& access)
+{
+	return "r" + std::to_string(access.registerIndex);
+}
+static std::string quoteShellArgument(const std::string& argument)
+{
+	std::string quoted {"'"};
+	for (const char c : argument)
+	{
+		quoted += c == '\'' ? std::string {"'\\''"} : std::string {c};
+	}
+	return quoted + "'";
+}
+
+void EVMNativeProgram::translate(std::span<const EVMInstruction> instructions, std::ostream& output)
+{
+	EVMControlFlowGraph graph {};
+	graph.build(instructions);
+	writeSource(instructions, graph, output);
+}
+void EVMNativeProgram::writeSource(std::span<const EVMInstruction> instructions, const EVMControlFlowGraph& graph, std::ostream& output)
+{
+	const size_t count = instructions.size();
+	const auto& blocks = graph.getBlocks();
+	const auto& functions = graph.getFunctions();
+	std::vector<uint32_t> functionAt(blocks.size(), EVMControlFlowGraph::No_Block);
+	for (uint32_t function = 0; function < functions.size(); function++)
+	{
+		functionAt[functions[function].entry] = function;
+	}
+	// return points past the end of code are only possible after a call in the last instruction
+	const bool checkReturnPoints = count > 0 && instructions[count - 1].opcode == EVMOpcode::CALL;
+
+	output << Runtime_Source << '\n';
+	for (size_t function = 0; function < functions.size(); function++)
+	{
+		output << "static uint32_t f" << function << "(evm_native_runtime* rt, uint32_t depth);\n";
+	}
+	std::vector<bool> emitted(blocks.size());
+	std::vector<uint32_t> worklist {};
+	for (size_t function = 0; function < functions.size(); function++)
+	{
+		// blocks reachable within the function, a block shared by several functions is emitted in each of them
+		std::fill(emitted.begin(), emitted.end(), false);
+		worklist.assign(1, functions[function].entry);
+		emitted[functions[function].entry] = true;
+		while (!worklist.empty())
+		{
+			const uint32_t block = worklist.back();
+			worklist.pop_back();
+			for (const uint32_t successor : graph.getSuccessors(block))
+			{
+				if (!emitted[successor])
+				{
+					emitted[successor] = true;
+					worklist.push_back(successor);
+				}
+			}
+		}
+		output << "\nstatic uint32_t f" << function << "(evm_native_runtime* rt, uint32_t depth)\n{\n\tEVM_LOCALS;\n";
+		output << "\tgoto " << getLabel(blocks[functions[function].entry].begin, count) << ";\n";
+		bool fetchFailed = false;
+		for (uint32_t block = 0; block < blocks.size(); block++)
+		{
+			if (!emitted[block])
+			{
+				continue;
+			}
+			for (uint32_t i = blocks[block].begin; i < blocks[block].end; i++)
+			{
+				const EVMInstruction& instruction = instructions[i];
+				const std::string next = getLabel(i + 1, count);
+				fetchFailed = fetchFailed || i + 1 == count;
+				const auto load = [&](size_t argument, const char* variable, const std::string& slowPath)
+				{
+					const DataAccess& access = instruction.arguments.at(argument).data.dataAccess;
+					if (access.type == DataAccessType::REGISTER)
+					{
+						output << '\t' << variable << " = " << getRegister(access) << ";\n";
+						return;
+					}
+					output << "\tif (EVM_UNLIKELY(!evm_load(rt, " << getRegister(access) << ", " << static_cast<unsigned>(access.accessSize) << ", &" << variable << "))) " << slowPath << ";\n";
+				};
+				const auto store = [&](size_t argument, const std::string& value)
+				{
+					const DataAccess& access = instruction.arguments.at(argument).data.dataAccess;
+					if (access.type == DataAccessType::REGISTER)
+					{
+						output << '\t' << getRegister(access) << " = " << value << ";\n";
+						return;
+					}
+					output << "\tif (EVM_UNLIKELY(!evm_store(rt, " << getRegister(access) << ", " << static_cast<unsigned>(access.accessSize) << ", " << value << "))) EVM_EXECUTE(" << i << "u, " << next << ");\n";
+				};
+				const std::string execute = "EVM_EXECUTE(" + std::to_string(i) + "u, " + next + ")";
+				const std::string fail = "EVM_FAIL(" + std::to_string(i) + "u)";
+				const bool hasTarget = instruction.target < count;
+				output << getLabel(i, count) << ":\n";
+				switch (instruction.opcode)
+				{
+					case EVMOpcode::MOV:
+						load(0, "a", execute);
+						store(1, "a");
+						break;
+					case EVMOpcode::LOADCONST:
+						output << "\ta = EVM_CONSTANT(0x" << std::hex << static_cast<uint64_t>(instruction.arguments.at(0).data.constant) << std::dec << ");\n";
+						store(1, "a");
+						break;
+					case EVMOpcode::ADD:
+					case EVMOpcode::SUB:
+					case EVMOpcode::MUL:
+					{
+						const char operation = instruction.opcode == EVMOpcode::ADD ? '+' : instruction.opcode == EVMOpcode::SUB ? '-' : '*';
+						load(0, "a", execute);
+						load(1, "b", execute);
+						output << "\ta = (int64_t)((uint64_t)a " << operation << " (uint64_t)b);\n"; // wraps like the interpreter does
+						store(2, "a");
+						break;
+					}
+					case EVMOpcode::DIV:
+					case EVMOpcode::MOD:
+						load(0, "a", execute);
+						load(1, "b", execute);
+						output << "\tif (EVM_UNLIKELY(b == 0 || (a == INT64_MIN && b == -1))) " << execute << ";\n";
+						output << "\ta = a " << (instruction.opcode == EVMOpcode::DIV ? '/' : '%') << " b;\n";
+						store(2, "a");
+						break;
+					case EVMOpcode::COMPARE:
+						load(0, "a", execute);
+						load(1, "b", execute);
+						output << "\ta = a == b ? 0 : (a < b ? -1 : 1);\n";
+						store(2, "a");
+						break;
+					case EVMOpcode::JUMP:
+						output << '\t' << (hasTarget ? "goto " + getLabel(instruction.target, count) : fail) << ";\n";
+						break;
+					case EVMOpcode::JUMPEQUAL:
+						load(1, "a", fail);
+						load(2, "b", fail);
+						output << "\tif (a == b) " << (hasTarget ? "goto " + getLabel(instruction.target, count) : fail) << ";\n";
+						break;
+					case EVMOpcode::CALL:
+						if (!hasTarget)
+						{
+							output << '\t' << fail << ";\n";
+							break;
+						}
+						output << "\tif (EVM_UNLIKELY((int64_t)depth > rt->maxDepth)) EVM_STOP(" << i << "u, EVM_STACK_OVERFLOW);\n";
+						output << "\trt->returnPoints[depth] = " << i + 1 << "u;\n";
+						output << "\tEVM_SPILL();\n";
+						output << "\tif ((a = f" << functionAt[graph.getBlockOf(instruction.target)] << "(rt, depth + 1)) != EVM_RETURNED) return (uint32_t)a;\n";
+						output << "\tEVM_RELOAD();\n";
+						break;
+					case EVMOpcode::RET:
+						output << "\tif (depth == 0) EVM_STOP(" << i << "u, EVM_LEFT);\n";
+						if (checkReturnPoints)
+						{
+							output << "\tif (EVM_UNLIKELY(rt->returnPoints[depth - 1] >= " << count << "u)) " << fail << ";\n";
+						}
+						output << "\tEVM_SPILL();\n\treturn EVM_RETURNED;\n";
+						break;
+					case EVMOpcode::HLT:
+						output << "\tEVM_SPILL();\n\treturn EVM_HALTED;\n";
+						break;
+					case EVMOpcode::READ:
+					case EVMOpcode::WRITE:
+					case EVMOpcode::CONSOLEREAD:
+					case EVMOpcode::CONSOLEWRITE:
+					case EVMOpcode::CREATETHREAD:
+					case EVMOpcode::JOINTHREAD:
+					case EVMOpcode::SLEEP:
+					case EVMOpcode::LOCK:
+					case EVMOpcode::UNLOCK:
+						output << '\t' << execute << ";\n";
+						break;
+					default:
+						break; // interpreter skips unknown instructions as well
+				}
+			}
+			// blocks are emitted in code order, so only falling through to a block that was not emitted right after needs a jump
+			const EVMOpcode last = instructions[blocks[block].end - 1].opcode;
+			const bool fallsThrough = last != EVMOpcode::JUMP && last != EVMOpcode::RET && last != EVMOpcode::HLT;
+			if (fallsThrough && (block + 1 == blocks.size() || !emitted[block + 1]))
+			{
+				output << "\tgoto " << getLabel(blocks[block].end, count) << ";\n";
+			}
+		}
+		if (fetchFailed)
+		{
+			output << "fetch_failed:\n\tEVM_STOP(" << count << "u, EVM_FETCH_FAILED);\n";
+		}
+		output << "}\n";
+	}
+	output << "\nuint32_t evm_native_run(evm_native_runtime* rt, uint32_t instruction)\n{\n\tswitch (instruction)\n\t{\n";
+	for (size_t function = 0; function < functions.size(); function++)
+	{
+		output << "\t\tcase " << blocks[functions[function].entry].begin << "u: return f" << function << "(rt, 0);\n";
+	}
+	output << "\t}\n\trt->ip = instruction;\n\treturn EVM_LEFT;\n}\n";
+}
+std::string EVMNativeProgram::getCompiler()
+{
+	const char* compiler = std::getenv("CC");
+	return compiler != nullptr && *compiler != '\0' ? compiler : "cc";
+}
+bool EVMNativeProgram::compile(const std::string& compiler, const std::string& sourcePath, const std::string& libraryPath, bool verbose)
+{
+	// compiler diagnostics never reach guest output on stdout
+	const std::string command = compiler + " " + Compiler_Flags + " -o " + quoteShellArgument(libraryPath) + " " + quoteShellArgument(sourcePath) + (verbose ? " 1>&2" : " >/dev/null 2>&1");
+	return std::system(command.c_str()) == 0 && std::filesystem::exists(libraryPath);
+}
+static std::optional<std::string> readFile(const std::filesystem::path& path)
+{
+	std::ifstream file {path, std::ios::binary};
+	if (!file.is_open())
+	{
+		return std::nullopt;
+	}
+	return std::string {std::istreambuf_iterator<char> {file}, std::istreambuf_iterator<char> {}};
+}
+// written aside and renamed, so concurrent runs never read a partially written file
+static bool replaceFile(const std::filesystem::path& path, const std::string& bytes)
+{
+	std::error_code error {};
+	std::filesystem::path temporaryPath {path};
+	temporaryPath += ".tmp" + std::to_string(std::random_device {}());
+	{
+		std::ofstream file {temporaryPath, std::ios::binary | std::ios::trunc};
+		file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+		if (!file.good())
+		{
+			file.close();
+			std::filesystem::remove(temporaryPath, error);
+			return false;
+		}
+	}
+	std::filesystem::permissions(temporaryPath, std::filesystem::perms::group_write | std::filesystem::perms::others_write, std::filesystem::perm_options::remove, error);
+	if (!error)
+	{
+		std::filesystem::rename(temporaryPath, path, error);
+	}
+	if (error)
+	{
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+	return true;
+}
+// C source a cached library was compiled from, headed by the hash of the library bytes
+static std::filesystem::path getSourcePath(const std::filesystem::path& cachedPath)
+{
+	std::filesystem::path sourcePath {cachedPath};
+	return sourcePath.replace_extension(".c");
+}
+static std::string getCachedSource(const std::string& library, const std::string& sourceText)
+{
+	std::ostringstream cachedSource;
+	cachedSource << "/* library xxh64 " << std::hex << std::setw(16) << std::setfill('0') << utils::hashBytes(std::as_bytes(std::span {library})) << " */\n" << sourceText;
+	return cachedSource.str();
+}
+// only the user running the VM can replace it: owned by them and not writable by group or others
+static bool isPrivate(const std::filesystem::path& path, bool directory)
+{
+#ifdef EVM_NATIVE_SUPPORTED
+	struct stat pathStat {};
+	// the cache directory may be reached through a link, files in it may not
+	if ((directory ? stat(path.c_str(), &pathStat) : lstat(path.c_str(), &pathStat)) != 0)
+	{
+		return false;
+	}
+	const bool expectedType = directory ? S_ISDIR(pathStat.st_mode) : S_ISREG(pathStat.st_mode);
+	return expectedType && pathStat.st_uid == geteuid() && (pathStat.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+#else
+	return false;
+#endif
+}
+bool EVMNativeProgram::storeLibrary(const std::filesystem::path& libraryPath, const std::filesystem::path& cachedPath, const std::string& sourceText)
+{
+	std::error_code error {};
+	if (std::filesystem::create_directories(cachedPath.parent_path(), error))
+	{
+		std::filesystem::permissions(cachedPath.parent_path(), std::filesystem::perms::owner_all, error); // see isCached
+	}
+	const auto library = readFile(libraryPath);
+	// until the source is replaced as well, a new library does not match its source and is not loaded
+	return library.has_value() && replaceFile(cachedPath, library.value()) && replaceFile(getSourcePath(cachedPath), getCachedSource(library.value(), sourceText));
+}
+bool EVMNativeProgram::isCached(const std::filesystem::path& cachedPath, const std::string& sourceText)
+{
+	// dlopen runs code of the library at once, so everything is checked before: a library is used only when nobody else
+	// can have replaced it and it is the one compiled from this source, not a stale one, a foreign one or a hash collision
+	const std::filesystem::path sourcePath = getSourcePath(cachedPath);
+	if (!isPrivate(cachedPath.parent_path(), true) || !isPrivate(cachedPath, false) || !isPrivate(sourcePath, false))
+	{
+		return false;
+	}
+	const auto library = readFile(cachedPath);
+	const auto cachedSource = readFile(sourcePath);
+	return library.has_value() && cachedSource.has_value() && cachedSource.value() == getCachedSource(library.value(), sourceText);
+}
+bool EVMNativeProgram::load(const std::string& libraryPath)
+{
+#ifdef EVM_NATIVE_SUPPORTED
+	void* library = dlopen(libraryPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (library == nullptr)
+	{
+		return false;
+	}
+	void* entry = dlsym(library, Entry_Symbol);
+	if (entry == nullptr)
+	{
+		dlclose(library);
+		return false;
+	}
+	m_library = library;
+	m_entry = reinterpret_cast<EntryFunction>(entry);
+	return true;
+#else
+	return false;
+#endif
+}
+EVMNativeProgram::~EVMNativeProgram()
+{
+#ifdef EVM_NATIVE_SUPPORTED
+	if (m_library != nullptr)
+	{
+		dlclose(m_library);
+	}
+#endif
+}
+bool EVMNativeProgram::build(std::span<const EVMInstruction> instructions, const std::string& cacheDirectory, bool verbose)
+{
+#ifdef EVM_NATIVE_SUPPORTED
+	const std::string compiler = getCompiler();
+	EVMControlFlowGraph graph {};
+	graph.build(instructions);
+	std::ostringstream source;
+	writeSource(instructions, graph, source);
+	source << "/* " << compiler << ' ' << Compiler_Flags << " */\n"; // compiler takes part in the cache key
+	const std::string sourceText = source.str();
+	std::stringstream libraryName;
+	libraryName << std::hex << std::setw(16) << std::setfill('0') << utils::hashBytes(std::as_bytes(std::span {sourceText})) << ".so";
+
+	std::error_code error {};
+	const std::filesystem::path cachedPath = cacheDirectory.empty() ? std::filesystem::path {} : std::filesystem::path {cacheDirectory} / libraryName.str();
+	const bool cached = !cachedPath.empty() && std::filesystem::exists(cachedPath, error);
+	bool loaded = cached && isCached(cachedPath, sourceText) && load(cachedPath.string());
+	if (cached && !loaded && verbose)
+	{
+		std::cerr << "Cached native code " << cachedPath.string() << " does not match program or can be changed by other users, it is compiled again" << std::endl;
+	}
+	if (!loaded)
+	{
+		const std::filesystem::path workDirectory = std::filesystem::temp_directory_path(error) / ("esetvm-native-" + std::to_string(std::random_device {}()));
+		const std::filesystem::path sourcePath = workDirectory / "program.c";
+		const std::filesystem::path libraryPath = workDirectory / libraryName.str();
+		if (error || !std::filesystem::create_directories(workDirectory, error))
+		{
+			return false;
+		}
+		{
+			std::ofstream sourceFile {sourcePath, std::ios::trunc};
+			sourceFile << sourceText;
+		}
+		if (compile(compiler, sourcePath.string(), libraryPath.string(), verbose))
+		{
+			if (!cachedPath.empty() && !storeLibrary(libraryPath, cachedPath, sourceText))
+			{
+				std::cerr << "Could not write native code to " << cachedPath.string() << std::endl; // not fatal, program still runs natively
+			}
+			loaded = load(libraryPath.string()); // stays mapped after its file is removed
+		}
+		std::filesystem::remove_all(workDirectory, error);
+	}
+	if (!loaded)
+	{
+		return false;
+	}
+	m_entries.assign(instructions.size(), false);
+	for (const auto& function : graph.getFunctions())
+	{
+		m_entries[graph.getBlocks()[function.entry].begin] = true;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "EVMControlFlowGraph.h"
+#include "EVMTypes.h"
+#include <filesystem>
+#include <inttypes.h>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+// state passed between the interpreter and translated code, layout is repeated in the C source of every program
+struct EVMNativeRuntime
+{
+	int64_t* registers; // guest registers of the thread, up to date whenever the interpreter is called
+	uint8_t* memory;
+	uint64_t memorySize;
+	uint32_t* returnPoints; // instruction following each call made by native code, indexed by native call depth
+	int64_t maxDepth; // calls made at a deeper native call depth overflow the guest stack
+	uint32_t depth; // native call depth of the instruction passed to execute
+	uint32_t ip; // instruction at which native code stopped
+	int (*execute)(EVMNativeRuntime* runtime, uint32_t instruction); // interpreter executes one instruction, 0 when it fails
+	void* unit;
+};
+
+// Ahead of time translation of a decoded program to C, compiled by the system C compiler ($CC or cc) into a shared
+// object that runs in place of the interpreter. Every guest function becomes one C function with guest registers as
+// locals and guest calls as C calls. File, console, thread and lock instructions, and instructions that would fail,
+// are executed by the interpreter through EVMNativeRuntime::execute, so output and error messages stay the same.
+class EVMNativeProgram
+{
+public:
+	enum class EVMNativeStatus : uint32_t
+	{
+		RETURNED, // guest ret, passed between native functions only
+		HALTED,
+		FAILED, // interpreter failed to execute an instruction and reported why
+		FETCH_FAILED, // execution ran past the end of code
+		STACK_OVERFLOW, // guest call at runtime ip
+		LEFT // guest ret with no native caller at runtime ip, interpreter continues there
+	};
+
+private:
+	using EntryFunction = uint32_t (*)(EVMNativeRuntime* runtime, uint32_t instruction);
+	static constexpr const char* Compiler_Flags = "-O2 -fPIC -shared -w";
+	static constexpr const char* Entry_Symbol = "evm_native_run";
+
+	void* m_library {};
+	EntryFunction m_entry {};
+	std::vector<bool> m_entries {}; // instructions at which native code can start, entries of guest functions
+
+	static void writeSource(std::span<const EVMInstruction> instructions, const EVMControlFlowGraph& graph, std::ostream& output);
+	static std::string getCompiler();
+	static bool compile(const std::string& compiler, const std::string& sourcePath, const std::string& libraryPath, bool verbose);
+	static bool storeLibrary(const std::filesystem::path& libraryPath, const std::filesystem::path& cachedPath, const std::string& sourceText);
+	static bool isCached(const std::filesystem::path& cachedPath, const std::string& sourceText);
+	bool load(const std::string& libraryPath);
+
+public:
+	EVMNativeProgram() = default;
+	EVMNativeProgram(const EVMNativeProgram&) = delete;
+	EVMNativeProgram& operator=(const EVMNativeProgram&) = delete;
+	~EVMNativeProgram();
+	static void translate(std::span<const EVMInstruction> instructions, std::ostream& output);
+	// false when program could not be compiled or loaded, it is interpreted then. When cacheDirectory is set, compiled
+	// programs are stored there by hash of their C source, next to that source, and reused when both still match.
+	bool build(std::span<const EVMInstruction> instructions, const std::string& cacheDirectory, bool verbose);
+	bool isLoaded() const { return m_entry != nullptr; }
+	bool canStartAt(size_t instruction) const { return instruction < m_entries.size() && m_entries[instruction]; }
+	EVMNativeStatus run(EVMNativeRuntime& runtime, size_t instruction) const { return static_cast<EVMNativeStatus>(m_entry(&runtime, static_cast<uint32_t>(instruction))); }
+};
@@ -0,0 +1,50 @@
+#include "EVMOffsetIndex.h"
+
+EVMOffsetIndex::EVMOffsetIndex(uint64_t bitCount)
+{
+	init(bitCount);
+}
+void EVMOffsetIndex::init(uint64_t bitCount)
+{
+	m_bitCount = bitCount;
+	m_count = 0;
+	m_words.assign((bitCount + 63) / 64, 0);
+	m_blockRanks.clear();
+}
+void EVMOffsetIndex::insert(uint64_t offset)
+{
+	if (offset >= m_bitCount)
+	{
+		return;
+	}
+	m_words[offset / 64] |= 1ULL << (offset % 64);
+}
+void EVMOffsetIndex::buildRanks()
+{
+	m_blockRanks.assign((m_words.size() + Words_Per_Rank_Block - 1) / Words_Per_Rank_Block, 0);
+	uint32_t rank = 0;
+	for (size_t i = 0; i < m_words.size(); i++)
+	{
+		if (i % Words_Per_Rank_Block == 0)
+		{
+			m_blockRanks[i / Words_Per_Rank_Block] = rank;
+		}
+		rank += std::popcount(m_words[i]);
+	}
+	m_count = rank;
+}
+std::optional<size_t> EVMOffsetIndex::rank(uint64_t offset) const
+{
+	if (!contains(offset))
+	{
+		return std::nullopt;
+	}
+	const size_t word = offset / 64;
+	const size_t block = word / Words_Per_Rank_Block;
+	size_t rank = m_blockRanks[block];
+	for (size_t i = block * Words_Per_Rank_Block; i < word; i++)
+	{
+		rank += std::popcount(m_words[i]);
+	}
+	return rank + std::popcount(m_words[word] & ((1ULL << (offset % 64)) - 1));
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <bit>
+#include <inttypes.h>
+#include <optional>
+#include <vector>
+
+// Set of code bit offsets stored as one bit per code bit with a rank directory.
+// rank of an offset is the number of offsets before it, so for instruction starts it is the instruction index.
+// Uses about code size / 8 bytes plus 1/16 of that for ranks, lookups are a few popcounts.
+class EVMOffsetIndex
+{
+private:
+	static const size_t Words_Per_Rank_Block = 8; // one rank entry per 512 bits
+
+	std::vector<uint64_t> m_words {};
+	std::vector<uint32_t> m_blockRanks {}; // set bits before each block
+	uint64_t m_bitCount {};
+	size_t m_count {};
+
+public:
+	EVMOffsetIndex() = default;
+	EVMOffsetIndex(uint64_t bitCount);
+	void init(uint64_t bitCount);
+	void insert(uint64_t offset); // offsets outside of the indexed range are ignored
+	void buildRanks(); // must be called after last insert and before rank()
+
+	bool contains(uint64_t offset) const
+	{
+		return offset < m_bitCount && (m_words[offset / 64] >> (offset % 64) & 1);
+	}
+	std::optional<size_t> rank(uint64_t offset) const; // nullopt if offset is not in the set
+	size_t size() const { return m_count; }
+	size_t getMemoryUsage() const { return m_words.capacity() * sizeof(uint64_t) + m_blockRanks.capacity() * sizeof(uint32_t); }
+};
@@ -0,0 +1,884 @@
+#include "EVMOptimizer.h"
+#include "EVMDisasm.h"
+#include <bit>
+#include <map>
+
+std::optional<size_t> EVMOptimizer::getDestinationArgument(EVMOpcode opcode)
+{
+	switch (opcode)
+	{
+		case EVMOpcode::MOV:
+		case EVMOpcode::LOADCONST:
+		case EVMOpcode::CREATETHREAD:
+			return 1;
+		case EVMOpcode::ADD:
+		case EVMOpcode::SUB:
+		case EVMOpcode::DIV:
+		case EVMOpcode::MOD:
+		case EVMOpcode::MUL:
+		case EVMOpcode::COMPARE:
+			return 2;
+		case EVMOpcode::READ:
+			return 3;
+		case EVMOpcode::CONSOLEREAD:
+			return 0;
+		default:
+			return std::nullopt;
+	}
+}
+std::optional<int64_t> EVMOptimizer::evaluate(const EVMInstruction& instruction, const RegisterConstants& constants)
+{
+	const auto value = [&](size_t argument) -> std::optional<int64_t>
+	{
+		const DataAccess& dataAccess = instruction.arguments[argument].data.dataAccess;
+		if (dataAccess.type != DataAccessType::REGISTER)
+		{
+			return std::nullopt; // memory may be changed by other threads
+		}
+		return constants[dataAccess.registerIndex];
+	};
+	if (instruction.opcode == EVMOpcode::LOADCONST)
+	{
+		return instruction.arguments[0].data.constant;
+	}
+	if (instruction.opcode == EVMOpcode::MOV)
+	{
+		return value(0);
+	}
+	if (getDestinationArgument(instruction.opcode) != 2)
+	{
+		return std::nullopt;
+	}
+	const auto first = value(0);
+	const auto second = value(1);
+	if (!first.has_value() || !second.has_value())
+	{
+		return std::nullopt;
+	}
+	// wrapping arithmetic as the interpreter does on two's complement hardware
+	const uint64_t a = static_cast<uint64_t>(first.value());
+	const uint64_t b = static_cast<uint64_t>(second.value());
+	switch (instruction.opcode)
+	{
+		case EVMOpcode::ADD:
+			return static_cast<int64_t>(a + b);
+		case EVMOpcode::SUB:
+			return static_cast<int64_t>(a - b);
+		case EVMOpcode::MUL:
+			return static_cast<int64_t>(a * b);
+		case EVMOpcode::DIV:
+		case EVMOpcode::MOD:
+			if (second.value() == 0 || (first.value() == INT64_MIN && second.value() == -1))
+			{
+				return std::nullopt; // faults at run time, left to the interpreter
+			}
+			return instruction.opcode == EVMOpcode::DIV ? first.value() / second.value() : first.value() % second.value();
+		case EVMOpcode::COMPARE:
+			return first.value() == second.value() ? 0 : first.value() < second.value() ? -1 : 1;
+		default:
+			return std::nullopt;
+	}
+}
+void EVMOptimizer::transfer(const EVMInstruction& instruction, RegisterConstants& constants)
+{
+	const auto destination = getDestinationArgument(instruction.opcode);
+	if (!destination.has_value())
+	{
+		return;
+	}
+	const DataAccess& dataAccess = instruction.arguments[destination.value()].data.dataAccess;
+	if (dataAccess.type == DataAccessType::REGISTER)
+	{
+		constants[dataAccess.registerIndex] = evaluate(instruction, constants);
+	}
+}
+bool EVMOptimizer::isRemovableWrite(const EVMInstruction& instruction)
+{
+	switch (instruction.opcode)
+	{
+		case EVMOpcode::MOV:
+		case EVMOpcode::LOADCONST:
+		case EVMOpcode::ADD:
+		case EVMOpcode::SUB:
+		case EVMOpcode::MUL:
+		case EVMOpcode::COMPARE:
+			break;
+		default:
+			return false; // div and mod can fault, the rest has side effects
+	}
+	for (const auto& argument : instruction.arguments)
+	{
+		if (argument.type == ArgumentType::DATA_ACCESS && argument.data.dataAccess.type != DataAccessType::REGISTER)
+		{
+			return false; // memory access can fault or be seen by other threads
+		}
+	}
+	return true;
+}
+bool EVMOptimizer::isSelfMove(const EVMInstruction& instruction)
+{
+	if (instruction.opcode != EVMOpcode::MOV)
+	{
+		return false;
+	}
+	const DataAccess& source = instruction.arguments[0].data.dataAccess;
+	const DataAccess& destination = instruction.arguments[1].data.dataAccess;
+	return source.type == DataAccessType::REGISTER && destination.type == DataAccessType::REGISTER && source.registerIndex == destination.registerIndex;
+}
+void EVMOptimizer::getRegisterUsage(const EVMInstruction& instruction, uint16_t& used, uint16_t& defined)
+{
+	used = 0;
+	defined = 0;
+	if (instruction.opcode == EVMOpcode::CALL || instruction.opcode == EVMOpcode::RET || instruction.opcode == EVMOpcode::CREATETHREAD)
+	{
+		used = All_Registers; // callee, caller or new thread sees all registers
+	}
+	const auto destination = getDestinationArgument(instruction.opcode);
+	for (size_t i = 0; i < instruction.arguments.size(); i++)
+	{
+		const EVMArgument& argument = instruction.arguments[i];
+		if (argument.type != ArgumentType::DATA_ACCESS)
+		{
+			continue;
+		}
+		const uint16_t mask = static_cast<uint16_t>(1U << argument.data.dataAccess.registerIndex);
+		if (argument.data.dataAccess.type == DataAccessType::REGISTER && destination == i)
+		{
+			defined |= mask;
+		}
+		else
+		{
+			used |= mask; // source register or address register of a memory access
+		}
+	}
+}
+uint16_t EVMOptimizer::getNamedRegisters(const EVMInstruction& instruction)
+{
+	uint16_t named = 0;
+	for (const auto& argument : instruction.arguments)
+	{
+		if (argument.type == ArgumentType::DATA_ACCESS)
+		{
+			named |= static_cast<uint16_t>(1U << argument.data.dataAccess.registerIndex);
+		}
+	}
+	return named;
+}
+std::vector<bool> EVMOptimizer::findUnknownEntries() const
+{
+	const auto& blocks = m_graph.getBlocks();
+	std::vector<bool> unknownEntries(blocks.size());
+	for (const auto& function : m_graph.getFunctions())
+	{
+		unknownEntries[function.entry] = function.called || function.threadEntry;
+	}
+	for (size_t blockIndex = 1; blockIndex < blocks.size(); blockIndex++)
+	{
+		if (m_instructions[blocks[blockIndex].begin - 1].opcode == EVMOpcode::CALL)
+		{
+			unknownEntries[blockIndex] = true; // return point
+		}
+	}
+	return unknownEntries;
+}
+void EVMOptimizer::compact()
+{
+	std::vector<uint32_t> newIndex(m_instructions.size() + 1); // removed instructions map to the next kept one
+	uint32_t kept = 0;
+	for (size_t i = 0; i < m_instructions.size(); i++)
+	{
+		newIndex[i] = kept;
+		kept += !m_removed[i];
+	}
+	newIndex[m_instructions.size()] = kept;
+	std::vector<EVMInstruction> instructions {};
+	instructions.reserve(kept);
+	for (size_t i = 0; i < m_instructions.size(); i++)
+	{
+		if (!m_removed[i])
+		{
+			instructions.push_back(m_instructions[i]);
+		}
+	}
+	for (auto& instruction : instructions)
+	{
+		if (instruction.target == EVMInstruction::Unresolved_Target)
+		{
+			continue;
+		}
+		instruction.target = newIndex[instruction.target];
+		if (instruction.target < kept)
+		{
+			instruction.arguments[0].data.codeAddress = instructions[instruction.target].offset;
+		}
+	}
+	m_instructions = std::move(instructions);
+	m_removed.assign(m_instructions.size(), false);
+}
+std::vector<std::optional<EVMOptimizer::RegisterConstants>> EVMOptimizer::findEntryConstants() const
+{
+	const auto& blocks = m_graph.getBlocks();
+	const std::vector<bool> unknownEntries = findUnknownEntries();
+	RegisterConstants unknown {};
+	RegisterConstants zeros {};
+	zeros.fill(0); // main thread starts with zeroed registers
+	std::vector<std::optional<RegisterConstants>> entries(blocks.size());
+	std::vector<size_t> worklist {0};
+	entries[0] = unknownEntries[0] ? unknown : zeros;
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		if (unknownEntries[i] && i != 0)
+		{
+			entries[i] = unknown;
+			worklist.push_back(i);
+		}
+	}
+	// forward data flow, every register value only goes from known to unknown, so this terminates
+	while (!worklist.empty())
+	{
+		const size_t blockIndex = worklist.back();
+		worklist.pop_back();
+		RegisterConstants constants = entries[blockIndex].value();
+		for (size_t i = blocks[blockIndex].begin; i < blocks[blockIndex].end; i++)
+		{
+			transfer(m_instructions[i], constants);
+		}
+		for (const uint32_t successor : m_graph.getSuccessors(blockIndex))
+		{
+			if (!entries[successor].has_value())
+			{
+				entries[successor] = constants;
+				worklist.push_back(successor);
+				continue;
+			}
+			bool changed = false;
+			for (size_t r = 0; r < Register_Count; r++)
+			{
+				if (entries[successor].value()[r].has_value() && entries[successor].value()[r] != constants[r])
+				{
+					entries[successor].value()[r].reset();
+					changed = true;
+				}
+			}
+			if (changed)
+			{
+				worklist.push_back(successor);
+			}
+		}
+	}
+	return entries;
+}
+void EVMOptimizer::propagateConstants()
+{
+	m_graph.build(m_instructions);
+	const auto& blocks = m_graph.getBlocks();
+	const auto entries = findEntryConstants();
+	for (size_t blockIndex = 0; blockIndex < blocks.size(); blockIndex++)
+	{
+		if (!entries[blockIndex].has_value())
+		{
+			continue; // unreachable, removed later
+		}
+		RegisterConstants constants = entries[blockIndex].value();
+		for (size_t i = blocks[blockIndex].begin; i < blocks[blockIndex].end; i++)
+		{
+			EVMInstruction& instruction = m_instructions[i];
+			if (isSelfMove(instruction))
+			{
+				m_removed[i] = true;
+				m_stats.removedRedundantWrites++;
+				continue;
+			}
+			const auto destination = getDestinationArgument(instruction.opcode);
+			const auto value = evaluate(instruction, constants);
+			if (value.has_value() && destination.has_value())
+			{
+				const DataAccess& dataAccess = instruction.arguments[destination.value()].data.dataAccess;
+				if (dataAccess.type == DataAccessType::REGISTER && constants[dataAccess.registerIndex] == value)
+				{
+					m_removed[i] = true;
+					m_stats.removedRedundantWrites++;
+					continue;
+				}
+				if (instruction.opcode != EVMOpcode::LOADCONST)
+				{
+					EVMArgument constant {.type = ArgumentType::CONSTANT};
+					constant.data.constant = value.value();
+					const EVMArgument target = instruction.arguments[destination.value()];
+					instruction.opcode = EVMOpcode::LOADCONST;
+					instruction.arguments = {};
+					instruction.arguments.push_back(constant);
+					instruction.arguments.push_back(target);
+					m_stats.foldedInstructions++;
+				}
+			}
+			else if (instruction.opcode == EVMOpcode::JUMPEQUAL)
+			{
+				const DataAccess& first = instruction.arguments[1].data.dataAccess;
+				const DataAccess& second = instruction.arguments[2].data.dataAccess;
+				if (first.type == DataAccessType::REGISTER && second.type == DataAccessType::REGISTER)
+				{
+					const bool sameRegister = first.registerIndex == second.registerIndex;
+					const auto a = constants[first.registerIndex];
+					const auto b = constants[second.registerIndex];
+					if (sameRegister || (a.has_value() && b.has_value() && a == b))
+					{
+						const EVMArgument target = instruction.arguments[0];
+						instruction.opcode = EVMOpcode::JUMP;
+						instruction.arguments = {};
+						instruction.arguments.push_back(target);
+						m_stats.simplifiedBranches++;
+					}
+					else if (a.has_value() && b.has_value())
+					{
+						m_removed[i] = true;
+						m_stats.simplifiedBranches++;
+						continue;
+					}
+				}
+			}
+			transfer(instruction, constants);
+		}
+	}
+	compact();
+}
+void EVMOptimizer::removeUnreachable()
+{
+	m_graph.build(m_instructions);
+	const auto& blocks = m_graph.getBlocks();
+	std::vector<bool> reached(blocks.size());
+	std::vector<uint32_t> worklist {0};
+	reached[0] = true;
+	while (!worklist.empty())
+	{
+		const uint32_t blockIndex = worklist.back();
+		const auto& block = blocks[blockIndex];
+		worklist.pop_back();
+		const auto reach = [&](uint32_t successor)
+		{
+			if (!reached[successor])
+			{
+				reached[successor] = true;
+				worklist.push_back(successor);
+			}
+		};
+		for (const uint32_t successor : m_graph.getSuccessors(blockIndex))
+		{
+			reach(successor);
+		}
+		for (size_t i = block.begin; i < block.end; i++)
+		{
+			if (m_instructions[i].opcode == EVMOpcode::CALL || m_instructions[i].opcode == EVMOpcode::CREATETHREAD)
+			{
+				reach(m_graph.getBlockOf(m_instructions[i].target));
+			}
+		}
+	}
+	for (size_t blockIndex = 0; blockIndex < blocks.size(); blockIndex++)
+	{
+		if (!reached[blockIndex])
+		{
+			std::fill(m_removed.begin() + blocks[blockIndex].begin, m_removed.begin() + blocks[blockIndex].end, true);
+			m_stats.removedUnreachable += blocks[blockIndex].end - blocks[blockIndex].begin;
+		}
+	}
+	compact();
+}
+std::vector<uint32_t> EVMOptimizer::findBlockFunctions() const
+{
+	// Each function claims the blocks it reaches. A block reached by a second function becomes shared together with
+	// everything reachable from it, so every block is claimed once and shared once at most.
+	const auto& blocks = m_graph.getBlocks();
+	const auto& functions = m_graph.getFunctions();
+	std::vector<uint32_t> blockFunctions(blocks.size(), EVMControlFlowGraph::No_Block);
+	std::vector<bool> shared(blocks.size());
+	std::vector<uint32_t> worklist {};
+	std::vector<uint32_t> sharedWorklist {};
+	const auto share = [&](uint32_t blockIndex)
+	{
+		if (shared[blockIndex])
+		{
+			return;
+		}
+		shared[blockIndex] = true;
+		sharedWorklist.push_back(blockIndex);
+		while (!sharedWorklist.empty())
+		{
+			const uint32_t current = sharedWorklist.back();
+			sharedWorklist.pop_back();
+			for (const uint32_t successor : m_graph.getSuccessors(current))
+			{
+				if (!shared[successor])
+				{
+					shared[successor] = true;
+					sharedWorklist.push_back(successor);
+				}
+			}
+		}
+	};
+	const auto claim = [&](uint32_t blockIndex, uint32_t function)
+	{
+		if (shared[blockIndex] || blockFunctions[blockIndex] == function)
+		{
+			return;
+		}
+		if (blockFunctions[blockIndex] != EVMControlFlowGraph::No_Block)
+		{
+			share(blockIndex);
+			return;
+		}
+		blockFunctions[blockIndex] = function;
+		worklist.push_back(blockIndex);
+	};
+	for (uint32_t function = 0; function < functions.size(); function++)
+	{
+		claim(functions[function].entry, function);
+		while (!worklist.empty())
+		{
+			const uint32_t blockIndex = worklist.back();
+			worklist.pop_back();
+			for (const uint32_t successor : m_graph.getSuccessors(blockIndex))
+			{
+				claim(successor, function);
+			}
+		}
+	}
+	for (size_t blockIndex = 0; blockIndex < blocks.size(); blockIndex++)
+	{
+		if (shared[blockIndex])
+		{
+			blockFunctions[blockIndex] = EVMControlFlowGraph::No_Block;
+		}
+	}
+	return blockFunctions;
+}
+void EVMOptimizer::computeLiveness()
+{
+	m_graph.build(m_instructions);
+	const auto& blocks = m_graph.getBlocks();
+	m_blockFunctions = findBlockFunctions();
+	m_liveIn.assign(blocks.size(), 0);
+	m_returnLive.assign(m_graph.getFunctions().size(), 0);
+	// backward data flow over the whole program, live sets only grow
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (const auto& callSite : m_graph.getCallSites())
+		{
+			if (m_instructions[callSite.instruction].opcode == EVMOpcode::CALL)
+			{
+				const size_t returnPoint = callSite.instruction + 1;
+				m_returnLive[callSite.function] |= returnPoint < m_instructions.size() ? m_liveIn[m_graph.getBlockOf(returnPoint)] : All_Registers;
+			}
+		}
+		for (size_t blockIndex = blocks.size(); blockIndex-- > 0;)
+		{
+			uint16_t live = 0;
+			for (const uint32_t successor : m_graph.getSuccessors(static_cast<uint32_t>(blockIndex)))
+			{
+				live |= m_liveIn[successor];
+			}
+			for (size_t i = blocks[blockIndex].end; i-- > blocks[blockIndex].begin;)
+			{
+				uint16_t used {};
+				uint16_t defined {};
+				getLiveRegisterUsage(i, used, defined);
+				live = (live & ~defined) | used;
+			}
+			if (live != m_liveIn[blockIndex])
+			{
+				m_liveIn[blockIndex] = live;
+				changed = true;
+			}
+		}
+	}
+}
+void EVMOptimizer::getLiveRegisterUsage(size_t instruction, uint16_t& used, uint16_t& defined) const
+{
+	const EVMInstruction& current = m_instructions[instruction];
+	getRegisterUsage(current, used, defined);
+	if (current.opcode == EVMOpcode::CALL && current.target < m_instructions.size())
+	{
+		used = m_liveIn[m_graph.getBlockOf(current.target)]; // what is live at the return point stays live through the callee
+	}
+	else if (current.opcode == EVMOpcode::RET)
+	{
+		// the program entry and threads may return with an empty call stack, as does code shared by functions
+		const uint32_t function = m_blockFunctions[m_graph.getBlockOf(instruction)];
+		if (function != EVMControlFlowGraph::No_Block && function != 0 && !m_graph.getFunctions()[function].threadEntry)
+		{
+			used = m_returnLive[function];
+		}
+	}
+}
+bool EVMOptimizer::removeDeadWrites()
+{
+	computeLiveness();
+	const auto& blocks = m_graph.getBlocks();
+	bool removed = false;
+	for (uint32_t blockIndex = 0; blockIndex < blocks.size(); blockIndex++)
+	{
+		const auto& block = blocks[blockIndex];
+		uint16_t live = 0;
+		for (const uint32_t successor : m_graph.getSuccessors(blockIndex))
+		{
+			live |= m_liveIn[successor];
+		}
+		for (size_t i = block.end; i-- > block.begin;)
+		{
+			uint16_t used {};
+			uint16_t defined {};
+			getLiveRegisterUsage(i, used, defined);
+			if (defined != 0 && (live & defined) == 0 && isRemovableWrite(m_instructions[i]))
+			{
+				m_removed[i] = true;
+				m_stats.removedDeadWrites++;
+				removed = true;
+				continue;
+			}
+			live = (live & ~defined) | used;
+		}
+	}
+	compact();
+	return removed;
+}
+bool EVMOptimizer::findConstantUses(size_t loadConst, uint32_t loop, const std::vector<std::optional<RegisterConstants>>& entries, std::vector<uint32_t>& searchMarks, uint32_t search, std::vector<size_t>& uses) const
+{
+	const auto& blocks = m_graph.getBlocks();
+	const EVMInstruction& load = m_instructions[loadConst];
+	const uint8_t registerIndex = load.arguments[1].data.dataAccess.registerIndex;
+	const uint16_t mask = static_cast<uint16_t>(1U << registerIndex);
+	std::vector<std::pair<uint32_t, size_t>> worklist {{m_graph.getBlockOf(loadConst), loadConst + 1}}; // block and first instruction to follow
+	size_t followed = 0;
+	while (!worklist.empty())
+	{
+		const auto [blockIndex, first] = worklist.back();
+		worklist.pop_back();
+		if (!entries[blockIndex].has_value())
+		{
+			return false;
+		}
+		RegisterConstants constants = entries[blockIndex].value();
+		bool overwritten = false;
+		for (size_t i = blocks[blockIndex].begin; i < blocks[blockIndex].end && !overwritten; i++)
+		{
+			const EVMInstruction& instruction = m_instructions[i];
+			if (i >= first)
+			{
+				if (++followed > Max_Constant_Use_Search)
+				{
+					return false;
+				}
+				uint16_t used {};
+				uint16_t defined {};
+				getLiveRegisterUsage(i, used, defined);
+				if ((used & mask) != 0)
+				{
+					const bool readsArgument = (getNamedRegisters(instruction) & mask) != 0 && instruction.opcode != EVMOpcode::CALL && instruction.opcode != EVMOpcode::RET && instruction.opcode != EVMOpcode::CREATETHREAD;
+					if (!readsArgument || constants[registerIndex] != load.arguments[0].data.constant || !m_graph.isInLoop(blockIndex, loop))
+					{
+						return false;
+					}
+					uses.push_back(i);
+				}
+				overwritten = (defined & mask) != 0;
+			}
+			transfer(instruction, constants);
+		}
+		if (overwritten)
+		{
+			continue;
+		}
+		for (const uint32_t successor : m_graph.getSuccessors(blockIndex))
+		{
+			if (searchMarks[successor] != search)
+			{
+				searchMarks[successor] = search;
+				worklist.push_back({successor, blocks[successor].begin});
+			}
+		}
+	}
+	return true;
+}
+void EVMOptimizer::hoistLoopConstants()
+{
+	// A loadConst leaves its loop when it is the only write of its register there and the old value is not read, or
+	// when all reads it reaches are in the loop and can take the value from a register loaded once in front of it.
+	// Loops without calls use registers neither read nor written in them, the rest only registers no instruction
+	// names at all, each holding one constant in the whole program. Outer loops go first, so constants leave
+	// whole loop nests; loops inside a changed loop wait for the next optimization.
+	computeLiveness();
+	m_graph.computeDominators();
+	const auto& blocks = m_graph.getBlocks();
+	const auto& loops = m_graph.getLoops();
+	const auto entries = findEntryConstants();
+	std::vector<std::vector<uint32_t>> loopBlocks(loops.size());
+	for (uint32_t blockIndex = 0; blockIndex < blocks.size(); blockIndex++)
+	{
+		for (uint32_t loop = blocks[blockIndex].loop; loop != EVMControlFlowGraph::No_Block; loop = loops[loop].parent)
+		{
+			loopBlocks[loop].push_back(blockIndex);
+		}
+	}
+	std::vector<bool> functionEntries(blocks.size());
+	for (const auto& function : m_graph.getFunctions())
+	{
+		functionEntries[function.entry] = true;
+	}
+	uint16_t unnamed = All_Registers;
+	for (const auto& instruction : m_instructions)
+	{
+		unnamed &= static_cast<uint16_t>(~getNamedRegisters(instruction));
+	}
+	uint16_t unassigned = unnamed;
+	std::map<int64_t, uint8_t> constantRegisters {}; // unnamed register given to each constant
+	std::vector<std::vector<EVMInstruction>> preheaders(loops.size());
+	std::vector<uint32_t> searchMarks(blocks.size());
+	uint32_t search = 0;
+	std::vector<size_t> uses {};
+	for (uint32_t loop = static_cast<uint32_t>(loops.size()); loop-- > 0;)
+	{
+		bool enclosingChanged = false;
+		for (uint32_t parent = loops[loop].parent; parent != EVMControlFlowGraph::No_Block; parent = loops[parent].parent)
+		{
+			enclosingChanged = enclosingChanged || !preheaders[parent].empty();
+		}
+		const uint32_t headerBlock = loops[loop].header;
+		const uint32_t header = blocks[headerBlock].begin;
+		if (enclosingChanged || header == 0 || functionEntries[headerBlock])
+		{
+			continue;
+		}
+		const EVMOpcode previous = m_instructions[header - 1].opcode;
+		if (previous != EVMOpcode::JUMP && previous != EVMOpcode::RET && previous != EVMOpcode::HLT && m_graph.isInLoop(m_graph.getBlockOf(header - 1), loop))
+		{
+			continue; // loop falls through into its header, there is no place for the preheader
+		}
+		const size_t room = m_instructions[header].offset - m_instructions[header - 1].offset - 1; // offsets left for the preheader
+		uint16_t named = 0;
+		bool calls = false;
+		std::array<size_t, Register_Count> writes {};
+		for (const uint32_t blockIndex : loopBlocks[loop])
+		{
+			for (size_t i = blocks[blockIndex].begin; i < blocks[blockIndex].end; i++)
+			{
+				uint16_t used {};
+				uint16_t defined {};
+				getRegisterUsage(m_instructions[i], used, defined);
+				named |= getNamedRegisters(m_instructions[i]);
+				calls = calls || m_instructions[i].opcode == EVMOpcode::CALL;
+				for (size_t r = 0; r < Register_Count; r++)
+				{
+					writes[r] += (defined >> r) & 1;
+				}
+			}
+		}
+		std::vector<EVMInstruction>& preheader = preheaders[loop];
+		for (const uint32_t blockIndex : loopBlocks[loop])
+		{
+			for (size_t i = blocks[blockIndex].begin; i < blocks[blockIndex].end; i++)
+			{
+				const EVMInstruction& instruction = m_instructions[i];
+				if (instruction.opcode != EVMOpcode::LOADCONST || instruction.arguments[1].data.dataAccess.type != DataAccessType::REGISTER)
+				{
+					continue;
+				}
+				const int64_t value = instruction.arguments[0].data.constant;
+				const uint8_t registerIndex = instruction.arguments[1].data.dataAccess.registerIndex;
+				const uint16_t mask = static_cast<uint16_t>(1U << registerIndex);
+				if (!calls && writes[registerIndex] == 1 && (m_liveIn[headerBlock] & mask) == 0)
+				{
+					if (preheader.size() < room)
+					{
+						preheader.push_back(instruction);
+						m_removed[i] = true;
+						m_stats.hoistedConstants++;
+					}
+					continue;
+				}
+				uses.clear();
+				if (!findConstantUses(i, loop, entries, searchMarks, ++search, uses) || uses.empty())
+				{
+					continue; // unread writes are left to removeDeadWrites
+				}
+				std::optional<uint8_t> constantRegister {};
+				for (const auto& hoisted : preheader)
+				{
+					if (hoisted.arguments[0].data.constant == value)
+					{
+						constantRegister = hoisted.arguments[1].data.dataAccess.registerIndex; // nothing else writes it in the loop
+					}
+				}
+				const uint16_t unused = static_cast<uint16_t>(~(named | m_liveIn[headerBlock] | unnamed));
+				if (!constantRegister.has_value() && !calls && unused != 0)
+				{
+					constantRegister = static_cast<uint8_t>(std::countr_zero(unused));
+				}
+				if (!constantRegister.has_value() && constantRegisters.contains(value))
+				{
+					constantRegister = constantRegisters[value];
+				}
+				if (!constantRegister.has_value() && unassigned != 0)
+				{
+					constantRegister = static_cast<uint8_t>(std::countr_zero(unassigned));
+					constantRegisters[value] = constantRegister.value();
+					unassigned &= static_cast<uint16_t>(~(1U << constantRegister.value()));
+				}
+				const bool loaded = (named & (1U << constantRegister.value_or(registerIndex))) != 0;
+				if (!constantRegister.has_value() || (!loaded && preheader.size() >= room))
+				{
+					continue;
+				}
+				for (const size_t use : uses)
+				{
+					EVMInstruction& reader = m_instructions[use];
+					const auto destination = getDestinationArgument(reader.opcode);
+					for (size_t argument = 0; argument < reader.arguments.size(); argument++)
+					{
+						DataAccess& dataAccess = reader.arguments[argument].data.dataAccess;
+						const bool written = dataAccess.type == DataAccessType::REGISTER && destination == argument;
+						if (reader.arguments[argument].type == ArgumentType::DATA_ACCESS && dataAccess.registerIndex == registerIndex && !written)
+						{
+							dataAccess.registerIndex = constantRegister.value();
+						}
+					}
+				}
+				if (!loaded)
+				{
+					preheader.push_back(instruction);
+					preheader.back().arguments[1].data.dataAccess.registerIndex = constantRegister.value();
+				}
+				named |= static_cast<uint16_t>(1U << constantRegister.value());
+				m_removed[i] = true;
+				m_stats.hoistedConstants++;
+			}
+		}
+	}
+	// preheaders go right in front of loop headers, jumps into the loop from outside enter through them
+	std::vector<uint32_t> preheaderLoops(m_instructions.size(), EVMControlFlowGraph::No_Block);
+	for (uint32_t loop = 0; loop < loops.size(); loop++)
+	{
+		if (!preheaders[loop].empty())
+		{
+			preheaderLoops[blocks[loops[loop].header].begin] = loop;
+		}
+	}
+	std::vector<uint32_t> newIndex(m_instructions.size() + 1);
+	std::vector<uint32_t> preheaderStarts(m_instructions.size());
+	std::vector<EVMInstruction> instructions {};
+	std::vector<bool> removed {};
+	for (size_t i = 0; i < m_instructions.size(); i++)
+	{
+		if (preheaderLoops[i] != EVMControlFlowGraph::No_Block)
+		{
+			std::vector<EVMInstruction>& preheader = preheaders[preheaderLoops[i]];
+			preheaderStarts[i] = static_cast<uint32_t>(instructions.size());
+			for (size_t j = 0; j < preheader.size(); j++)
+			{
+				preheader[j].offset = m_instructions[i].offset - static_cast<uint32_t>(preheader.size() - j);
+				instructions.push_back(preheader[j]);
+				removed.push_back(false);
+			}
+		}
+		newIndex[i] = static_cast<uint32_t>(instructions.size());
+		instructions.push_back(m_instructions[i]);
+		removed.push_back(m_removed[i]);
+	}
+	newIndex[m_instructions.size()] = static_cast<uint32_t>(instructions.size());
+	for (size_t i = 0; i < m_instructions.size(); i++)
+	{
+		EVMInstruction& instruction = instructions[newIndex[i]];
+		if (instruction.target == EVMInstruction::Unresolved_Target)
+		{
+			continue;
+		}
+		const uint32_t loop = instruction.target < m_instructions.size() ? preheaderLoops[instruction.target] : EVMControlFlowGraph::No_Block;
+		const bool entersLoop = loop != EVMControlFlowGraph::No_Block && !m_graph.isInLoop(m_graph.getBlockOf(i), loop);
+		instruction.target = entersLoop ? preheaderStarts[instruction.target] : newIndex[instruction.target];
+	}
+	m_instructions = std::move(instructions);
+	m_removed = std::move(removed);
+	compact();
+}
+void EVMOptimizer::simplifyJumps()
+{
+	const size_t count = m_instructions.size();
+	const auto threadTarget = [&](uint32_t target)
+	{
+		// chains of jumps are followed up to a limit, which also ends cycles of jumps
+		for (size_t step = 0; step < Max_Jump_Thread_Length && target < count && m_instructions[target].opcode == EVMOpcode::JUMP; step++)
+		{
+			target = m_instructions[target].target;
+		}
+		return target;
+	};
+	for (size_t i = 0; i < count; i++)
+	{
+		EVMInstruction& instruction = m_instructions[i];
+		if ((instruction.opcode != EVMOpcode::JUMP && instruction.opcode != EVMOpcode::JUMPEQUAL && instruction.opcode != EVMOpcode::CALL) || instruction.target >= count)
+		{
+			continue;
+		}
+		const uint32_t target = threadTarget(instruction.target);
+		if (target != instruction.target && target < count)
+		{
+			instruction.target = target;
+			instruction.arguments[0].data.codeAddress = m_instructions[target].offset;
+			m_stats.simplifiedJumps++;
+		}
+		const bool comparesRegisters = instruction.opcode == EVMOpcode::JUMPEQUAL &&
+			instruction.arguments[1].data.dataAccess.type == DataAccessType::REGISTER && instruction.arguments[2].data.dataAccess.type == DataAccessType::REGISTER;
+		if (instruction.target == i + 1 && (instruction.opcode == EVMOpcode::JUMP || comparesRegisters))
+		{
+			m_removed[i] = true; // both ways lead to the next instruction, memory operands are kept as their reads can fault
+			m_stats.simplifiedJumps++;
+		}
+	}
+	compact();
+}
+bool EVMOptimizer::optimize(std::span<const EVMInstruction> instructions)
+{
+	for (const auto& instruction : instructions)
+	{
+		for (const auto& argument : instruction.arguments)
+		{
+			if (argument.type == ArgumentType::ADDRESS && instruction.target == EVMInstruction::Unresolved_Target)
+			{
+				return false; // jumps outside of decoded code fault at run time, their targets cannot be remapped
+			}
+		}
+	}
+	m_instructions.assign(instructions.begin(), instructions.end());
+	m_removed.assign(m_instructions.size(), false);
+	m_stats = {};
+	if (!m_instructions.empty())
+	{
+		propagateConstants();
+	}
+	if (!m_instructions.empty())
+	{
+		removeUnreachable();
+	}
+	if (!m_instructions.empty())
+	{
+		hoistLoopConstants();
+	}
+	while (!m_instructions.empty() && removeDeadWrites())
+	{
+	}
+	if (!m_instructions.empty())
+	{
+		simplifyJumps();
+	}
+	if (!m_instructions.empty())
+	{
+		removeUnreachable(); // blocks only reached through threaded jumps
+	}
+	m_instructionOffsets.clear();
+	for (const auto& instruction : m_instructions)
+	{
+		m_instructionOffsets.push_back(instruction.offset);
+	}
+	return true;
+}
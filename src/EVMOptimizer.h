@@ -0,0 +1,73 @@
+#pragma once
+
+#include "EVMControlFlowGraph.h"
+#include "EVMTypes.h"
+#include <array>
+#include <inttypes.h>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Whole program optimizer run between decoding and execution. Only guest register values are reasoned about,
+// memory accesses, file and console I/O, thread and lock operations stay in place and in original order.
+// Kept instructions keep their code offsets, so listings, profiles and samples still name the original code,
+// constants hoisted in front of a loop take unused offsets just below its header.
+class EVMOptimizer
+{
+public:
+	struct EVMOptimizerStats
+	{
+		size_t foldedInstructions; // mov, arithmetic and compare of known values turned into loadConst
+		size_t simplifiedBranches; // jumpEqual with known outcome turned into jump or removed
+		size_t removedRedundantWrites; // register already held the written value
+		size_t removedDeadWrites; // register was overwritten or never read afterwards
+		size_t removedUnreachable;
+		size_t simplifiedJumps; // jumps and calls retargeted past jumps, jumps to the next instruction removed
+		size_t hoistedConstants; // loadConst in a loop moved in front of it, or replaced by a register loaded there
+	};
+
+private:
+	static const size_t Register_Count = 16;
+	static constexpr uint16_t All_Registers = 0xffff;
+	static const size_t Max_Jump_Thread_Length = 16;
+	static const size_t Max_Constant_Use_Search = 4096; // instructions followed from one loadConst when looking for its reads
+
+	using RegisterConstants = std::array<std::optional<int64_t>, Register_Count>; // nullopt when value is not known
+
+	std::vector<EVMInstruction> m_instructions {};
+	std::vector<bool> m_removed {};
+	std::vector<uint32_t> m_instructionOffsets {};
+	EVMOptimizerStats m_stats {};
+	EVMControlFlowGraph m_graph {}; // rebuilt by each pass from the current instructions
+	std::vector<uint16_t> m_liveIn {}; // registers live at block entries, filled by computeLiveness
+	std::vector<uint16_t> m_returnLive {}; // per function, registers read after some call of it returns
+	std::vector<uint32_t> m_blockFunctions {}; // function reaching the block when only one does, No_Block otherwise
+
+	static std::optional<size_t> getDestinationArgument(EVMOpcode opcode); // argument the instruction writes to
+	static std::optional<int64_t> evaluate(const EVMInstruction& instruction, const RegisterConstants& constants); // value written, if known
+	static void transfer(const EVMInstruction& instruction, RegisterConstants& constants);
+	static bool isRemovableWrite(const EVMInstruction& instruction); // only writes a register and cannot fail
+	static bool isSelfMove(const EVMInstruction& instruction);
+	static void getRegisterUsage(const EVMInstruction& instruction, uint16_t& used, uint16_t& defined);
+	static uint16_t getNamedRegisters(const EVMInstruction& instruction); // registers appearing in arguments
+
+	std::vector<bool> findUnknownEntries() const; // blocks entered by call, return or new thread, no register value is known there
+	std::vector<std::optional<RegisterConstants>> findEntryConstants() const; // register values at block entries, nullopt for unreachable blocks
+	std::vector<uint32_t> findBlockFunctions() const;
+	void computeLiveness(); // builds the graph, calls and returns keep live only what callee and callers read
+	void getLiveRegisterUsage(size_t instruction, uint16_t& used, uint16_t& defined) const; // needs computeLiveness
+	// reads of the register loaded by loadConst that it reaches, false unless all of them are in the loop and know the value
+	bool findConstantUses(size_t loadConst, uint32_t loop, const std::vector<std::optional<RegisterConstants>>& entries, std::vector<uint32_t>& searchMarks, uint32_t search, std::vector<size_t>& uses) const;
+	void compact(); // drops removed instructions and retargets code addresses
+	void propagateConstants();
+	void removeUnreachable();
+	bool removeDeadWrites();
+	void hoistLoopConstants();
+	void simplifyJumps();
+
+public:
+	bool optimize(std::span<const EVMInstruction> instructions); // false when some code address is not linked, program is then kept as is
+	std::span<const EVMInstruction> getInstructions() const { return m_instructions; }
+	std::span<const uint32_t> getInstructionOffsets() const { return m_instructionOffsets; }
+	const EVMOptimizerStats& getStats() const { return m_stats; }
+};
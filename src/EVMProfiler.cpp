@@ -0,0 +1,189 @@
+#include "EVMProfiler.h"
+
+EVMThreadProfile::EVMThreadProfile(size_t instructionCount, uint32_t seed, uint64_t clockOverhead):
+m_executions(instructionCount),
+m_sampledCycles(instructionCount),
+m_random(seed | 1),
+m_clockOverhead(clockOverhead)
+{
+	m_untilSample = nextSamplePeriod();
+}
+
+EVMProfiler::EVMProfiler(size_t instructionCount):
+m_executions(instructionCount),
+m_sampledCycles(instructionCount),
+m_clockOverhead(measureClockOverhead())
+{
+}
+EVMThreadProfile EVMProfiler::createThreadProfile()
+{
+	std::unique_lock l {m_mergeMutex};
+	return EVMThreadProfile {m_executions.size(), 0x9e3779b9u * ++m_threadCount, m_clockOverhead};
+}
+void EVMProfiler::merge(const EVMThreadProfile& profile)
+{
+	std::unique_lock l {m_mergeMutex};
+	for (size_t i = 0; i < m_executions.size(); i++)
+	{
+		m_executions[i] += profile.m_executions[i];
+		m_sampledCycles[i] += profile.m_sampledCycles[i];
+	}
+	m_samples += profile.m_samples;
+}
+const char* EVMProfiler::getClockName()
+{
+#ifdef EVM_PROFILER_RDTSC
+	return "tsc";
+#else
+	return "ns";
+#endif
+}
+uint64_t EVMProfiler::measureClockOverhead()
+{
+	uint64_t overhead = UINT64_MAX;
+	for (int i = 0; i < 64; i++)
+	{
+		const uint64_t start = EVMThreadProfile::readCycleCounter();
+		overhead = std::min(overhead, EVMThreadProfile::readCycleCounter() - start);
+	}
+	return overhead;
+}
+uint64_t EVMProfiler::getTotalExecutions() const
+{
+	uint64_t total = 0;
+	for (uint64_t executions : m_executions)
+	{
+		total += executions;
+	}
+	return total;
+}
+std::vector<EVMProfiler::EVMProfileEntry> EVMProfiler::getInstructionEntries() const
+{
+	// sampled cycles are scaled by the actual sampling rate, which is close to Mean_Sample_Period
+	const double scale = m_samples == 0 ? 0.0 : static_cast<double>(getTotalExecutions()) / m_samples;
+	std::vector<EVMProfileEntry> entries {};
+	for (size_t i = 0; i < m_executions.size(); i++)
+	{
+		if (m_executions[i] != 0)
+		{
+			entries.push_back({i, m_executions[i], static_cast<uint64_t>(m_sampledCycles[i] * scale)});
+		}
+	}
+	std::stable_sort(entries.begin(), entries.end(), [](const EVMProfileEntry& a, const EVMProfileEntry& b)
+	{
+		return a.cycles != b.cycles ? a.cycles > b.cycles : a.executions > b.executions;
+	});
+	return entries;
+}
+std::vector<EVMProfiler::EVMProfileEntry> EVMProfiler::getOpcodeEntries(std::span<const EVMInstruction> instructions) const
+{
+	std::vector<EVMProfileEntry> opcodes {};
+	for (const auto& entry : getInstructionEntries())
+	{
+		const size_t opcode = static_cast<size_t>(instructions[entry.index].opcode);
+		auto opcodeEntry = std::find_if(opcodes.begin(), opcodes.end(), [opcode](const EVMProfileEntry& e) { return e.index == opcode; });
+		if (opcodeEntry == opcodes.end())
+		{
+			opcodes.push_back({opcode, 0, 0});
+			opcodeEntry = opcodes.end() - 1;
+		}
+		opcodeEntry->executions += entry.executions;
+		opcodeEntry->cycles += entry.cycles;
+	}
+	std::stable_sort(opcodes.begin(), opcodes.end(), [](const EVMProfileEntry& a, const EVMProfileEntry& b)
+	{
+		return a.cycles != b.cycles ? a.cycles > b.cycles : a.executions > b.executions;
+	});
+	return opcodes;
+}
+static double getShare(uint64_t value, uint64_t total)
+{
+	return total == 0 ? 0.0 : 100.0 * value / total;
+}
+void EVMProfiler::writeReport(const EVMDisasm& disasm, std::ostream& output) const
+{
+	const auto instructions = disasm.getInstructions();
+	const auto instructionEntries = getInstructionEntries();
+	const auto opcodeEntries = getOpcodeEntries(instructions);
+	uint64_t totalExecutions = 0;
+	uint64_t totalCycles = 0;
+	for (const auto& entry : instructionEntries)
+	{
+		totalExecutions += entry.executions;
+		totalCycles += entry.cycles;
+	}
+
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(2);
+	ss << "Profile: " << totalExecutions << " instructions executed on " << m_threadCount << " threads, " << totalCycles << " estimated " << getClockName() << " cycles" << std::endl;
+	ss << std::endl << std::left << std::setw(14) << "opcode" << std::right << std::setw(16) << "executions" << std::setw(9) << "%" << std::setw(18) << "cycles" << std::setw(9) << "%" << std::endl;
+	for (const auto& entry : opcodeEntries)
+	{
+		ss << std::left << std::setw(14) << EVMDisasm::getOpcodeName(static_cast<EVMOpcode>(entry.index)) << std::right
+			<< std::setw(16) << entry.executions << std::setw(9) << getShare(entry.executions, totalExecutions)
+			<< std::setw(18) << entry.cycles << std::setw(9) << getShare(entry.cycles, totalCycles) << std::endl;
+	}
+	ss << std::endl << std::setw(10) << "index" << std::setw(12) << "offset" << std::setw(16) << "executions" << std::setw(9) << "%"
+		<< std::setw(18) << "cycles" << std::setw(9) << "%" << "  source" << std::endl;
+	for (size_t i = 0; i < instructionEntries.size() && i < Report_Instruction_Count; i++)
+	{
+		const auto& entry = instructionEntries[i];
+		ss << std::setw(10) << entry.index << std::setw(12) << instructions[entry.index].offset
+			<< std::setw(16) << entry.executions << std::setw(9) << getShare(entry.executions, totalExecutions)
+			<< std::setw(18) << entry.cycles << std::setw(9) << getShare(entry.cycles, totalCycles)
+			<< "  " << disasm.getSourceCodeLineForIp(entry.index).value_or("") << std::endl;
+	}
+	output << ss.str();
+}
+static void appendJsonString(std::string& buffer, const std::string& value)
+{
+	buffer += '"';
+	for (char c : value)
+	{
+		if (c == '"' || c == '\\')
+		{
+			buffer += '\\';
+			buffer += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			buffer += c == '\t' ? "\\t" : " ";
+		}
+		else
+		{
+			buffer += c;
+		}
+	}
+	buffer += '"';
+}
+void EVMProfiler::writeJson(const EVMDisasm& disasm, std::ostream& output) const
+{
+	const auto instructions = disasm.getInstructions();
+	const auto instructionEntries = getInstructionEntries();
+	std::string json {};
+	json += "{\"clock\": ";
+	appendJsonString(json, getClockName());
+	json += ", \"threads\": " + std::to_string(m_threadCount) + ", \"samples\": " + std::to_string(m_samples) + ",\n\"opcodes\": [";
+	bool first = true;
+	for (const auto& entry : getOpcodeEntries(instructions))
+	{
+		json += first ? "\n" : ",\n";
+		json += "{\"opcode\": ";
+		appendJsonString(json, EVMDisasm::getOpcodeName(static_cast<EVMOpcode>(entry.index)));
+		json += ", \"executions\": " + std::to_string(entry.executions) + ", \"cycles\": " + std::to_string(entry.cycles) + "}";
+		first = false;
+	}
+	json += "],\n\"instructions\": [";
+	first = true;
+	for (const auto& entry : instructionEntries)
+	{
+		json += first ? "\n" : ",\n";
+		json += "{\"index\": " + std::to_string(entry.index) + ", \"offset\": " + std::to_string(instructions[entry.index].offset) +
+			", \"executions\": " + std::to_string(entry.executions) + ", \"cycles\": " + std::to_string(entry.cycles) + ", \"source\": ";
+		appendJsonString(json, disasm.getSourceCodeLineForIp(entry.index).value_or(""));
+		json += "}";
+		first = false;
+	}
+	json += "]}\n";
+	output << json;
+}
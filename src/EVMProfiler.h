@@ -0,0 +1,110 @@
+#pragma once
+
+#include "EVMDisasm.h"
+#include "EVMTypes.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <inttypes.h>
+#include <mutex>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define EVM_PROFILER_RDTSC
+#endif
+
+// counters of one guest thread, owned by its execution unit and merged into the profiler when the thread exits
+class EVMThreadProfile
+{
+private:
+	std::vector<uint64_t> m_executions; // per instruction index
+	std::vector<uint64_t> m_sampledCycles; // per instruction index, only sampled executions are timed
+	uint64_t m_samples {};
+	uint32_t m_untilSample;
+	uint32_t m_random;
+	uint64_t m_sampleStart {};
+	uint64_t m_clockOverhead; // cost of reading the clock, not charged to instructions
+
+	friend class EVMProfiler;
+public:
+	static const uint32_t Mean_Sample_Period = 64; // one execution in this many is timed on average
+
+	EVMThreadProfile(size_t instructionCount, uint32_t seed, uint64_t clockOverhead);
+	static uint64_t readCycleCounter()
+	{
+#ifdef EVM_PROFILER_RDTSC
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+	void beginInstruction(size_t index)
+	{
+		m_executions[index]++;
+		if (--m_untilSample == 0)
+		{
+			m_sampleStart = readCycleCounter();
+		}
+	}
+	void endInstruction(size_t index)
+	{
+		if (m_untilSample == 0)
+		{
+			const uint64_t cycles = readCycleCounter() - m_sampleStart;
+			m_sampledCycles[index] += cycles > m_clockOverhead ? cycles - m_clockOverhead : 0;
+			m_samples++;
+			m_untilSample = nextSamplePeriod();
+		}
+	}
+	uint32_t nextSamplePeriod()
+	{
+		// periods vary so that loops whose length divides the period are not always sampled at the same instruction
+		m_random ^= m_random << 13;
+		m_random ^= m_random >> 17;
+		m_random ^= m_random << 5;
+		return Mean_Sample_Period / 2 + m_random % Mean_Sample_Period;
+	}
+};
+
+// per opcode and per instruction execution counts and host cycles of all guest threads of a run
+class EVMProfiler
+{
+private:
+	static const size_t Report_Instruction_Count = 20; // hottest instructions listed in the text report
+
+	struct EVMProfileEntry
+	{
+		size_t index; // instruction index or opcode
+		uint64_t executions;
+		uint64_t cycles; // estimated from samples
+	};
+
+	std::mutex m_mergeMutex {};
+	std::vector<uint64_t> m_executions;
+	std::vector<uint64_t> m_sampledCycles;
+	uint64_t m_samples {};
+	uint32_t m_threadCount {};
+	uint64_t m_clockOverhead;
+
+	std::vector<EVMProfileEntry> getInstructionEntries() const; // executed instructions, most expensive first
+	std::vector<EVMProfileEntry> getOpcodeEntries(std::span<const EVMInstruction> instructions) const; // executed opcodes, most expensive first
+public:
+	EVMProfiler(size_t instructionCount);
+	EVMThreadProfile createThreadProfile();
+	void merge(const EVMThreadProfile& profile);
+	static const char* getClockName();
+	static uint64_t measureClockOverhead();
+	uint64_t getTotalExecutions() const;
+	uint64_t getExecutions(size_t index) const { return m_executions.at(index); }
+	// reports need all threads merged, instructions are the ones the profile was recorded with
+	void writeReport(const EVMDisasm& disasm, std::ostream& output) const;
+	void writeJson(const EVMDisasm& disasm, std::ostream& output) const;
+};
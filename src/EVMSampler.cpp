@@ -0,0 +1,163 @@
+#include "EVMSampler.h"
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#define EVM_SAMPLER_SIGNAL_TIMER
+#endif
+
+std::atomic<uint32_t> EVMSampler::tick = 0;
+std::atomic<bool> EVMSampler::active = false;
+
+#ifdef EVM_SAMPLER_SIGNAL_TIMER
+// handler and profiling timer of the host, restored when sampling stops, only one sampler runs at a time
+static struct sigaction previousAction {};
+static itimerval previousTimer {};
+#endif
+
+EVMThreadSamples::EVMThreadSamples(std::span<const EVMInstruction> instructions, size_t entryIp, uint32_t tick):
+m_instructions(instructions),
+m_entryOffset(entryIp < instructions.size() ? instructions[entryIp].offset : 0),
+m_seenTick(tick)
+{
+}
+void EVMThreadSamples::sample(uint32_t tick, const std::stack<size_t>& callStack)
+{
+	m_seenTick = tick;
+	// call stack holds return instruction numbers, the call preceding each of them names the function entered
+	std::stack<size_t> returns {callStack};
+	m_frames.resize(returns.size() + 1);
+	for (size_t i = returns.size(); i > 0; i--, returns.pop())
+	{
+		const size_t returnIp = returns.top();
+		const bool validCall = returnIp > 0 && returnIp <= m_instructions.size() && m_instructions[returnIp - 1].opcode == EVMOpcode::CALL;
+		m_frames[i] = validCall ? m_instructions[returnIp - 1].arguments[0].data.codeAddress : 0;
+	}
+	m_frames[0] = m_entryOffset;
+	m_stacks[m_frames]++;
+}
+
+void EVMSampler::onTimer(int)
+{
+	tick.fetch_add(1, std::memory_order_relaxed); // lock free atomics are async signal safe
+}
+EVMSampler::EVMSampler(std::chrono::microseconds interval):
+m_interval(interval)
+{
+}
+EVMSampler::~EVMSampler()
+{
+	stop();
+}
+bool EVMSampler::start()
+{
+	if (m_started || active.exchange(true))
+	{
+		return false;
+	}
+	m_started = true;
+	m_stop = false;
+#ifdef EVM_SAMPLER_SIGNAL_TIMER
+	// profiling timer counts CPU time of the whole process, so idle guests are not sampled
+	struct sigaction action {};
+	action.sa_handler = &EVMSampler::onTimer;
+	action.sa_flags = SA_RESTART; // console reads and sleeps of guests are not interrupted
+	sigemptyset(&action.sa_mask);
+	itimerval timer {};
+	timer.it_interval.tv_sec = m_interval.count() / 1000000;
+	timer.it_interval.tv_usec = m_interval.count() % 1000000;
+	timer.it_value = timer.it_interval;
+	if (sigaction(SIGPROF, &action, &previousAction) == 0)
+	{
+		if (setitimer(ITIMER_PROF, &timer, &previousTimer) == 0)
+		{
+			m_signalTimer = true;
+			return true;
+		}
+		sigaction(SIGPROF, &previousAction, nullptr);
+	}
+#endif
+	m_timerThread = std::thread {[this]()
+	{
+		while (!m_stop)
+		{
+			std::this_thread::sleep_for(m_interval);
+			onTimer(0);
+		}
+	}};
+	return true;
+}
+void EVMSampler::stop()
+{
+	if (!m_started)
+	{
+		return;
+	}
+#ifdef EVM_SAMPLER_SIGNAL_TIMER
+	if (m_signalTimer)
+	{
+		itimerval timer {};
+		setitimer(ITIMER_PROF, &timer, nullptr);
+		// a tick may still be pending, it is taken here so a default host action does not end the process
+		sigset_t profSignal {};
+		sigset_t previousMask {};
+		sigemptyset(&profSignal);
+		sigaddset(&profSignal, SIGPROF);
+		pthread_sigmask(SIG_BLOCK, &profSignal, &previousMask);
+#ifdef __linux__
+		const timespec noWait {};
+		while (sigtimedwait(&profSignal, nullptr, &noWait) == SIGPROF)
+		{
+		}
+#endif
+		sigaction(SIGPROF, &previousAction, nullptr);
+		pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+		setitimer(ITIMER_PROF, &previousTimer, nullptr);
+		m_signalTimer = false;
+	}
+#endif
+	if (m_timerThread.joinable())
+	{
+		m_stop = true;
+		m_timerThread.join();
+	}
+	m_started = false;
+	active = false;
+}
+EVMThreadSamples EVMSampler::createThreadSamples(std::span<const EVMInstruction> instructions, size_t entryIp) const
+{
+	return EVMThreadSamples {instructions, entryIp, getTick()};
+}
+void EVMSampler::merge(const EVMThreadSamples& samples)
+{
+	std::unique_lock l {m_mergeMutex};
+	for (const auto& [frames, count] : samples.m_stacks)
+	{
+		m_stacks[frames] += count;
+	}
+}
+uint64_t EVMSampler::getSampleCount() const
+{
+	uint64_t count = 0;
+	for (const auto& stack : m_stacks)
+	{
+		count += stack.second;
+	}
+	return count;
+}
+void EVMSampler::writeCollapsedStacks(std::ostream& output) const
+{
+	std::stringstream ss;
+	ss << std::hex;
+	for (const auto& [frames, count] : m_stacks)
+	{
+		for (size_t i = 0; i < frames.size(); i++)
+		{
+			ss << (i == 0 ? "" : ";") << "sub_" << frames[i];
+		}
+		ss << " " << std::dec << count << std::hex << std::endl;
+	}
+	output << ss.str();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "EVMTypes.h"
+#include <atomic>
+#include <chrono>
+#include <inttypes.h>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <span>
+#include <stack>
+#include <string>
+#include <thread>
+#include <vector>
+
+// guest call stacks sampled by one guest thread, owned by its execution unit and merged into the sampler when the thread exits
+class EVMThreadSamples
+{
+private:
+	std::span<const EVMInstruction> m_instructions;
+	uint32_t m_entryOffset; // code offset the thread started at, bottom frame of all its stacks
+	uint32_t m_seenTick;
+	std::map<std::vector<uint32_t>, uint64_t> m_stacks {}; // function entry offsets, outermost first
+	std::vector<uint32_t> m_frames {};
+
+	friend class EVMSampler;
+public:
+	EVMThreadSamples(std::span<const EVMInstruction> instructions, size_t entryIp, uint32_t tick);
+	bool isSampleDue(uint32_t tick) const { return tick != m_seenTick; }
+	void sample(uint32_t tick, const std::stack<size_t>& callStack);
+};
+
+// statistical profiler of guest functions; a timer ticks while the process uses CPU and every running guest thread records
+// its call stack at the next instruction after a tick, stacks are written in the collapsed format of flame graph tools
+class EVMSampler
+{
+private:
+	static std::atomic<uint32_t> tick;
+	static std::atomic<bool> active; // one sampler at a time, the timer is process wide
+
+	std::mutex m_mergeMutex {};
+	std::map<std::vector<uint32_t>, uint64_t> m_stacks {};
+	std::chrono::microseconds m_interval;
+	bool m_started {};
+	bool m_signalTimer {};
+	std::atomic<bool> m_stop {};
+	std::thread m_timerThread {};
+
+	static void onTimer(int);
+public:
+	static constexpr auto Default_Interval = std::chrono::milliseconds(1);
+
+	EVMSampler(std::chrono::microseconds interval = Default_Interval);
+	EVMSampler(const EVMSampler&) = delete;
+	EVMSampler& operator=(const EVMSampler&) = delete;
+	~EVMSampler();
+	bool start(); // false when another sampler is running
+	void stop();
+	static uint32_t getTick() { return tick.load(std::memory_order_relaxed); }
+	EVMThreadSamples createThreadSamples(std::span<const EVMInstruction> instructions, size_t entryIp) const;
+	void merge(const EVMThreadSamples& samples);
+	uint64_t getSampleCount() const;
+	// one line per distinct stack: frames separated by ';' and the number of samples, threads must have exited
+	void writeCollapsedStacks(std::ostream& output) const;
+};
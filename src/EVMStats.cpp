@@ -0,0 +1,110 @@
+#include "EVMStats.h"
+#include <iomanip>
+#include <sstream>
+
+static const std::vector<std::string> Phase_Names {"load", "decode", "link", "optimize", "cfg", "compile", "render", "execute"};
+
+static double toSeconds(std::chrono::steady_clock::duration duration)
+{
+	return std::chrono::duration<double>(duration).count();
+}
+void EVMStats::addPhase(const std::string& name, std::chrono::steady_clock::duration duration)
+{
+	m_phases.emplace_back(name, duration);
+}
+std::chrono::steady_clock::duration EVMStats::getPhase(const std::string& name) const
+{
+	std::chrono::steady_clock::duration total {};
+	for (const auto& [phaseName, duration] : m_phases)
+	{
+		if (phaseName == name)
+		{
+			total += duration;
+		}
+	}
+	return total;
+}
+uint32_t EVMStats::threadStarted()
+{
+	const uint32_t live = m_liveThreads.fetch_add(1) + 1;
+	uint32_t peak = m_peakLiveThreads.load();
+	while (live > peak && !m_peakLiveThreads.compare_exchange_weak(peak, live))
+	{
+	}
+	return m_startedThreads.fetch_add(1);
+}
+void EVMStats::threadExited(uint32_t threadNumber, uint64_t instructions)
+{
+	m_liveThreads.fetch_sub(1);
+	std::unique_lock l {m_threadsMutex};
+	if (m_threadInstructions.size() <= threadNumber)
+	{
+		m_threadInstructions.resize(threadNumber + 1);
+	}
+	m_threadInstructions[threadNumber] = instructions;
+}
+uint64_t EVMStats::getTotalInstructions() const
+{
+	uint64_t total = 0;
+	for (uint64_t instructions : m_threadInstructions)
+	{
+		total += instructions;
+	}
+	return total;
+}
+void EVMStats::writeText(std::ostream& output) const
+{
+	// key=value lines, keys never change meaning so they can be trended
+	const uint64_t instructions = getTotalInstructions();
+	const double executeSeconds = toSeconds(getPhase("execute"));
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(6);
+	for (const auto& name : Phase_Names)
+	{
+		ss << "phase." << name << ".seconds=" << toSeconds(getPhase(name)) << '\n';
+	}
+	ss << "instructions.total=" << instructions << '\n';
+	for (size_t i = 0; i < m_threadInstructions.size(); i++)
+	{
+		ss << "instructions.thread." << i << '=' << m_threadInstructions[i] << '\n';
+	}
+	ss << std::setprecision(0) << "instructions.per_second=" << (executeSeconds > 0 ? instructions / executeSeconds : 0.0) << '\n';
+	ss << "threads.started=" << m_startedThreads << '\n';
+	ss << "threads.peak_live=" << m_peakLiveThreads << '\n';
+	ss << "memory.guest_bytes=" << m_guestMemoryBytes << '\n';
+	ss << "file.guest_reads=" << m_file.guestReads << '\n';
+	ss << "file.guest_writes=" << m_file.guestWrites << '\n';
+	ss << "file.bytes_read=" << m_file.bytesRead << '\n';
+	ss << "file.bytes_written=" << m_file.bytesWritten << '\n';
+	ss << "file.host_reads=" << m_file.fileReads << '\n';
+	ss << "file.host_writes=" << m_file.fileWrites << '\n';
+	ss << "file.host_flushes=" << m_file.fileFlushes << '\n';
+	ss << "console.reads=" << m_consoleReads << '\n';
+	ss << "console.bytes_written=" << m_consoleBytesWritten << '\n';
+	output << ss.str();
+}
+void EVMStats::writeJson(std::ostream& output) const
+{
+	const uint64_t instructions = getTotalInstructions();
+	const double executeSeconds = toSeconds(getPhase("execute"));
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(6);
+	ss << "{\"phases\": {";
+	for (size_t i = 0; i < Phase_Names.size(); i++)
+	{
+		ss << (i == 0 ? "" : ", ") << '"' << Phase_Names[i] << "\": " << toSeconds(getPhase(Phase_Names[i]));
+	}
+	ss << "}, \"instructions\": {\"total\": " << instructions << ", \"perThread\": [";
+	for (size_t i = 0; i < m_threadInstructions.size(); i++)
+	{
+		ss << (i == 0 ? "" : ", ") << m_threadInstructions[i];
+	}
+	ss << std::setprecision(0) << "], \"perSecond\": " << (executeSeconds > 0 ? instructions / executeSeconds : 0.0) << "}, ";
+	ss << "\"threads\": {\"started\": " << m_startedThreads << ", \"peakLive\": " << m_peakLiveThreads << "}, ";
+	ss << "\"memory\": {\"guestBytes\": " << m_guestMemoryBytes << "}, ";
+	ss << "\"file\": {\"guestReads\": " << m_file.guestReads << ", \"guestWrites\": " << m_file.guestWrites << ", \"bytesRead\": " << m_file.bytesRead
+		<< ", \"bytesWritten\": " << m_file.bytesWritten << ", \"hostReads\": " << m_file.fileReads << ", \"hostWrites\": " << m_file.fileWrites
+		<< ", \"hostFlushes\": " << m_file.fileFlushes << "}, ";
+	ss << "\"console\": {\"reads\": " << m_consoleReads << ", \"bytesWritten\": " << m_consoleBytesWritten << "}}\n";
+	output << ss.str();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "EVMFileCache.h"
+#include <atomic>
+#include <chrono>
+#include <inttypes.h>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// run metrics reported by --stats, either as key=value lines or as one JSON object
+class EVMStats
+{
+private:
+	std::vector<std::pair<std::string, std::chrono::steady_clock::duration>> m_phases {}; // in order they ran
+	std::mutex m_threadsMutex {};
+	std::vector<uint64_t> m_threadInstructions {}; // by guest thread number, main thread is 0
+	std::atomic<uint32_t> m_startedThreads {};
+	std::atomic<uint32_t> m_liveThreads {};
+	std::atomic<uint32_t> m_peakLiveThreads {};
+	std::atomic<uint64_t> m_consoleReads {};
+	std::atomic<uint64_t> m_consoleBytesWritten {};
+	uint64_t m_guestMemoryBytes {};
+	EVMFileCache::EVMFileCacheStats m_file {};
+
+	std::chrono::steady_clock::duration getPhase(const std::string& name) const;
+	uint64_t getTotalInstructions() const;
+public:
+	void addPhase(const std::string& name, std::chrono::steady_clock::duration duration);
+	// guest threads report themselves, number is the order in which threads started
+	uint32_t threadStarted();
+	void threadExited(uint32_t threadNumber, uint64_t instructions);
+	void consoleRead() { m_consoleReads.fetch_add(1, std::memory_order_relaxed); }
+	void consoleWritten(size_t bytes) { m_consoleBytesWritten.fetch_add(bytes, std::memory_order_relaxed); }
+	void setGuestMemoryBytes(uint64_t bytes) { m_guestMemoryBytes = bytes; }
+	void setFileStats(const EVMFileCache::EVMFileCacheStats& file) { m_file = file; }
+	uint32_t getPeakLiveThreads() const { return m_peakLiveThreads; }
+	const std::vector<uint64_t>& getThreadInstructions() const { return m_threadInstructions; } // guest threads must have exited
+	void writeText(std::ostream& output) const;
+	void writeJson(std::ostream& output) const;
+};
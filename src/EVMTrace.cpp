@@ -0,0 +1,142 @@
+#include "EVMTrace.h"
+
+size_t EVMTraceRing::drain(std::ostream& output)
+{
+	const size_t tail = m_tail.load(std::memory_order_relaxed);
+	const size_t head = m_head.load(std::memory_order_acquire);
+	size_t position = tail;
+	while (position != head)
+	{
+		// contiguous part up to the end of the buffer
+		const size_t index = position & (Capacity - 1);
+		const size_t count = std::min(head - position, Capacity - index);
+		output.write(reinterpret_cast<const char*>(&m_records[index]), count * sizeof(EVMTraceRecord));
+		position += count;
+	}
+	m_tail.store(head, std::memory_order_release);
+	return head - tail;
+}
+
+EVMTraceWriter::EVMTraceWriter(const std::string& tracePath, uint32_t flags, uint64_t sourceHash):
+m_file(tracePath, std::ios::binary | std::ios::trunc),
+m_flags(flags)
+{
+	if (!m_file.is_open())
+	{
+		return;
+	}
+	EVMTraceHeader header {};
+	memcpy(header.magic, Trace_Magic, sizeof(header.magic));
+	header.version = Trace_Version;
+	header.flags = flags;
+	header.sourceHash = sourceHash;
+	m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	m_spillThread = std::thread {&EVMTraceWriter::spill, this};
+}
+EVMTraceWriter::~EVMTraceWriter()
+{
+	close();
+}
+bool EVMTraceWriter::close()
+{
+	if (m_spillThread.joinable())
+	{
+		{
+			std::unique_lock l {m_stopMutex};
+			m_stop = true;
+		}
+		m_stopCondition.notify_one();
+		m_spillThread.join();
+	}
+	if (!m_file.is_open())
+	{
+		return false;
+	}
+	drainRings();
+	m_file.close();
+	return !m_file.fail();
+}
+EVMTraceRing& EVMTraceWriter::createRing()
+{
+	std::unique_lock l {m_ringsMutex};
+	m_rings.push_back(std::make_unique<EVMTraceRing>(static_cast<uint16_t>(m_rings.size())));
+	return *m_rings.back();
+}
+size_t EVMTraceWriter::drainRings()
+{
+	std::unique_lock l {m_ringsMutex};
+	size_t drained = 0;
+	for (auto& ring : m_rings)
+	{
+		drained += ring->drain(m_file);
+	}
+	return drained;
+}
+void EVMTraceWriter::spill()
+{
+	while (!m_stop)
+	{
+		if (drainRings() == 0)
+		{
+			std::unique_lock l {m_stopMutex};
+			m_stopCondition.wait_for(l, Spill_Interval, [this]() { return m_stop.load(); });
+		}
+	}
+}
+
+EVMTraceDecoder::EVMTraceDecoder(const std::string& tracePath)
+{
+	std::ifstream traceFile {tracePath, std::ios::binary};
+	if (!traceFile.is_open())
+	{
+		m_error = ESETVMStatus::FILE_OPEN_ERROR;
+		return;
+	}
+	traceFile.read(reinterpret_cast<char*>(&m_header), sizeof(m_header));
+	if (traceFile.fail() || memcmp(m_header.magic, EVMTraceWriter::Trace_Magic, sizeof(m_header.magic)) || m_header.version != EVMTraceWriter::Trace_Version)
+	{
+		m_error = ESETVMStatus::FILE_CORRUPTED;
+		return;
+	}
+	EVMTraceRecord record {};
+	while (traceFile.read(reinterpret_cast<char*>(&record), sizeof(record)))
+	{
+		m_records.push_back(record);
+	}
+	// rings are spilled in chunks, records of one thread are in order and follow each other at equal timestamps
+	std::stable_sort(m_records.begin(), m_records.end(), [](const EVMTraceRecord& a, const EVMTraceRecord& b)
+	{
+		return a.timestamp != b.timestamp ? a.timestamp < b.timestamp : a.threadId < b.threadId;
+	});
+}
+bool EVMTraceDecoder::render(const EVMDisasm& disasm, uint64_t sourceHash, std::ostream& output) const
+{
+	if (m_error != ESETVMStatus::SUCCESS || m_header.sourceHash != sourceHash)
+	{
+		return false;
+	}
+	std::string buffer {};
+	for (const auto& record : m_records)
+	{
+		buffer.assign(record.callDepth, '\t');
+		buffer += std::to_string(record.threadId) + ": ";
+		if (record.type == EVMTraceRecordType::INSTRUCTION)
+		{
+			const auto insNum = m_header.flags & TRACE_CODE_OFFSETS ? disasm.insNumFromCodeOff(record.location) : std::optional<size_t> {record.location};
+			const auto line = insNum.has_value() ? disasm.getSourceCodeLineForIp(insNum.value()) : std::nullopt;
+			if (!line.has_value())
+			{
+				return false;
+			}
+			buffer += line.value();
+		}
+		else
+		{
+			std::stringstream ss;
+			ss << "    r" << record.location << " = 0x" << std::hex << record.value;
+			buffer += ss.str();
+		}
+		output << buffer << '\n';
+	}
+	return !output.fail();
+}
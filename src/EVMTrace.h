@@ -0,0 +1,116 @@
+#pragma once
+
+#include "EVMDisasm.h"
+#include "EVMTypes.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <inttypes.h>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class EVMTraceRecordType : uint8_t
+{
+	INSTRUCTION,
+	REGISTER // register changed by the preceding instruction of the same thread
+};
+struct EVMTraceRecord
+{
+	uint64_t timestamp; // nanoseconds since trace start
+	uint64_t value; // new register value for REGISTER records
+	uint32_t location; // instruction number (code offset when decoding lazily) or register index
+	uint16_t threadId; // guest threads are numbered in order of creation
+	EVMTraceRecordType type;
+	uint8_t callDepth; // saturates at 255
+};
+enum EVMTraceFlags : uint32_t
+{
+	TRACE_CODE_OFFSETS = 1, // locations are code offsets instead of instruction numbers
+	TRACE_REGISTERS = 2
+};
+
+// single producer single consumer ring, the producer is one guest thread and the consumer is the spill thread
+class EVMTraceRing
+{
+private:
+	static const size_t Capacity = 64 * 1024; // power of two
+
+	std::vector<EVMTraceRecord> m_records;
+	alignas(64) std::atomic<size_t> m_head {}; // written by producer only
+	alignas(64) std::atomic<size_t> m_tail {}; // written by consumer only
+	uint16_t m_threadId;
+
+public:
+	EVMTraceRing(uint16_t threadId): m_records(Capacity), m_threadId(threadId) {}
+	uint16_t getThreadId() const { return m_threadId; }
+	void push(const EVMTraceRecord& record)
+	{
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		while (head - m_tail.load(std::memory_order_acquire) == Capacity)
+		{
+			std::this_thread::yield(); // full, trace is lossless so wait for the spill thread
+		}
+		m_records[head & (Capacity - 1)] = record;
+		m_head.store(head + 1, std::memory_order_release);
+	}
+	size_t drain(std::ostream& output);
+};
+
+// owns per thread rings and the thread spilling them to the trace file
+class EVMTraceWriter
+{
+private:
+	static constexpr char Trace_Magic[] = "EVMTRACE";
+	static const uint32_t Trace_Version = 1;
+	static constexpr auto Spill_Interval = std::chrono::milliseconds(1);
+
+	std::ofstream m_file;
+	std::mutex m_ringsMutex {};
+	std::vector<std::unique_ptr<EVMTraceRing>> m_rings {};
+	std::chrono::steady_clock::time_point m_start {std::chrono::steady_clock::now()};
+	uint32_t m_flags;
+	std::atomic<bool> m_stop {};
+	std::mutex m_stopMutex {};
+	std::condition_variable m_stopCondition {};
+	std::thread m_spillThread {};
+
+	void spill();
+	size_t drainRings();
+	friend class EVMTraceDecoder;
+public:
+	struct EVMTraceHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t flags;
+		uint64_t sourceHash;
+	};
+
+	EVMTraceWriter(const std::string& tracePath, uint32_t flags, uint64_t sourceHash);
+	~EVMTraceWriter();
+	bool isOpen() const { return m_file.is_open(); }
+	bool close(); // drains all rings, false if writing failed
+	uint32_t getFlags() const { return m_flags; }
+	EVMTraceRing& createRing(); // one per guest thread, valid until writer is destroyed
+	uint64_t getTimestamp() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count(); }
+};
+
+// renders a trace in the verbose mode text format: one tab per call level, thread, source line
+class EVMTraceDecoder
+{
+private:
+	std::vector<EVMTraceRecord> m_records {};
+	EVMTraceWriter::EVMTraceHeader m_header {};
+	ESETVMStatus m_error {ESETVMStatus::SUCCESS};
+
+public:
+	EVMTraceDecoder(const std::string& tracePath);
+	ESETVMStatus getError() const { return m_error; }
+	size_t getRecordCount() const { return m_records.size(); }
+	bool render(const EVMDisasm& disasm, uint64_t sourceHash, std::ostream& output) const; // disasm must have parsed instructions
+};
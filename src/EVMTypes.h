@@ -1,12 +1,15 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <inttypes.h>
 #include <stack>
+#include <stdexcept>
 #include <vector>
 
 using bitSequenceInteger = uint8_t;
 
-enum class EVMOpcode
+enum class EVMOpcode : uint8_t
 {
 	UNKNOWN,
 	MOV,
@@ -32,7 +35,7 @@ enum class EVMOpcode
 	LOCK,
 	UNLOCK
 };
-enum class MemoryAccessSize
+enum class MemoryAccessSize : uint8_t
 {
 	NONE = 0,
 	BYTE = 1,
@@ -40,7 +43,7 @@ enum class MemoryAccessSize
 	DWORD = 4,
 	QWORD = 8
 };
-enum class DataAccessType
+enum class DataAccessType : uint8_t
 {
 	REGISTER,
 	DEREFERENCE
@@ -51,7 +54,7 @@ struct DataAccess
 	MemoryAccessSize accessSize;
 	uint8_t registerIndex;
 };
-enum class ArgumentType
+enum class ArgumentType : uint8_t
 {
 	DATA_ACCESS,
 	ADDRESS,
@@ -67,11 +70,53 @@ struct EVMArgument
 		DataAccess dataAccess;
 	} data;
 };
+// fixed capacity keeps instructions trivially copyable, so decoded code can be stored and mapped as plain bytes
+class EVMArgumentList
+{
+private:
+	std::array<EVMArgument, 4> m_arguments {}; // read has the most arguments
+	uint8_t m_size {};
+public:
+	static constexpr size_t Max_Arguments = 4;
+	
+	void push_back(const EVMArgument& argument)
+	{
+		if (m_size == Max_Arguments)
+		{
+			throw std::length_error("too many instruction arguments");
+		}
+		m_arguments[m_size++] = argument;
+	}
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	const EVMArgument& operator[](size_t index) const { return m_arguments[index]; }
+	EVMArgument& operator[](size_t index) { return m_arguments[index]; }
+	const EVMArgument& at(size_t index) const
+	{
+		if (index >= m_size)
+		{
+			throw std::out_of_range("instruction argument index out of range");
+		}
+		return m_arguments[index];
+	}
+	const EVMArgument& back() const { return m_arguments[m_size - 1]; }
+	const EVMArgument* begin() const { return m_arguments.data(); }
+	const EVMArgument* end() const { return m_arguments.data() + m_size; }
+};
 struct EVMInstruction
 {
+	static constexpr uint32_t Unresolved_Target = UINT32_MAX;
+	
 	EVMOpcode opcode;
 	uint32_t offset; // code adresses are 32 bits
-	std::vector<EVMArgument> arguments;
+	EVMArgumentList arguments;
+	uint32_t target {Unresolved_Target}; // index of the instruction the code address argument points to, set by EVMDisasm::linkInstructions
+};
+struct EVMBasicBlock
+{
+	uint32_t offset;
+	uint32_t endOffset; // offset of the first instruction following the block
+	std::vector<EVMInstruction> instructions;
 };
 enum class ESETVMStatus
 {
@@ -91,7 +136,9 @@ enum class ESETVMStatus
 	FILE_TOO_BIG = 12,
 	OPCODE_PARSING_ERROR = 13,
 	OPCODE_ARGUMENT_PARSING_ERROR = 14,
-	INSTRUCTIONS_TO_SOURCE_CODE_ERROR = 15
+	INSTRUCTIONS_TO_SOURCE_CODE_ERROR = 15,
+	ASSEMBLE_ERROR = 16,
+	FILE_WRITE_ERROR = 17
 };
 struct EVMContext
 {
@@ -1,5 +1,6 @@
 #include "CLIArgParser.h"
 #include "ESETVM.h"
+#include "EVMAssembler.h"
 
 int main (int argc, char** argv)
 {
@@ -9,27 +10,45 @@ int main (int argc, char** argv)
 		return static_cast<int>(ESETVMStatus::CLI_ARG_PARSING_ERROR);
 	}
 	cmdLineFlags cliFlags = cliParser.getFlags();
-	ESETVM evm {cliParser.getInputPath(), cliParser.getOutputPath(), cliFlags.verbose}; // outputPath empty if not set
-	ESETVMStatus initStatus = evm.init();
-	if (initStatus != ESETVMStatus::SUCCESS)
+	if (cliFlags.assemble)
 	{
-		return static_cast<int>(initStatus);
+		return static_cast<int>(EVMAssembler::assembleFile(cliParser.getInputPath(), cliParser.getOutputPath()));
+	}
+	ESETVMOptions options {.verbose = cliFlags.verbose, .lazyDecoding = cliFlags.lazyDecoding, .imageCacheDirectory = cliParser.getImageCacheDirectory(),
+		.traceFilePath = cliFlags.trace ? cliParser.getTracePath() : "", .traceRegisters = cliFlags.traceRegisters,
+		.profile = cliFlags.profile, .profileJsonPath = cliParser.getProfileJsonPath(),
+		.sampleFilePath = cliFlags.sample ? cliParser.getSamplePath() : "",
+		.lockProfile = cliFlags.lockProfile, .lockProfileJsonPath = cliParser.getLockProfileJsonPath(),
+		.stats = cliFlags.stats || cliFlags.statsJson, .optimize = cliFlags.optimize, .aot = cliFlags.aot};
+	ESETVM evm {cliParser.getInputPath(), cliParser.getOutputPath(), options}; // outputPath empty if not set
+	ESETVMStatus status = evm.init();
+	if (status != ESETVMStatus::SUCCESS)
+	{
+		return static_cast<int>(status);
 	}
 	if (cliFlags.disassemble)
 	{
-		ESETVMStatus saveSrcStatus = evm.saveSourceCode();
-		if (saveSrcStatus != ESETVMStatus::SUCCESS)
-		{
-			return static_cast<int>(saveSrcStatus);
-		}
+		status = evm.saveSourceCode();
+	}
+	else if (cliFlags.rewrite)
+	{
+		status = evm.saveOptimizedProgram();
+	}
+	else if (cliFlags.cfgDot)
+	{
+		status = evm.saveControlFlowGraph();
+	}
+	else if (cliFlags.decodeTrace)
+	{
+		status = evm.decodeTrace(cliParser.getTracePath(), std::cout);
 	}
 	else if (cliFlags.run)
 	{
-		ESETVMStatus runStatus = evm.run(cliParser.getBinaryFilePath());
-		if (runStatus != ESETVMStatus::SUCCESS)
-		{
-			return static_cast<int>(runStatus);
-		}
+		status = evm.run(cliParser.getBinaryFilePath());
+	}
+	if (options.stats)
+	{
+		evm.writeStats(std::cerr, cliFlags.statsJson); // also for failed runs, which are worth trending as well
 	}
-	return static_cast<int>(ESETVMStatus::SUCCESS);
+	return static_cast<int>(status);
 }
@@ -1,27 +1,279 @@
 #include "utils.h"
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define UTILS_X86_HEX_ENCODERS
+#endif
 
 namespace utils
 {
+	static const size_t Hex_Dump_Task_Bytes = 1024 * 1024;
+	static const char Hex_Digits[] = "0123456789abcdef";
+	static const uint64_t Hash_Prime_1 = 0x9e3779b185ebca87ULL;
+	static const uint64_t Hash_Prime_2 = 0xc2b2ae3d27d4eb4fULL;
+	static const uint64_t Hash_Prime_3 = 0x165667b19e3779f9ULL;
+	static const uint64_t Hash_Prime_4 = 0x85ebca77c2b2ae63ULL;
+	static const uint64_t Hash_Prime_5 = 0x27d4eb2f165667c5ULL;
+
+	static void encodeHexScalar(const std::byte* input, size_t count, char* output)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			const auto value = static_cast<unsigned char>(input[i]);
+			output[3 * i] = Hex_Digits[value >> 4];
+			output[3 * i + 1] = Hex_Digits[value & 0xf];
+			output[3 * i + 2] = ' ';
+		}
+	}
+#ifdef UTILS_X86_HEX_ENCODERS
+	// shuffle masks spreading 16 interleaved digit pairs from two registers into 48 chars "xx xx ..."
+	struct HexSpreadMasks
+	{
+		alignas(16) uint8_t fromLow[3][16];
+		alignas(16) uint8_t fromHigh[3][16];
+		alignas(16) uint8_t spaces[3][16];
+	};
+	static constexpr HexSpreadMasks makeHexSpreadMasks()
+	{
+		HexSpreadMasks masks {};
+		for (size_t position = 0; position < 48; position++)
+		{
+			const size_t vector = position / 16;
+			const size_t lane = position % 16;
+			const size_t digit = position / 3 * 2 + position % 3;
+			const bool space = position % 3 == 2;
+			masks.fromLow[vector][lane] = !space && digit < 16 ? digit : 0x80;
+			masks.fromHigh[vector][lane] = !space && digit >= 16 ? digit - 16 : 0x80;
+			masks.spaces[vector][lane] = space ? ' ' : 0;
+		}
+		return masks;
+	}
+	static constexpr HexSpreadMasks Hex_Spread_Masks = makeHexSpreadMasks();
+
+	__attribute__((target("ssse3"))) static inline void spreadHexPairs(__m128i pairsLow, __m128i pairsHigh, char* output)
+	{
+		for (size_t i = 0; i < 3; i++)
+		{
+			const __m128i fromLow = _mm_shuffle_epi8(pairsLow, _mm_load_si128(reinterpret_cast<const __m128i*>(Hex_Spread_Masks.fromLow[i])));
+			const __m128i fromHigh = _mm_shuffle_epi8(pairsHigh, _mm_load_si128(reinterpret_cast<const __m128i*>(Hex_Spread_Masks.fromHigh[i])));
+			const __m128i spaces = _mm_load_si128(reinterpret_cast<const __m128i*>(Hex_Spread_Masks.spaces[i]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + 16 * i), _mm_or_si128(_mm_or_si128(fromLow, fromHigh), spaces));
+		}
+	}
+	__attribute__((target("ssse3"))) static inline void encodeHexBlockSSSE3(const std::byte* input, char* output)
+	{
+		const __m128i digits = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Hex_Digits));
+		const __m128i nibbleMask = _mm_set1_epi8(0x0f);
+		const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input));
+		const __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(value, 4), nibbleMask));
+		const __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(value, nibbleMask));
+		spreadHexPairs(_mm_unpacklo_epi8(high, low), _mm_unpackhi_epi8(high, low), output);
+	}
+	// count must be at least 16, last block overlaps the previous one instead of falling back to scalar code
+	__attribute__((target("ssse3"))) static void encodeHexSSSE3(const std::byte* input, size_t count, char* output)
+	{
+		size_t offset = 0;
+		for (; offset + 16 <= count; offset += 16)
+		{
+			encodeHexBlockSSSE3(input + offset, output + 3 * offset);
+		}
+		if (offset < count)
+		{
+			encodeHexBlockSSSE3(input + count - 16, output + 3 * (count - 16));
+		}
+	}
+	__attribute__((target("avx2"))) static inline void encodeHexBlockAVX2(const std::byte* input, char* output)
+	{
+		const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Hex_Digits)));
+		const __m256i nibbleMask = _mm256_set1_epi8(0x0f);
+		const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input));
+		const __m256i high = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(value, 4), nibbleMask));
+		const __m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(value, nibbleMask));
+		const __m256i pairsLow = _mm256_unpacklo_epi8(high, low); // per 128 bit lane: digits of bytes 0-7 and 16-23
+		const __m256i pairsHigh = _mm256_unpackhi_epi8(high, low); // bytes 8-15 and 24-31
+		spreadHexPairs(_mm256_castsi256_si128(pairsLow), _mm256_castsi256_si128(pairsHigh), output);
+		spreadHexPairs(_mm256_extracti128_si256(pairsLow, 1), _mm256_extracti128_si256(pairsHigh, 1), output + 48);
+	}
+	// count must be at least 32
+	__attribute__((target("avx2"))) static void encodeHexAVX2(const std::byte* input, size_t count, char* output)
+	{
+		size_t offset = 0;
+		for (; offset + 32 <= count; offset += 32)
+		{
+			encodeHexBlockAVX2(input + offset, output + 3 * offset);
+		}
+		if (offset < count)
+		{
+			encodeHexBlockAVX2(input + count - 32, output + 3 * (count - 32));
+		}
+	}
+#endif
+	static HexEncoder getBestHexEncoder()
+	{
+		static const HexEncoder bestEncoder = isHexEncoderSupported(HexEncoder::AVX2) ? HexEncoder::AVX2 : isHexEncoderSupported(HexEncoder::SSSE3) ? HexEncoder::SSSE3 : HexEncoder::SCALAR;
+		return bestEncoder;
+	}
+	bool isHexEncoderSupported(HexEncoder encoder)
+	{
+		switch (encoder)
+		{
+#ifdef UTILS_X86_HEX_ENCODERS
+			case HexEncoder::SSSE3:
+				return __builtin_cpu_supports("ssse3");
+			case HexEncoder::AVX2:
+				return __builtin_cpu_supports("avx2");
+#endif
+			case HexEncoder::SCALAR:
+			case HexEncoder::BEST:
+				return true;
+			default:
+				return false;
+		}
+	}
+	void encodeHex(std::span<const std::byte> bytes, char* output, HexEncoder encoder)
+	{
+		if (encoder == HexEncoder::BEST)
+		{
+			encoder = getBestHexEncoder();
+		}
+#ifdef UTILS_X86_HEX_ENCODERS
+		if (encoder == HexEncoder::AVX2 && bytes.size() >= 32)
+		{
+			encodeHexAVX2(bytes.data(), bytes.size(), output);
+			return;
+		}
+		if ((encoder == HexEncoder::AVX2 || encoder == HexEncoder::SSSE3) && bytes.size() >= 16)
+		{
+			encodeHexSSSE3(bytes.data(), bytes.size(), output);
+			return;
+		}
+#endif
+		encodeHexScalar(bytes.data(), bytes.size(), output);
+	}
+
 	std::streamsize getFileSize(std::ifstream& fileHandle)
 	{
-		fileHandle.ignore(std::numeric_limits<std::streamsize>::max());
-		std::streamsize length = fileHandle.gcount();
-		fileHandle.clear();   //  Since ignore will have set eof.
+		fileHandle.seekg(0, std::ios_base::end);
+		std::streamsize length = fileHandle.tellg();
 		fileHandle.seekg(0, std::ios_base::beg);
-		return length;
+		return length < 0 ? 0 : length;
+	}
+	std::string byteArrayToHexString(std::span<const std::byte> byteArray, uint32_t width, size_t threadCount)
+	{
+		// every byte takes "xx " and every full row adds a newline, so each range of rows knows where its text goes
+		const size_t rowBytes = width == 0 ? std::max<size_t>(byteArray.size(), 1) : width;
+		const size_t rowCount = (byteArray.size() + rowBytes - 1) / rowBytes;
+		const size_t rowsPerTask = std::max<size_t>(1, Hex_Dump_Task_Bytes / rowBytes);
+		std::string hexString (byteArray.size() * 3 + (width == 0 ? 0 : byteArray.size() / width), '\0');
+		parallelFor((rowCount + rowsPerTask - 1) / rowsPerTask, [&](size_t task)
+		{
+			const size_t end = std::min(byteArray.size(), (task + 1) * rowsPerTask * rowBytes);
+			for (size_t begin = task * rowsPerTask * rowBytes; begin < end; begin += rowBytes)
+			{
+				const auto row = byteArray.subspan(begin, std::min(rowBytes, end - begin));
+				char* output = hexString.data() + begin * 3 + (width == 0 ? 0 : begin / width);
+				encodeHex(row, output);
+				if (width != 0 && row.size() == width)
+				{
+					output[row.size() * 3] = '\n';
+				}
+			}
+		}, threadCount);
+		return hexString;
+	}
+	static uint64_t readWord(const std::byte* bytes)
+	{
+		uint64_t word {};
+		memcpy(&word, bytes, sizeof(word));
+		return word;
+	}
+	static uint64_t hashRound(uint64_t accumulator, uint64_t input)
+	{
+		return std::rotl(accumulator + input * Hash_Prime_2, 31) * Hash_Prime_1;
+	}
+	static uint64_t hashMerge(uint64_t hash, uint64_t accumulator)
+	{
+		return (hash ^ hashRound(0, accumulator)) * Hash_Prime_1 + Hash_Prime_4;
+	}
+	uint64_t hashBytes(std::span<const std::byte> bytes)
+	{
+		// XXH64 with seed 0, every input bit reaches every output bit
+		const std::byte* data = bytes.data();
+		const std::byte* const end = data + bytes.size();
+		uint64_t hash = Hash_Prime_5;
+		if (bytes.size() >= 32)
+		{
+			uint64_t accumulators[4] {Hash_Prime_1 + Hash_Prime_2, Hash_Prime_2, 0, 0 - Hash_Prime_1};
+			for (; end - data >= 32; data += 32)
+			{
+				for (size_t lane = 0; lane < 4; lane++)
+				{
+					accumulators[lane] = hashRound(accumulators[lane], readWord(data + lane * sizeof(uint64_t)));
+				}
+			}
+			hash = std::rotl(accumulators[0], 1) + std::rotl(accumulators[1], 7) + std::rotl(accumulators[2], 12) + std::rotl(accumulators[3], 18);
+			for (const uint64_t accumulator : accumulators)
+			{
+				hash = hashMerge(hash, accumulator);
+			}
+		}
+		hash += bytes.size();
+		for (; end - data >= 8; data += 8)
+		{
+			hash = std::rotl(hash ^ hashRound(0, readWord(data)), 27) * Hash_Prime_1 + Hash_Prime_4;
+		}
+		if (end - data >= 4)
+		{
+			uint32_t word {};
+			memcpy(&word, data, sizeof(word));
+			hash = std::rotl(hash ^ (word * Hash_Prime_1), 23) * Hash_Prime_2 + Hash_Prime_3;
+			data += 4;
+		}
+		for (; data < end; data++)
+		{
+			hash = std::rotl(hash ^ (static_cast<uint64_t>(*data) * Hash_Prime_5), 11) * Hash_Prime_1;
+		}
+		hash = (hash ^ (hash >> 33)) * Hash_Prime_2;
+		hash = (hash ^ (hash >> 29)) * Hash_Prime_3;
+		return hash ^ (hash >> 32);
+	}
+	size_t getWorkerThreadCount()
+	{
+		return std::max<size_t>(1, std::thread::hardware_concurrency());
 	}
-	std::string byteArrayToHexString(const std::vector<std::byte>& byteArray, uint32_t width)
+	void parallelFor(size_t count, const std::function<void(size_t)>& body, size_t threadCount)
 	{
-		std::stringstream ss;
-		ss << std::hex << std::setfill('0');
-		for (size_t i = 0; i < byteArray.size(); ++i) 
+		threadCount = std::min(threadCount == 0 ? getWorkerThreadCount() : threadCount, count);
+		if (threadCount <= 1)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				body(i);
+			}
+			return;
+		}
+		std::atomic<size_t> nextIndex {};
+		auto worker = [&]()
 		{
-			ss << std::setw(2) << static_cast<unsigned>(static_cast<unsigned char>(byteArray[i])) << " ";
-			if ((i + 1) % width == 0)
+			for (size_t i = nextIndex++; i < count; i = nextIndex++)
 			{
-				ss << std::endl;
+				body(i);
 			}
+		};
+		std::vector<std::thread> workers {};
+		for (size_t i = 1; i < threadCount; i++)
+		{
+			workers.emplace_back(worker);
+		}
+		worker();
+		for (auto& t : workers)
+		{
+			t.join();
 		}
-		return ss.str();
 	}
 }
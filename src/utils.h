@@ -1,7 +1,9 @@
 #pragma once
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <limits>
+#include <span>
 #include <sstream>
 #include <vector>
 
@@ -9,6 +11,20 @@ static const int BITS_IN_BYTE = 8;
 
 namespace utils
 {
+	enum class HexEncoder
+	{
+		SCALAR,
+		SSSE3,
+		AVX2,
+		BEST // fastest one supported by the running CPU
+	};
+
 	std::streamsize getFileSize(std::ifstream& fileHandle);
-	std::string byteArrayToHexString(const std::vector<std::byte>& byteArray, uint32_t width);
+	std::string byteArrayToHexString(std::span<const std::byte> byteArray, uint32_t width, size_t threadCount = 0); // rows are encoded in parallel
+	bool isHexEncoderSupported(HexEncoder encoder);
+	void encodeHex(std::span<const std::byte> bytes, char* output, HexEncoder encoder = HexEncoder::BEST); // writes "xx " for every byte, output must hold 3 chars per byte
+	uint64_t hashBytes(std::span<const std::byte> bytes); // XXH64, content key for cached files
+	size_t getWorkerThreadCount();
+	// runs body(index) for every index in [0, count) on threadCount threads (0 = all cores), indices are handed out dynamically
+	void parallelFor(size_t count, const std::function<void(size_t)>& body, size_t threadCount = 0);
 }
@@ -3,14 +3,21 @@
 #include "../src/CLIArgParser.h"
 #include "../src/CLIArgParser.cpp"
 #include "../src/ESETVM.h"
+#include "../src/EVMAssembler.h"
+#include "../src/EVMControlFlowGraph.h"
 #include "../src/EVMDisasm.h"
 #include "../src/EVMDisasm.cpp"
 #include "../src/EVMFile.h"
 #include "../src/EVMFile.cpp"
+#include "../src/EVMNativeProgram.h"
+#include "../src/EVMOptimizer.h"
 #include "../src/utils.h"
 #include "../src/utils.cpp"
 #include <vector>
 #include <numeric>
+#include <random>
+#include <regex>
+#include <signal.h>
 #include <gtest/gtest.h>
 
 #define S(x) #x
@@ -382,7 +389,7 @@ static std::vector<std::string> crcDisasmFull = {
 
 static std::string testPath = STR(TEST_FOLDER);
 
-bool areInstructionsEqual(const std::vector<EVMInstruction>& vec1, const std::vector<EVMInstruction>& vec2) 
+bool areInstructionsEqual(std::span<const EVMInstruction> vec1, std::span<const EVMInstruction> vec2) 
 {
 	if (vec1.size() != vec2.size()) 
 	{
@@ -490,9 +497,9 @@ TEST(BitStreamReaderTest, CrcTest)
 {
 	BitStreamReader bitStreamReader (crcCodeTest);
 	
-	const auto bitStreamEndIt = bitStreamReader.readBits(crcCodeTest.size() * BITS_IN_BYTE, false);
-	EXPECT_TRUE(bitStreamEndIt.has_value());
-	std::vector<bool> bitStream{ bitStreamEndIt.value() - crcCodeTest.size() * BITS_IN_BYTE, bitStreamEndIt.value()};
+	const auto bitStreamResult = bitStreamReader.readBits(crcCodeTest.size() * BITS_IN_BYTE, false);
+	EXPECT_TRUE(bitStreamResult.has_value());
+	const std::vector<bool>& bitStream = bitStreamResult.value();
 	std::string bitStreamString {};
 	for (const auto& bit : bitStream)
 	{
@@ -500,6 +507,33 @@ TEST(BitStreamReaderTest, CrcTest)
 	}
 	EXPECT_EQ(bitStreamString, crcBitStreamTest);
 }
+TEST(BitStreamReaderTest, ReadVarMatchesBitOrder)
+{
+	BitStreamReader bitStreamReader (crcCodeFull);
+	const size_t streamSize = bitStreamReader.getStreamSize();
+	const auto allBitsResult = bitStreamReader.readBits(streamSize, false);
+	EXPECT_TRUE(allBitsResult.has_value());
+	const std::vector<bool>& allBits = allBitsResult.value();
+	for (size_t position = 0; position + 64 <= streamSize; position += 7)
+	{
+		for (size_t width : {1, 3, 5, 6, 7, 32, 64})
+		{
+			uint64_t littleEndian {};
+			uint64_t bigEndian {};
+			for (size_t i = 0; i < width; i++)
+			{
+				littleEndian |= static_cast<uint64_t>(allBits[position + i]) << i;
+				bigEndian = (bigEndian << 1) | static_cast<uint64_t>(allBits[position + i]);
+			}
+			EXPECT_TRUE(bitStreamReader.seek(position, BitStreamReaderSeekStrategy::BEG));
+			EXPECT_EQ(bitStreamReader.readVar<uint64_t>(width, false).value(), littleEndian);
+			EXPECT_EQ(bitStreamReader.readVar<uint64_t>(width, false, true).value(), bigEndian);
+		}
+	}
+	EXPECT_TRUE(bitStreamReader.seek(streamSize - 3, BitStreamReaderSeekStrategy::BEG));
+	EXPECT_FALSE(bitStreamReader.readVar<uint8_t>(4).has_value());
+	EXPECT_FALSE(bitStreamReader.readVar<uint8_t>(9).has_value());
+}
 TEST(DisassembleTest, InstructionParsingCrcTest)
 {
 	EVMDisasm disasm(crcCodeFull);
@@ -563,6 +597,77 @@ TEST(CliTest, CliArguments)
 	EXPECT_TRUE(parse8.getFlags().run);
 	EXPECT_EQ(parse8.getInputPath(), inputPath1);
 	EXPECT_EQ(parse8.getBinaryFilePath(), binaryPath);
+
+	argc = 4;
+	std::string sourcePath = testPath + "/samples/crc.easm";
+	const char* argv9[] {"","-a", sourcePath.c_str(), "output_file.evm"};
+	CLIArgParser parse9 {argc, argv9};
+	EXPECT_TRUE(parse9.parseArguments());
+	EXPECT_TRUE(parse9.getFlags().assemble);
+	EXPECT_EQ(parse9.getInputPath(), sourcePath);
+	EXPECT_EQ(parse9.getOutputPath(), "output_file.evm");
+
+	argc = 5;
+	const char* argv10[] {"","-a", sourcePath.c_str(), "output_file.evm", "-r"};
+	CLIArgParser parse10 {argc, argv10};
+	EXPECT_FALSE(parse10.parseArguments());
+
+	argc = 4;
+	const char* argv11[] {"","-O", "-r", inputPath1.c_str()};
+	CLIArgParser parse11 {argc, argv11};
+	EXPECT_TRUE(parse11.parseArguments());
+	EXPECT_TRUE(parse11.getFlags().optimize);
+
+	argc = 5;
+	const char* argv12[] {"","-O", "-d", inputPath1.c_str(), "output_file.txt"};
+	CLIArgParser parse12 {argc, argv12};
+	EXPECT_FALSE(parse12.parseArguments());
+
+	argc = 4;
+	const char* argv13[] {"","--cfg-dot", inputPath1.c_str(), "output_file.dot"};
+	CLIArgParser parse13 {argc, argv13};
+	EXPECT_TRUE(parse13.parseArguments());
+	EXPECT_TRUE(parse13.getFlags().cfgDot);
+	EXPECT_EQ(parse13.getOutputPath(), "output_file.dot");
+
+	argc = 5;
+	const char* argv14[] {"","--cfg-dot", inputPath1.c_str(), "output_file.dot", "-r"};
+	CLIArgParser parse14 {argc, argv14};
+	EXPECT_FALSE(parse14.parseArguments());
+
+	argc = 4;
+	const char* argv15[] {"","--optimize", inputPath1.c_str(), "output_file.evm"};
+	CLIArgParser parse15 {argc, argv15};
+	EXPECT_TRUE(parse15.parseArguments());
+	EXPECT_TRUE(parse15.getFlags().rewrite);
+	EXPECT_FALSE(parse15.getFlags().optimize);
+	EXPECT_EQ(parse15.getOutputPath(), "output_file.evm");
+
+	argc = 5;
+	const char* argv16[] {"","--optimize", inputPath1.c_str(), "output_file.evm", "-O"};
+	CLIArgParser parse16 {argc, argv16};
+	EXPECT_FALSE(parse16.parseArguments());
+
+	argc = 5;
+	const char* argv17[] {"","--aot", "-O", "-r", inputPath1.c_str()};
+	CLIArgParser parse17 {argc, argv17};
+	EXPECT_TRUE(parse17.parseArguments());
+	EXPECT_TRUE(parse17.getFlags().aot);
+
+	argc = 5;
+	const char* argv18[] {"","--aot", "-l", "-r", inputPath1.c_str()};
+	CLIArgParser parse18 {argc, argv18};
+	EXPECT_FALSE(parse18.parseArguments());
+
+	argc = 5;
+	const char* argv19[] {"","--aot", "--stats", "-r", inputPath1.c_str()};
+	CLIArgParser parse19 {argc, argv19};
+	EXPECT_FALSE(parse19.parseArguments());
+
+	argc = 5;
+	const char* argv20[] {"","--stats=json", "--aot", "-r", inputPath1.c_str()};
+	CLIArgParser parse20 {argc, argv20};
+	EXPECT_FALSE(parse20.parseArguments());
 }
 
 std::vector<std::string> getAllFilesInDirectory(const std::string& directoryPath) 
@@ -616,7 +721,112 @@ TEST(DisassembleTest, DisassembleAllProvidedSamples)
 		}
 	}
 }
-std::optional<std::string> getOutputEmulation(std::string path, const std::vector<std::string>& inputs, bool verbose, std::string binaryFilePath = "")
+TEST(BitStreamWriterTest, WriteVarMatchesReader)
+{
+	BitStreamWriter writer {};
+	std::vector<std::pair<uint64_t, size_t>> values {};
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	for (size_t i = 0; i < 1000; i++)
+	{
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		const size_t width = 1 + (state >> 58);
+		const uint64_t value = width == 64 ? state : state & ((1ULL << width) - 1);
+		values.emplace_back(value, width);
+		writer.writeVar<uint64_t>(value, width, i % 3 == 0);
+	}
+	writer.alignToByte();
+	BitStreamReader reader (writer.getBytes());
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		EXPECT_EQ(reader.readVar<uint64_t>(values[i].second, true, i % 3 == 0).value(), values[i].first);
+	}
+
+	BitStreamWriter patched {};
+	patched.writeVar<uint8_t>(0b101, 3, true);
+	patched.writeVar<uint32_t>(0);
+	EXPECT_TRUE(patched.writeVarAt<uint32_t>(3, 0xdeadbeef, 32));
+	EXPECT_FALSE(patched.writeVarAt<uint32_t>(8, 0, 32)); // past the end
+	BitStreamReader patchedReader (patched.getBytes());
+	EXPECT_EQ(patchedReader.readVar<uint8_t>(3, true, true).value(), 0b101);
+	EXPECT_EQ(patchedReader.readVar<uint32_t>().value(), 0xdeadbeef);
+}
+TEST(AssemblerTest, AssembledSamplesMatchPrecompiled)
+{
+	std::string outputFileFolder = testPath + "/samples/recompile_test/";
+	std::filesystem::create_directories(outputFileFolder);
+	for (const auto& filePath : getAllFilesInDirectory(testPath + "/samples/precompiled/"))
+	{
+		std::ifstream precompiled(filePath, std::ios::binary);
+		const std::string expected(std::istreambuf_iterator<char>(precompiled), {});
+		const std::string fileName = std::filesystem::path(filePath).stem().string();
+		for (const std::string& sourcePath : {testPath + "/samples/" + fileName + ".easm", outputFileFolder + fileName + "_native_decompiled.easm"})
+		{
+			if (sourcePath.starts_with(outputFileFolder)) // assemble -> disassemble -> assemble
+			{
+				ESETVM evm {filePath, sourcePath, false};
+				EXPECT_EQ(evm.init(), ESETVMStatus::SUCCESS);
+				EXPECT_EQ(evm.saveSourceCode(), ESETVMStatus::SUCCESS);
+			}
+			std::ifstream sourceFile(sourcePath, std::ios::binary);
+			const std::string source(std::istreambuf_iterator<char>(sourceFile), {});
+			EVMAssembler assembler {};
+			EXPECT_TRUE(assembler.assemble(source)) << sourcePath;
+			std::ostringstream output {};
+			EXPECT_TRUE(assembler.writeFile(output));
+			EXPECT_EQ(output.str(), expected) << sourcePath;
+		}
+	}
+}
+TEST(AssemblerTest, ReportsErrorsAndParsesConstants)
+{
+	EVMAssembler assembler {};
+	EXPECT_TRUE(assembler.assemble(".code\nloop:\n\tjumpEqual end , r1,qword [ r15 ]\n\tjump loop # back\nend:\n.data\n0a FF 0x10\n"));
+	EXPECT_EQ(assembler.getDataSize(), 3);
+	EXPECT_EQ(assembler.getDataBytes().size(), 3);
+	EVMDisasm disasm(assembler.getCodeBytes());
+	EXPECT_TRUE(disasm.parseInstructions());
+	EXPECT_TRUE(disasm.convertInstructionsToSourceCode());
+	const std::vector<std::string> expected {"sub_0:", "jumpEqual sub_56, r1, qword[r15]", "jump sub_0"};
+	EXPECT_EQ(disasm.getSourceCode(), expected);
+
+	EXPECT_EQ(EVMAssembler::parseConstant("0x10"), 16);
+	EXPECT_EQ(EVMAssembler::parseConstant("-1"), -1);
+	EXPECT_EQ(EVMAssembler::parseConstant("010"), 8);
+	EXPECT_EQ(EVMAssembler::parseConstant("0b101"), 5);
+	EXPECT_EQ(EVMAssembler::parseConstant("0xffffffffffffffff"), -1);
+	EXPECT_EQ(EVMAssembler::parseConstant("-9223372036854775808"), INT64_MIN);
+	EXPECT_FALSE(EVMAssembler::parseConstant("0x10000000000000000").has_value());
+	EXPECT_FALSE(EVMAssembler::parseConstant("12a").has_value());
+
+	for (const char* source : {".code\nmov r1, r16\n", ".code\nmov r1, xword[r1]\n", ".code\njump nowhere\n", ".code\nadd r1, r2\n",
+		".code\nfoo r1\n", "mov r1, r2\n", ".code\na:\na:\n", ".data\n100\n", ".dataSize 1\n.dataSize 2\n"})
+	{
+		EXPECT_FALSE(assembler.assemble(source)) << source;
+		EXPECT_EQ(assembler.getError(), ESETVMStatus::ASSEMBLE_ERROR);
+	}
+}
+TEST(EVMFileTest, MappedAndStreamLoadingMatch)
+{
+	std::vector<std::string> evmFilePaths = getAllFilesInDirectory(testPath + "/samples/precompiled/");
+	for (const auto& filePath : evmFilePaths)
+	{
+		EVMFile streamFile {filePath, EVMFileLoadMode::STREAM};
+		EVMFile mappedFile {filePath, EVMFileLoadMode::MAPPED};
+		EXPECT_EQ(streamFile.getError(), ESETVMStatus::SUCCESS);
+		EXPECT_EQ(mappedFile.getError(), ESETVMStatus::SUCCESS);
+		EXPECT_EQ(std::filesystem::file_size(filePath), mappedFile.getFileBytes().size());
+		EXPECT_TRUE(std::ranges::equal(streamFile.getHeaderBytes(), mappedFile.getHeaderBytes()));
+		EXPECT_TRUE(std::ranges::equal(streamFile.getCodeBytes(), mappedFile.getCodeBytes()));
+		EXPECT_TRUE(std::ranges::equal(streamFile.getDataBytes(), mappedFile.getDataBytes()));
+		EXPECT_EQ(mappedFile.getCodeBytes().size(), mappedFile.getcodeSize());
+		EXPECT_EQ(mappedFile.getDataBytes().size(), mappedFile.getInitialDataSize());
+	}
+	EVMFile missingFile {testPath + "/samples/does_not_exist.evm"};
+	EXPECT_EQ(missingFile.getError(), ESETVMStatus::FILE_OPEN_ERROR);
+	EVMFile notEvmFile {testPath + "/samples/crc.easm"};
+	EXPECT_EQ(notEvmFile.getError(), ESETVMStatus::NOT_EVM_FILE);
+}
+std::optional<std::string> getOutputEmulation(std::string path, const std::vector<std::string>& inputs, bool verbose, std::string binaryFilePath = "", bool lazyDecoding = false, std::string imageCacheDirectory = "", bool optimize = false, bool aot = false)
 {
 	std::ostringstream concatInput;
 	for (const auto& input: inputs)
@@ -636,7 +846,7 @@ std::optional<std::string> getOutputEmulation(std::string path, const std::vecto
 	std::cout.rdbuf(outputStream.rdbuf());
 	std::cin.rdbuf(inputStream.rdbuf());
 	
-	ESETVM evm {path, "", verbose};
+	ESETVM evm {path, "", ESETVMOptions {.verbose = verbose, .lazyDecoding = lazyDecoding, .imageCacheDirectory = imageCacheDirectory, .optimize = optimize, .aot = aot}};
 	if (evm.init() != ESETVMStatus::SUCCESS)
 	{
 		std::cout.rdbuf(coutbuf);
@@ -827,3 +1037,1221 @@ TEST (EmulationTest, Philosophers)
 	
 	std::cin.rdbuf(cinbuf);
 }
+TEST (FileCacheTest, WriteBehindCoalescing)
+{
+	std::string cacheFilePath = testPath + "/samples/file_cache_test.bin";
+	{
+		std::ofstream initialFile {cacheFilePath, std::ios::out | std::ios::binary | std::ios::trunc};
+		initialFile << "0123456789";
+	}
+	std::fstream fileHandle {cacheFilePath, std::ios::binary | std::ios::out | std::ios::in};
+	EVMFileCache fileCache {fileHandle, EVMFileCache::Page_Size * 2};
+	EXPECT_TRUE(fileCache.isOpen());
+
+	const std::vector<uint8_t> pattern {'a', 'b'};
+	for (size_t offset = 0; offset < 20; offset += 4)
+	{
+		EXPECT_TRUE(fileCache.write(offset, pattern.data(), pattern.size()));
+	}
+	std::vector<uint8_t> readBack(32);
+	const auto bytesRead = fileCache.read(0, readBack.data(), readBack.size());
+	EXPECT_TRUE(bytesRead.has_value());
+	EXPECT_EQ(bytesRead.value(), 18);
+	std::string expected {"ab23ab67ab\0\0ab\0\0ab", 18};
+	EXPECT_TRUE(std::equal(expected.begin(), expected.end(), readBack.begin()));
+
+	// crossing the dirty limit flushes everything written so far
+	std::vector<uint8_t> bigWrite(EVMFileCache::Page_Size * 2, 'x');
+	EXPECT_TRUE(fileCache.write(EVMFileCache::Page_Size, bigWrite.data(), bigWrite.size()));
+	EXPECT_EQ(std::filesystem::file_size(cacheFilePath), EVMFileCache::Page_Size * 3);
+	EXPECT_TRUE(fileCache.flush());
+	fileHandle.close();
+
+	std::ifstream result {cacheFilePath, std::ios::binary};
+	std::vector<char> contents(std::istreambuf_iterator<char>(result), {});
+	EXPECT_EQ(contents.size(), EVMFileCache::Page_Size * 3);
+	EXPECT_TRUE(std::equal(expected.begin(), expected.end(), contents.begin()));
+	EXPECT_TRUE(std::all_of(contents.begin() + EVMFileCache::Page_Size, contents.end(), [](char c) { return c == 'x'; }));
+	result.close();
+	std::filesystem::remove(cacheFilePath);
+}
+TEST (EmulationTest, LazyDecodingMatchesFullDecoding)
+{
+	const std::vector<std::pair<std::string, std::vector<std::string>>> samples
+	{
+		{"math.evm", {""}},
+		{"fibonacci_loop.evm", {"5"}},
+		{"memory.evm", {""}},
+		{"xor.evm", {"123456", "98765"}},
+		{"xor-with-stack-frame.evm", {"123456", "98765"}},
+		{"threadingBase.evm", {""}},
+		{"lock.evm", {""}}
+	};
+	for (const auto& [sample, inputs] : samples)
+	{
+		std::string samplePath = testPath + "/samples/precompiled/" + sample;
+		const auto fullResult = getOutputEmulation(samplePath, inputs, false);
+		const auto lazyResult = getOutputEmulation(samplePath, inputs, false, "", true);
+		EXPECT_TRUE(fullResult.has_value());
+		EXPECT_TRUE(lazyResult.has_value());
+		EXPECT_EQ(fullResult, lazyResult);
+	}
+	std::string crcEvm = testPath + "/samples/precompiled/crc.evm";
+	std::string crcBin = testPath + "/samples/crc.bin";
+	const auto crcResult = getOutputEmulation(crcEvm, {""}, false, crcBin, true);
+	EXPECT_TRUE(crcResult.has_value());
+	EXPECT_EQ(crcResult.value(), "000000008407759b\n");
+}
+TEST (OptimizerTest, OptimizedSamplesMatchUnoptimized)
+{
+	const std::vector<std::pair<std::string, std::vector<std::string>>> samples
+	{
+		{"math.evm", {""}},
+		{"fibonacci_loop.evm", {"5"}},
+		{"memory.evm", {""}},
+		{"xor.evm", {"123456", "98765"}},
+		{"xor-with-stack-frame.evm", {"123456", "98765"}},
+		{"threadingBase.evm", {""}},
+		{"lock.evm", {""}}
+	};
+	for (const auto& [sample, inputs] : samples)
+	{
+		std::string samplePath = testPath + "/samples/precompiled/" + sample;
+		const auto result = getOutputEmulation(samplePath, inputs, false);
+		const auto optimizedResult = getOutputEmulation(samplePath, inputs, false, "", false, "", true);
+		EXPECT_TRUE(result.has_value());
+		EXPECT_TRUE(optimizedResult.has_value());
+		EXPECT_EQ(result, optimizedResult) << sample;
+	}
+	std::string crcEvm = testPath + "/samples/precompiled/crc.evm";
+	std::string crcBin = testPath + "/samples/crc.bin";
+	const auto crcResult = getOutputEmulation(crcEvm, {""}, false, crcBin, false, "", true);
+	EXPECT_TRUE(crcResult.has_value());
+	EXPECT_EQ(crcResult.value(), "000000008407759b\n");
+}
+TEST (OptimizerTest, FoldsConstantsAndRemovesDeadCode)
+{
+	EVMAssembler assembler {};
+	ASSERT_TRUE(assembler.assemble(".code\n"
+		"loadConst 5, r1\n"
+		"loadConst 7, r2\n"
+		"add r1, r2, r3\n" // folded to 12
+		"mov r3, r4\n" // folded to 12
+		"jumpEqual skip, r1, r2\n" // never taken, removed
+		"loadConst 12, r3\n" // r3 already holds 12
+		"skip:\n"
+		"jumpEqual print, r3, r4\n" // always taken, becomes jump
+		"loadConst 1, r5\n" // unreachable
+		"print:\n"
+		"loadConst 2, r6\n" // overwritten before read
+		"loadConst 3, r6\n"
+		"consoleWrite r3\n"
+		"consoleWrite r6\n"
+		"hlt\n"
+		"consoleWrite r4\n")); // unreachable
+	EVMDisasm disasm(assembler.getCodeBytes());
+	ASSERT_TRUE(disasm.parseInstructions());
+	EVMOptimizer optimizer {};
+	ASSERT_TRUE(optimizer.optimize(disasm.getInstructions()));
+	const auto& stats = optimizer.getStats();
+	EXPECT_EQ(stats.foldedInstructions, 2);
+	EXPECT_EQ(stats.simplifiedBranches, 2);
+	EXPECT_EQ(stats.removedRedundantWrites, 1);
+	EXPECT_EQ(stats.removedUnreachable, 2);
+
+	std::vector<EVMOpcode> opcodes {};
+	for (const auto& instruction : optimizer.getInstructions())
+	{
+		opcodes.push_back(instruction.opcode);
+	}
+	// r1, r2, r4 and the first r6 write are no longer read, the jump became a jump to the next instruction
+	const std::vector<EVMOpcode> expected {EVMOpcode::LOADCONST, EVMOpcode::LOADCONST, EVMOpcode::CONSOLEWRITE, EVMOpcode::CONSOLEWRITE, EVMOpcode::HLT};
+	EXPECT_EQ(opcodes, expected);
+	EXPECT_EQ(stats.removedDeadWrites, 4);
+	EXPECT_EQ(stats.simplifiedJumps, 1);
+	for (size_t i = 0; i < optimizer.getInstructions().size(); i++) // kept instructions keep their code offsets
+	{
+		EXPECT_TRUE(disasm.insNumFromCodeOff(optimizer.getInstructionOffsets()[i]).has_value());
+	}
+}
+TEST (OptimizerTest, HoistsLoopConstants)
+{
+	const std::string source = ".code\n"
+		"loadConst 3, r1\n"
+		"call sum\n"
+		"consoleWrite r5\n"
+		"consoleWrite r6\n"
+		"hlt\n"
+		"sum:\n"
+		"loadConst 0, r5\n"
+		"loop:\n"
+		"jumpEqual done, r1, r2\n"
+		"loadConst 7, r3\n" // only write of r3 in the loop, callers do not read it
+		"loadConst 2, r4\n" // r4 is reused below, its reads take 2 from an unused register
+		"add r5, r4, r5\n"
+		"compare r5, r3, r4\n"
+		"add r6, r4, r6\n"
+		"loadConst 1, r4\n"
+		"sub r1, r4, r1\n"
+		"jump loop\n"
+		"done:\n"
+		"ret\n";
+	EVMAssembler assembler {};
+	ASSERT_TRUE(assembler.assemble(source));
+	EVMDisasm disasm(assembler.getCodeBytes());
+	ASSERT_TRUE(disasm.parseInstructions());
+	EVMOptimizer optimizer {};
+	ASSERT_TRUE(optimizer.optimize(disasm.getInstructions()));
+	EXPECT_EQ(optimizer.getStats().hoistedConstants, 3);
+
+	const auto instructions = optimizer.getInstructions();
+	const auto backJump = std::ranges::find_if(instructions, [](const EVMInstruction& instruction) { return instruction.opcode == EVMOpcode::JUMP; });
+	ASSERT_NE(backJump, instructions.end());
+	const size_t header = backJump->target;
+	ASSERT_GE(header, 3);
+	for (size_t i = header - 3; i < header; i++) // preheader
+	{
+		EXPECT_EQ(instructions[i].opcode, EVMOpcode::LOADCONST);
+	}
+	EXPECT_TRUE(std::none_of(instructions.begin() + header, backJump, [](const EVMInstruction& instruction) { return instruction.opcode == EVMOpcode::LOADCONST; }));
+	for (size_t i = 1; i < instructions.size(); i++)
+	{
+		EXPECT_LT(optimizer.getInstructionOffsets()[i - 1], optimizer.getInstructionOffsets()[i]);
+	}
+
+	const std::string folder = testPath + "/samples/recompile_test/";
+	std::filesystem::create_directories(folder);
+	const std::string programPath = folder + "hoist.evm";
+	{
+		std::ofstream programFile {programPath, std::ios::binary | std::ios::trunc};
+		ASSERT_TRUE(assembler.writeFile(programFile));
+	}
+	const auto result = getOutputEmulation(programPath, {""}, false);
+	EXPECT_TRUE(result.has_value());
+	EXPECT_EQ(result, getOutputEmulation(programPath, {""}, false, "", false, "", true));
+}
+TEST (OptimizerTest, RewrittenSamplesRunIdentically)
+{
+	const std::vector<std::pair<std::string, std::vector<std::string>>> samples
+	{
+		{"math.evm", {""}},
+		{"fibonacci_loop.evm", {"5"}},
+		{"memory.evm", {""}},
+		{"xor.evm", {"123456", "98765"}},
+		{"xor-with-stack-frame.evm", {"123456", "98765"}},
+		{"threadingBase.evm", {""}},
+		{"lock.evm", {""}},
+		{"crc.evm", {""}}
+	};
+	const std::string outputFileFolder = testPath + "/samples/recompile_test/";
+	std::filesystem::create_directories(outputFileFolder);
+	for (const auto& [sample, inputs] : samples)
+	{
+		const std::string samplePath = testPath + "/samples/precompiled/" + sample;
+		const std::string rewrittenPath = outputFileFolder + "optimized_" + sample;
+		ESETVM evm {samplePath, rewrittenPath, false};
+		ASSERT_EQ(evm.init(), ESETVMStatus::SUCCESS);
+		ASSERT_EQ(evm.saveOptimizedProgram(), ESETVMStatus::SUCCESS) << sample;
+
+		EVMFile original {samplePath};
+		EVMFile rewritten {rewrittenPath};
+		ASSERT_EQ(rewritten.getError(), ESETVMStatus::SUCCESS);
+		EXPECT_EQ(rewritten.getDataSize(), original.getDataSize());
+		EXPECT_TRUE(std::ranges::equal(rewritten.getDataBytes(), original.getDataBytes()));
+		EVMDisasm originalDisasm {original.getCodeBytes()};
+		EVMDisasm rewrittenDisasm {rewritten.getCodeBytes()};
+		ASSERT_TRUE(originalDisasm.parseInstructions());
+		ASSERT_TRUE(rewrittenDisasm.parseInstructions());
+		EXPECT_LT(rewrittenDisasm.getInstructions().size(), originalDisasm.getInstructions().size()) << sample;
+		for (const auto& instruction : rewrittenDisasm.getInstructions())
+		{
+			const bool hasAddress = std::ranges::any_of(instruction.arguments, [](const EVMArgument& argument) { return argument.type == ArgumentType::ADDRESS; });
+			EXPECT_TRUE(!hasAddress || instruction.target != EVMInstruction::Unresolved_Target) << sample; // every code address was patched
+		}
+
+		const std::string binaryPath = sample == "crc.evm" ? testPath + "/samples/crc.bin" : "";
+		const auto result = getOutputEmulation(samplePath, inputs, false, binaryPath);
+		const auto rewrittenResult = getOutputEmulation(rewrittenPath, inputs, false, binaryPath);
+		EXPECT_TRUE(result.has_value());
+		EXPECT_EQ(result, rewrittenResult) << sample;
+	}
+}
+TEST (OptimizerTest, EncodedInstructionsGetNewOffsets)
+{
+	EVMAssembler assembler {};
+	ASSERT_TRUE(assembler.assemble(".dataSize 16\n.code\n"
+		"loadConst 0x100, r1\n"
+		"loop:\n"
+		"jumpEqual end, r1, r2\n"
+		"add r2, r3, r2\n"
+		"jump loop\n"
+		"end:\n"
+		"mov qword[r2], r4\n"
+		"hlt\n"
+		".data\n01 02\n"));
+	EVMDisasm disasm(assembler.getCodeBytes());
+	ASSERT_TRUE(disasm.parseInstructions());
+	std::vector<EVMInstruction> instructions(disasm.getInstructions().begin(), disasm.getInstructions().end());
+	instructions.erase(instructions.begin()); // later code moves, jumps have to follow it
+	for (auto& instruction : instructions)
+	{
+		instruction.target = instruction.target == EVMInstruction::Unresolved_Target ? instruction.target : instruction.target - 1;
+	}
+	EVMAssembler encoder {};
+	ASSERT_TRUE(encoder.encode(instructions, assembler.getDataBytes(), assembler.getDataSize()));
+	EXPECT_EQ(encoder.getDataSize(), 16);
+	EVMDisasm encodedDisasm(encoder.getCodeBytes());
+	ASSERT_TRUE(encodedDisasm.parseInstructions());
+	ASSERT_TRUE(encodedDisasm.convertInstructionsToSourceCode(false));
+	const std::vector<std::string> expected {"jumpEqual sub_69, r1, r2", "add r2, r3, r2", "jump sub_0", "mov qword[r2], r4", "hlt"};
+	EXPECT_EQ(encodedDisasm.getSourceCode(), expected);
+
+	instructions[0].target = EVMInstruction::Unresolved_Target;
+	EXPECT_FALSE(encoder.encode(instructions, {}, 0));
+	EXPECT_EQ(encoder.getError(), ESETVMStatus::ASSEMBLE_ERROR);
+}
+TEST (ControlFlowGraphTest, BlocksFunctionsDominatorsAndLoops)
+{
+	EVMAssembler assembler {};
+	ASSERT_TRUE(assembler.assemble(".code\n"
+		"loadConst 0, r1\n"
+		"createThread worker, r2\n"
+		"outer:\n"
+		"loadConst 0, r3\n"
+		"inner:\n"
+		"call helper\n"
+		"add r3, r4, r3\n"
+		"jumpEqual inner, r3, r5\n"
+		"add r1, r4, r1\n"
+		"jumpEqual outer, r1, r5\n"
+		"hlt\n"
+		"helper:\n"
+		"ret\n"
+		"worker:\n"
+		"hlt\n"));
+	EVMDisasm disasm(assembler.getCodeBytes());
+	ASSERT_TRUE(disasm.parseInstructions());
+	EVMControlFlowGraph graph {};
+	graph.build(disasm.getInstructions());
+	graph.computeDominators();
+	const uint32_t none = EVMControlFlowGraph::No_Block;
+
+	const auto& blocks = graph.getBlocks();
+	ASSERT_EQ(blocks.size(), 8);
+	const std::vector<uint32_t> begins {0, 2, 3, 4, 6, 8, 9, 10};
+	const std::vector<std::vector<uint32_t>> successors {{1}, {2}, {3}, {2, 4}, {1, 5}, {}, {}, {}};
+	const std::vector<uint32_t> idoms {none, 0, 1, 2, 3, 4, none, none};
+	const std::vector<uint32_t> functions {0, 0, 0, 0, 0, 0, 1, 2};
+	for (uint32_t block = 0; block < blocks.size(); block++)
+	{
+		EXPECT_EQ(blocks[block].begin, begins[block]);
+		EXPECT_TRUE(std::ranges::equal(graph.getSuccessors(block), successors[block])) << block;
+		EXPECT_EQ(blocks[block].idom, idoms[block]) << block;
+		EXPECT_EQ(blocks[block].function, functions[block]) << block;
+		for (const uint32_t successor : graph.getSuccessors(block))
+		{
+			EXPECT_EQ(std::ranges::count(graph.getPredecessors(successor), block), 1);
+		}
+	}
+	ASSERT_EQ(graph.getFunctions().size(), 3);
+	EXPECT_TRUE(graph.getFunctions()[1].called);
+	EXPECT_TRUE(graph.getFunctions()[2].threadEntry);
+	ASSERT_EQ(graph.getCallSites().size(), 2);
+	EXPECT_EQ(graph.getCallSites()[0].instruction, 1);
+	EXPECT_EQ(graph.getCallSites()[0].function, 2);
+	EXPECT_EQ(graph.getCallSites()[1].function, 1);
+
+	ASSERT_EQ(graph.getLoops().size(), 2); // inner loop first
+	EXPECT_EQ(graph.getLoops()[0].header, 2);
+	EXPECT_EQ(graph.getLoops()[0].parent, 1);
+	EXPECT_EQ(graph.getLoops()[0].depth, 2);
+	EXPECT_EQ(graph.getLoops()[1].header, 1);
+	EXPECT_EQ(graph.getLoops()[1].depth, 1);
+	EXPECT_EQ(blocks[3].loop, 0);
+	EXPECT_EQ(blocks[4].loop, 1);
+	EXPECT_EQ(blocks[5].loop, none);
+	EXPECT_TRUE(graph.isInLoop(3, 1));
+	EXPECT_FALSE(graph.isInLoop(4, 0));
+	EXPECT_TRUE(graph.dominates(1, 4));
+	EXPECT_FALSE(graph.dominates(4, 1));
+	EXPECT_FALSE(graph.dominates(0, 6));
+
+	std::ostringstream dot {};
+	EXPECT_TRUE(graph.writeDot(dot, disasm));
+	for (const char* expected : {"subgraph cluster_2", "b3 -> b2;", "b2 -> b6 [style=dashed];", "b0 -> b7 [style=dotted];", "peripheries=2", "call sub_"})
+	{
+		EXPECT_NE(dot.str().find(expected), std::string::npos) << expected;
+	}
+}
+TEST (ControlFlowGraphTest, DominatorsMatchReachabilityDefinition)
+{
+	// random branchy code, a dominates b when b cannot be reached from any function entry once a is removed
+	std::mt19937 random {7};
+	const size_t count = 3000;
+	std::vector<EVMInstruction> instructions(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const EVMOpcode opcodes[] {EVMOpcode::ADD, EVMOpcode::ADD, EVMOpcode::ADD, EVMOpcode::JUMPEQUAL, EVMOpcode::JUMPEQUAL, EVMOpcode::JUMP, EVMOpcode::CALL, EVMOpcode::RET, EVMOpcode::HLT};
+		instructions[i].opcode = opcodes[random() % std::size(opcodes)];
+		if (instructions[i].opcode == EVMOpcode::JUMPEQUAL || instructions[i].opcode == EVMOpcode::JUMP || instructions[i].opcode == EVMOpcode::CALL)
+		{
+			instructions[i].target = random() % 8 == 0 ? random() % count : std::min<uint32_t>(count - 1, i + random() % 40 - 20); // mostly local
+		}
+	}
+	EVMControlFlowGraph graph {};
+	graph.build(instructions);
+	graph.computeDominators();
+	const auto& blocks = graph.getBlocks();
+	const auto reachableWithout = [&](uint32_t removed)
+	{
+		std::vector<bool> reached(blocks.size());
+		std::vector<uint32_t> worklist {};
+		for (const auto& function : graph.getFunctions())
+		{
+			if (function.entry != removed && !reached[function.entry])
+			{
+				reached[function.entry] = true;
+				worklist.push_back(function.entry);
+			}
+		}
+		while (!worklist.empty())
+		{
+			const uint32_t block = worklist.back();
+			worklist.pop_back();
+			for (const uint32_t successor : graph.getSuccessors(block))
+			{
+				if (successor != removed && !reached[successor])
+				{
+					reached[successor] = true;
+					worklist.push_back(successor);
+				}
+			}
+		}
+		return reached;
+	};
+	const auto reachable = reachableWithout(EVMControlFlowGraph::No_Block);
+	size_t checkedPairs = 0;
+	for (uint32_t dominator = 0; dominator < blocks.size(); dominator++)
+	{
+		if (!reachable[dominator])
+		{
+			continue;
+		}
+		const auto reached = reachableWithout(dominator);
+		for (uint32_t block = 0; block < blocks.size(); block++)
+		{
+			if (reachable[block])
+			{
+				EXPECT_EQ(graph.dominates(dominator, block), block == dominator || !reached[block]) << dominator << " " << block;
+				checkedPairs++;
+			}
+		}
+	}
+	EXPECT_GT(checkedPairs, 10000);
+	for (uint32_t block = 0; block < blocks.size(); block++)
+	{
+		EXPECT_EQ(graph.isReachable(block), reachable[block]);
+		for (uint32_t loop = 0; loop < graph.getLoops().size(); loop++)
+		{
+			if (graph.isInLoop(block, loop))
+			{
+				EXPECT_TRUE(graph.dominates(graph.getLoops()[loop].header, block));
+			}
+		}
+	}
+	EXPECT_FALSE(graph.getLoops().empty());
+}
+TEST (NativeProgramTest, NativeSamplesMatchInterpreter)
+{
+	const std::vector<std::pair<std::string, std::vector<std::string>>> samples
+	{
+		{"math.evm", {""}},
+		{"fibonacci_loop.evm", {"5"}},
+		{"memory.evm", {""}},
+		{"xor.evm", {"123456", "98765"}},
+		{"xor-with-stack-frame.evm", {"123456", "98765"}},
+		{"threadingBase.evm", {""}},
+		{"lock.evm", {""}}
+	};
+	const std::string cacheDirectory = testPath + "/samples/recompile_test/native_cache";
+	std::filesystem::remove_all(cacheDirectory);
+	for (const auto& [sample, inputs] : samples)
+	{
+		std::string samplePath = testPath + "/samples/precompiled/" + sample;
+		const auto result = getOutputEmulation(samplePath, inputs, false);
+		const auto nativeResult = getOutputEmulation(samplePath, inputs, false, "", false, "", false, true);
+		const auto optimizedNativeResult = getOutputEmulation(samplePath, inputs, false, "", false, cacheDirectory, true, true);
+		EXPECT_TRUE(result.has_value());
+		EXPECT_EQ(result, nativeResult) << sample;
+		EXPECT_EQ(result, optimizedNativeResult) << sample;
+	}
+	std::string crcEvm = testPath + "/samples/precompiled/crc.evm";
+	std::string crcBin = testPath + "/samples/crc.bin";
+	for (int run = 0; run < 2; run++) // second run loads compiled code from cache
+	{
+		const auto crcResult = getOutputEmulation(crcEvm, {""}, false, crcBin, false, cacheDirectory, false, true);
+		EXPECT_TRUE(crcResult.has_value());
+		EXPECT_EQ(crcResult.value(), "000000008407759b\n");
+	}
+}
+TEST (NativeProgramTest, CallsAndFaultsMatchInterpreter)
+{
+	const std::vector<std::string> sources
+	{
+		// guest calls nested 5000 deep, as C calls in native code
+		".code\nloadConst 5000, r1\nloadConst 1, r2\ncall down\nconsoleWrite r4\nhlt\n"
+		"down:\njumpEqual bottom, r1, r3\nsub r1, r2, r1\nadd r4, r2, r4\ncall down\nbottom:\nret\n",
+		// unbounded recursion overflows the guest stack
+		".code\nloop:\ncall loop\n",
+		// stores out of memory bounds are reported by the interpreter
+		".dataSize 8\n.code\nloadConst 7, r1\nloadConst 0x1122, r2\nmov r2, word[r0]\nconsoleWrite qword[r0]\nmov r2, dword[r1]\nhlt\n",
+		// store wider than the whole memory
+		".dataSize 4\n.code\nloadConst 0x1122, r2\nmov r2, qword[r0]\nhlt\n",
+		// load that starts in memory and ends past it
+		".dataSize 4\n.code\nloadConst 2, r0\nmov qword[r0], r1\nhlt\n",
+		// ret without a call continues in the interpreter, which finds the stack empty
+		".code\nloadConst 3, r1\nconsoleWrite r1\nret\n"
+	};
+	// accesses partly past the end of memory, rejected by native code and reported by the interpreter
+	const std::map<size_t, std::string> boundsErrors {{3, "VM tries to write out of memory bounds"}, {4, "VM tries to read out of memory bounds"}};
+	const std::string folder = testPath + "/samples/recompile_test/";
+	std::filesystem::create_directories(folder);
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		EVMAssembler assembler {};
+		ASSERT_TRUE(assembler.assemble(sources[i]));
+		const std::string programPath = folder + "native_" + std::to_string(i) + ".evm";
+		{
+			std::ofstream programFile {programPath, std::ios::binary | std::ios::trunc};
+			ASSERT_TRUE(assembler.writeFile(programFile));
+		}
+		const auto runProgram = [&](bool aot)
+		{
+			std::ostringstream output;
+			std::ostringstream errors;
+			std::streambuf* coutbuf = std::cout.rdbuf(output.rdbuf());
+			std::streambuf* cerrbuf = std::cerr.rdbuf(errors.rdbuf());
+			ESETVM evm {programPath, "", ESETVMOptions {.aot = aot}};
+			ESETVMStatus status = evm.init();
+			if (status == ESETVMStatus::SUCCESS)
+			{
+				status = evm.run("");
+			}
+			std::cout.rdbuf(coutbuf);
+			std::cerr.rdbuf(cerrbuf);
+			const std::string firstError = errors.str().substr(0, errors.str().find('\n')); // crash info names the host thread
+			return std::tuple {status, output.str(), firstError};
+		};
+		const auto interpreted = runProgram(false);
+		EXPECT_EQ(interpreted, runProgram(true)) << sources[i];
+		if (const auto expected = boundsErrors.find(i); expected != boundsErrors.end())
+		{
+			EXPECT_EQ(std::get<0>(interpreted), ESETVMStatus::EXECUTION_ERROR);
+			EXPECT_EQ(std::get<2>(interpreted), expected->second);
+		}
+	}
+	std::ostringstream source;
+	EVMAssembler assembler {};
+	ASSERT_TRUE(assembler.assemble(sources[0]));
+	EVMDisasm disasm(assembler.getCodeBytes());
+	ASSERT_TRUE(disasm.parseInstructions());
+	EVMNativeProgram::translate(disasm.getInstructions(), source);
+	EXPECT_NE(source.str().find("static uint32_t f0(evm_native_runtime* rt, uint32_t depth)\n{"), std::string::npos);
+	EXPECT_NE(source.str().find("static uint32_t f1(evm_native_runtime* rt, uint32_t depth)\n{"), std::string::npos); // one C function per guest function
+	EXPECT_EQ(source.str().find("static uint32_t f2("), std::string::npos);
+}
+TEST (NativeProgramTest, CachedLibraryIsCheckedBeforeLoading)
+{
+	const std::string folder = testPath + "/samples/recompile_test/";
+	const std::string mathEvm = testPath + "/samples/precompiled/math.evm";
+	const std::string mathCache = folder + "native_cache_math";
+	const std::string markerPath = folder + "planted_library_ran";
+	std::filesystem::remove_all(mathCache);
+	std::filesystem::remove(markerPath);
+	const auto expected = getOutputEmulation(mathEvm, {""}, false);
+	ASSERT_TRUE(getOutputEmulation(mathEvm, {""}, false, "", false, mathCache, false, true).has_value());
+	std::filesystem::path mathLibrary {};
+	for (const auto& entry : std::filesystem::directory_iterator {mathCache})
+	{
+		if (entry.path().extension() == ".so")
+		{
+			mathLibrary = entry.path();
+		}
+	}
+	ASSERT_FALSE(mathLibrary.empty());
+	EXPECT_TRUE(std::filesystem::exists(std::filesystem::path {mathLibrary}.replace_extension(".c")));
+	const auto othersMayWrite = [](const std::filesystem::path& path)
+	{
+		return (std::filesystem::status(path).permissions() & (std::filesystem::perms::group_write | std::filesystem::perms::others_write)) != std::filesystem::perms::none;
+	};
+	EXPECT_FALSE(othersMayWrite(mathCache));
+	EXPECT_FALSE(othersMayWrite(mathLibrary));
+
+	// constructor of this library leaves a marker as soon as the library is mapped
+	const std::string plantedSource = folder + "planted.c";
+	const std::string plantedLibrary = folder + "planted.so";
+	{
+		std::ofstream sourceFile {plantedSource, std::ios::trunc};
+		sourceFile << "#include <stdio.h>\n__attribute__((constructor)) static void planted(void) { FILE* f = fopen(\"" << markerPath << "\", \"w\"); if (f) fclose(f); }\n";
+		sourceFile << "unsigned evm_native_run(void* rt, unsigned instruction) { return 1; }\n";
+	}
+	const char* compiler = std::getenv("CC");
+	const std::string command = std::string {compiler != nullptr && *compiler != '\0' ? compiler : "cc"} + " -shared -fPIC -o " + plantedLibrary + " " + plantedSource;
+	ASSERT_EQ(std::system(command.c_str()), 0);
+
+	// library of other source under the name of math.evm code is compiled again and replaced, never mapped
+	std::filesystem::copy_file(plantedLibrary, mathLibrary, std::filesystem::copy_options::overwrite_existing);
+	EXPECT_EQ(getOutputEmulation(mathEvm, {""}, false, "", false, mathCache, false, true), expected);
+	EXPECT_FALSE(std::filesystem::exists(markerPath));
+	const auto readFile = [](const std::filesystem::path& path)
+	{
+		std::ifstream file {path, std::ios::binary};
+		return std::string {std::istreambuf_iterator<char> {file}, std::istreambuf_iterator<char> {}};
+	};
+	EXPECT_TRUE(readFile(mathLibrary) != readFile(plantedLibrary)); // libraries are binary, compared without printing them
+
+	// matching library that other users could have replaced is not used either, it is compiled again
+	std::filesystem::permissions(mathLibrary, std::filesystem::perms::group_write, std::filesystem::perm_options::add);
+	EXPECT_EQ(getOutputEmulation(mathEvm, {""}, false, "", false, mathCache, false, true), expected);
+	EXPECT_FALSE(othersMayWrite(mathLibrary));
+
+	// intact cache entry is loaded as it is
+	const auto writeTime = std::filesystem::last_write_time(mathLibrary);
+	EVMFile file {mathEvm};
+	EVMDisasm disasm(file.getCodeBytes());
+	ASSERT_TRUE(disasm.parseInstructions());
+	EVMNativeProgram program {};
+	EXPECT_TRUE(program.build(disasm.getInstructions(), mathCache, false));
+	EXPECT_TRUE(program.isLoaded());
+	EXPECT_EQ(std::filesystem::last_write_time(mathLibrary), writeTime);
+}
+TEST (NativeProgramTest, FallsBackToInterpreterWithoutCompiler)
+{
+	const char* compiler = std::getenv("CC");
+	const std::string savedCompiler = compiler != nullptr ? compiler : "";
+	setenv("CC", (testPath + "/samples/no_such_compiler").c_str(), 1);
+	std::string mathEvm = testPath + "/samples/precompiled/math.evm";
+	EVMFile file {mathEvm};
+	EVMDisasm disasm(file.getCodeBytes());
+	ASSERT_TRUE(disasm.parseInstructions());
+	EVMNativeProgram program {};
+	EXPECT_FALSE(program.build(disasm.getInstructions(), "", false));
+	EXPECT_FALSE(program.isLoaded());
+	const auto result = getOutputEmulation(mathEvm, {""}, false, "", false, "", false, true);
+	if (compiler != nullptr)
+	{
+		setenv("CC", savedCompiler.c_str(), 1);
+	}
+	else
+	{
+		unsetenv("CC");
+	}
+	EXPECT_TRUE(result.has_value());
+	EXPECT_EQ(result.value(), "0000000000000118\n00000000000000e8\n000000000000000a\n0000000000000010\n0000000000001800\n0000000000000001\n");
+}
+TEST (BlockCacheTest, BlocksMatchLinearDecoding)
+{
+	EVMDisasm disasm(crcCodeFull);
+	EXPECT_TRUE(disasm.parseInstructions());
+	const auto& instructions = disasm.getInstructions();
+
+	EVMBlockCache blockCache {disasm};
+	size_t instructionIndex = 0;
+	uint32_t blockOffset = 0;
+	while (instructionIndex < instructions.size())
+	{
+		const EVMBasicBlock* block = blockCache.getBlock(blockOffset);
+		EXPECT_NE(block, nullptr);
+		EXPECT_EQ(block->offset, blockOffset);
+		EXPECT_TRUE(areInstructionsEqual(block->instructions, {instructions.begin() + instructionIndex, instructions.begin() + instructionIndex + block->instructions.size()}));
+		instructionIndex += block->instructions.size();
+		EXPECT_TRUE(EVMDisasm::isBlockTerminator(block->instructions.back().opcode) || instructionIndex == instructions.size());
+		EXPECT_EQ(blockCache.getBlock(blockOffset), block); // second lookup hits the cache
+		blockOffset = block->endOffset;
+	}
+	EXPECT_EQ(blockCache.getBlock(blockOffset), nullptr); // padding at the end of code
+}
+TEST (DisassembleTest, ParallelDecodingMatchesSequential)
+{
+	std::vector<std::string> evmFilePaths = getAllFilesInDirectory(testPath + "/samples/precompiled/");
+	for (const auto& filePath : evmFilePaths)
+	{
+		EVMFile file {filePath};
+		EVMDisasm sequential {file.getCodeBytes()};
+		EXPECT_TRUE(sequential.parseInstructions() && sequential.convertInstructionsToSourceCode());
+		for (size_t chunkBits : {8, 100, 128, 1000})
+		{
+			EVMDisasm parallel {file.getCodeBytes()};
+			EXPECT_TRUE(parallel.parseInstructionsParallel(4, chunkBits));
+			EXPECT_TRUE(areInstructionsEqual(sequential.getInstructions(), parallel.getInstructions()));
+			for (size_t i = 0; i < parallel.getInstructions().size(); i++)
+			{
+				EXPECT_EQ(parallel.insNumFromCodeOff(parallel.getInstructions()[i].offset), i);
+			}
+			EXPECT_TRUE(parallel.convertInstructionsToSourceCode());
+			EXPECT_EQ(sequential.getSourceCodeLines(), parallel.getSourceCodeLines());
+		}
+	}
+	// undecodable bits in the middle of code are reported like in sequential decoding
+	std::vector<std::byte> corruptedCode {crcCodeFull.begin(), crcCodeFull.end()};
+	std::fill(corruptedCode.begin() + corruptedCode.size() / 2, corruptedCode.begin() + corruptedCode.size() / 2 + 8, std::byte {0x41});
+	EVMDisasm sequential {corruptedCode};
+	EVMDisasm parallel {corruptedCode};
+	EXPECT_FALSE(sequential.parseInstructions());
+	EXPECT_FALSE(parallel.parseInstructionsParallel(4, 64));
+	EXPECT_EQ(sequential.getError(), parallel.getError());
+	EXPECT_EQ(sequential.getInstructions().size(), parallel.getInstructions().size());
+}
+TEST (ImageCacheTest, CachedImageMatchesDecoding)
+{
+	std::string cacheDirectory = testPath + "/samples/recompile_test/image_cache/";
+	std::filesystem::remove_all(cacheDirectory);
+	const std::vector<std::pair<std::string, std::vector<std::string>>> samples
+	{
+		{"math.evm", {""}},
+		{"fibonacci_loop.evm", {"5"}},
+		{"memory.evm", {""}},
+		{"xor-with-stack-frame.evm", {"123456", "98765"}},
+		{"threadingBase.evm", {""}}
+	};
+	for (const auto& [sample, inputs] : samples)
+	{
+		std::string samplePath = testPath + "/samples/precompiled/" + sample;
+		const auto decodedResult = getOutputEmulation(samplePath, inputs, false);
+		const auto firstResult = getOutputEmulation(samplePath, inputs, false, "", false, cacheDirectory); // builds image
+		const auto cachedResult = getOutputEmulation(samplePath, inputs, false, "", false, cacheDirectory); // maps image
+		EXPECT_TRUE(decodedResult.has_value());
+		EXPECT_EQ(decodedResult, firstResult);
+		EXPECT_EQ(decodedResult, cachedResult);
+
+		EVMFile file {samplePath};
+		EVMDisasm disasm {file.getCodeBytes()};
+		EXPECT_TRUE(disasm.parseInstructions());
+		const uint64_t fileHash = utils::hashBytes(file.getFileBytes());
+		const std::string imagePath = EVMImage::getImagePath(cacheDirectory, fileHash);
+		EVMImage image {};
+		EXPECT_TRUE(image.load(imagePath, fileHash, file.getFileBytes().size(), disasm.getCodeBitSize()));
+		EXPECT_TRUE(areInstructionsEqual(disasm.getInstructions(), image.getInstructions()));
+		EXPECT_TRUE(std::ranges::equal(file.getDataBytes(), image.getInitialData()));
+		for (size_t i = 0; i < image.getInstructions().size(); i++)
+		{
+			EXPECT_EQ(image.getInstructions()[i].target, disasm.getInstructions()[i].target);
+		}
+		EXPECT_FALSE(image.load(imagePath, fileHash + 1, file.getFileBytes().size(), disasm.getCodeBitSize())); // different input
+	}
+	// damaged image is rejected and rebuilt
+	std::string crcEvm = testPath + "/samples/precompiled/crc.evm";
+	std::string crcBin = testPath + "/samples/crc.bin";
+	EXPECT_EQ(getOutputEmulation(crcEvm, {""}, false, crcBin, false, cacheDirectory).value_or(""), "000000008407759b\n");
+	EVMFile crcFile {crcEvm};
+	const uint64_t crcHash = utils::hashBytes(crcFile.getFileBytes());
+	const std::string crcImagePath = EVMImage::getImagePath(cacheDirectory, crcHash);
+	const auto imageSize = std::filesystem::file_size(crcImagePath);
+	{
+		std::fstream imageFile {crcImagePath, std::ios::binary | std::ios::in | std::ios::out};
+		imageFile.seekp(imageSize / 2);
+		imageFile.put(static_cast<char>(0xee));
+	}
+	EVMImage damagedImage {};
+	EXPECT_FALSE(damagedImage.load(crcImagePath, crcHash, crcFile.getFileBytes().size(), crcFile.getcodeSize() * BITS_IN_BYTE));
+	EXPECT_EQ(getOutputEmulation(crcEvm, {""}, false, crcBin, false, cacheDirectory).value_or(""), "000000008407759b\n");
+	EVMImage rebuiltImage {};
+	EXPECT_TRUE(rebuiltImage.load(crcImagePath, crcHash, crcFile.getFileBytes().size(), crcFile.getcodeSize() * BITS_IN_BYTE));
+}
+TEST (DisassembleTest, StreamedSourceMatchesSourceLines)
+{
+	std::vector<std::string> evmFilePaths = getAllFilesInDirectory(testPath + "/samples/precompiled/");
+	for (const auto& filePath : evmFilePaths)
+	{
+		EVMFile file {filePath};
+		EVMDisasm disasm {file.getCodeBytes()};
+		EXPECT_TRUE(disasm.parseInstructions() && disasm.convertInstructionsToSourceCode());
+		std::string expected {};
+		for (const auto& line : disasm.getSourceCodeLines())
+		{
+			expected += line + "\n";
+		}
+		std::ostringstream streamed {};
+		EXPECT_TRUE(disasm.writeSourceCode(streamed));
+		EXPECT_EQ(streamed.str(), expected);
+		std::ostringstream streamedParallel {};
+		EXPECT_TRUE(disasm.writeSourceCode(streamedParallel, true, 4, 3)); // many small blocks, labels cross block borders
+		EXPECT_EQ(streamedParallel.str(), expected);
+	}
+	EVMInstruction negativeConstant {};
+	negativeConstant.opcode = EVMOpcode::LOADCONST;
+	EVMArgument constant {}; constant.type = ArgumentType::CONSTANT; constant.data.constant = -2; negativeConstant.arguments.push_back(constant);
+	EVMArgument dereference {}; dereference.type = ArgumentType::DATA_ACCESS; dereference.data.dataAccess.type = DataAccessType::DEREFERENCE; dereference.data.dataAccess.accessSize = MemoryAccessSize::QWORD; dereference.data.dataAccess.registerIndex = 15; negativeConstant.arguments.push_back(dereference);
+	std::stringstream ss;
+	ss << std::hex << "loadConst 0x" << constant.data.constant << ", qword[r15]";
+	EXPECT_EQ(EVMDisasm{}.instructionToSourceCode(negativeConstant), ss.str());
+}
+TEST (UtilsTest, HashBytesIsXxh64)
+{
+	const auto hashString = [](std::string_view text) { return utils::hashBytes(std::as_bytes(std::span {text})); };
+	EXPECT_EQ(hashString(""), 0xef46db3751d8e999ULL);
+	EXPECT_EQ(hashString("a"), 0xd24ec4f1a98c6e5bULL);
+	EXPECT_EQ(hashString("abc"), 0x44bc2cf5ad770999ULL);
+	// top bits flipped in two words cancelled out in the former word-wise FNV hash
+	std::vector<std::byte> bytes(32);
+	std::vector<std::byte> flipped(bytes);
+	flipped[7] ^= std::byte {0x80};
+	flipped[15] ^= std::byte {0x80};
+	EXPECT_NE(utils::hashBytes(bytes), utils::hashBytes(flipped));
+	for (size_t size = 0; size < 80; size++) // every input bit changes the hash, through all tail lengths
+	{
+		std::vector<std::byte> input(size, std::byte {0x5a});
+		const uint64_t hash = utils::hashBytes(input);
+		for (size_t bit = 0; bit < size * 8; bit++)
+		{
+			input[bit / 8] ^= std::byte(1 << (bit % 8));
+			EXPECT_NE(utils::hashBytes(input), hash) << size << ' ' << bit;
+			input[bit / 8] ^= std::byte(1 << (bit % 8));
+		}
+	}
+}
+TEST (UtilsTest, HexDumpMatchesStreamFormatting)
+{
+	std::vector<std::byte> bytes (3 * 1024 * 1024 + 17);
+	for (size_t i = 0; i < bytes.size(); i++)
+	{
+		bytes[i] = static_cast<std::byte>((i * 2654435761u) >> 13);
+	}
+	for (size_t size : {size_t {0}, size_t {1}, size_t {39}, size_t {40}, size_t {41}, size_t {4000}, bytes.size()})
+	{
+		std::span<const std::byte> data {bytes.data(), size};
+		std::stringstream ss;
+		ss << std::hex << std::setfill('0');
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			ss << std::setw(2) << static_cast<unsigned>(static_cast<unsigned char>(data[i])) << " ";
+			if ((i + 1) % 40 == 0)
+			{
+				ss << std::endl;
+			}
+		}
+		EXPECT_EQ(utils::byteArrayToHexString(data, 40, 1), ss.str());
+		EXPECT_EQ(utils::byteArrayToHexString(data, 40, 4), ss.str());
+	}
+}
+TEST (UtilsTest, HexEncodersMatchScalar)
+{
+	std::vector<std::byte> bytes (300);
+	for (size_t i = 0; i < bytes.size(); i++)
+	{
+		bytes[i] = static_cast<std::byte>(i * 7 + 3);
+	}
+	for (auto encoder : {utils::HexEncoder::SSSE3, utils::HexEncoder::AVX2, utils::HexEncoder::BEST})
+	{
+		if (!utils::isHexEncoderSupported(encoder))
+		{
+			continue;
+		}
+		for (size_t offset : {0, 1, 5})
+		{
+			for (size_t size = 0; size + offset <= bytes.size(); size += 1 + size / 16)
+			{
+				std::span<const std::byte> data {bytes.data() + offset, size};
+				std::string expected (size * 3, '\0');
+				std::string encoded (size * 3, '\0');
+				utils::encodeHex(data, expected.data(), utils::HexEncoder::SCALAR);
+				utils::encodeHex(data, encoded.data(), encoder);
+				EXPECT_EQ(encoded, expected);
+			}
+		}
+	}
+}
+TEST (OffsetIndexTest, RankMatchesSortedOffsets)
+{
+	const uint64_t bitCount = 100000;
+	std::vector<uint32_t> offsets {};
+	for (uint32_t offset = 3; offset < bitCount; offset += 1 + (offset * 2654435761u >> 27))
+	{
+		offsets.push_back(offset);
+	}
+	EVMOffsetIndex index {bitCount};
+	for (const uint32_t offset : offsets)
+	{
+		index.insert(offset);
+	}
+	index.insert(bitCount); // outside of indexed range
+	index.insert(UINT32_MAX);
+	index.buildRanks();
+	EXPECT_EQ(index.size(), offsets.size());
+	for (uint64_t offset = 0; offset < bitCount + 200; offset++)
+	{
+		const auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+		const bool present = it != offsets.end() && *it == offset;
+		EXPECT_EQ(index.contains(offset), present);
+		EXPECT_EQ(index.rank(offset), present ? std::optional<size_t> {static_cast<size_t>(it - offsets.begin())} : std::nullopt);
+	}
+	EXPECT_LT(index.getMemoryUsage(), bitCount / 8 + bitCount / 64);
+}
+TEST (DisassembleTest, SourceLineForIpRenderedOnDemand)
+{
+	EVMFile file {testPath + "/samples/precompiled/philosophers.evm"};
+	EVMDisasm disasm {file.getCodeBytes()};
+	EXPECT_TRUE(disasm.parseInstructions());
+	EXPECT_TRUE(disasm.getSourceCodeLines().empty());
+	std::vector<std::string> expected {};
+	for (const auto& instruction : disasm.getInstructions())
+	{
+		expected.push_back(disasm.instructionToSourceCode(instruction));
+	}
+	std::vector<std::thread> threads {};
+	for (size_t t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&disasm, &expected, t]()
+		{
+			for (size_t round = 0; round < 3; round++) // later rounds hit the memo cache
+			{
+				for (size_t ip = t; ip < expected.size(); ip++)
+				{
+					EXPECT_EQ(disasm.getSourceCodeLineForIp(ip), expected[ip]);
+				}
+			}
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	EXPECT_EQ(disasm.getSourceCodeLineForIp(expected.size()), std::nullopt);
+}
+static std::string stripTraceThreadIds(const std::string& text)
+{
+	// verbose mode prints native thread ids, traces number guest threads
+	static const std::regex threadId {"^(\\t*)[0-9]+: ", std::regex::multiline};
+	return std::regex_replace(text, threadId, "$1");
+}
+TEST (TraceTest, DecodedTraceMatchesVerboseOutput)
+{
+	const std::string tracePath = testPath + "/samples/recompile_test/test.trace";
+	std::filesystem::create_directories(testPath + "/samples/recompile_test/");
+	const std::vector<std::pair<std::string, std::vector<std::string>>> samples
+	{
+		{"fibonacci_loop.evm", {"5"}},
+		{"xor-with-stack-frame.evm", {"123456", "98765"}}
+	};
+	for (const auto& [sample, inputs] : samples)
+	{
+		for (bool lazyDecoding : {false, true})
+		{
+			std::string samplePath = testPath + "/samples/precompiled/" + sample;
+			std::ostringstream verboseOutput;
+			std::streambuf* cerrbuf = std::cerr.rdbuf(verboseOutput.rdbuf());
+			const auto verboseResult = getOutputEmulation(samplePath, inputs, true, "", lazyDecoding);
+			std::cerr.rdbuf(cerrbuf);
+
+			std::ostringstream concatInput;
+			for (const auto& input : inputs)
+			{
+				concatInput << input << std::endl;
+			}
+			std::istringstream inputStream(concatInput.str());
+			std::ostringstream outputStream;
+			std::streambuf* coutbuf = std::cout.rdbuf(outputStream.rdbuf());
+			std::streambuf* cinbuf = std::cin.rdbuf(inputStream.rdbuf());
+			ESETVM tracedEvm {samplePath, "", ESETVMOptions {.lazyDecoding = lazyDecoding, .traceFilePath = tracePath, .traceRegisters = true}};
+			EXPECT_EQ(tracedEvm.init(), ESETVMStatus::SUCCESS);
+			EXPECT_EQ(tracedEvm.run(""), ESETVMStatus::SUCCESS);
+			std::cout.rdbuf(coutbuf);
+			std::cin.rdbuf(cinbuf);
+			EXPECT_EQ(verboseResult, outputStream.str());
+
+			ESETVM decodingEvm {samplePath, "", false};
+			EXPECT_EQ(decodingEvm.init(), ESETVMStatus::SUCCESS);
+			std::ostringstream decoded;
+			EXPECT_EQ(decodingEvm.decodeTrace(tracePath, decoded), ESETVMStatus::SUCCESS);
+			std::string decodedInstructions {};
+			std::istringstream decodedLines {decoded.str()};
+			for (std::string line; std::getline(decodedLines, line);)
+			{
+				if (line.find(":     r") == std::string::npos) // register changes are not part of verbose output
+				{
+					decodedInstructions += line + "\n";
+				}
+			}
+			EXPECT_NE(decodedInstructions, decoded.str());
+			EXPECT_EQ(stripTraceThreadIds(decodedInstructions), stripTraceThreadIds(verboseOutput.str()));
+		}
+	}
+	ESETVM otherEvm {testPath + "/samples/precompiled/math.evm", "", false};
+	EXPECT_EQ(otherEvm.init(), ESETVMStatus::SUCCESS);
+	std::ostringstream decoded;
+	EXPECT_EQ(otherEvm.decodeTrace(tracePath, decoded), ESETVMStatus::FILE_CORRUPTED); // trace of another program
+}
+TEST (ProfilerTest, ExecutionCountsMatchVerboseOutput)
+{
+	const std::string profilePath = testPath + "/samples/recompile_test/profile.json";
+	std::filesystem::create_directories(testPath + "/samples/recompile_test/");
+	const std::vector<std::pair<std::string, std::vector<std::string>>> samples
+	{
+		{"fibonacci_loop.evm", {"5"}},
+		{"threadingBase.evm", {""}}
+	};
+	for (const auto& [sample, inputs] : samples)
+	{
+		std::string samplePath = testPath + "/samples/precompiled/" + sample;
+		std::ostringstream verboseOutput;
+		std::streambuf* cerrbuf = std::cerr.rdbuf(verboseOutput.rdbuf());
+		const auto verboseResult = getOutputEmulation(samplePath, inputs, true);
+		std::cerr.rdbuf(cerrbuf);
+		std::map<std::string, uint64_t> verboseCounts {};
+		std::istringstream verboseLines {verboseOutput.str()};
+		for (std::string line; std::getline(verboseLines, line);)
+		{
+			verboseCounts[line.substr(line.find(": ") + 2)]++;
+		}
+
+		std::istringstream inputStream(inputs.front() + "\n");
+		std::ostringstream outputStream;
+		std::ostringstream report;
+		std::streambuf* coutbuf = std::cout.rdbuf(outputStream.rdbuf());
+		std::streambuf* cinbuf = std::cin.rdbuf(inputStream.rdbuf());
+		cerrbuf = std::cerr.rdbuf(report.rdbuf());
+		ESETVM profiledEvm {samplePath, "", ESETVMOptions {.profile = true, .profileJsonPath = profilePath}};
+		EXPECT_EQ(profiledEvm.init(), ESETVMStatus::SUCCESS);
+		EXPECT_EQ(profiledEvm.run(""), ESETVMStatus::SUCCESS);
+		std::cout.rdbuf(coutbuf);
+		std::cin.rdbuf(cinbuf);
+		std::cerr.rdbuf(cerrbuf);
+		EXPECT_EQ(verboseResult, outputStream.str());
+		EXPECT_EQ(report.str().rfind("Profile: ", 0), 0);
+
+		std::ifstream profileFile {profilePath};
+		const std::string profile {std::istreambuf_iterator<char> {profileFile}, std::istreambuf_iterator<char> {}};
+		std::map<std::string, uint64_t> profileCounts {};
+		const std::regex instructionEntry {"\"executions\": (\\d+), \"cycles\": \\d+, \"source\": \"([^\"]*)\""};
+		for (auto it = std::sregex_iterator(profile.begin(), profile.end(), instructionEntry); it != std::sregex_iterator(); ++it)
+		{
+			profileCounts[(*it)[2]] += std::stoull((*it)[1]);
+		}
+		EXPECT_FALSE(profileCounts.empty());
+		EXPECT_EQ(profileCounts, verboseCounts);
+	}
+	ESETVM lazyEvm {testPath + "/samples/precompiled/math.evm", "", ESETVMOptions {.lazyDecoding = true, .profile = true}};
+	EXPECT_EQ(lazyEvm.init(), ESETVMStatus::SUCCESS);
+	EXPECT_EQ(lazyEvm.run(""), ESETVMStatus::EMULATION_ERROR); // profile is indexed by instruction number
+}
+#if defined(__unix__) || defined(__APPLE__)
+static void hostProfilingHandler(int) {}
+TEST (SamplerTest, StopRestoresHostSignalHandler)
+{
+	struct sigaction hostAction {};
+	hostAction.sa_handler = &hostProfilingHandler;
+	sigemptyset(&hostAction.sa_mask);
+	struct sigaction savedAction {};
+	ASSERT_EQ(sigaction(SIGPROF, &hostAction, &savedAction), 0);
+	{
+		EVMSampler sampler {std::chrono::microseconds(100)};
+		ASSERT_TRUE(sampler.start());
+		struct sigaction samplingAction {};
+		sigaction(SIGPROF, nullptr, &samplingAction);
+		EXPECT_NE(samplingAction.sa_handler, &hostProfilingHandler);
+		const auto start = std::chrono::steady_clock::now();
+		while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(5)) // burn CPU time so ticks arrive
+		{
+		}
+		sampler.stop();
+	}
+	struct sigaction restoredAction {};
+	sigaction(SIGPROF, &savedAction, &restoredAction);
+	EXPECT_EQ(restoredAction.sa_handler, &hostProfilingHandler);
+}
+#endif
+TEST (SamplerTest, CollapsedStacksNameCalledFunctions)
+{
+	std::string samplePath = testPath + "/samples/precompiled/xor-with-stack-frame.evm";
+	EVMFile file {samplePath};
+	ASSERT_EQ(file.getError(), ESETVMStatus::SUCCESS);
+	EVMDisasm disasm {file.getCodeBytes()};
+	ASSERT_TRUE(disasm.parseInstructions());
+	const auto instructions = disasm.getInstructions();
+	std::vector<size_t> calls {};
+	for (size_t i = 0; i < instructions.size(); i++)
+	{
+		if (instructions[i].opcode == EVMOpcode::CALL)
+		{
+			calls.push_back(i);
+		}
+	}
+	ASSERT_GE(calls.size(), 3);
+
+	// main called xor (third call), xor called pop1 (fourth call)
+	EVMSampler sampler {};
+	EVMThreadSamples samples = sampler.createThreadSamples(instructions, 0);
+	std::stack<size_t> callStack {};
+	EXPECT_FALSE(samples.isSampleDue(EVMSampler::getTick()));
+	samples.sample(EVMSampler::getTick() + 1, callStack);
+	callStack.push(calls[2] + 1);
+	callStack.push(calls[3] + 1);
+	samples.sample(EVMSampler::getTick() + 2, callStack);
+	samples.sample(EVMSampler::getTick() + 3, callStack);
+	sampler.merge(samples);
+	EXPECT_EQ(sampler.getSampleCount(), 3);
+
+	std::stringstream expected;
+	expected << std::hex << "sub_0 1\nsub_0;sub_" << instructions[calls[2]].arguments[0].data.codeAddress << ";sub_" << instructions[calls[3]].arguments[0].data.codeAddress << " 2\n";
+	std::ostringstream collapsed;
+	sampler.writeCollapsedStacks(collapsed);
+	EXPECT_EQ(collapsed.str(), expected.str());
+
+	// every label in a sampled run is one the disassembler prints
+	const std::string samplesPath = testPath + "/samples/recompile_test/samples.folded";
+	std::filesystem::create_directories(testPath + "/samples/recompile_test/");
+	std::istringstream inputStream("123456\n98765\n");
+	std::ostringstream outputStream;
+	std::streambuf* coutbuf = std::cout.rdbuf(outputStream.rdbuf());
+	std::streambuf* cinbuf = std::cin.rdbuf(inputStream.rdbuf());
+	ESETVM sampledEvm {samplePath, "", ESETVMOptions {.sampleFilePath = samplesPath}};
+	EXPECT_EQ(sampledEvm.init(), ESETVMStatus::SUCCESS);
+	EXPECT_EQ(sampledEvm.run(""), ESETVMStatus::SUCCESS);
+	std::cout.rdbuf(coutbuf);
+	std::cin.rdbuf(cinbuf);
+	EXPECT_EQ(outputStream.str(), getOutputEmulation(samplePath, {"123456", "98765"}, false));
+	disasm.convertInstructionsToSourceCode();
+	std::set<std::string> labels {"sub_0"};
+	for (const auto& line : disasm.getSourceCodeLines())
+	{
+		if (line.back() == ':')
+		{
+			labels.insert(line.substr(0, line.size() - 1));
+		}
+	}
+	std::ifstream samplesFile {samplesPath};
+	ASSERT_TRUE(samplesFile.is_open());
+	const std::regex collapsedLine {"(sub_[0-9a-f]+)(;sub_[0-9a-f]+)* [0-9]+"};
+	for (std::string line; std::getline(samplesFile, line);)
+	{
+		EXPECT_TRUE(std::regex_match(line, collapsedLine)) << line;
+		std::istringstream frames {line.substr(0, line.find(' '))};
+		for (std::string frame; std::getline(frames, frame, ';');)
+		{
+			EXPECT_TRUE(labels.contains(frame)) << frame;
+		}
+	}
+}
+TEST (LockProfilerTest, CountsAcquisitionsPerLockAndSite)
+{
+	EVMThreadLockStats first {};
+	first.acquired(5, 100, false, {});
+	first.released(5);
+	first.acquired(5, 100, true, std::chrono::microseconds(30));
+	first.released(5);
+	first.released(6); // not held by this thread
+	EVMThreadLockStats second {};
+	second.acquired(5, 200, true, std::chrono::microseconds(50));
+	second.acquired(-1, 200, false, {});
+	EVMLockProfiler lockProfiler {};
+	lockProfiler.merge(first);
+	lockProfiler.merge(second);
+	ASSERT_EQ(lockProfiler.getLocks().size(), 2);
+	const EVMLockStats& stats = lockProfiler.getLocks().at(5);
+	EXPECT_EQ(stats.acquisitions, 3);
+	EXPECT_EQ(stats.contended, 2);
+	EXPECT_EQ(stats.totalWaitNs, 80000);
+	EXPECT_EQ(stats.maxWaitNs, 50000);
+	EXPECT_EQ(stats.sites.at(100).acquisitions, 2);
+	EXPECT_EQ(stats.sites.at(200).waitNs, 50000);
+	EXPECT_EQ(lockProfiler.getLocks().at(-1).totalHoldNs, 0); // still held when thread stats were merged
+
+	// lock.evm takes lock 123 once in main thread and once in the created thread
+	std::string lockEvm = testPath + "/samples/precompiled/lock.evm";
+	const std::string profilePath = testPath + "/samples/recompile_test/locks.json";
+	std::filesystem::create_directories(testPath + "/samples/recompile_test/");
+	for (bool lazyDecoding : {false, true})
+	{
+		std::ostringstream outputStream;
+		std::ostringstream report;
+		std::streambuf* coutbuf = std::cout.rdbuf(outputStream.rdbuf());
+		std::streambuf* cerrbuf = std::cerr.rdbuf(report.rdbuf());
+		ESETVM evm {lockEvm, "", ESETVMOptions {.lazyDecoding = lazyDecoding, .lockProfile = true, .lockProfileJsonPath = profilePath}};
+		EXPECT_EQ(evm.init(), ESETVMStatus::SUCCESS);
+		EXPECT_EQ(evm.run(""), ESETVMStatus::SUCCESS);
+		std::cout.rdbuf(coutbuf);
+		std::cerr.rdbuf(cerrbuf);
+		EXPECT_EQ(outputStream.str(), "0000000000000300\n");
+		EXPECT_EQ(report.str().rfind("Lock profile: 1 locks, 2 acquisitions", 0), 0);
+
+		std::ifstream profileFile {profilePath};
+		const std::string profile {std::istreambuf_iterator<char> {profileFile}, std::istreambuf_iterator<char> {}};
+		EXPECT_TRUE(std::regex_search(profile, std::regex {"\\{\"id\": 123, \"acquisitions\": 2, "}));
+		EXPECT_EQ(std::regex_search(profile, std::regex {"\"offset\": 72, \"index\": 1,"}), !lazyDecoding);
+		EXPECT_EQ(std::regex_search(profile, std::regex {"\"offset\": 72, \"index\": null,"}), lazyDecoding);
+	}
+}
+TEST (StatsTest, RunMetricsMatchProgram)
+{
+	auto parseStats = [](const std::string& text)
+	{
+		std::map<std::string, std::string> stats {};
+		std::istringstream lines {text};
+		for (std::string line; std::getline(lines, line);)
+		{
+			const size_t separator = line.find('=');
+			EXPECT_NE(separator, std::string::npos) << line;
+			stats[line.substr(0, separator)] = line.substr(separator + 1);
+		}
+		return stats;
+	};
+
+	// 1000 threads each write 2 bytes to the file, the file cache writes them back at once
+	std::filesystem::create_directories(testPath + "/samples/recompile_test/");
+	const std::string binaryPath = testPath + "/samples/recompile_test/stats.bin";
+	std::filesystem::copy_file(testPath + "/samples/multithreaded_file_write.bin", binaryPath, std::filesystem::copy_options::overwrite_existing);
+	ESETVM fileEvm {testPath + "/samples/precompiled/multithreaded_file_write.evm", "", ESETVMOptions {.stats = true}};
+	EXPECT_EQ(fileEvm.init(), ESETVMStatus::SUCCESS);
+	EXPECT_EQ(fileEvm.run(binaryPath), ESETVMStatus::SUCCESS);
+	std::ostringstream fileStatsText;
+	fileEvm.writeStats(fileStatsText, false);
+	auto stats = parseStats(fileStatsText.str());
+	EXPECT_EQ(stats["threads.started"], "1001");
+	EXPECT_GE(std::stoul(stats["threads.peak_live"]), 2);
+	EXPECT_EQ(stats["file.guest_writes"], "1000");
+	EXPECT_EQ(stats["file.bytes_written"], "2000");
+	EXPECT_EQ(stats["file.host_writes"], "1");
+	uint64_t threadInstructions = 0;
+	for (uint32_t i = 0; i < 1001; i++)
+	{
+		threadInstructions += std::stoull(stats["instructions.thread." + std::to_string(i)]);
+	}
+	EXPECT_EQ(std::to_string(threadInstructions), stats["instructions.total"]);
+	EXPECT_GT(std::stod(stats["phase.execute.seconds"]), 0.0);
+
+	// math.evm writes six values to console and runs 15 instructions
+	std::ostringstream outputStream;
+	std::streambuf* coutbuf = std::cout.rdbuf(outputStream.rdbuf());
+	ESETVM mathEvm {testPath + "/samples/precompiled/math.evm", "", ESETVMOptions {.stats = true}};
+	EXPECT_EQ(mathEvm.init(), ESETVMStatus::SUCCESS);
+	EXPECT_EQ(mathEvm.run(""), ESETVMStatus::SUCCESS);
+	std::cout.rdbuf(coutbuf);
+	std::ostringstream mathStatsText;
+	mathEvm.writeStats(mathStatsText, false);
+	stats = parseStats(mathStatsText.str());
+	EXPECT_EQ(stats["instructions.total"], "15");
+	EXPECT_EQ(stats["instructions.thread.0"], "15");
+	EXPECT_EQ(stats["console.bytes_written"], std::to_string(outputStream.str().size()));
+	EXPECT_EQ(stats["memory.guest_bytes"], "0");
+	std::ostringstream mathStatsJson;
+	mathEvm.writeStats(mathStatsJson, true);
+	EXPECT_TRUE(std::regex_search(mathStatsJson.str(), std::regex {"\"instructions\": \\{\"total\": 15, \"perThread\": \\[15\\]"}));
+
+	// instructions are counted when native code was compiled too, runs collecting stats are interpreted and say so
+	std::ostringstream nativeOutputStream;
+	std::ostringstream nativeErrorStream;
+	coutbuf = std::cout.rdbuf(nativeOutputStream.rdbuf());
+	std::streambuf* cerrbuf = std::cerr.rdbuf(nativeErrorStream.rdbuf());
+	ESETVM nativeMathEvm {testPath + "/samples/precompiled/math.evm", "", ESETVMOptions {.stats = true, .aot = true}};
+	EXPECT_EQ(nativeMathEvm.init(), ESETVMStatus::SUCCESS);
+	EXPECT_EQ(nativeMathEvm.run(""), ESETVMStatus::SUCCESS);
+	std::cout.rdbuf(coutbuf);
+	std::cerr.rdbuf(cerrbuf);
+	EXPECT_EQ(nativeOutputStream.str(), outputStream.str());
+	EXPECT_NE(nativeErrorStream.str().find("runs collecting stats are interpreted"), std::string::npos);
+	std::ostringstream nativeMathStatsText;
+	nativeMathEvm.writeStats(nativeMathStatsText, false);
+	stats = parseStats(nativeMathStatsText.str());
+	EXPECT_EQ(stats["instructions.total"], "15");
+	EXPECT_EQ(stats["instructions.thread.0"], "15");
+}